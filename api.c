@@ -36,6 +36,9 @@
 #endif
 #include "miner.h"
 #include "util.h"
+#ifdef HAVE_BFG_LOWLEVEL
+#include "lowlevel.h"
+#endif
 #include "driver-cpu.h" /* for algo_names[], TODO: re-factor dependency */
 #include "driver-opencl.h"
 
@@ -142,6 +145,8 @@ static const char *OSINFO =
 #define _MINECOIN	"COIN"
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
+#define _LOWLTRACE	"LOWLTRACE"
+#define _LOCKSTATS	"LOCKSTATS"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -176,6 +181,8 @@ static const char ISJSON = '{';
 #define JSON_NOTIFY	JSON1 _NOTIFY JSON2
 #define JSON_CLOSE	JSON3
 #define JSON_MINESTATS	JSON1 _MINESTATS JSON2
+#define JSON_LOWLTRACE	JSON1 _LOWLTRACE JSON2
+#define JSON_LOCKSTATS	JSON1 _LOCKSTATS JSON2
 #define JSON_CHECK	JSON1 _CHECK JSON2
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
@@ -315,6 +322,19 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_INVSTRATEGY 0x102
 #define MSG_FAILPORT 0x103
 
+#define MSG_LOWLTRACE 0x104
+#define MSG_NOLOWLTRACE 0x105
+#define MSG_INVLOWLTRACE 0x106
+#define MSG_MISLOWLTRACE 0x107
+#define MSG_LOWLTRACESAVED 0x108
+
+#define MSG_INVGOAL 0x109
+#define MSG_GOALSET 0x10a
+#define MSG_GOALSETERR 0x10b
+
+#define MSG_LOCKSTATS 0x10c
+#define MSG_NOLOCKSTATS 0x10d
+
 #define USE_ALTMSG 0x4000
 
 enum code_severity {
@@ -468,6 +488,16 @@ struct CODES {
  { SEVERITY_ERR,   MSG_INVNEG,	PARAM_BOTH,	"Invalid negative number (%d) for '%s'" },
  { SEVERITY_ERR,   MSG_INVSTRATEGY,	PARAM_STR,	"Invalid strategy for '%s'" },
  { SEVERITY_ERR,   MSG_FAILPORT,	PARAM_BOTH,	"Failed to set port (%d) for '%s'" },
+ { SEVERITY_SUCC,  MSG_LOWLTRACE,	PARAM_NONE,	"Lowlevel trace" },
+ { SEVERITY_ERR,   MSG_NOLOWLTRACE,	PARAM_NONE,	"Lowlevel tracing is not enabled" },
+ { SEVERITY_ERR,   MSG_INVLOWLTRACE,	PARAM_STR,	"No lowlevel trace for '%s'" },
+ { SEVERITY_ERR,   MSG_MISLOWLTRACE,	PARAM_NONE,	"Missing lowlevel trace channel or filename" },
+ { SEVERITY_SUCC,  MSG_LOWLTRACESAVED,	PARAM_STR,	"Lowlevel trace saved to file '%s'" },
+ { SEVERITY_ERR,   MSG_INVGOAL,	PARAM_STR,	"Unknown goal '%s'" },
+ { SEVERITY_SUCC,  MSG_GOALSET,	PARAM_STR,	"Set options for goal '%s'" },
+ { SEVERITY_ERR,   MSG_GOALSETERR,	PARAM_STR,	"Failed to set goal options: %s" },
+ { SEVERITY_SUCC,  MSG_LOCKSTATS,	PARAM_NONE,	"Lock stats" },
+ { SEVERITY_ERR,   MSG_NOLOCKSTATS,	PARAM_NONE,	"Lock profiling is not enabled" },
  { SEVERITY_SUCC,  MSG_SETQUOTA,PARAM_SET,	"Set pool '%s' to quota %d'" },
  { SEVERITY_ERR,   MSG_CONPAR,	PARAM_NONE,	"Missing config parameters 'name,N'" },
  { SEVERITY_ERR,   MSG_CONVAL,	PARAM_STR,	"Missing config value N for '%s,N'" },
@@ -1948,6 +1978,10 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_uint(root, "Stale", &(pool->stale_shares), false);
 		root = api_add_uint(root, "Get Failures", &(pool->getfail_occasions), false);
 		root = api_add_uint(root, "Remote Failures", &(pool->remotefail_occasions), false);
+		root = api_add_bool(root, "Standby", &(pool->standby), false);
+		root = api_add_uint32(root, "Failovers", &(pool->failovers), false);
+		root = api_add_timeval(root, "Last Failover Gap", &(pool->failover_gap_last), false);
+		root = api_add_timeval(root, "Max Failover Gap", &(pool->failover_gap_max), false);
 		root = api_add_escape(root, "User", pool->rpc_user, false);
 		root = api_add_time(root, "Last Share Time", &(pool->last_share_time), false);
 		root = api_add_diff(root, "Diff1 Shares", &(pool->diff1), false);
@@ -1990,10 +2024,13 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	char buf[TMPBUFSIZ];
 	bool io_open;
 	double utility, mhs, work_utility;
+	uint64_t stale_checks, stale_check_hits;
 
 	message(io_data, MSG_SUMM, 0, NULL, isjson);
 	io_open = io_add(io_data, isjson ? COMSTR JSON_SUMMARY : _SUMMARY COMSTR);
 
+	get_stale_check_counts(&stale_checks, &stale_check_hits);
+
 	// stop hashmeter() changing some while copying
 	mutex_lock(&hash_lock);
 
@@ -2022,6 +2059,8 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	root = api_add_uint(root, "Local Work", &(local_work), true);
 	root = api_add_uint(root, "Remote Failures", &(total_ro), true);
 	root = api_add_uint(root, "Network Blocks", &(new_blocks), true);
+	root = api_add_uint64(root, "Stale Checks", &stale_checks, true);
+	root = api_add_uint64(root, "Stale Check Hits", &stale_check_hits, true);
 	root = api_add_mhtotal(root, "Total MH", &(total_mhashes_done), true);
 	root = api_add_diff(root, "Diff1 Work", &total_diff1, true);
 	root = api_add_utility(root, "Work Utility", &(work_utility), false);
@@ -2984,6 +3023,12 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 		root = api_add_timeval(root, "Pool Max", &(pool_stats->getwork_wait_max), false);
 		root = api_add_timeval(root, "Pool Min", &(pool_stats->getwork_wait_min), false);
 		root = api_add_double(root, "Pool Av", &(pool_stats->getwork_wait_rolling), false);
+		root = api_add_uint32(root, "Pool In Flight", &(pool_stats->getwork_inflight), false);
+		root = api_add_uint32(root, "Pool Max In Flight", &(pool_stats->getwork_inflight_max), false);
+		root = api_add_uint64(root, "Coinbase Check Hits", &(pool_stats->cbcheck_hits), false);
+		root = api_add_uint64(root, "Coinbase Check Misses", &(pool_stats->cbcheck_misses), false);
+		root = api_add_uint64(root, "Prefetch Hits", &(pool_stats->prefetch_hits), false);
+		root = api_add_uint64(root, "Prefetch Misses", &(pool_stats->prefetch_misses), false);
 		root = api_add_bool(root, "Work Had Roll Time", &(pool_stats->hadrolltime), false);
 		root = api_add_bool(root, "Work Can Roll", &(pool_stats->canroll), false);
 		root = api_add_bool(root, "Work Had Expire", &(pool_stats->hadexpire), false);
@@ -3078,6 +3123,13 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	struct mining_goal_info *goal, *tmpgoal;
 	bool precom = false;
+	double total_weight = 0;
+	uint64_t total_works = 0;
+	HASH_ITER(hh, mining_goals, goal, tmpgoal)
+	{
+		total_weight += goal->weight;
+		total_works += goal->works;
+	}
 	HASH_ITER(hh, mining_goals, goal, tmpgoal)
 	{
 		if (goal->is_default)
@@ -3118,6 +3170,17 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 		root = api_add_diff(root, "Network Difficulty", &goal->current_diff, true);
 		
 		root = api_add_diff(root, "Difficulty Accepted", &goal->diff_accepted, false);
+		root = api_add_diff(root, "Diff1 Work", &goal->diff1, false);
+		
+		if (total_weight > 0)
+		{
+			double target_share = goal->weight / total_weight;
+			double work_share = total_works ? (double)goal->works / total_works : 0;
+			root = api_add_double(root, "Weight", &goal->weight, false);
+			root = api_add_int(root, "Staged", &goal->staged, false);
+			root = api_add_percent(root, "Target Share%", &target_share, true);
+			root = api_add_percent(root, "Work Share%", &work_share, true);
+		}
 		
 		root = print_data(root, buf, isjson, precom);
 		io_add(io_data, buf);
@@ -3126,6 +3189,198 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 	}
 }
 
+static void goalset(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	struct mining_goal_info *goal;
+	const char *emsg;
+	char *comma;
+
+	if (param == NULL || *param == '\0') {
+		message(io_data, MSG_CONPAR, 0, NULL, isjson);
+		return;
+	}
+
+	comma = strchr(param, ',');
+	if (!comma) {
+		message(io_data, MSG_CONVAL, 0, param, isjson);
+		return;
+	}
+
+	*(comma++) = '\0';
+
+	HASH_FIND_STR(mining_goals, param, goal);
+	if (!goal) {
+		message(io_data, MSG_INVGOAL, 0, param, isjson);
+		return;
+	}
+
+	emsg = set_goal_params(goal, comma);
+	if (emsg) {
+		message(io_data, MSG_GOALSETERR, 0, emsg, isjson);
+		return;
+	}
+
+	message(io_data, MSG_GOALSET, 0, goal->name, isjson);
+}
+
+#ifdef HAVE_BFG_LOWLEVEL
+static void lowltrace(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root = NULL;
+	struct lowl_trace *trace = NULL;
+	struct lowl_trace_rec *recs;
+	char buf[TMPBUFSIZ], hex[(LOWL_TRACE_DATA_MAX * 2) + 1];
+	uint64_t total_recs, total_bytes, len;
+	bool io_open = false;
+	int count, i, n;
+
+	if (!opt_lowl_trace) {
+		message(io_data, MSG_NOLOWLTRACE, 0, NULL, isjson);
+		return;
+	}
+
+	if (param && *param) {
+		trace = lowl_trace_find(param);
+		if (!trace) {
+			message(io_data, MSG_INVLOWLTRACE, 0, param, isjson);
+			return;
+		}
+	}
+
+	message(io_data, MSG_LOWLTRACE, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_LOWLTRACE);
+
+	if (!trace) {
+		// Without a channel, just list them
+		n = 0;
+		for (trace = lowl_trace_next(NULL); trace; trace = lowl_trace_next(trace)) {
+			count = lowl_trace_snapshot(trace, NULL, &total_recs, &total_bytes);
+			root = api_add_int(root, "LOWLTRACE", &n, true);
+			root = api_add_string(root, "Channel", lowl_trace_name(trace), false);
+			root = api_add_int(root, "Records", &count, true);
+			root = api_add_uint64(root, "Total Records", &total_recs, true);
+			root = api_add_uint64(root, "Total Bytes", &total_bytes, true);
+			root = print_data(root, buf, isjson, isjson && (n > 0));
+			io_add(io_data, buf);
+			++n;
+		}
+	} else {
+		count = lowl_trace_snapshot(trace, &recs, NULL, NULL);
+		for (i = 0; i < count; ++i) {
+			len = recs[i].len;
+			bin2hex(hex, recs[i].data, (len < LOWL_TRACE_DATA_MAX) ? len : LOWL_TRACE_DATA_MAX);
+			root = api_add_int(root, "LOWLTRACE", &i, true);
+			root = api_add_timeval(root, "Time", &recs[i].tv, true);
+			root = api_add_const(root, "Direction", (recs[i].dir == LTD_READ) ? "Read" : "Write", false);
+			root = api_add_uint64(root, "Length", &len, true);
+			root = api_add_string(root, "Data", hex, true);
+			root = print_data(root, buf, isjson, isjson && (i > 0));
+			io_add(io_data, buf);
+		}
+		free(recs);
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+static void lowltracesave(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	struct lowl_trace *trace;
+	char *filename, *ptr;
+
+	if (!opt_lowl_trace) {
+		message(io_data, MSG_NOLOWLTRACE, 0, NULL, isjson);
+		return;
+	}
+
+	filename = param ? strchr(param, ',') : NULL;
+	if (!(filename && filename[1])) {
+		message(io_data, MSG_MISLOWLTRACE, 0, NULL, isjson);
+		return;
+	}
+	*(filename++) = '\0';
+
+	trace = lowl_trace_find(param);
+	if (!trace) {
+		message(io_data, MSG_INVLOWLTRACE, 0, param, isjson);
+		return;
+	}
+
+	ptr = escape_string(filename, isjson);
+	if (lowl_trace_save(trace, filename))
+		message(io_data, MSG_LOWLTRACESAVED, 0, ptr, isjson);
+	else
+		message(io_data, MSG_BADFN, 0, ptr, isjson);
+	if (ptr != filename)
+		free(ptr);
+}
+#endif
+
+#ifdef USE_LOCK_STATS
+static
+void lock_stats_hist_str(char * const out, const size_t outsz, const uint64_t * const hist)
+{
+	size_t len = 0;
+	int i;
+
+	out[0] = '\0';
+	for (i = 0; i < LOCK_STATS_BUCKETS && len < outsz; ++i)
+		len += snprintf(&out[len], outsz - len, "%s%"PRIu64, i ? "," : "", hist[i]);
+}
+
+static void lockstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root = NULL;
+	struct lock_site *site;
+	char buf[TMPBUFSIZ], where[0x100], hist[LOCK_STATS_BUCKETS * 21];
+	bool io_open = false;
+	double d;
+	int n = 0;
+
+	if (!opt_lock_stats) {
+		message(io_data, MSG_NOLOCKSTATS, 0, NULL, isjson);
+		return;
+	}
+
+	message(io_data, MSG_LOCKSTATS, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_LOCKSTATS);
+
+	for (site = lock_stats_sites; site; site = site->next) {
+		snprintf(where, sizeof(where), "%s:%d", site->file, site->line);
+		root = api_add_int(root, "LOCKSTATS", &n, true);
+		root = api_add_string(root, "Lock", site->lockname, false);
+		root = api_add_const(root, "Op", site->op, false);
+		root = api_add_string(root, "Site", where, true);
+		root = api_add_string(root, "Function", site->func, false);
+		root = api_add_uint64(root, "Acquisitions", &site->acquisitions, true);
+		root = api_add_uint64(root, "Contended", &site->contended, true);
+		d = site->wait_us / 1e6;
+		root = api_add_elapsed(root, "Wait Total", &d, true);
+		d = site->wait_max_us / 1e6;
+		root = api_add_elapsed(root, "Wait Max", &d, true);
+		d = site->hold_us / 1e6;
+		root = api_add_elapsed(root, "Hold Total", &d, true);
+		d = site->hold_max_us / 1e6;
+		root = api_add_elapsed(root, "Hold Max", &d, true);
+		lock_stats_hist_str(hist, sizeof(hist), site->wait_hist);
+		root = api_add_string(root, "Wait Histogram", hist, true);
+		lock_stats_hist_str(hist, sizeof(hist), site->hold_hist);
+		root = api_add_string(root, "Hold Histogram", hist, true);
+		root = print_data(root, buf, isjson, isjson && (n > 0));
+		io_add(io_data, buf);
+		++n;
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+#endif
+
 static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
@@ -3452,6 +3707,7 @@ struct CMDS {
 	{ "addpool",		addpool,	true,	false },
 	{ "poolpriority",	poolpriority,	true,	false },
 	{ "poolquota",		poolquota,	true,	false },
+	{ "goalset",		goalset,	true,	false },
 	{ "enablepool",		enablepool,	true,	false },
 	{ "disablepool",	disablepool,	true,	false },
 	{ "removepool",		removepool,	true,	false },
@@ -3481,6 +3737,13 @@ struct CMDS {
 	{ "procset",		pgaset,		true,	false },
 #endif
 	{ "zero",		dozero,		true,	false },
+#ifdef HAVE_BFG_LOWLEVEL
+	{ "lowltrace",		lowltrace,	false,	false },
+	{ "lowltracesave",	lowltracesave,	true,	false },
+#endif
+#ifdef USE_LOCK_STATS
+	{ "lockstats",		lockstats,	false,	false },
+#endif
 	{ NULL,			NULL,		false,	false }
 };
 
@@ -32,6 +32,7 @@
 #include "deviceapi.h"
 #include "logging.h"
 #include "lowlevel.h"
+#include "lowl-reactor.h"
 #ifdef NEED_BFG_LOWL_VCOM
 #include "lowl-vcom.h"
 #endif
@@ -215,7 +216,6 @@ int restart_wait(struct thr_info *thr, unsigned int mstime)
 	}
 }
 
-static
 struct work *get_and_prepare_work(struct thr_info *thr)
 {
 	struct cgpu_info *proc = thr->cgpu;
@@ -334,11 +334,23 @@ bool do_job_prepare(struct thr_info *mythr, struct timeval *tvp_now)
 	if ((!mythr->work) || abandon_work(mythr->work, &tv_worktime, proc->max_hashes))
 	{
 		mythr->work_restart = false;
-		request_work(mythr);
-		// FIXME: Allow get_work to return NULL to retry on notification
 		if (mythr->next_work)
+		{
 			free_work(mythr->next_work);
-		mythr->next_work = get_and_prepare_work(mythr);
+			mythr->next_work = NULL;
+		}
+		if (bfg_reactor_owns(mythr))
+		{
+			// get_work may block every other device, so the reactor fetches it elsewhere and brings us back here
+			if (!bfg_reactor_get_work(mythr, &mythr->next_work))
+				return true;
+		}
+		else
+		{
+			request_work(mythr);
+			// FIXME: Allow get_work to return NULL to retry on notification
+			mythr->next_work = get_and_prepare_work(mythr);
+		}
 		if (!mythr->next_work)
 			return false;
 		mythr->starting_next_work = true;
@@ -475,10 +487,23 @@ bool do_process_results(struct thr_info *mythr, struct timeval *tvp_now, struct
 	return true;
 }
 
+// Called from the device's thread when its mutex_request notifier is readable
+void cgpu_grant_control_request(struct thr_info * const thr)
+{
+	struct cgpu_info * const cgpu = thr->cgpu;
+	// FIXME: This can only handle one request at a time!
+	pthread_mutex_t *mutexp = &cgpu->device_mutex;
+	notifier_read(thr->mutex_request);
+	mutex_lock(mutexp);
+	pthread_cond_signal(&cgpu->device_cond);
+	pthread_cond_wait(&cgpu->device_cond, mutexp);
+	mutex_unlock(mutexp);
+}
+
+// Returns true if woken by a notifier or control request, rather than the timeout
 static
-void do_notifier_select(struct thr_info *thr, struct timeval *tvp_timeout)
+bool do_notifier_select(struct thr_info *thr, struct timeval *tvp_timeout)
 {
-	struct cgpu_info *cgpu = thr->cgpu;
 	struct timeval tv_now;
 	int maxfd;
 	fd_set rfds;
@@ -494,23 +519,16 @@ void do_notifier_select(struct thr_info *thr, struct timeval *tvp_timeout)
 		FD_SET(thr->mutex_request[0], &rfds);
 		set_maxfd(&maxfd, thr->mutex_request[0]);
 	}
-	if (select(maxfd + 1, &rfds, NULL, NULL, select_timeout(tvp_timeout, &tv_now)) < 0)
-		return;
+	if (select(maxfd + 1, &rfds, NULL, NULL, select_timeout(tvp_timeout, &tv_now)) <= 0)
+		return false;
 	if (thr->mutex_request[1] != INVSOCK && FD_ISSET(thr->mutex_request[0], &rfds))
-	{
-		// FIXME: This can only handle one request at a time!
-		pthread_mutex_t *mutexp = &cgpu->device_mutex;
-		notifier_read(thr->mutex_request);
-		mutex_lock(mutexp);
-		pthread_cond_signal(&cgpu->device_cond);
-		pthread_cond_wait(&cgpu->device_cond, mutexp);
-		mutex_unlock(mutexp);
-	}
+		cgpu_grant_control_request(thr);
 	if (FD_ISSET(thr->notifier[0], &rfds)) {
 		notifier_read(thr->notifier);
 	}
 	if (FD_ISSET(thr->work_restart_notifier[0], &rfds))
 		notifier_read(thr->work_restart_notifier);
+	return true;
 }
 
 void cgpu_setup_control_requests(struct cgpu_info * const cgpu)
@@ -539,8 +557,7 @@ void cgpu_release_control(struct cgpu_info * const cgpu)
 	mutex_unlock(&cgpu->device_mutex);
 }
 
-static
-void _minerloop_setup(struct thr_info *mythr)
+void minerloop_setup(struct thr_info *mythr)
 {
 	struct cgpu_info * const cgpu = mythr->cgpu, *proc;
 	
@@ -555,94 +572,312 @@ void _minerloop_setup(struct thr_info *mythr)
 	}
 }
 
-void minerloop_async(struct thr_info *mythr)
+static
+void minerloop_async_proc(struct cgpu_info * const cgpu, struct cgpu_info * const proc, struct timeval * const tvp_now)
 {
-	struct thr_info *thr = mythr;
-	struct cgpu_info *cgpu = mythr->cgpu;
-	struct device_drv *api = cgpu->drv;
-	struct timeval tv_now;
-	struct timeval tv_timeout;
-	struct cgpu_info *proc;
+	struct device_drv * const api = cgpu->drv;
+	struct thr_info * const mythr = proc->thr[0];
 	bool is_running, should_be_running;
 	
-	_minerloop_setup(mythr);
+	// Processors without their own jobs only get polled and watchdogged
+	if (api->async_jobs_per_device && proc != cgpu)
+		goto defer_events;
 	
-	while (likely(!cgpu->shutdown)) {
-		tv_timeout.tv_sec = -1;
-		timer_set_now(&tv_now);
-		for (proc = cgpu; proc; proc = proc->next_proc)
+	// Nothing should happen while we're starting a job
+	if (unlikely(mythr->busy_state == TBS_STARTING_JOB))
+		goto defer_events;
+	
+	is_running = mythr->work;
+	should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
+	
+	if (should_be_running)
+	{
+		if (unlikely(!(is_running || mythr->_job_transition_in_progress)))
+		{
+			mt_disable_finish(mythr);
+			goto djp;
+		}
+		if (unlikely(mythr->work_restart))
+			goto djp;
+	}
+	else  // ! should_be_running
+	{
+		if (unlikely(mythr->_job_transition_in_progress && timer_isset(&mythr->tv_morework)))
+		{
+			// Really only happens at startup
+			applog(LOG_DEBUG, "%"PRIpreprv": Job transition in progress, with morework timer enabled: unsetting in-progress flag", proc->proc_repr);
+			mythr->_job_transition_in_progress = false;
+		}
+		if (unlikely((is_running || !mythr->_mt_disable_called) && !mythr->_job_transition_in_progress))
 		{
-			mythr = proc->thr[0];
-			
-			// Nothing should happen while we're starting a job
-			if (unlikely(mythr->busy_state == TBS_STARTING_JOB))
-				goto defer_events;
-			
-			is_running = mythr->work;
-			should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
-			
-			if (should_be_running)
-			{
-				if (unlikely(!(is_running || mythr->_job_transition_in_progress)))
-				{
-					mt_disable_finish(mythr);
-					goto djp;
-				}
-				if (unlikely(mythr->work_restart))
-					goto djp;
-			}
-			else  // ! should_be_running
-			{
-				if (unlikely(mythr->_job_transition_in_progress && timer_isset(&mythr->tv_morework)))
-				{
-					// Really only happens at startup
-					applog(LOG_DEBUG, "%"PRIpreprv": Job transition in progress, with morework timer enabled: unsetting in-progress flag", proc->proc_repr);
-					mythr->_job_transition_in_progress = false;
-				}
-				if (unlikely((is_running || !mythr->_mt_disable_called) && !mythr->_job_transition_in_progress))
-				{
 disabled: ;
-					if (is_running)
-					{
-						if (mythr->busy_state != TBS_GETTING_RESULTS)
-							do_get_results(mythr, false);
-						else
-							// Avoid starting job when pending result fetch completes
-							mythr->_proceed_with_new_job = false;
-					}
-					else  // !mythr->_mt_disable_called
-						mt_disable_start__async(mythr);
-				}
-				
-				timer_unset(&mythr->tv_morework);
-			}
-			
-			if (timer_passed(&mythr->tv_morework, &tv_now))
-			{
-djp: ;
-				if (!do_job_prepare(mythr, &tv_now))
-					goto disabled;
-			}
-			
-defer_events:
-			if (timer_passed(&mythr->tv_poll, &tv_now))
-				api->poll(mythr);
-			
-			if (timer_passed(&mythr->tv_watchdog, &tv_now))
+			if (is_running)
 			{
-				timer_set_delay(&mythr->tv_watchdog, &tv_now, WATCHDOG_INTERVAL * 1000000);
-				bfg_watchdog(proc, &tv_now);
+				if (mythr->busy_state != TBS_GETTING_RESULTS)
+					do_get_results(mythr, false);
+				else
+					// Avoid starting job when pending result fetch completes
+					mythr->_proceed_with_new_job = false;
 			}
-			
-			reduce_timeout_to(&tv_timeout, &mythr->tv_morework);
-			reduce_timeout_to(&tv_timeout, &mythr->tv_poll);
-			reduce_timeout_to(&tv_timeout, &mythr->tv_watchdog);
+			else  // !mythr->_mt_disable_called
+				mt_disable_start__async(mythr);
 		}
 		
-		do_notifier_select(thr, &tv_timeout);
+		timer_unset(&mythr->tv_morework);
+	}
+	
+	if (timer_passed(&mythr->tv_morework, tvp_now))
+	{
+djp: ;
+		if (!do_job_prepare(mythr, tvp_now))
+			goto disabled;
+	}
+	
+defer_events:
+	if (timer_passed(&mythr->tv_poll, tvp_now))
+		api->poll(mythr);
+	
+	if (timer_passed(&mythr->tv_watchdog, tvp_now))
+	{
+		timer_set_delay(&mythr->tv_watchdog, tvp_now, WATCHDOG_INTERVAL * 1000000);
+		bfg_watchdog(proc, tvp_now);
 	}
 }
 
+// True if minerloop_async_proc would only check timers, so need not run until one is due
+static
+bool minerloop_async_proc_idle(struct cgpu_info * const cgpu, struct cgpu_info * const proc)
+{
+	struct thr_info * const mythr = proc->thr[0];
+	
+	if ((cgpu->drv->async_jobs_per_device && proc != cgpu) || mythr->busy_state == TBS_STARTING_JOB)
+		return true;
+	if (proc->deven == DEV_ENABLED && !mythr->pause)
+		return (mythr->work || mythr->_job_transition_in_progress) && !mythr->work_restart;
+	return !((mythr->work || !mythr->_mt_disable_called) && !mythr->_job_transition_in_progress);
+}
+
+// One pass of minerloop_async over every processor of a device
+// tvp_timeout is reduced to the next time anything needs to happen
+void minerloop_async_step(struct cgpu_info * const cgpu, struct timeval * const tvp_now, struct timeval * const tvp_timeout)
+{
+	struct thr_info *mythr;
+	struct cgpu_info *proc;
+	
+	for (proc = cgpu; proc; proc = proc->next_proc)
+	{
+		mythr = proc->thr[0];
+		
+		minerloop_async_proc(cgpu, proc, tvp_now);
+		
+		reduce_timeout_to(tvp_timeout, &mythr->tv_morework);
+		reduce_timeout_to(tvp_timeout, &mythr->tv_poll);
+		reduce_timeout_to(tvp_timeout, &mythr->tv_watchdog);
+	}
+}
+
+static void minerloop_queue_proc(struct cgpu_info *, struct cgpu_info *, struct timeval *);
+static bool minerloop_queue_proc_idle(struct cgpu_info *, struct cgpu_info *);
+
+// Per-device state for drivers with minerloop_timer_wheel
+struct minerloop_wheel {
+	struct cgpu_info *cgpu;
+	bool async;
+	struct timer_wheel wheel;
+	
+	// Incremented every step; threads remember when they were last visited and queued
+	unsigned step;
+	// Touched threads to visit later this step, and those left for the next step
+	struct thr_info *pending;
+	struct thr_info *revisit;
+	
+	bool full_walk;
+	struct timeval tv_full_walk;
+};
+
+static
+struct minerloop_wheel *minerloop_wheel_new(struct cgpu_info * const cgpu, const bool async, const struct timeval * const tvp_now)
+{
+	struct minerloop_wheel * const mlw = malloc(sizeof(*mlw));
+	struct cgpu_info *proc;
+	struct thr_info *thr;
+	
+	if (unlikely(!mlw))
+		quit(1, "Failed to malloc minerloop_wheel");
+	*mlw = (struct minerloop_wheel){
+		.cgpu = cgpu,
+		.async = async,
+		.full_walk = true,
+	};
+	timer_wheel_init(&mlw->wheel, tvp_now);
+	timer_unset(&mlw->tv_full_walk);
+	for (proc = cgpu; proc; proc = proc->next_proc)
+	{
+		thr = proc->thr[0];
+		thr->wheel_entry = (struct timer_wheel_entry){
+			.userp = thr,
+		};
+		thr->wheel_visited = thr->wheel_queued = 0;
+	}
+	cgpu->thr[0]->minerloop_wheel = mlw;
+	return mlw;
+}
+
+static
+void minerloop_wheel_free(struct minerloop_wheel * const mlw)
+{
+	if (!mlw)
+		return;
+	mlw->cgpu->thr[0]->minerloop_wheel = NULL;
+	free(mlw);
+}
+
+// Ensures a processor's thread gets visited, even if none of its timers are due
+void minerloop_wheel_touch(struct thr_info * const thr)
+{
+	struct minerloop_wheel * const mlw = thr->cgpu->device->thr[0]->minerloop_wheel;
+	unsigned step;
+	
+	if (!mlw)
+		return;
+	// Threads already visited this step wait for the next
+	step = mlw->step;
+	if (thr->wheel_visited == step)
+		++step;
+	if (thr->wheel_queued == step)
+		return;
+	thr->wheel_queued = step;
+	if (step == mlw->step)
+	{
+		thr->wheel_pending_next = mlw->pending;
+		mlw->pending = thr;
+	}
+	else
+	{
+		thr->wheel_revisit_next = mlw->revisit;
+		mlw->revisit = thr;
+	}
+}
+
+// Puts a thread's wheel entry at its earliest timer
+static
+void minerloop_wheel_resync(struct minerloop_wheel * const mlw, struct thr_info * const thr)
+{
+	struct timer_wheel_entry * const entry = &thr->wheel_entry;
+	struct timeval tv_due;
+	
+	timer_unset(&tv_due);
+	if (mlw->async)
+		reduce_timeout_to(&tv_due, &thr->tv_morework);
+	reduce_timeout_to(&tv_due, &thr->tv_poll);
+	reduce_timeout_to(&tv_due, &thr->tv_watchdog);
+	if (!timer_isset(&tv_due))
+		timer_wheel_cancel(&mlw->wheel, entry);
+	else
+	if (!(timer_wheel_entry_scheduled(entry) && entry->tv.tv_sec == tv_due.tv_sec && entry->tv.tv_usec == tv_due.tv_usec))
+		timer_wheel_schedule(&mlw->wheel, entry, &tv_due);
+}
+
+static
+void minerloop_wheel_visit(struct minerloop_wheel * const mlw, struct thr_info * const thr, struct timeval * const tvp_now)
+{
+	struct cgpu_info * const proc = thr->cgpu;
+	bool idle;
+	
+	if (thr->wheel_visited == mlw->step)
+		return;
+	thr->wheel_visited = mlw->step;
+	if (mlw->async)
+	{
+		minerloop_async_proc(mlw->cgpu, proc, tvp_now);
+		idle = minerloop_async_proc_idle(mlw->cgpu, proc);
+	}
+	else
+	{
+		minerloop_queue_proc(mlw->cgpu, proc, tvp_now);
+		idle = minerloop_queue_proc_idle(mlw->cgpu, proc);
+	}
+	if (!idle)
+		minerloop_wheel_touch(thr);
+	minerloop_wheel_resync(mlw, thr);
+}
+
+// Like minerloop_async_step, but only visits processors that are due or touched
+static
+void minerloop_wheel_step(struct minerloop_wheel * const mlw, struct timeval * const tvp_now, struct timeval * const tvp_timeout)
+{
+	struct timer_wheel_entry *expired, *entry, *tmp;
+	struct thr_info *thr, *next;
+	struct cgpu_info *proc;
+	
+	++mlw->step;
+	
+	// Anything left non-idle by the last step goes first
+	thr = mlw->revisit;
+	mlw->revisit = NULL;
+	for ( ; thr; thr = next)
+	{
+		next = thr->wheel_revisit_next;
+		minerloop_wheel_visit(mlw, thr, tvp_now);
+	}
+	
+	expired = timer_wheel_expire(&mlw->wheel, tvp_now);
+	DL_FOREACH_SAFE(expired, entry, tmp)
+		minerloop_wheel_touch(entry->userp);
+	
+	// Notifiers can mean anything changed, and full walks catch whatever drivers forgot to touch
+	if (mlw->full_walk || timer_passed(&mlw->tv_full_walk, tvp_now))
+	{
+		mlw->full_walk = false;
+		timer_set_delay(&mlw->tv_full_walk, tvp_now, WATCHDOG_INTERVAL * 1000000);
+		for (proc = mlw->cgpu; proc; proc = proc->next_proc)
+			minerloop_wheel_visit(mlw, proc->thr[0], tvp_now);
+	}
+	
+	while ((thr = mlw->pending))
+	{
+		mlw->pending = thr->wheel_pending_next;
+		minerloop_wheel_visit(mlw, thr, tvp_now);
+	}
+	
+	// Touched threads may have had their timers changed after their visit
+	for (thr = mlw->revisit; thr; thr = thr->wheel_revisit_next)
+		minerloop_wheel_resync(mlw, thr);
+	// HACK: Some designs set the main thr tv_poll from secondary thrs
+	minerloop_wheel_resync(mlw, mlw->cgpu->thr[0]);
+	
+	timer_wheel_reduce_timeout(&mlw->wheel, tvp_timeout);
+	reduce_timeout_to(tvp_timeout, &mlw->tv_full_walk);
+}
+
+void minerloop_async(struct thr_info *mythr)
+{
+	struct cgpu_info *cgpu = mythr->cgpu;
+	struct minerloop_wheel *mlw = NULL;
+	struct timeval tv_now;
+	struct timeval tv_timeout;
+	
+	minerloop_setup(mythr);
+	if (cgpu->drv->minerloop_timer_wheel)
+	{
+		timer_set_now(&tv_now);
+		mlw = minerloop_wheel_new(cgpu, true, &tv_now);
+	}
+	
+	while (likely(!cgpu->shutdown)) {
+		tv_timeout.tv_sec = -1;
+		timer_set_now(&tv_now);
+		if (mlw)
+			minerloop_wheel_step(mlw, &tv_now, &tv_timeout);
+		else
+			minerloop_async_step(cgpu, &tv_now, &tv_timeout);
+		if (do_notifier_select(mythr, &tv_timeout) && mlw)
+			mlw->full_walk = true;
+	}
+	
+	minerloop_wheel_free(mlw);
+}
+
 static
 void do_queue_flush(struct thr_info *mythr)
 {
@@ -657,125 +892,276 @@ void do_queue_flush(struct thr_info *mythr)
 	}
 }
 
+static
+void minerloop_queue_proc(struct cgpu_info * const cgpu, struct cgpu_info * const proc, struct timeval * const tvp_now)
+{
+	struct device_drv * const api = cgpu->drv;
+	struct thr_info * const mythr = proc->thr[0];
+	bool should_be_running;
+	struct work *work;
+	
+	should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
+redo:
+	if (should_be_running)
+	{
+		if (unlikely(mythr->_mt_disable_called))
+			mt_disable_finish(mythr);
+		
+		if (unlikely(mythr->work_restart))
+		{
+			mythr->work_restart = false;
+			do_queue_flush(mythr);
+		}
+		
+		while (!mythr->queue_full)
+		{
+			if (mythr->next_work)
+			{
+				work = mythr->next_work;
+				mythr->next_work = NULL;
+			}
+			else
+			{
+				request_work(mythr);
+				// FIXME: Allow get_work to return NULL to retry on notification
+				work = get_and_prepare_work(mythr);
+			}
+			if (!work)
+				break;
+			if (!api->queue_append(mythr, work))
+				mythr->next_work = work;
+		}
+	}
+	else
+	if (unlikely(!mythr->_mt_disable_called))
+	{
+		do_queue_flush(mythr);
+		mt_disable_start(mythr);
+	}
+	
+	if (timer_passed(&mythr->tv_poll, tvp_now))
+		api->poll(mythr);
+	
+	if (timer_passed(&mythr->tv_watchdog, tvp_now))
+	{
+		timer_set_delay(&mythr->tv_watchdog, tvp_now, WATCHDOG_INTERVAL * 1000000);
+		bfg_watchdog(proc, tvp_now);
+	}
+	
+	should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
+	if (should_be_running && !mythr->queue_full)
+		goto redo;
+}
+
+// True if minerloop_queue_proc would only check timers, so need not run until one is due
+static
+bool minerloop_queue_proc_idle(struct cgpu_info * const cgpu, struct cgpu_info * const proc)
+{
+	struct thr_info * const mythr = proc->thr[0];
+	
+	if (proc->deven == DEV_ENABLED && !mythr->pause)
+		return mythr->queue_full && !mythr->_mt_disable_called && !mythr->work_restart;
+	return mythr->_mt_disable_called;
+}
+
 void minerloop_queue(struct thr_info *thr)
 {
 	struct thr_info *mythr;
 	struct cgpu_info *cgpu = thr->cgpu;
-	struct device_drv *api = cgpu->drv;
+	struct minerloop_wheel *mlw = NULL;
 	struct timeval tv_now;
 	struct timeval tv_timeout;
 	struct cgpu_info *proc;
-	bool should_be_running;
-	struct work *work;
 	
-	_minerloop_setup(thr);
+	minerloop_setup(thr);
+	if (cgpu->drv->minerloop_timer_wheel)
+	{
+		timer_set_now(&tv_now);
+		mlw = minerloop_wheel_new(cgpu, false, &tv_now);
+	}
 	
 	while (likely(!cgpu->shutdown)) {
 		tv_timeout.tv_sec = -1;
 		timer_set_now(&tv_now);
-		for (proc = cgpu; proc; proc = proc->next_proc)
+		if (mlw)
+			minerloop_wheel_step(mlw, &tv_now, &tv_timeout);
+		else
 		{
-			mythr = proc->thr[0];
-			
-			should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
-redo:
-			if (should_be_running)
+			for (proc = cgpu; proc; proc = proc->next_proc)
 			{
-				if (unlikely(mythr->_mt_disable_called))
-					mt_disable_finish(mythr);
+				mythr = proc->thr[0];
 				
-				if (unlikely(mythr->work_restart))
-				{
-					mythr->work_restart = false;
-					do_queue_flush(mythr);
-				}
+				minerloop_queue_proc(cgpu, proc, &tv_now);
 				
-				while (!mythr->queue_full)
-				{
-					if (mythr->next_work)
-					{
-						work = mythr->next_work;
-						mythr->next_work = NULL;
-					}
-					else
-					{
-						request_work(mythr);
-						// FIXME: Allow get_work to return NULL to retry on notification
-						work = get_and_prepare_work(mythr);
-					}
-					if (!work)
-						break;
-					if (!api->queue_append(mythr, work))
-						mythr->next_work = work;
-				}
-			}
-			else
-			if (unlikely(!mythr->_mt_disable_called))
-			{
-				do_queue_flush(mythr);
-				mt_disable_start(mythr);
+				reduce_timeout_to(&tv_timeout, &mythr->tv_poll);
+				reduce_timeout_to(&tv_timeout, &mythr->tv_watchdog);
 			}
 			
-			if (timer_passed(&mythr->tv_poll, &tv_now))
-				api->poll(mythr);
-			
-			if (timer_passed(&mythr->tv_watchdog, &tv_now))
-			{
-				timer_set_delay(&mythr->tv_watchdog, &tv_now, WATCHDOG_INTERVAL * 1000000);
-				bfg_watchdog(proc, &tv_now);
-			}
-			
-			should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
-			if (should_be_running && !mythr->queue_full)
-				goto redo;
-			
-			reduce_timeout_to(&tv_timeout, &mythr->tv_poll);
-			reduce_timeout_to(&tv_timeout, &mythr->tv_watchdog);
+			// HACK: Some designs set the main thr tv_poll from secondary thrs
+			reduce_timeout_to(&tv_timeout, &cgpu->thr[0]->tv_poll);
 		}
 		
-		// HACK: Some designs set the main thr tv_poll from secondary thrs
-		reduce_timeout_to(&tv_timeout, &cgpu->thr[0]->tv_poll);
-		
-		do_notifier_select(thr, &tv_timeout);
+		if (do_notifier_select(thr, &tv_timeout) && mlw)
+			mlw->full_walk = true;
 	}
+	
+	minerloop_wheel_free(mlw);
 }
 
-void *miner_thread(void *userdata)
+#define TEST_MLW_PROCS  1000
+
+struct test_mlw_proc {
+	struct cgpu_info proc;
+	struct thr_info thr;
+	struct thr_info *thrp;
+	unsigned period_ms;
+	unsigned polls[2];
+};
+
+static struct timeval test_mlw_now;
+static int test_mlw_mode;
+
+static
+void test_minerloop_wheel_poll(struct thr_info * const thr)
 {
-	struct thr_info *mythr = userdata;
-	struct cgpu_info *cgpu = mythr->cgpu;
-	struct device_drv *drv = cgpu->drv;
+	struct test_mlw_proc * const tp = thr->cgpu_data;
+	
+	++tp->polls[test_mlw_mode];
+	timer_set_delay(&thr->tv_poll, &test_mlw_now, tp->period_ms * 1000);
+}
 
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+// Simulates a second of a device whose processors only get polled; returns real microseconds taken
+static
+long test_minerloop_wheel_run(struct test_mlw_proc * const tps, const int procs, const bool use_wheel, unsigned * const out_steps)
+{
+	struct cgpu_info * const cgpu = &tps[0].proc;
+	struct minerloop_wheel *mlw = NULL;
+	struct timeval tv_end, tv_timeout, tv_start_real;
+	struct thr_info *thr;
+	int i;
+	
+	test_mlw_mode = use_wheel;
+	test_mlw_now = (struct timeval){ .tv_sec = 1000000, };
+	timer_set_delay(&tv_end, &test_mlw_now, 1000000);
+	for (i = 0; i < procs; ++i)
+	{
+		thr = &tps[i].thr;
+		timer_unset(&thr->tv_morework);
+		timer_unset(&thr->tv_watchdog);
+		timer_set_delay(&thr->tv_poll, &test_mlw_now, (i % tps[i].period_ms) * 1000);
+	}
+	if (use_wheel)
+		mlw = minerloop_wheel_new(cgpu, true, &test_mlw_now);
+	
+	*out_steps = 0;
+	timer_set_now(&tv_start_real);
+	while (timercmp(&test_mlw_now, &tv_end, <))
+	{
+		timer_unset(&tv_timeout);
+		if (mlw)
+			minerloop_wheel_step(mlw, &test_mlw_now, &tv_timeout);
+		else
+			minerloop_async_step(cgpu, &test_mlw_now, &tv_timeout);
+		++*out_steps;
+		// select returns just after the timeout
+		timer_set_delay(&test_mlw_now, &tv_timeout, 1);
+	}
+	
+	minerloop_wheel_free(mlw);
+	return timer_elapsed_us(&tv_start_real, NULL);
+}
 
-	char threadname[20];
-	snprintf(threadname, 20, "miner_%s", cgpu->proc_repr_ns);
-	RenameThread(threadname);
+void test_minerloop_wheel()
+{
+	static struct device_drv drv = {
+		.dname = "test",
+		.name = "TST",
+		.async_jobs_per_device = true,
+		.minerloop_timer_wheel = true,
+		.poll = test_minerloop_wheel_poll,
+	};
+	// Only the full count shows the difference in time; fewer still check the wheel wakes exactly as often
+	const int procs = opt_unittest_bench ? TEST_MLW_PROCS : (TEST_MLW_PROCS / 10);
+	struct test_mlw_proc * const tps = calloc(procs, sizeof(*tps));
+	struct test_mlw_proc *tp;
+	uint32_t seed = 1;
+	unsigned steps[2];
+	long us[2];
+	int i;
+	
+	if (unlikely(!tps))
+		quit(1, "Failed to calloc %s", __func__);
+	for (i = 0; i < procs; ++i)
+	{
+		tp = &tps[i];
+		seed = seed * 1103515245 + 12345;
+		tp->period_ms = 50 + (seed >> 16) % 101;
+		tp->thrp = &tp->thr;
+		tp->thr.cgpu = &tp->proc;
+		tp->thr.cgpu_data = tp;
+		tp->proc.drv = &drv;
+		tp->proc.device = &tps[0].proc;
+		tp->proc.proc_id = i;
+		tp->proc.deven = DEV_ENABLED;
+		tp->proc.thr = &tp->thrp;
+		if (i + 1 < procs)
+			tp->proc.next_proc = &tps[i + 1].proc;
+	}
+	// Keep the first processor busy, so everything only gets polled
+	tps[0].thr.busy_state = TBS_STARTING_JOB;
+	
+	us[0] = test_minerloop_wheel_run(tps, procs, false, &steps[0]);
+	us[1] = test_minerloop_wheel_run(tps, procs, true, &steps[1]);
+	if (opt_unittest_bench)
+		applog(LOG_NOTICE, "%s: %d processors for 1s: full walk %u steps in %ldus, timer wheel %u steps in %ldus",
+		       __func__, procs, steps[0], us[0], steps[1], us[1]);
+	if (steps[0] != steps[1])
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: timer wheel woke %u times, but full walk %u times", __func__, steps[1], steps[0]);
+	}
+	
+	for (i = 0; i < procs; ++i)
+	{
+		tp = &tps[i];
+		if (tp->polls[0] != tp->polls[1] || !tp->polls[0])
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: processor %d polled %u times by full walk, but %u by timer wheel",
+			       __func__, i, tp->polls[0], tp->polls[1]);
+			break;
+		}
+	}
+	free(tps);
+}
 
+// Runs the driver's thread_init; returns false (after reporting) if the device failed
+bool miner_thread_init(struct thr_info * const mythr)
+{
+	struct cgpu_info * const cgpu = mythr->cgpu;
+	struct device_drv * const drv = cgpu->drv;
+	
 	if (drv->thread_init && !drv->thread_init(mythr)) {
 		dev_error(cgpu, REASON_THREAD_FAIL_INIT);
 		for (struct cgpu_info *slave = cgpu->next_proc; slave && !slave->threads; slave = slave->next_proc)
 			dev_error(slave, REASON_THREAD_FAIL_INIT);
 		__thr_being_msg(LOG_ERR, mythr, "failure, exiting");
-		goto out;
+		return false;
 	}
 
 	if (drv_ready(cgpu) && !cgpu->already_set_defaults)
 		cgpu_set_defaults(cgpu);
 	
 	thread_reportout(mythr);
-	applog(LOG_DEBUG, "Popping ping in miner thread");
-	notifier_read(mythr->notifier);  // Wait for a notification to start
-	
-	cgtime(&cgpu->cgminer_stats.start_tv);
-	if (drv->minerloop)
-		drv->minerloop(mythr);
-	else
-		minerloop_scanhash(mythr);
-	__thr_being_msg(LOG_NOTICE, mythr, "shutting down");
+	return true;
+}
 
-out: ;
+void miner_thread_shutdown(struct thr_info * const mythr)
+{
+	struct cgpu_info * const cgpu = mythr->cgpu;
+	struct device_drv * const drv = cgpu->drv;
 	struct cgpu_info *proc = cgpu;
+	
 	do
 	{
 		proc->deven = DEV_DISABLED;
@@ -790,6 +1176,35 @@ out: ;
 		drv->thread_shutdown(mythr);
 
 	notifier_destroy(mythr->notifier);
+}
+
+void *miner_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+	struct cgpu_info *cgpu = mythr->cgpu;
+	struct device_drv *drv = cgpu->drv;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	char threadname[20];
+	snprintf(threadname, 20, "miner_%s", cgpu->proc_repr_ns);
+	RenameThread(threadname);
+
+	if (!miner_thread_init(mythr))
+		goto out;
+	
+	applog(LOG_DEBUG, "Popping ping in miner thread");
+	notifier_read(mythr->notifier);  // Wait for a notification to start
+	
+	cgtime(&cgpu->cgminer_stats.start_tv);
+	if (drv->minerloop)
+		drv->minerloop(mythr);
+	else
+		minerloop_scanhash(mythr);
+	__thr_being_msg(LOG_NOTICE, mythr, "shutting down");
+
+out:
+	miner_thread_shutdown(mythr);
 
 	return NULL;
 }
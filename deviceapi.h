@@ -36,13 +36,15 @@ extern void _bfg_register_driver(const struct device_drv *);
 	}                                           \
 // END BFG_REGISTER_DRIVER
 
-extern bool bfg_need_detect_rescan;
+// Probes which could not tell yet ask for another scan after the current one
+extern void bfg_request_detect_rescan(void);
 
 extern float common_sha256d_and_scrypt_min_nonce_diff(struct cgpu_info *, const struct mining_algorithm *);
 extern float common_scrypt_min_nonce_diff(struct cgpu_info *, const struct mining_algorithm *);
 
 extern void request_work(struct thr_info *);
 extern struct work *get_work(struct thr_info *);
+extern struct work *get_and_prepare_work(struct thr_info *);
 extern bool hashes_done(struct thr_info *, int64_t hashes, struct timeval *tvp_hashes, uint32_t *max_nonce);
 extern bool hashes_done2(struct thr_info *, int64_t hashes, uint32_t *max_nonce);
 extern void mt_disable_start(struct thr_info *);
@@ -62,15 +64,22 @@ extern void mt_job_transition(struct thr_info *);
 extern void job_start_complete(struct thr_info *);
 extern void job_start_abort(struct thr_info *, bool failure);
 extern bool do_process_results(struct thr_info *, struct timeval *tvp_now, struct work *, bool stopping);
+extern void minerloop_setup(struct thr_info *);
+extern void minerloop_async_step(struct cgpu_info *, struct timeval *tvp_now, struct timeval *tvp_timeout);
 extern void minerloop_async(struct thr_info *);
 
 extern void minerloop_queue(struct thr_info *);
+extern void minerloop_wheel_touch(struct thr_info *);
+extern void test_minerloop_wheel();
 
 // Establishes a simple way for external threads to directly communicate with device
 extern void cgpu_setup_control_requests(struct cgpu_info *);
 extern void cgpu_request_control(struct cgpu_info *);
 extern void cgpu_release_control(struct cgpu_info *);
+extern void cgpu_grant_control_request(struct thr_info *);
 
+extern bool miner_thread_init(struct thr_info *);
+extern void miner_thread_shutdown(struct thr_info *);
 extern void *miner_thread(void *);
 
 extern void add_cgpu_live(void*);
@@ -356,7 +356,7 @@ bool compac_lowl_probe(const struct lowlevel_device_info * const info)
 static
 void antminer_drv_init()
 {
-	antminer_drv = icarus_drv;
+	icarus_drv_derive(&antminer_drv);
 	antminer_drv.dname = "antminer";
 	antminer_drv.name = "AMU";
 	antminer_drv.lowl_match = antminer_lowl_match;
@@ -44,6 +44,15 @@ bool bfsb_spi_txrx(struct spi_port *port)
 	return rv;
 }
 
+static
+bool bfsb_spi_txrx_segments(struct spi_port * const port)
+{
+	struct cgpu_info * const proc = port->cgpu;
+	struct bitfury_device * const bitfury = proc->device_data;
+	spi_bfsb_select_bank(bitfury->slot);
+	return sys_spi_txrx_segments(port);
+}
+
 static
 int bfsb_autodetect()
 {
@@ -74,6 +83,7 @@ int bfsb_autodetect()
 			*port = *sys_spi;
 			port->cgpu = &dummy_cgpu;
 			port->txrx = bfsb_spi_txrx;
+			port->txrx_segments = bfsb_spi_txrx_segments;
 			port->speed = 625000;
 			dummy_bitfury.slot = i;
 			
@@ -170,6 +180,7 @@ struct device_drv bfsb_drv = {
 	.name = "BSB",
 	.drv_detect = bfsb_detect,
 	.minerloop = minerloop_async,
+	.minerloop_timer_wheel = true,
 	.job_prepare = bitfury_job_prepare,
 	.thread_init = bfsb_init,
 	.poll = bitfury_do_io,
@@ -154,40 +154,27 @@ void bitforce_vcom_close(struct cgpu_info * const dev)
 static
 ssize_t bitforce_vcom_read(void * const buf_p, size_t bufLen, struct cgpu_info * const dev)
 {
-	uint8_t *buf = buf_p;
-	const int fd = dev->device_fd;
-	ssize_t rv, ret = 0;
-	while (bufLen > 0)
-	{
-		rv = read(fd, buf, bufLen);
-		if (rv <= 0)
-		{
-			if (ret > 0)
-				return ret;
-			return rv;
-		}
-		buf += rv;
-		bufLen -= rv;
-		ret += rv;
-	}
-	return ret;
+	// Binary data (eg, FLB results) may already be in the buffer filled by bitforce_vcom_gets
+	return serial_read(dev->device_fd, buf_p, bufLen);
 }
 
 static
 void bitforce_vcom_gets(char *buf, size_t bufLen, struct cgpu_info * const dev)
 {
 	const int fd = dev->device_fd;
-	while (likely(bufLen > 1 && read(fd, buf, 1) == 1 && (buf++)[0] != '\n'))
-	{}
-
-	buf[0] = '\0';
+	char eol = '\n';
+	ssize_t len = (bufLen > 1) ? serial_read_line(fd, buf, bufLen - 1, eol) : 0;
+	if (len < 0)
+		len = 0;
+	
+	buf[len] = '\0';
 }
 
 static
 ssize_t bitforce_vcom_write(struct cgpu_info * const dev, const void *buf, ssize_t bufLen)
 {
 	const int fd = dev->device_fd;
-	if ((bufLen) != write(fd, buf, bufLen))
+	if ((bufLen) != serial_write(fd, buf, bufLen))
 		return 0;
 	else
 		return bufLen;
@@ -190,6 +190,7 @@ bool bitfury_init_chip(struct cgpu_info * const proc)
 		.nbits = htole32(0x6461011a),
 	};
 	bitfury_payload_to_atrvec(bitfury->atrvec, &payload);
+	bitfury->atrvec_frame_valid = false;
 	return bitfury_init_oldbuf(proc, NULL);
 }
 
@@ -266,31 +267,22 @@ bool bitfury_job_prepare(struct thr_info *thr, struct work *work, __maybe_unused
 	}
 	work_to_bitfury_payload(&bitfury->payload, work);
 	if (bitfury->chipgen)
+	{
 		bitfury_payload_to_atrvec(bitfury->atrvec, &bitfury->payload);
+		bitfury->atrvec_frame_valid = false;
+	}
 	
 	work->blk.nonce = 0xffffffff;
 	return true;
 }
 
 static
-bool fudge_nonce(struct work * const work, uint32_t *nonce_p) {
-	static const uint32_t offsets[] = {0, 0xffc00000, 0xff800000, 0x02800000, 0x02C00000, 0x00400000};
-	uint32_t nonce;
-	int i;
-	
+int fudge_nonces(struct work * const work, uint32_t * const nonces, bool * const found, const int count)
+{
 	if (unlikely(!work))
-		return false;
+		return 0;
 	
-	for (i = 0; i < 6; ++i)
-	{
-		nonce = *nonce_p + offsets[i];
-		if (test_nonce(work, nonce, false))
-		{
-			*nonce_p = nonce;
-			return true;
-		}
-	}
-	return false;
+	return bitfury_fudge_nonces(work->midstate, *(uint32_t *)&work->data[0x40], *(uint32_t *)&work->data[0x44], *(uint32_t *)&work->data[0x48], nonces, found, count);
 }
 
 void bitfury_noop_job_start(struct thr_info __maybe_unused * const thr)
@@ -365,6 +357,32 @@ int bitfury_select_freq(struct bitfury_device *bitfury, struct cgpu_info *proc)
 	return 0;
 }
 
+// Restores the queue if the chip does not fit in the current frame
+static
+bool bitfury_queue_chip(struct spi_port * const spi, struct bitfury_device * const bitfury, const int lastchip)
+{
+	const int segments_count = spi->segments_count;
+	const size_t segments_sz = spi->segments_sz;
+	
+	if (spi_queue_fasync(spi, bitfury->fasync - lastchip)
+	 && spi_queue_segment(spi, bitfury->atrvec_frame, bitfury->atrvec_frame_rx, sizeof(bitfury->atrvec_frame)))
+		return true;
+	spi->segments_count = segments_count;
+	spi->segments_sz = segments_sz;
+	return false;
+}
+
+// Returns how many chips have valid replies: if the transfer failed, those in this frame are dropped
+static
+int bitfury_do_io_flush(struct cgpu_info * const dev, struct spi_port * const spi, const int frame_start, const int n_chips)
+{
+	if (likely(spi_txrx_segments(spi)))
+		return n_chips;
+	applog(LOG_DEBUG, "%s: SPI transfer failed, ignoring %d chip replies",
+	       dev->dev_repr, n_chips - frame_start);
+	return frame_start;
+}
+
 void bitfury_do_io(struct thr_info * const master_thr)
 {
 	struct cgpu_info *proc;
@@ -375,7 +393,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 	int n, i, j;
 	bool newjob;
 	uint32_t nonce;
-	int n_chips = 0, lastchip = 0;
+	int n_chips = 0, lastchip = 0, frame_start = 0;
 	struct spi_port *spi = NULL;
 	bool should_be_running;
 	struct timeval tv_now;
@@ -405,16 +423,37 @@ void bitfury_do_io(struct thr_info * const master_thr)
 			if (spi != bitfury->spi)
 			{
 				if (spi)
-					spi_txrx(spi);
+					n_chips = bitfury_do_io_flush(master_thr->cgpu, spi, frame_start, n_chips);
 				spi = bitfury->spi;
-				spi_clear_buf(spi);
-				spi_emit_break(spi);
+				spi_clear_segments(spi);
+				spi_queue_break(spi);
+				lastchip = 0;
+				frame_start = n_chips;
+			}
+			// The frame only changes with the job, so queue it directly instead of rebuilding it every poll
+			if (!bitfury->atrvec_frame_valid)
+			{
+				spi_build_data(bitfury->atrvec_frame, 0x3000, &bitfury->atrvec[0], 19 * 4);
+				bitfury->atrvec_frame_valid = true;
+			}
+			if (!bitfury_queue_chip(spi, bitfury, lastchip))
+			{
+				// Too many chips for one transfer, so send what is queued and start a new frame for the rest
+				n_chips = bitfury_do_io_flush(master_thr->cgpu, spi, frame_start, n_chips);
+				spi_clear_segments(spi);
+				spi_queue_break(spi);
 				lastchip = 0;
+				frame_start = n_chips;
+				if (!bitfury_queue_chip(spi, bitfury, lastchip))
+				{
+					applog(LOG_ERR, "%"PRIpreprv": Chip cannot be polled in a single SPI transfer",
+					       proc->proc_repr);
+					continue;
+				}
 			}
 			procs[n_chips] = proc;
-			spi_emit_fasync(spi, bitfury->fasync - lastchip);
 			lastchip = bitfury->fasync;
-			rxbuf[n_chips] = spi_emit_data(spi, 0x3000, &bitfury->atrvec[0], 19 * 4);
+			rxbuf[n_chips] = &bitfury->atrvec_frame_rx[3];
 			++n_chips;
 		}
 		else
@@ -427,7 +466,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 		return;
 	}
 	timer_set_now(&tv_now);
-	spi_txrx(spi);
+	n_chips = bitfury_do_io_flush(master_thr->cgpu, spi, frame_start, n_chips);
 	
 	for (j = 0; j < n_chips; ++j)
 	{
@@ -490,6 +529,8 @@ void bitfury_do_io(struct thr_info * const master_thr)
 			// TODO: Delay morework until right before it's needed
 			timer_set_now(&thr->tv_morework);
 			job_start_complete(thr);
+			// Polling runs on the master thread, so the chip's own thread needs a visit for its next job
+			minerloop_wheel_touch(thr);
 		}
 		
 		for (n = 0; newbuf[n] == oldbuf[n]; ++n)
@@ -591,9 +632,24 @@ void bitfury_do_io(struct thr_info * const master_thr)
 		
 		if (n)
 		{
+			uint32_t nonces[0x10];
+			bool found_work[0x10], found_prev[0x10];
+			
 			for (i = 0; i < n; ++i)
 			{
-				nonce = bitfury_decnonce(newbuf[i]);
+				nonces[i] = bitfury_decnonce(newbuf[i]);
+				found_work[i] = false;
+			}
+			if (likely(bitfury->chipgen))
+			{
+				// Check every result against the current job in one batch, then whatever is left against the previous one
+				fudge_nonces(thr->work, nonces, found_work, n);
+				memcpy(found_prev, found_work, sizeof(*found_prev) * n);
+				fudge_nonces(thr->prev_work, nonces, found_prev, n);
+			}
+			for (i = 0; i < n; ++i)
+			{
+				nonce = nonces[i];
 				if (unlikely(!bitfury->chipgen))
 				{
 					switch (nonce & 0xe03fffff)
@@ -614,7 +670,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 						goto chipgen_detected;
 				}
 				else
-				if (fudge_nonce(thr->work, &nonce))
+				if (found_work[i])
 				{
 					applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (work=%p)",
 					       proc->proc_repr, i, (unsigned long)nonce, thr->work);
@@ -626,7 +682,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 					applog(LOG_DEBUG, "%"PRIpreprv": Ignoring unrecognised nonce %08lx (no prev work)",
 					       proc->proc_repr, (unsigned long)be32toh(nonce));
 				else
-				if (fudge_nonce(thr->prev_work, &nonce))
+				if (found_prev[i])
 				{
 					applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (prev work=%p)",
 					       proc->proc_repr, i, (unsigned long)nonce, thr->prev_work);
@@ -660,6 +716,7 @@ chipgen_detected:
 				applog(LOG_DEBUG, "%"PRIpreprv": Detected bitfury gen%d chip",
 				       proc->proc_repr, bitfury->chipgen);
 				bitfury_payload_to_atrvec(bitfury->atrvec, &bitfury->payload);
+				bitfury->atrvec_frame_valid = false;
 			}
 			bitfury->active = (bitfury->active + n) % 0x10;
 		}
@@ -710,6 +767,13 @@ struct api_data *bitfury_api_device_detail(struct cgpu_info * const cgpu)
 	root = api_add_uint(root, "fasync", &bitfury->fasync, false);
 	if (bitfury->chipgen)
 		root = api_add_int(root, "Chip Generation", &bitfury->chipgen, false);
+	if (bitfury->spi)
+	{
+		// Shared by all chips on the same bus
+		const double spi_rate = spi_stat_transactions_per_sec(bitfury->spi);
+		root = api_add_uint64(root, "SPI Transactions", &bitfury->spi->stat_transactions, true);
+		root = api_add_double(root, "SPI Transactions/s", &spi_rate, true);
+	}
 	
 	return root;
 }
@@ -840,6 +904,7 @@ struct device_drv bitfury_drv = {
 	.thread_shutdown = bitfury_shutdown,
 	
 	.minerloop = minerloop_async,
+	.minerloop_timer_wheel = true,
 	.job_prepare = bitfury_job_prepare,
 	.job_start = bitfury_noop_job_start,
 	.poll = bitfury_do_io,
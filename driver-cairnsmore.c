@@ -202,7 +202,7 @@ static bool cairnsmore_identify(struct cgpu_info *cm1)
 
 static void cairnsmore_drv_init()
 {
-	cairnsmore_drv = icarus_drv;
+	icarus_drv_derive(&cairnsmore_drv);
 	cairnsmore_drv.dname = "cairnsmore";
 	cairnsmore_drv.name = "ECM";
 	cairnsmore_drv.lowl_match = cairnsmore_lowl_match;
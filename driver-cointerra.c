@@ -24,6 +24,7 @@ static const unsigned long cointerra_latest_result_usecs = (10 * 1000000);
 static const unsigned cointerra_max_nonce_diff = 0x20;
 
 #define COINTERRA_USB_TIMEOUT  500
+#define COINTERRA_USB_ASYNC_READS  4
 #define COINTERRA_PACKET_SIZE  0x40
 #define COINTERRA_START_SEQ  0x5a,0x5a
 #define COINTERRA_MSG_SIZE  (COINTERRA_PACKET_SIZE - sizeof(cointerra_startseq))
@@ -232,6 +233,7 @@ static void cta_close(struct cgpu_info *cointerra)
 			applog(LOG_INFO, "%s %d: Reset on close failed", cointerra->drv->name,
 				cointerra->device_id);
 		}
+		usb_ep_async_read_stop(info->ep);
 	}
 
 	mutex_destroy(&info->lock);
@@ -933,6 +935,10 @@ static bool cta_prepare(struct thr_info *thr)
 	cgtime(&info->core_hash_start);
 	
 	usb_ep_set_timeouts_ms(info->ep, COINTERRA_USB_TIMEOUT, COINTERRA_USB_TIMEOUT);
+	// Keep reads queued so nonces are picked up as soon as the device has them
+	// NOTE: This does not save any threads: cta_scanwork still waits on usb_read from the mining thread
+	if (!usb_ep_async_read_start(info->ep, COINTERRA_USB_ASYNC_READS, NULL, NULL))
+		applog(LOG_DEBUG, "%s: Failed to start async reads, using synchronous reads", cointerra->dev_repr);
 	timer_set_now(&thr->tv_poll);
 
 	return true;
@@ -317,6 +317,7 @@ void dualminer_thread_shutdown(struct thr_info *thr)
 
 	// icarus teardown
 	do_icarus_close(thr);
+	icarus_epoll_close(thr);
 	free(thr->cgpu_data);
 }
 
@@ -357,7 +358,7 @@ char *dualminer_set_device(struct cgpu_info *cgpu, char *option, char *setting,
 static
 void dualminer_drv_init()
 {
-	dualminer_drv = icarus_drv;
+	icarus_drv_derive(&dualminer_drv);
 	dualminer_drv.dname = "dualminer";
 	dualminer_drv.name = "DMU";
 	dualminer_drv.drv_min_nonce_diff = dualminer_min_nonce_diff;
@@ -93,7 +93,7 @@ static bool erupter_identify(struct cgpu_info *erupter)
 
 static void erupter_drv_init()
 {
-	erupter_drv = icarus_drv;
+	icarus_drv_derive(&erupter_drv);
 	erupter_drv.dname = "erupter";
 	erupter_drv.name = "BES";
 	erupter_drv.lowl_match = erupter_lowl_match;
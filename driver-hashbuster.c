@@ -150,7 +150,7 @@ static
 int hashbuster_chip_count(hid_device *h)
 {
 	/* Do not allocate spi_port on the stack! OS X, at least, has a 512 KB default stack size for secondary threads */
-	struct spi_port *spi = malloc(sizeof(*spi));
+	struct spi_port *spi = calloc(1, sizeof(*spi));
 	spi->txrx = hashbuster_spi_txrx;
 	spi->userp = h;
 	spi->repr = hashbuster_drv.dname;
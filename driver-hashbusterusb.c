@@ -215,7 +215,7 @@ bool hashbusterusb_lowl_probe(const struct lowlevel_device_info * const info)
 	
 	int chip_n;
 	
-	port = malloc(sizeof(*port));
+	port = calloc(1, sizeof(*port));
 	port->cgpu = &dummy_cgpu;
 	port->txrx = hashbusterusb_spi_txrx;
 	port->userp = ep;
@@ -61,6 +61,8 @@
 #include "compat.h"
 #include "dynclock.h"
 #include "driver-icarus.h"
+#include "lowlevel.h"
+#include "lowl-reactor.h"
 #include "lowl-vcom.h"
 
 // The serial I/O speed - Linux uses a define 'B115200' in bits/termios.h
@@ -165,6 +167,39 @@ void icarus_log_protocol(const char * const repr, const void *buf, size_t bufLen
 	applog(LOG_DEBUG, "%s: DEVPROTO: %s %s", repr, prefix, hex);
 }
 
+#ifdef HAVE_EPOLL
+// Ensures the device fd is registered in the thread's persistent epoll set
+// Only needs syscalls when the fd has changed (ie, after a reopen)
+static
+bool icarus_epoll_watch_devfd(const char * const repr, struct icarus_state * const state, const int fd)
+{
+	if (likely(state->epoll_devfd == fd))
+		return true;
+	
+	if (state->epoll_devfd != -1)
+	{
+		// Normally already removed by closing it, but it might have been dup'd
+		++state->epoll_setup_syscalls;
+		epoll_ctl(state->epollfd, EPOLL_CTL_DEL, state->epoll_devfd, NULL);
+		state->epoll_devfd = -1;
+	}
+	
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.fd = fd,
+	};
+	++state->epoll_setup_syscalls;
+	if (-1 == epoll_ctl(state->epollfd, EPOLL_CTL_ADD, fd, &ev))
+	{
+		applog(LOG_DEBUG, "%s: Error adding %s fd to epoll", "device", repr);
+		return false;
+	}
+	state->epoll_devfd = fd;
+	return true;
+}
+#endif
+
+// NOTE: If thr is provided, thr->cgpu_data must be a struct icarus_state
 int icarus_read(const char * const repr, uint8_t *buf, const int fd, struct timeval * const tvp_finish, struct thr_info * const thr, const struct timeval * const tvp_timeout, struct timeval * const tvp_now, int read_size)
 {
 	int rv;
@@ -175,12 +210,27 @@ int icarus_read(const char * const repr, uint8_t *buf, const int fd, struct time
 	// If there is no thr, then there's no work restart to watch..
 	
 #ifdef HAVE_EPOLL
+	struct icarus_state * const state = thr ? thr->cgpu_data : NULL;
 	bool watching_work_restart = !thr;
+	bool epoll_persistent = false;
 	int epollfd;
 	struct epoll_event evr[2];
 	
-	epollfd = epoll_create(2);
-	if (epollfd != -1) {
+	if (state && state->epollfd != -1)
+	{
+		// Persistent epoll set from icarus_prepare, already watching the work restart notifier
+		epollfd = state->epollfd;
+		if (icarus_epoll_watch_devfd(repr, state, fd))
+		{
+			epoll_persistent = true;
+			watching_work_restart = true;
+		}
+		else
+			epollfd = -1;
+	}
+	else
+	if ((epollfd = epoll_create(2)) != -1)
+	{
 		struct epoll_event ev = {
 			.events = EPOLLIN,
 			.data.fd = fd,
@@ -214,6 +264,8 @@ int icarus_read(const char * const repr, uint8_t *buf, const int fd, struct time
 		{
 			if ((!watching_work_restart) && remaining_ms > 100)
 				remaining_ms = 100;
+			if (epoll_persistent)
+				++state->epoll_wait_syscalls;
 			ret = epoll_wait(epollfd, evr, 2, remaining_ms);
 			timer_set_now(tvp_now);
 			switch (ret)
@@ -235,7 +287,7 @@ int icarus_read(const char * const repr, uint8_t *buf, const int fd, struct time
 					}
 					// fallthru to...
 				case 2:  // device has data
-					ret = read(fd, buf, read_size);
+					ret = serial_read_raw(fd, buf, read_size);
 					break;
 				default:
 					return_via(out, rv = ICA_GETS_ERROR);
@@ -251,7 +303,7 @@ int icarus_read(const char * const repr, uint8_t *buf, const int fd, struct time
 				remaining_ms = 1;
 			vcom_set_timeout_ms(fd, remaining_ms);
 			// Read first byte alone to get earliest tv_finish
-			ret = read(fd, buf, first ? 1 : read_size);
+			ret = serial_read_raw(fd, buf, first ? 1 : read_size);
 			timer_set_now(tvp_now);
 		}
 		if (first)
@@ -284,7 +336,7 @@ int icarus_read(const char * const repr, uint8_t *buf, const int fd, struct time
 
 out:
 #ifdef HAVE_EPOLL
-	if (epollfd != -1)
+	if (epollfd != -1 && !epoll_persistent)
 		close(epollfd);
 #endif
 	return rv;
@@ -300,7 +352,7 @@ int icarus_write(const char * const repr, int fd, const void *buf, size_t bufLen
 	if (unlikely(fd == -1))
 		return 1;
 	
-	ret = write(fd, buf, bufLen);
+	ret = serial_write(fd, buf, bufLen);
 	if (unlikely(ret != bufLen))
 		return 1;
 
@@ -312,11 +364,16 @@ int icarus_write(const char * const repr, int fd, const void *buf, size_t bufLen
 void do_icarus_close(struct thr_info *thr)
 {
 	struct cgpu_info *icarus = thr->cgpu;
+	struct icarus_state * const state = thr->cgpu_data;
 	const int fd = icarus->device_fd;
 	if (fd == -1)
 		return;
+	bfg_reactor_unwatch_fd(thr);
 	icarus_close(fd);
 	icarus->device_fd = -1;
+	// Closing the fd drops it from the epoll set; a reopen may reuse the same number
+	if (state)
+		state->epoll_devfd = -1;
 }
 
 static const char *timing_mode_str(enum timing_mode timing_mode)
@@ -464,7 +521,7 @@ int icarus_excess_nonce_size(int fd, struct ICARUS_INFO *info)
 	// Read excess_size from Icarus
 	struct timeval tv_now;
 	timer_set_now(&tv_now);
-	int bytes_read = read(fd, excess_bin, excess_size);
+	int bytes_read = serial_read_raw(fd, excess_bin, excess_size);
 	// Number of bytes that were still available
 
 	return bytes_read;
@@ -637,9 +694,21 @@ struct cgpu_info *icarus_detect_custom(const char *devpath, struct device_drv *a
 	{
 		if (!info->work_division)
 		{
-			fd = icarus_open2(devpath, baud, true);
-			info->work_division = icarus_probe_work_division(fd, api->dname, info);
-			icarus_close(fd);
+			// Autodetection can take seconds, so reuse the result from the last time this device was found
+			const char * const cached = lowlevel_probe_cache_param();
+			char param[0x20];
+			int cached_work_division;
+			
+			if (cached && sscanf(cached, "work_division=%d", &cached_work_division) == 1 && is_power_of_two(cached_work_division))
+				info->work_division = cached_work_division;
+			else
+			{
+				fd = icarus_open2(devpath, baud, true);
+				info->work_division = icarus_probe_work_division(fd, api->dname, info);
+				icarus_close(fd);
+			}
+			snprintf(param, sizeof(param), "work_division=%d", info->work_division);
+			lowlevel_probe_cache_set_param(param);
 		}
 		info->fpga_count = info->work_division;
 	}
@@ -706,13 +775,26 @@ static bool icarus_prepare(struct thr_info *thr)
 	struct icarus_state *state;
 	thr->cgpu_data = state = calloc(1, sizeof(*state));
 	state->firstrun = true;
+	state->epollfd = state->epoll_devfd = -1;
 
 #ifdef HAVE_EPOLL
+	// Keep one epoll set for the life of the thread; icarus_read adds the device fd as needed
 	int epollfd = epoll_create(2);
 	if (epollfd != -1)
 	{
-		close(epollfd);
 		notifier_init(thr->work_restart_notifier);
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.fd = thr->work_restart_notifier[0],
+		};
+		state->epoll_setup_syscalls += 2;
+		if (-1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, thr->work_restart_notifier[0], &ev))
+		{
+			applog(LOG_DEBUG, "%s: Error adding %s fd to epoll", "work restart", icarus->dev_repr);
+			close(epollfd);
+		}
+		else
+			state->epollfd = epollfd;
 	}
 #endif
 
@@ -747,6 +829,17 @@ bool icarus_init(struct thr_info *thr)
 		info->work_division = upper_power_of_two_u32(info->work_division);
 	info->nonce_mask = mask(info->work_division);
 	
+#ifdef HAVE_EPOLL
+	if (bfg_reactor_owns(thr))
+	{
+		state->async_nonce_bin = calloc(1, info->read_size);
+		// Only read when the reactor says there is data, and never block the other devices
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (!bfg_reactor_watch_fd(thr, fd))
+			return false;
+	}
+#endif
+	
 	return true;
 }
 
@@ -1311,6 +1404,154 @@ out:
 	return hash_count;
 }
 
+#ifdef HAVE_EPOLL
+// minerloop_async hooks, only used when the device is run from the shared I/O reactor
+// These skip the timing calibration, identify and reopen modes done by icarus_scanhash,
+// but still reopen the port after comms errors
+
+static
+bool icarus_reopen_async(struct thr_info * const thr)
+{
+	struct cgpu_info * const icarus = thr->cgpu;
+	struct icarus_state * const state = thr->cgpu_data;
+	int fd;
+	
+	if (!icarus_reopen(icarus, state, &fd))
+		return false;
+	state->async_nonce_len = 0;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (!bfg_reactor_watch_fd(thr, fd))
+	{
+		do_icarus_close(thr);
+		return false;
+	}
+	applog(LOG_DEBUG, "%s: Reopened %s", icarus->dev_repr, icarus->device_path);
+	return true;
+}
+
+static
+void icarus_job_start_async(struct thr_info * const thr)
+{
+	struct cgpu_info * const icarus = thr->cgpu;
+	struct ICARUS_INFO * const info = icarus->device_data;
+	struct icarus_state * const state = thr->cgpu_data;
+	
+	// A failed reopen leaves the device in DEV_RECOVER_ERR, so the watchdog retries it later
+	if ((unlikely(icarus->device_fd == -1) && !icarus_reopen_async(thr)) || !info->job_start_func(thr))
+	{
+		job_start_abort(thr, true);
+		return;
+	}
+	state->firstrun = false;
+	
+	mt_job_transition(thr);
+	// Icarus doesn't report finishing the nonce range, so move on before it would go idle
+	timer_set_delay(&thr->tv_morework, &thr->tv_jobstart, (info->read_timeout_ms ?: 1) * 1000);
+	job_start_complete(thr);
+}
+
+static
+void icarus_poll_async(struct thr_info * const thr)
+{
+	struct cgpu_info * const icarus = thr->cgpu;
+	struct ICARUS_INFO * const info = icarus->device_data;
+	struct icarus_state * const state = thr->cgpu_data;
+	const int fd = icarus->device_fd;
+	struct work *nonce_work;
+	uint32_t nonce;
+	ssize_t r;
+	bool got_data = false;
+	
+	timer_unset(&thr->tv_poll);
+	if (unlikely(fd == -1))
+		return;
+	
+	while (true)
+	{
+		r = serial_read_raw(fd, &state->async_nonce_bin[state->async_nonce_len], info->read_size - state->async_nonce_len);
+		if (r <= 0)
+		{
+			// We only get polled when the fd is readable, so nothing at all to read means a hangup
+			if (unlikely((r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || (r == 0 && !got_data)))
+			{
+				applog(LOG_ERR, "%s: Comms error (%s)", icarus->dev_repr, r ? "rerr" : "hangup");
+				dev_error(icarus, REASON_DEV_COMMS_ERROR);
+				// Reopened by the next job start
+				do_icarus_close(thr);
+				timer_set_now(&thr->tv_morework);
+			}
+			return;
+		}
+		got_data = true;
+		if (opt_dev_protocol && opt_debug)
+			icarus_log_protocol(icarus->dev_repr, &state->async_nonce_bin[state->async_nonce_len], r, "RECV");
+		state->async_nonce_len += r;
+		if (state->async_nonce_len < info->read_size)
+			continue;
+		state->async_nonce_len = 0;
+		
+		memcpy(&nonce, state->async_nonce_bin, sizeof(nonce));
+		nonce = icarus_nonce32toh(info, nonce);
+		const struct cgpu_info * const proc = icarus_proc_for_nonce(icarus, nonce);
+		
+		if (thr->work && test_nonce(thr->work, nonce, false))
+			nonce_work = thr->work;
+		else
+		if (thr->prev_work && test_nonce(thr->prev_work, nonce, false))
+			nonce_work = thr->prev_work;
+		else
+		{
+			inc_hw_errors(proc->thr[0], thr->work, nonce);
+			continue;
+		}
+		
+		submit_nonce(proc->thr[0], nonce_work, nonce);
+		
+		// Icarus stops hashing when it finds a nonce, so start the next job right away
+		if (nonce_work == thr->work && !info->continue_search)
+			timer_set_now(&thr->tv_morework);
+	}
+}
+
+static
+int64_t icarus_job_process_results_async(struct thr_info * const thr, struct work * const work, const bool stopping)
+{
+	struct cgpu_info * const icarus = thr->cgpu;
+	struct ICARUS_INFO * const info = icarus->device_data;
+	double estimate_hashes = timer_elapsed_us(&thr->tv_results_jobstart, NULL) / 1e6;
+	
+	estimate_hashes /= info->Hs;
+	if (unlikely(estimate_hashes > 0xffffffff))
+		estimate_hashes = 0xffffffff;
+	if (unlikely(estimate_hashes < 0))
+		estimate_hashes = 0;
+	
+	int64_t hash_count = estimate_hashes;
+	const int64_t hash_count_per_proc = hash_count / icarus->procs;
+	if (hash_count_per_proc > 0)
+	{
+		for_each_managed_proc(proc, icarus)
+		{
+			hashes_done2(proc->thr[0], hash_count_per_proc, NULL);
+			hash_count -= hash_count_per_proc;
+		}
+	}
+	
+	return hash_count;
+}
+#endif
+
+// Drivers based on Icarus get the reactor hooks only once verified with their own nonce and timing handling
+void icarus_drv_derive(struct device_drv * const drv)
+{
+	*drv = icarus_drv;
+	drv->async_jobs_per_device = false;
+	drv->io_reactor_capable = false;
+	drv->job_start = NULL;
+	drv->job_process_results = NULL;
+	drv->poll = NULL;
+}
+
 static struct api_data *icarus_drv_stats(struct cgpu_info *cgpu)
 {
 	struct api_data *root = NULL;
@@ -1340,6 +1581,16 @@ static struct api_data *icarus_drv_stats(struct cgpu_info *cgpu)
 	root = api_add_int(root, "baud", &(info->baud), false);
 	root = api_add_int(root, "work_division", &(info->work_division), false);
 	root = api_add_int(root, "fpga_count", &(info->fpga_count), false);
+	
+	struct thr_info * const thr = cgpu->device->thr ? cgpu->device->thr[0] : NULL;
+	const struct icarus_state * const state = thr ? thr->cgpu_data : NULL;
+	if (state)
+	{
+		const bool persistent_epoll = (state->epollfd != -1);
+		root = api_add_bool(root, "persistent_epoll", &persistent_epoll, true);
+		root = api_add_uint64(root, "epoll_setup_syscalls", &(state->epoll_setup_syscalls), false);
+		root = api_add_uint64(root, "epoll_wait_syscalls", &(state->epoll_wait_syscalls), false);
+	}
 
 	return root;
 }
@@ -1415,9 +1666,25 @@ const char *icarus_set_reopen(struct cgpu_info * const proc, const char * const
 	return NULL;
 }
 
+void icarus_epoll_close(struct thr_info * const thr)
+{
+	struct icarus_state * const state = thr->cgpu_data;
+	if (state->epollfd == -1)
+		return;
+	close(state->epollfd);
+	state->epollfd = state->epoll_devfd = -1;
+}
+
+static
+void icarus_thread_disable(struct thr_info * const thr)
+{
+	do_icarus_close(thr);
+}
+
 static void icarus_shutdown(struct thr_info *thr)
 {
 	do_icarus_close(thr);
+	icarus_epoll_close(thr);
 	free(thr->cgpu_data);
 }
 
@@ -1451,6 +1718,13 @@ struct device_drv icarus_drv = {
 	.thread_init = icarus_init,
 	.scanhash = icarus_scanhash,
 	.job_prepare = icarus_job_prepare,
-	.thread_disable = close_device_fd,
+#ifdef HAVE_EPOLL
+	.async_jobs_per_device = true,
+	.io_reactor_capable = true,
+	.job_start = icarus_job_start_async,
+	.job_process_results = icarus_job_process_results_async,
+	.poll = icarus_poll_async,
+#endif
+	.thread_disable = icarus_thread_disable,
 	.thread_shutdown = icarus_shutdown,
 };
@@ -155,13 +155,26 @@ struct icarus_state {
 	bool identify;
 	
 	uint8_t *ob_bin;
+	
+	// Persistent epoll set (work restart notifier + device fd), reused across icarus_read calls
+	int epollfd;
+	// Device fd currently registered in epollfd, or -1
+	int epoll_devfd;
+	uint64_t epoll_setup_syscalls;
+	uint64_t epoll_wait_syscalls;
+	
+	// Used when run from the shared I/O reactor: partially received nonce
+	uint8_t *async_nonce_bin;
+	int async_nonce_len;
 };
 
+extern void icarus_drv_derive(struct device_drv *);
 extern struct cgpu_info *icarus_detect_custom(const char *devpath, struct device_drv *, struct ICARUS_INFO *);
 extern int icarus_read(const char *repr, uint8_t *buf, int fd, struct timeval *tvp_finish, struct thr_info *, const struct timeval *tvp_timeout, struct timeval *tvp_now, int read_size);
 extern int icarus_write(const char * const repr, int fd, const void *buf, size_t bufLen);
 extern bool icarus_init(struct thr_info *);
 extern void do_icarus_close(struct thr_info *thr);
+extern void icarus_epoll_close(struct thr_info *);
 extern bool icarus_job_start(struct thr_info *);
 
 extern const char *icarus_set_baud(struct cgpu_info *proc, const char *optname, const char *newvalue, char *replybuf, enum bfg_set_device_replytype *out_success);
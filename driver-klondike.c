@@ -35,6 +35,12 @@
 #include "lowl-usb.h"
 #include "miner.h"
 
+#if defined(NEED_BFG_LOWL_VCOM) && !defined(WIN32)
+#define KLONDIKE_EMULATION
+#include "lowl-emu.h"
+#include "lowl-vcom.h"
+#endif
+
 #define K1 "K1"
 #define K16 "K16"
 #define K64 "K64"
@@ -60,6 +66,8 @@ static const char *msg_reply = "Reply";
 #define MERKLE_BYTES 12
 
 #define REPLY_SIZE		15	// adequate for all types of replies
+#define KLONDIKE_USB_PACKET_SIZE	64
+#define KLONDIKE_USB_ASYNC_READS	4
 #define MAX_KLINES		1024	// unhandled reply limit
 #define CMD_REPLY_RETRIES	8	// how many retries for cmds
 #define TACH_FACTOR		87890	// fan rpm divisor
@@ -204,6 +212,7 @@ typedef struct jobque {
 	int workqc;
 	struct timeval last_update;
 	bool overheat;
+	bool overheat_abort;
 	bool flushed;
 	int late_update_count;
 	int late_update_sequential;
@@ -316,11 +325,31 @@ static KLIST *release_kitem(struct cgpu_info *klncgpu, KLIST *kitem)
 	return NULL;
 }
 
+#ifdef KLONDIKE_EMULATION
+// Emulated Klondikes speak the same protocol over a serial port
+static
+bool klondike_lowl_emulated(const struct lowlevel_device_info * const info, const struct device_drv * const drv)
+{
+	const char * const dname = bfg_emu_devinfo_dname(info);
+	return (dname && !strcasecmp(dname, drv->dname));
+}
+#else
+#define klondike_lowl_emulated(info, drv)  false
+#endif
+
 static
-int usb_init(struct cgpu_info * const klncgpu, struct libusb_device * const dev)
+int usb_init(struct cgpu_info * const klncgpu, const struct lowlevel_device_info * const info)
 {
 	struct klondike_info * const klninfo = klncgpu->device_data;
+	struct libusb_device * const dev = info->lowl_data;
 	int e;
+#ifdef KLONDIKE_EMULATION
+	if (klondike_lowl_emulated(info, klncgpu->drv))
+	{
+		klninfo->fd = serial_open(info->path, 0, 1, true);
+		return (klninfo->fd != -1);
+	}
+#endif
 	if (libusb_open(dev, &klninfo->usbdev_handle) != LIBUSB_SUCCESS)
 		return 0;
 	if (LIBUSB_SUCCESS != (e = libusb_set_configuration(klninfo->usbdev_handle, 1)))
@@ -350,6 +379,24 @@ int _usb_rw(struct cgpu_info * const klncgpu, void * const buf, const size_t buf
 	
 	*processed = 0;
 	
+#ifdef KLONDIKE_EMULATION
+	if (klninfo->fd != -1)
+	{
+		ssize_t r;
+		while (*processed < bufsiz)
+		{
+			if (ep & LIBUSB_ENDPOINT_IN)
+				r = serial_read(klninfo->fd, &cbuf[*processed], bufsiz - *processed);
+			else
+				r = serial_write(klninfo->fd, &cbuf[*processed], bufsiz - *processed);
+			if (r <= 0)
+				return r ? LIBUSB_ERROR_IO : LIBUSB_ERROR_TIMEOUT;
+			*processed += r;
+		}
+		return LIBUSB_SUCCESS;
+	}
+#endif
+	
 	while (*processed < bufsiz)
 	{
 		err = libusb_bulk_transfer(klninfo->usbdev_handle, ep, cbuf, bufsiz, &sent, timeout);
@@ -373,6 +420,14 @@ static
 void usb_uninit(struct cgpu_info * const klncgpu)
 {
 	struct klondike_info * const klninfo = klncgpu->device_data;
+#ifdef KLONDIKE_EMULATION
+	if (klninfo->fd != -1)
+	{
+		serial_close(klninfo->fd);
+		klninfo->fd = -1;
+		return;
+	}
+#endif
 	libusb_release_interface(klninfo->usbdev_handle, 0);
 	libusb_close(klninfo->usbdev_handle);
 }
@@ -800,7 +855,8 @@ static void control_init(struct cgpu_info *klncgpu)
 	struct klondike_info * const klninfo = klncgpu->device_data;
 	int err, interface;
 
-	if (klninfo->usbinfo_nodev)
+	// Emulated devices have no USB interface to reset
+	if (klninfo->usbinfo_nodev || klninfo->fd != -1)
 		return;
 
 	interface = 0;
@@ -863,6 +919,15 @@ bool klondike_lowl_match(const struct lowlevel_device_info * const info)
 
 bool klondike_lowl_probe_custom(const struct lowlevel_device_info * const info, struct device_drv * const drv, struct klondike_info * const klninfo)
 {
+	klninfo->fd = -1;
+	if (klondike_lowl_emulated(info, drv))
+	{
+#ifdef KLONDIKE_EMULATION
+		if (serial_claim_v(info->path, drv))
+			goto err;
+#endif
+	}
+	else
 	if (unlikely(info->lowl != &lowl_usb))
 	{
 		bfg_probe_result_flags = BPR_WRONG_DEVTYPE;
@@ -870,8 +935,8 @@ bool klondike_lowl_probe_custom(const struct lowlevel_device_info * const info,
 		       __func__, info->product, info->serial);
 		goto err;
 	}
-	struct libusb_device * const dev = info->lowl_data;
-	if (bfg_claim_libusb(drv, true, dev))
+	else
+	if (bfg_claim_libusb(drv, true, info->lowl_data))
 		goto err;
 	
 // static bool klondike_detect_one(struct libusb_device *dev, struct usb_find_devices *found)
@@ -894,7 +959,7 @@ bool klondike_lowl_probe_custom(const struct lowlevel_device_info * const info,
 
 	klninfo->free = new_klist_set(klncgpu);
 
-	if (usb_init(klncgpu, dev)) {
+	if (usb_init(klncgpu, info)) {
 		int sent, recd, err;
 		KLIST kitem;
 		int attempts = 0;
@@ -1107,187 +1172,229 @@ static void klondike_check_nonce(struct cgpu_info *klncgpu, KLIST *kitem)
 	inc_hw_errors2(thr, NULL, &nonce);
 }
 
-// thread to keep looking for replies
-static void *klondike_get_replies(void *userdata)
+// Handles a complete reply, returning kitem if it wasn't kept
+static KLIST *klondike_handle_reply(struct cgpu_info *klncgpu, KLIST *kitem)
 {
-	struct cgpu_info *klncgpu = (struct cgpu_info *)userdata;
 	struct klondike_info *klninfo = (struct klondike_info *)(klncgpu->device_data);
-	KLIST *kitem = NULL;
-	int err, recd, slaves, dev, isc;
-	bool overheat, sent;
+	const int recd = REPLY_SIZE;
+	int slaves, dev, isc;
+	bool overheat;
 
-	applog(LOG_DEBUG, "%s%i: listening for replies",
-			  klncgpu->drv->name, klncgpu->device_id);
+	cgtime(&(kitem->tv_when));
+	rd_lock(&(klninfo->stat_lock));
+	kitem->block_seq = klninfo->block_seq;
+	rd_unlock(&(klninfo->stat_lock));
+	if (opt_log_level <= READ_DEBUG) {
+		char hexdata[recd * 2];
+		bin2hex(hexdata, &kitem->kline.hd.dev, recd-1);
+		applog(READ_DEBUG, "%s%i:%d reply [%c:%s]",
+				klncgpu->drv->name, klncgpu->device_id,
+				(int)(kitem->kline.hd.dev),
+				kitem->kline.hd.cmd, hexdata);
+	}
 
-	while (klncgpu->shutdown == false) {
-		if (klninfo->usbinfo_nodev)
-			return NULL;
+	// We can't check this until it's initialised
+	if (klninfo->initialised) {
+		rd_lock(&(klninfo->stat_lock));
+		slaves = klninfo->status[0].kline.ws.slavecount;
+		rd_unlock(&(klninfo->stat_lock));
 
-		if (kitem == NULL)
-			kitem = allocate_kitem(klncgpu);
-		else
-			memset((void *)&(kitem->kline), 0, sizeof(kitem->kline));
-
-		err = usb_read(klncgpu, &kitem->kline, REPLY_SIZE, &recd);
-		if (err || recd != REPLY_SIZE) {
-			if (err != -7)
-				applog(LOG_ERR, "%s%i: reply err=%d amt=%d",
-						klncgpu->drv->name, klncgpu->device_id,
-						err, recd);
+		if (kitem->kline.hd.dev > slaves) {
+			applog(LOG_ERR, "%s%i: reply [%c] has invalid dev=%d (max=%d) using 0",
+					klncgpu->drv->name, klncgpu->device_id,
+					(char)(kitem->kline.hd.cmd),
+					(int)(kitem->kline.hd.dev),
+					slaves);
+			/* TODO: this is rather problematic if there are slaves
+			 * however without slaves - it should always be zero */
+			kitem->kline.hd.dev = 0;
+		} else {
+			wr_lock(&(klninfo->stat_lock));
+			klninfo->jobque[kitem->kline.hd.dev].late_update_sequential = 0;
+			wr_unlock(&(klninfo->stat_lock));
 		}
-		if (!err && recd == REPLY_SIZE) {
-			cgtime(&(kitem->tv_when));
-			rd_lock(&(klninfo->stat_lock));
-			kitem->block_seq = klninfo->block_seq;
-			rd_unlock(&(klninfo->stat_lock));
-			if (opt_log_level <= READ_DEBUG) {
-				char hexdata[recd * 2];
-				bin2hex(hexdata, &kitem->kline.hd.dev, recd-1);
-				applog(READ_DEBUG, "%s%i:%d reply [%c:%s]",
-						klncgpu->drv->name, klncgpu->device_id,
-						(int)(kitem->kline.hd.dev),
-						kitem->kline.hd.cmd, hexdata);
-			}
+	}
 
-			// We can't check this until it's initialised
+	switch (kitem->kline.hd.cmd) {
+		case KLN_CMD_NONCE:
+			klondike_check_nonce(klncgpu, kitem);
+			display_kline(klncgpu, &kitem->kline, msg_reply);
+			break;
+		case KLN_CMD_WORK:
+			// We can't do/check this until it's initialised
 			if (klninfo->initialised) {
-				rd_lock(&(klninfo->stat_lock));
-				slaves = klninfo->status[0].kline.ws.slavecount;
-				rd_unlock(&(klninfo->stat_lock));
-
-				if (kitem->kline.hd.dev > slaves) {
-					applog(LOG_ERR, "%s%i: reply [%c] has invalid dev=%d (max=%d) using 0",
-							klncgpu->drv->name, klncgpu->device_id,
-							(char)(kitem->kline.hd.cmd),
-							(int)(kitem->kline.hd.dev),
-							slaves);
-					/* TODO: this is rather problematic if there are slaves
-					 * however without slaves - it should always be zero */
-					kitem->kline.hd.dev = 0;
-				} else {
-					wr_lock(&(klninfo->stat_lock));
-					klninfo->jobque[kitem->kline.hd.dev].late_update_sequential = 0;
-					wr_unlock(&(klninfo->stat_lock));
+				dev = kitem->kline.ws.dev;
+				if (kitem->kline.ws.workqc == 0) {
+					bool idle = false;
+					rd_lock(&(klninfo->stat_lock));
+					if (klninfo->jobque[dev].flushed == false)
+						idle = true;
+					slaves = klninfo->status[0].kline.ws.slavecount;
+					rd_unlock(&(klninfo->stat_lock));
+					if (idle)
+						applog(LOG_WARNING, "%s%i:%d went idle before work was sent",
+								    klncgpu->drv->name,
+								    klncgpu->device_id,
+								    dev);
 				}
+				wr_lock(&(klninfo->stat_lock));
+				klninfo->jobque[dev].flushed = false;
+				wr_unlock(&(klninfo->stat_lock));
 			}
+		case KLN_CMD_STATUS:
+		case KLN_CMD_ABORT:
+			// We can't do/check this until it's initialised
+			if (klninfo->initialised) {
+				isc = 0;
+				dev = kitem->kline.ws.dev;
+				wr_lock(&(klninfo->stat_lock));
+				klninfo->jobque[dev].workqc = (int)(kitem->kline.ws.workqc);
+				cgtime(&(klninfo->jobque[dev].last_update));
+				slaves = klninfo->status[0].kline.ws.slavecount;
+				overheat = klninfo->jobque[dev].overheat;
+				if (dev == 0) {
+					if (kitem->kline.ws.slavecount != slaves)
+						isc = ++klninfo->incorrect_slave_sequential;
+					else
+						isc = klninfo->incorrect_slave_sequential = 0;
+				}
+				wr_unlock(&(klninfo->stat_lock));
 
-			switch (kitem->kline.hd.cmd) {
-				case KLN_CMD_NONCE:
-					klondike_check_nonce(klncgpu, kitem);
-					display_kline(klncgpu, &kitem->kline, msg_reply);
+				if (isc) {
+					applog(LOG_ERR, "%s%i:%d reply [%c] has a diff"
+							" # of slaves=%d (curr=%d)%s",
+							klncgpu->drv->name,
+							klncgpu->device_id,
+							dev,
+							(char)(kitem->kline.ws.cmd),
+							(int)(kitem->kline.ws.slavecount),
+							slaves,
+							isc <= KLN_ISS_IGNORE ? "" :
+							 " disabling device");
+					if (isc > KLN_ISS_IGNORE)
+						usb_nodev(klncgpu);
 					break;
-				case KLN_CMD_WORK:
-					// We can't do/check this until it's initialised
-					if (klninfo->initialised) {
-						dev = kitem->kline.ws.dev;
-						if (kitem->kline.ws.workqc == 0) {
-							bool idle = false;
-							rd_lock(&(klninfo->stat_lock));
-							if (klninfo->jobque[dev].flushed == false)
-								idle = true;
-							slaves = klninfo->status[0].kline.ws.slavecount;
-							rd_unlock(&(klninfo->stat_lock));
-							if (idle)
-								applog(LOG_WARNING, "%s%i:%d went idle before work was sent",
-										    klncgpu->drv->name,
-										    klncgpu->device_id,
-										    dev);
-						}
-						wr_lock(&(klninfo->stat_lock));
-						klninfo->jobque[dev].flushed = false;
-						wr_unlock(&(klninfo->stat_lock));
-					}
-				case KLN_CMD_STATUS:
-				case KLN_CMD_ABORT:
-					// We can't do/check this until it's initialised
-					if (klninfo->initialised) {
-						isc = 0;
-						dev = kitem->kline.ws.dev;
+				}
+
+				if (!overheat) {
+					double temp = cvtKlnToC(kitem->kline.ws.temp);
+					if (temp >= KLN_KILLWORK_TEMP) {
 						wr_lock(&(klninfo->stat_lock));
-						klninfo->jobque[dev].workqc = (int)(kitem->kline.ws.workqc);
-						cgtime(&(klninfo->jobque[dev].last_update));
-						slaves = klninfo->status[0].kline.ws.slavecount;
-						overheat = klninfo->jobque[dev].overheat;
-						if (dev == 0) {
-							if (kitem->kline.ws.slavecount != slaves)
-								isc = ++klninfo->incorrect_slave_sequential;
-							else
-								isc = klninfo->incorrect_slave_sequential = 0;
-						}
+						klninfo->jobque[dev].overheat = true;
+						// Commands can't be sent from the USB event thread, so klondike_scanwork aborts the work
+						klninfo->jobque[dev].overheat_abort = true;
 						wr_unlock(&(klninfo->stat_lock));
 
-						if (isc) {
-							applog(LOG_ERR, "%s%i:%d reply [%c] has a diff"
-									" # of slaves=%d (curr=%d)%s",
-									klncgpu->drv->name,
-									klncgpu->device_id,
-									dev,
-									(char)(kitem->kline.ws.cmd),
-									(int)(kitem->kline.ws.slavecount),
-									slaves,
-									isc <= KLN_ISS_IGNORE ? "" :
-									 " disabling device");
-							if (isc > KLN_ISS_IGNORE)
-								usb_nodev(klncgpu);
-							break;
-						}
-
-						if (!overheat) {
-							double temp = cvtKlnToC(kitem->kline.ws.temp);
-							if (temp >= KLN_KILLWORK_TEMP) {
-								KLINE kline;
-
-								wr_lock(&(klninfo->stat_lock));
-								klninfo->jobque[dev].overheat = true;
-								wr_unlock(&(klninfo->stat_lock));
-
-								applog(LOG_WARNING, "%s%i:%d Critical overheat (%.0fC)",
-										    klncgpu->drv->name,
-										    klncgpu->device_id,
-										    dev, temp);
-
-								zero_kline(&kline);
-								kline.hd.cmd = KLN_CMD_ABORT;
-								kline.hd.dev = dev;
-								sent = SendCmd(klncgpu, &kline, KSENDHD(0));
-								kln_disable(klncgpu, dev, false);
-								if (!sent) {
-									applog(LOG_ERR, "%s%i:%d overheat failed to"
-											" abort work - disabling device",
-											klncgpu->drv->name,
-											klncgpu->device_id,
-											dev);
-									usb_nodev(klncgpu);
-								}
-							}
-						}
+						applog(LOG_WARNING, "%s%i:%d Critical overheat (%.0fC)",
+								    klncgpu->drv->name,
+								    klncgpu->device_id,
+								    dev, temp);
 					}
-				case KLN_CMD_ENABLE:
-					wr_lock(&(klninfo->stat_lock));
-					klninfo->errorcount += kitem->kline.ws.errorcount;
-					klninfo->noisecount += kitem->kline.ws.noise;
-					wr_unlock(&(klninfo->stat_lock));
-					display_kline(klncgpu, &kitem->kline, msg_reply);
-					kitem->ready = true;
-					kitem = NULL;
-					break;
-				case KLN_CMD_CONFIG:
-					display_kline(klncgpu, &kitem->kline, msg_reply);
-					kitem->ready = true;
-					kitem = NULL;
-					break;
-				case KLN_CMD_IDENT:
-					display_kline(klncgpu, &kitem->kline, msg_reply);
-					kitem->ready = true;
-					kitem = NULL;
-					break;
-				default:
-					display_kline(klncgpu, &kitem->kline, msg_reply);
-					break;
+				}
 			}
+		case KLN_CMD_ENABLE:
+			wr_lock(&(klninfo->stat_lock));
+			klninfo->errorcount += kitem->kline.ws.errorcount;
+			klninfo->noisecount += kitem->kline.ws.noise;
+			wr_unlock(&(klninfo->stat_lock));
+			display_kline(klncgpu, &kitem->kline, msg_reply);
+			kitem->ready = true;
+			kitem = NULL;
+			break;
+		case KLN_CMD_CONFIG:
+			display_kline(klncgpu, &kitem->kline, msg_reply);
+			kitem->ready = true;
+			kitem = NULL;
+			break;
+		case KLN_CMD_IDENT:
+			display_kline(klncgpu, &kitem->kline, msg_reply);
+			kitem->ready = true;
+			kitem = NULL;
+			break;
+		default:
+			display_kline(klncgpu, &kitem->kline, msg_reply);
+			break;
+	}
+	return kitem;
+}
+
+// Replies are read ahead with async transfers and handled here, on the USB event thread, instead of a thread per device
+static
+void klondike_reply_cb(__maybe_unused struct lowl_usb_endpoint * const ep, void * const userp, const void * const data, const size_t datasz)
+{
+	struct cgpu_info * const klncgpu = userp;
+	struct klondike_info * const klninfo = klncgpu->device_data;
+	const uint8_t *p = data;
+	size_t rem = datasz, n;
+	
+	if (!data)
+	{
+		applog(LOG_ERR, "%s%i: reading replies failed, disabling device",
+		       klncgpu->drv->name, klncgpu->device_id);
+		klninfo->usbinfo_nodev = true;
+		return;
+	}
+	
+	while (rem && !(klncgpu->shutdown || klninfo->usbinfo_nodev))
+	{
+		if (klninfo->reply_kitem == NULL)
+		{
+			klninfo->reply_kitem = allocate_kitem(klncgpu);
+			klninfo->reply_len = 0;
+		}
+		else
+		if (!klninfo->reply_len)
+			memset((void *)&(klninfo->reply_kitem->kline), 0, sizeof(klninfo->reply_kitem->kline));
+		
+		n = REPLY_SIZE - klninfo->reply_len;
+		if (n > rem)
+			n = rem;
+		memcpy(&((uint8_t *)&klninfo->reply_kitem->kline)[klninfo->reply_len], p, n);
+		klninfo->reply_len += n;
+		p += n;
+		rem -= n;
+		if (klninfo->reply_len < REPLY_SIZE)
+			break;
+		
+		klninfo->reply_len = 0;
+		klninfo->reply_kitem = klondike_handle_reply(klncgpu, klninfo->reply_kitem);
+	}
+}
+
+// Sends the aborts for critical overheats found by klondike_handle_reply
+static void klondike_overheat_abort(struct cgpu_info *klncgpu)
+{
+	struct klondike_info *klninfo = (struct klondike_info *)(klncgpu->device_data);
+	KLINE kline;
+	int slaves, dev;
+	bool pending, sent;
+
+	rd_lock(&(klninfo->stat_lock));
+	slaves = klninfo->status[0].kline.ws.slavecount;
+	rd_unlock(&(klninfo->stat_lock));
+
+	for (dev = 0; dev <= slaves; dev++) {
+		wr_lock(&(klninfo->stat_lock));
+		pending = klninfo->jobque[dev].overheat_abort;
+		klninfo->jobque[dev].overheat_abort = false;
+		wr_unlock(&(klninfo->stat_lock));
+		if (!pending)
+			continue;
+
+		zero_kline(&kline);
+		kline.hd.cmd = KLN_CMD_ABORT;
+		kline.hd.dev = dev;
+		sent = SendCmd(klncgpu, &kline, KSENDHD(0));
+		kln_disable(klncgpu, dev, false);
+		if (!sent) {
+			applog(LOG_ERR, "%s%i:%d overheat failed to"
+					" abort work - disabling device",
+					klncgpu->drv->name,
+					klncgpu->device_id,
+					dev);
+			usb_nodev(klncgpu);
 		}
 	}
-	return NULL;
 }
 
 static void klondike_flush_work(struct cgpu_info *klncgpu)
@@ -1323,19 +1430,55 @@ static void klondike_flush_work(struct cgpu_info *klncgpu)
 	}
 }
 
+#ifdef KLONDIKE_EMULATION
+// Emulated devices have no USB event thread, so their replies are read here
+static
+void *klondike_serial_reader(void * const userp)
+{
+	struct cgpu_info * const klncgpu = userp;
+	struct klondike_info * const klninfo = klncgpu->device_data;
+	uint8_t buf[KLONDIKE_USB_PACKET_SIZE];
+	ssize_t r;
+	
+	RenameThread("klondike_rx");
+	while (!(klncgpu->shutdown || klninfo->usbinfo_nodev))
+	{
+		r = serial_read_raw(klninfo->fd, buf, sizeof(buf));
+		if (r < 0)
+		{
+			klondike_reply_cb(NULL, klncgpu, NULL, 0);
+			break;
+		}
+		if (r)
+			klondike_reply_cb(NULL, klncgpu, buf, r);
+	}
+	return NULL;
+}
+#endif
+
 static bool klondike_thread_prepare(struct thr_info *thr)
 {
 	struct cgpu_info *klncgpu = thr->cgpu;
 	struct klondike_info *klninfo = (struct klondike_info *)(klncgpu->device_data);
 
-	if (thr_info_create(&(klninfo->replies_thr), NULL, klondike_get_replies, (void *)klncgpu)) {
-		applog(LOG_ERR, "%s%i: thread create failed", klncgpu->drv->name, klncgpu->device_id);
-		return false;
+#ifdef KLONDIKE_EMULATION
+	if (klninfo->fd != -1)
+	{
+		if (unlikely(pthread_create(&klninfo->read_thr, NULL, klondike_serial_reader, klncgpu))) {
+			applog(LOG_ERR, "%s%i: failed to start reading replies", klncgpu->drv->name, klncgpu->device_id);
+			return false;
+		}
+		return klondike_init(klncgpu);
 	}
-	pthread_detach(klninfo->replies_thr.pth);
+#endif
 
-	// let the listening get started
-	cgsleep_ms(100);
+	klninfo->ep_r = usb_open_ep(klninfo->usbdev_handle, 1 | LIBUSB_ENDPOINT_IN, KLONDIKE_USB_PACKET_SIZE);
+	if (!usb_ep_async_read_start(klninfo->ep_r, KLONDIKE_USB_ASYNC_READS, klondike_reply_cb, klncgpu)) {
+		applog(LOG_ERR, "%s%i: failed to start reading replies", klncgpu->drv->name, klncgpu->device_id);
+		usb_close_ep(klninfo->ep_r);
+		klninfo->ep_r = NULL;
+		return false;
+	}
 
 	return klondike_init(klncgpu);
 }
@@ -1366,6 +1509,18 @@ static void klondike_shutdown(struct thr_info *thr)
 	kln_disable(klncgpu, klninfo->status[0].kline.ws.slavecount, true);
 
 	klncgpu->shutdown = true;
+
+#ifdef KLONDIKE_EMULATION
+	if (klninfo->fd != -1)
+	{
+		pthread_join(klninfo->read_thr, NULL);
+		usb_uninit(klncgpu);
+		return;
+	}
+#endif
+
+	usb_close_ep(klninfo->ep_r);
+	klninfo->ep_r = NULL;
 }
 
 static void klondike_thread_enable(struct thr_info *thr)
@@ -1554,6 +1709,9 @@ static int64_t klondike_scanwork(struct thr_info *thr)
 	if (klninfo->usbinfo_nodev)
 		return -1;
 
+	if (klninfo->status != NULL)
+		klondike_overheat_abort(klncgpu);
+
 	restart_wait(thr, 200);
 	if (klninfo->status != NULL) {
 		rd_lock(&(klninfo->stat_lock));
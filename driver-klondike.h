@@ -12,7 +12,10 @@
 
 struct klondike_info {
 	pthread_rwlock_t stat_lock;
-	struct thr_info replies_thr;
+	// Replies are read with async transfers, and assembled into reply_kitem
+	struct lowl_usb_endpoint *ep_r;
+	struct klist *reply_kitem;
+	int reply_len;
 	cglock_t klist_lock;
 	struct klist *used;
 	struct klist *free;
@@ -51,6 +54,9 @@ struct klondike_info {
 	bool initialised;
 	
 	struct libusb_device_handle *usbdev_handle;
+	// Emulated devices are reached through a serial port instead, with replies read by read_thr
+	int fd;
+	pthread_t read_thr;
 	
 	// TODO:
 	bool usbinfo_nodev;
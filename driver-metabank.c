@@ -35,7 +35,7 @@
 BFG_REGISTER_DRIVER(metabank_drv)
 
 static
-bool metabank_spi_txrx(struct spi_port *port)
+void metabank_spi_select(struct spi_port * const port)
 {
 	static int current_slot = -1;
 	struct cgpu_info * const proc = port->cgpu;
@@ -48,11 +48,23 @@ bool metabank_spi_txrx(struct spi_port *port)
 		tm_i2c_set_oe(bitfury->slot);
 		current_slot = bitfury->slot;
 	}
-	
+}
+
+static
+bool metabank_spi_txrx(struct spi_port *port)
+{
+	metabank_spi_select(port);
 	const bool rv = sys_spi_txrx(port);
 	return rv;
 }
 
+static
+bool metabank_spi_txrx_segments(struct spi_port * const port)
+{
+	metabank_spi_select(port);
+	return sys_spi_txrx_segments(port);
+}
+
 static
 int metabank_autodetect()
 {
@@ -97,6 +109,7 @@ int metabank_autodetect()
 			*port = *sys_spi;
 			port->cgpu = &dummy_cgpu;
 			port->txrx = metabank_spi_txrx;
+			port->txrx_segments = metabank_spi_txrx_segments;
 			dummy_bitfury.slot = i;
 			
 			chip_n = libbitfury_detectChips1(port);
@@ -233,6 +246,7 @@ struct device_drv metabank_drv = {
 	.thread_disable = bitfury_disable,
 	
 	.minerloop = minerloop_async,
+	.minerloop_timer_wheel = true,
 	.job_prepare = bitfury_job_prepare,
 	.job_start = bitfury_noop_job_start,
 	.poll = bitfury_do_io,
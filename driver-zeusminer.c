@@ -314,7 +314,7 @@ static
 void zeusminer_drv_init()
 {
 	// based on Icarus
-	zeusminer_drv = icarus_drv;
+	icarus_drv_derive(&zeusminer_drv);
 	
 	// metadata
 	zeusminer_drv.dname = "zeusminer";
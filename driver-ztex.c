@@ -107,7 +107,7 @@ bool ztex_lowl_probe(const struct lowlevel_device_info * const info)
 		case CHECK_OK:
 			break;
 		case CHECK_RESCAN:
-			bfg_need_detect_rescan = true;
+			bfg_request_detect_rescan();
 			return false;
 	}
 	
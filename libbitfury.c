@@ -298,7 +298,8 @@ int libbitfury_detectChips1(struct spi_port *port) {
 }
 
 // in  = 1f 1e 1d 1c 1b 1a 19 18 17 16 15 14 13 12 11 10  f  e  d  c  b  a  9  8  7  6  5  4  3  2  1  0
-uint32_t bitfury_decnonce(uint32_t in)
+static
+uint32_t bitfury_decnonce_permute(uint32_t in)
 {
 	uint32_t out;
 
@@ -317,10 +318,32 @@ uint32_t bitfury_decnonce(uint32_t in)
 	if (in & 2) out |= (1 << 22);
 // out =  7  6  5  4  3  2  1  0  f  e 18 19 1a 1b 1c 1d 1e 1f 10 11 12 13 14 15 16 17  8  9  a  b  c  d
 
-	out -= 0x800004;
 	return out;
 }
 
+// The decode is a pure bit permutation, so each input byte can be looked up independently
+static uint32_t bitfury_decnonce_tbl[4][0x100];
+
+static
+__attribute__((constructor))
+void bitfury_decnonce_tbl_init(void)
+{
+	int i, j;
+	
+	for (i = 0; i < 4; ++i)
+		for (j = 0; j < 0x100; ++j)
+			bitfury_decnonce_tbl[i][j] = bitfury_decnonce_permute((uint32_t)j << (i * 8));
+}
+
+uint32_t bitfury_decnonce(uint32_t in)
+{
+	const uint32_t out = bitfury_decnonce_tbl[0][in & 0xff]
+	                   | bitfury_decnonce_tbl[1][(in >> 8) & 0xff]
+	                   | bitfury_decnonce_tbl[2][(in >> 16) & 0xff]
+	                   | bitfury_decnonce_tbl[3][in >> 24];
+	return out - 0x800004;
+}
+
 static
 int libbitfury_rehash(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t nnonce) {
 	uint8_t in[16];
@@ -363,14 +386,134 @@ int libbitfury_rehash(const void *midstate, const uint32_t m7, const uint32_t nt
 	return 0;
 }
 
+#define BITFURY_HASH_LANES  8
+
+static const uint32_t bitfury_nonce_offsets[] = {0, 0xffc00000, 0xff800000, 0x02800000, 0x02C00000, 0x00400000};
+
+// SHA-256 compression of BITFURY_HASH_LANES independent blocks; every step loops over the lanes, so the compiler can vectorise it with whatever the host has
+static
+void bitfury_sha256_lanes(uint32_t st[8][BITFURY_HASH_LANES], uint32_t w[64][BITFURY_HASH_LANES])
+{
+	uint32_t v[8][BITFURY_HASH_LANES];
+	uint32_t t1, t2;
+	int i, l;
+	
+	for (i = 16; i < 64; ++i)
+		for (l = 0; l < BITFURY_HASH_LANES; ++l)
+			w[i][l] = s1(w[i-2][l]) + w[i-7][l] + s0(w[i-15][l]) + w[i-16][l];
+	memcpy(v, st, sizeof(v));
+	// Rather than shifting the working variables, rotate which slot plays which role
+#define BITFURY_LANES_ROUND(a, b, c, d, e, f, g, h, i)  do {  \
+	for (l = 0; l < BITFURY_HASH_LANES; ++l)  \
+	{  \
+		t1 = v[h][l] + S1(v[e][l]) + Ch(v[e][l], v[f][l], v[g][l]) + SHA_K[i] + w[i][l];  \
+		t2 = S0(v[a][l]) + Maj(v[a][l], v[b][l], v[c][l]);  \
+		v[d][l] += t1;  \
+		v[h][l] = t1 + t2;  \
+	}  \
+} while (0)
+	for (i = 0; i < 64; i += 8)
+	{
+		BITFURY_LANES_ROUND(0, 1, 2, 3, 4, 5, 6, 7, i);
+		BITFURY_LANES_ROUND(7, 0, 1, 2, 3, 4, 5, 6, i + 1);
+		BITFURY_LANES_ROUND(6, 7, 0, 1, 2, 3, 4, 5, i + 2);
+		BITFURY_LANES_ROUND(5, 6, 7, 0, 1, 2, 3, 4, i + 3);
+		BITFURY_LANES_ROUND(4, 5, 6, 7, 0, 1, 2, 3, i + 4);
+		BITFURY_LANES_ROUND(3, 4, 5, 6, 7, 0, 1, 2, i + 5);
+		BITFURY_LANES_ROUND(2, 3, 4, 5, 6, 7, 0, 1, i + 6);
+		BITFURY_LANES_ROUND(1, 2, 3, 4, 5, 6, 7, 0, i + 7);
+	}
+#undef BITFURY_LANES_ROUND
+	for (i = 0; i < 8; ++i)
+		for (l = 0; l < BITFURY_HASH_LANES; ++l)
+			st[i][l] += v[i][l];
+}
+
+// Checks up to BITFURY_HASH_LANES candidates, recording the first good one for each result
+static
+int bitfury_fudge_lanes(const uint32_t * const mid, const uint32_t * const tail, uint32_t * const cand, const int * const idx, const int lanes, uint32_t * const nonces, bool * const found)
+{
+	uint32_t st[8][BITFURY_HASH_LANES], w[64][BITFURY_HASH_LANES];
+	int i, l, rv = 0;
+	
+	for (l = lanes; l < BITFURY_HASH_LANES; ++l)
+		cand[l] = cand[0];
+	
+	// Second block of the header: m7, ntime, nbits, nonce, then padding for 80 bytes
+	memset(w, 0, sizeof(w[0]) * 16);
+	for (l = 0; l < BITFURY_HASH_LANES; ++l)
+	{
+		for (i = 0; i < 8; ++i)
+			st[i][l] = mid[i];
+		for (i = 0; i < 3; ++i)
+			w[i][l] = tail[i];
+		w[3][l] = le32toh(cand[l]);
+		w[4][l] = 0x80000000;
+		w[15][l] = 80 * 8;
+	}
+	bitfury_sha256_lanes(st, w);
+	
+	// Hash of the hash, padded for 32 bytes
+	memset(w, 0, sizeof(w[0]) * 16);
+	for (l = 0; l < BITFURY_HASH_LANES; ++l)
+	{
+		for (i = 0; i < 8; ++i)
+		{
+			w[i][l] = st[i][l];
+			st[i][l] = sha256_h0[i];
+		}
+		w[8][l] = 0x80000000;
+		w[15][l] = 32 * 8;
+	}
+	bitfury_sha256_lanes(st, w);
+	
+	for (l = 0; l < lanes; ++l)
+	{
+		if (st[7][l] || found[idx[l]])
+			continue;
+		nonces[idx[l]] = cand[l];
+		found[idx[l]] = true;
+		++rv;
+	}
+	return rv;
+}
+
+int bitfury_fudge_nonces(const void * const midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t * const nonces, bool * const found, const int count)
+{
+	const uint32_t tail[3] = { le32toh(m7), le32toh(ntime), le32toh(nbits) };
+	uint32_t mid[8], cand[BITFURY_HASH_LANES];
+	int idx[BITFURY_HASH_LANES];
+	int i, j, lanes = 0, rv = 0;
+	
+	memcpy(mid, midstate, sizeof(mid));
+	for (i = 0; i < count; ++i)
+	{
+		if (found[i])
+			continue;
+		for (j = 0; j < sizeof(bitfury_nonce_offsets) / sizeof(*bitfury_nonce_offsets); ++j)
+		{
+			cand[lanes] = nonces[i] + bitfury_nonce_offsets[j];
+			idx[lanes] = i;
+			if (++lanes == BITFURY_HASH_LANES)
+			{
+				rv += bitfury_fudge_lanes(mid, tail, cand, idx, lanes, nonces, found);
+				lanes = 0;
+			}
+		}
+	}
+	if (lanes)
+		rv += bitfury_fudge_lanes(mid, tail, cand, idx, lanes, nonces, found);
+	return rv;
+}
+
+// Checks one result, stopping at the first good candidate (usually the first); only batches of results are worth hashing in lanes
 bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t *nonce_p) {
-	static const uint32_t offsets[] = {0, 0xffc00000, 0xff800000, 0x02800000, 0x02C00000, 0x00400000};
 	uint32_t nonce;
 	int i;
 	
-	for (i = 0; i < 6; ++i)
+	for (i = 0; i < sizeof(bitfury_nonce_offsets) / sizeof(*bitfury_nonce_offsets); ++i)
 	{
-		nonce = *nonce_p + offsets[i];
+		nonce = *nonce_p + bitfury_nonce_offsets[i];
 		if (libbitfury_rehash(midstate, m7, ntime, nbits, nonce))
 		{
 			*nonce_p = nonce;
@@ -395,3 +538,79 @@ void bitfury_payload_to_atrvec(uint32_t *atrvec, struct bitfury_payload *p)
 	memcpy(atrvec, p, 20*4);
 	libbitfury_ms3_compute(atrvec);
 }
+
+static
+uint32_t _test_bitfury_fudge_nonce(const void * const midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t nonce)
+{
+	if (bitfury_fudge_nonce(midstate, m7, ntime, nbits, &nonce))
+		return nonce;
+	return 0;
+}
+
+void test_bitfury_nonces(void)
+{
+	static const uint8_t midstate[32] = "\x33\xfb\x46\xdc\x61\x2a\x7a\x23\xf0\xa2\x2d\x63\x31\x54\x21\xdc"
+	                                    "\xae\x86\xfe\xc3\x88\xc1\x9c\x8c\x20\x18\x10\x68\xfc\x95\x3f\xf7";
+	const uint32_t m7 = htole32(0xc3baafef), ntime = htole32(0x326fa351), nbits = htole32(0x6461011a);
+	// Results recorded from a chip working on the payload driver-bitfury uses for init, plus two garbage words
+	static const uint32_t chipout[] = {
+		0x187c344e, 0x80ca496a, 0xaa093983, 0x485349a2, 0x4360b9ed, 0xf07e0cf9, 0x8b9a8f12, 0x6ddf33df,
+	};
+	static const uint32_t expected[] = {
+		0x50460f87, 0x6c4054e0, 0x82d56423, 0xa1c4b2a0, 0xecf081a3, 0xf803df88, 0, 0,
+	};
+	const int count = sizeof(chipout) / sizeof(*chipout);
+	uint32_t nonces[count], x;
+	bool found[count];
+	struct timeval tv_start, tv_ref, tv_batch;
+	int i, j, iters;
+	
+	for (x = 0, i = 0; i < 0x100000; ++i, x = x * 1103515245 + 12345)
+		if (bitfury_decnonce(x) != bitfury_decnonce_permute(x) - 0x800004)
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: bitfury_decnonce(%08lx) mismatch", __func__, (unsigned long)x);
+			break;
+		}
+	
+	for (i = 0; i < count; ++i)
+	{
+		nonces[i] = bitfury_decnonce(chipout[i]);
+		found[i] = false;
+	}
+	if (bitfury_fudge_nonces(midstate, m7, ntime, nbits, nonces, found, count) != 6)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: bitfury_fudge_nonces found wrong number of nonces", __func__);
+	}
+	for (i = 0; i < count; ++i)
+	{
+		x = _test_bitfury_fudge_nonce(midstate, m7, ntime, nbits, bitfury_decnonce(chipout[i]));
+		if (found[i] != (expected[i] != 0) || (found[i] && nonces[i] != expected[i]) || x != expected[i])
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: result %d (%08lx) decoded to %08lx (batch) / %08lx (one at a time), expected %08lx",
+			       __func__, i, (unsigned long)chipout[i], (unsigned long)(found[i] ? nonces[i] : 0), (unsigned long)x, (unsigned long)expected[i]);
+		}
+	}
+	
+	// Rough comparison against checking candidates one at a time
+	iters = 0x100;
+	timer_set_now(&tv_start);
+	for (i = 0; i < iters; ++i)
+		for (j = 0; j < count; ++j)
+			_test_bitfury_fudge_nonce(midstate, m7, ntime, nbits, bitfury_decnonce(chipout[j]));
+	timer_set_now(&tv_ref);
+	for (i = 0; i < iters; ++i)
+	{
+		for (j = 0; j < count; ++j)
+		{
+			nonces[j] = bitfury_decnonce(chipout[j]);
+			found[j] = false;
+		}
+		bitfury_fudge_nonces(midstate, m7, ntime, nbits, nonces, found, count);
+	}
+	timer_set_now(&tv_batch);
+	applog(LOG_NOTICE, "%s: %d result sets in %ldus one at a time, %ldus batched",
+	       __func__, iters, timer_elapsed_us(&tv_start, &tv_ref), timer_elapsed_us(&tv_ref, &tv_batch));
+}
@@ -41,6 +41,10 @@ struct bitfury_device {
 	int chipgen;
 	int chipgen_probe;
 	uint32_t atrvec[20];
+	// atrvec as a ready-to-send SPI frame, and where its reply lands
+	uint8_t atrvec_frame[3 + 19 * 4];
+	uint8_t atrvec_frame_rx[3 + 19 * 4];
+	bool atrvec_frame_valid;
 	struct bitfury_payload payload;
 	struct freq_stat chip_stat;
 	struct timeval timer1;
@@ -66,5 +70,7 @@ extern void bitfury_send_freq(struct spi_port *, int slot, int chip_n, int bits)
 extern int libbitfury_detectChips1(struct spi_port *);
 extern uint32_t bitfury_decnonce(uint32_t);
 extern bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t *nonce_p);
+// Fixes up each nonces[i] not already found[i], returning how many were newly found
+extern int bitfury_fudge_nonces(const void *midstate, uint32_t m7, uint32_t ntime, uint32_t nbits, uint32_t *nonces, bool *found, int count);
 
 #endif /* __LIBBITFURY_H__ */
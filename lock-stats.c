@@ -0,0 +1,311 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "logging.h"
+#include "miner.h"
+#include "util.h"
+
+#define LOCK_STATS_MAX_HELD  0x20
+
+struct lock_held {
+	const void *lock;
+	struct lock_site *site;
+	struct timeval tv_acquired;
+};
+
+bool opt_lock_stats;
+struct lock_site *lock_stats_sites;
+
+// Locks currently held by a thread, most recent last
+struct lock_stats_held {
+	struct lock_held locks[LOCK_STATS_MAX_HELD];
+	int count;
+};
+
+static
+struct lock_stats_held *lock_stats_held()
+{
+	void ** const p = _bfg_lock_stats_held();
+	
+	if (unlikely(!*p))
+	{
+		*p = calloc(1, sizeof(struct lock_stats_held));
+		if (unlikely(!*p))
+			quithere(1, "Failed to calloc held locks");
+	}
+	return *p;
+}
+
+static
+int lock_stats_bucket(uint64_t us)
+{
+	int i;
+	
+	for (i = 0; i < LOCK_STATS_BUCKETS - 1; ++i, us >>= 2)
+		if (us < 1)
+			return i;
+	return LOCK_STATS_BUCKETS - 1;
+}
+
+static
+void lock_stats_max(uint64_t * const maxp, const uint64_t us)
+{
+	uint64_t old = *maxp;
+	
+	while (us > old)
+	{
+		const uint64_t prev = __sync_val_compare_and_swap(maxp, old, us);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+static
+void lock_stats_register(struct lock_site * const site)
+{
+	struct lock_site *head;
+	
+	if (!__sync_bool_compare_and_swap(&site->registered, 0, 1))
+		return;
+	do {
+		head = lock_stats_sites;
+		site->next = head;
+	} while (!__sync_bool_compare_and_swap(&lock_stats_sites, head, site));
+}
+
+static
+void lock_stats_push(struct lock_site * const site, const void * const lock, const struct timeval * const tv)
+{
+	struct lock_stats_held * const lsh = lock_stats_held();
+	struct lock_held *held;
+	
+	// Deeper nesting than this is not tracked for hold time, but still counted on acquisition
+	if (lsh->count >= LOCK_STATS_MAX_HELD)
+		return;
+	held = &lsh->locks[lsh->count++];
+	held->lock = lock;
+	held->site = site;
+	held->tv_acquired = *tv;
+}
+
+static
+struct lock_held *lock_stats_pop(const void * const lock, struct lock_held * const out)
+{
+	struct lock_stats_held * const lsh = lock_stats_held();
+	int i;
+	
+	for (i = lsh->count; i-- > 0; )
+		if (lsh->locks[i].lock == lock)
+		{
+			*out = lsh->locks[i];
+			memmove(&lsh->locks[i], &lsh->locks[i + 1], (lsh->count - i - 1) * sizeof(*lsh->locks));
+			--lsh->count;
+			return out;
+		}
+	// Acquired before profiling was enabled, or in a lock nest too deep to track
+	return NULL;
+}
+
+void lock_stats_acquired(struct lock_site * const site, const void * const lock, const struct timeval * const tv_start, const bool contended, const bool held)
+{
+	struct timeval tv_now;
+	uint64_t wait_us;
+	
+	timer_set_now(&tv_now);
+	wait_us = timer_elapsed_us(tv_start, &tv_now);
+	
+	if (unlikely(!site->registered))
+		lock_stats_register(site);
+	__sync_add_and_fetch(&site->acquisitions, 1);
+	if (contended)
+		__sync_add_and_fetch(&site->contended, 1);
+	__sync_add_and_fetch(&site->wait_us, wait_us);
+	__sync_add_and_fetch(&site->wait_hist[lock_stats_bucket(wait_us)], 1);
+	lock_stats_max(&site->wait_max_us, wait_us);
+	
+	if (held)
+		lock_stats_push(site, lock, &tv_now);
+}
+
+static
+void lock_stats_hold_done(const struct lock_held * const held)
+{
+	struct lock_site * const site = held->site;
+	struct timeval tv_now;
+	uint64_t hold_us;
+	
+	timer_set_now(&tv_now);
+	hold_us = timer_elapsed_us(&held->tv_acquired, &tv_now);
+	__sync_add_and_fetch(&site->hold_us, hold_us);
+	__sync_add_and_fetch(&site->hold_hist[lock_stats_bucket(hold_us)], 1);
+	lock_stats_max(&site->hold_max_us, hold_us);
+}
+
+void lock_stats_released(const void * const lock)
+{
+	struct lock_held held;
+	
+	if (lock_stats_pop(lock, &held))
+		lock_stats_hold_done(&held);
+}
+
+struct lock_site *lock_stats_suspend(const void * const lock)
+{
+	struct lock_held held;
+	
+	if (!lock_stats_pop(lock, &held))
+		return NULL;
+	lock_stats_hold_done(&held);
+	return held.site;
+}
+
+void lock_stats_resume(struct lock_site * const site, const void * const lock)
+{
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	lock_stats_push(site, lock, &tv_now);
+}
+
+static
+int lock_site_cmp(const void * const a, const void * const b)
+{
+	const struct lock_site * const sa = *(const struct lock_site **)a;
+	const struct lock_site * const sb = *(const struct lock_site **)b;
+	
+	if (sa->wait_us != sb->wait_us)
+		return (sa->wait_us < sb->wait_us) ? 1 : -1;
+	return (sa->hold_us < sb->hold_us) ? 1 : ((sa->hold_us > sb->hold_us) ? -1 : 0);
+}
+
+void lock_stats_dump(void)
+{
+	struct lock_site *site, **sites;
+	int count = 0, i;
+	
+	for (site = lock_stats_sites; site; site = site->next)
+		++count;
+	if (!count)
+		return;
+	sites = malloc(sizeof(*sites) * count);
+	if (!sites)
+		return;
+	i = 0;
+	for (site = lock_stats_sites; site && i < count; site = site->next)
+		sites[i++] = site;
+	qsort(sites, count, sizeof(*sites), lock_site_cmp);
+	
+	applog(LOG_WARNING, "Lock contention, by total wait time:");
+	for (i = 0; i < count; ++i)
+	{
+		site = sites[i];
+		applog(LOG_WARNING, "  %s %s at %s:%d (%s): %"PRIu64" acquired, %"PRIu64" contended, wait %.6fs (max %.6fs), hold %.6fs (max %.6fs)",
+		       site->op, site->lockname, site->file, site->line, site->func,
+		       site->acquisitions, site->contended,
+		       site->wait_us / 1e6, site->wait_max_us / 1e6,
+		       site->hold_us / 1e6, site->hold_max_us / 1e6);
+	}
+	free(sites);
+}
+
+void test_lock_stats(void)
+{
+	static const uint64_t bucket_tests[][2] = {
+		{       0,  0 },
+		{       1,  1 },
+		{       3,  1 },
+		{       4,  2 },
+		{      15,  2 },
+		{      16,  3 },
+		{ 1048575, 10 },
+		{ 1048576, 11 },
+		{ UINT64_MAX, LOCK_STATS_BUCKETS - 1 },
+	};
+	static pthread_mutex_t test_mutex = PTHREAD_MUTEX_INITIALIZER;
+	static pthread_cond_t test_cond = PTHREAD_COND_INITIALIZER;
+	struct lock_stats_held * const lsh = lock_stats_held();
+	struct lock_site *site = NULL, *waitsite;
+	struct timeval tv_deadline;
+	struct timespec ts_deadline;
+	const bool saved_opt = opt_lock_stats;
+	int i, b;
+	
+	for (i = 0; i < sizeof(bucket_tests) / sizeof(*bucket_tests); ++i)
+	{
+		b = lock_stats_bucket(bucket_tests[i][0]);
+		if (b != bucket_tests[i][1])
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: bucket for %"PRIu64"us is %d (expected %d)",
+			       __func__, bucket_tests[i][0], b, (int)bucket_tests[i][1]);
+		}
+	}
+	
+	opt_lock_stats = true;
+	for (i = 0; i < 3; ++i)
+	{
+		mutex_lock(&test_mutex);
+		if (!site)
+			site = lsh->locks[lsh->count - 1].site;
+		mutex_unlock_noyield(&test_mutex);
+	}
+	
+	// The 50ms timed wait must not count as holding the mutex
+	mutex_lock(&test_mutex);
+	waitsite = lsh->locks[lsh->count - 1].site;
+	gettimeofday(&tv_deadline, NULL);
+	tv_deadline.tv_usec += 50000;
+	if (tv_deadline.tv_usec >= 1000000)
+	{
+		++tv_deadline.tv_sec;
+		tv_deadline.tv_usec -= 1000000;
+	}
+	timeval_to_spec(&ts_deadline, &tv_deadline);
+	while (pthread_cond_timedwait(&test_cond, &test_mutex, &ts_deadline) != ETIMEDOUT)
+	{}
+	mutex_unlock_noyield(&test_mutex);
+	opt_lock_stats = saved_opt;
+	
+	if (lsh->count)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: %d locks left held", __func__, lsh->count);
+	}
+	if (!(site && site->registered && site->acquisitions == 3 && !site->contended))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: site not recorded correctly", __func__);
+	}
+	else
+	{
+		uint64_t holds = 0;
+		for (i = 0; i < LOCK_STATS_BUCKETS; ++i)
+			holds += site->hold_hist[i];
+		if (holds != 3 || strcmp(site->lockname, "&test_mutex"))
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: site %s has %"PRIu64" holds (expected 3)", __func__, site->lockname, holds);
+		}
+	}
+	if (waitsite->acquisitions != 1 || waitsite->hold_max_us >= 40000)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: timed wait counted as held (%"PRIu64" acquisitions, held up to %"PRIu64"us)",
+		       __func__, waitsite->acquisitions, waitsite->hold_max_us);
+	}
+}
@@ -0,0 +1,1205 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Device emulators
+ *
+ * Each emulated device is a pseudo-terminal with a thread on the master side
+ * speaking a device's serial protocol, and hashing the work it receives on the
+ * CPU so any nonces it returns are real. The slave side is reported as a VCOM
+ * device naming the driver it emulates, which is probed with it first; from
+ * then on the normal driver and mining code runs against it unmodified.
+ *
+ * CPU hashing is of course much slower than the hardware being emulated, so
+ * shares are rare; the point is exercising protocol handling, job restarts and
+ * result processing without hardware.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <utlist.h>
+
+#include "driver-icarus.h"
+#include "logging.h"
+#include "lowlevel.h"
+#include "lowl-emu.h"
+#include "lowl-vcom.h"
+#include "miner.h"
+#include "sha2.h"
+#include "util.h"
+
+// Nonces hashed between checks for new commands
+#define BFG_EMU_SCAN_BATCH  0x1000
+// Drop partially received commands after this long without more data
+#define BFG_EMU_RX_TIMEOUT_MS  100
+
+// Longest pause kept from a trace between the driver's last write and a replayed read
+#define BFG_EMU_REPLAY_MAX_DELAY_US  5000000
+
+// Appended to the product string of emulated devices
+#define BFG_EMU_PRODUCT_SUFFIX  " (BFGMiner emulated)"
+
+// Emulated BitForce Single hashrate, which determines when jobs complete
+#define BFG_EMU_BITFORCE_HASHRATE  832000000.
+#define BFG_EMU_BITFORCE_JOB_US  ((long)(0x100000000 / BFG_EMU_BITFORCE_HASHRATE * 1000000))
+
+// Emulated Klondike K16: a single board with one chip (so slaves and chip stats stay trivial) at the K16's hashrate
+#define BFG_EMU_KLONDIKE_HASHRATE  4500000000.
+#define BFG_EMU_KLONDIKE_JOB_US  ((long)(0x100000000 / BFG_EMU_KLONDIKE_HASHRATE * 1000000))
+#define BFG_EMU_KLONDIKE_REPLY_SIZE  15
+#define BFG_EMU_KLONDIKE_QUEUE  4
+// Like the firmware, nonces are reported this far past the one found
+#define BFG_EMU_KLONDIKE_NONCE_OFFSET  0xc0
+// About 40C in the Klondike's thermistor units
+#define BFG_EMU_KLONDIKE_TEMP  118
+
+struct bfg_emu;
+
+enum bfg_emu_type_id {
+	BET_ICARUS,
+	BET_BITFORCE,
+	BET_KLONDIKE,
+};
+
+struct bfg_emu_type {
+	const char *name;
+	// Driver to probe emulated devices with
+	const char *dname;
+	const char *product;
+	void (*run)(struct bfg_emu *);
+	// Nominal time to hash a full nonce range, for devices which report job completion
+	long job_us;
+};
+
+struct bfg_emu {
+	const struct bfg_emu_type *type;
+	void (*run)(struct bfg_emu *);
+	long job_us;
+	int master_fd;
+	// Held open so the pty stays usable (and raw) between driver opens
+	int slave_fd;
+	char *path;
+	char *serial;
+	
+	// Recorded lowlevel trace to play back instead of emulating the device
+	struct lowl_trace_rec *replay;
+	int replay_count;
+	
+	pthread_t pth;
+	bool stopping;
+	
+	struct bfg_emu *next;
+};
+
+static struct bfg_emu *emulators;
+
+struct bfg_emu_job {
+	uint32_t midstate[8];
+	// Second block of the header with its padding, as hashed; bytes 12-15 are the nonce
+	uint8_t block[64];
+	// Next nonce to hash, and the last one in the range
+	uint32_t nonce;
+	uint32_t nonce_end;
+	bool active;
+};
+
+// Takes midstate and data tail as found in struct work
+static
+void emu_job_set(struct bfg_emu_job * const job, const void * const midstate, const void * const datatail)
+{
+	uint32_t dt[3];
+	
+	memcpy(job->midstate, midstate, sizeof(job->midstate));
+	for (int i = 0; i < 8; ++i)
+		job->midstate[i] = le32toh(job->midstate[i]);
+	
+	// work->data is stored with each 32-bit word byteswapped from the header
+	memcpy(dt, datatail, sizeof(dt));
+	for (int i = 0; i < 3; ++i)
+		dt[i] = htobe32(le32toh(dt[i]));
+	memset(job->block, 0, sizeof(job->block));
+	memcpy(job->block, dt, sizeof(dt));
+	job->block[16] = 0x80;
+	// 80 byte message length in bits
+	job->block[62] = 0x02;
+	job->block[63] = 0x80;
+	
+	job->nonce = 0;
+	job->nonce_end = 0xffffffff;
+	job->active = true;
+}
+
+// Returns true with *out_nonce set if a diff 1 nonce was found
+static
+bool emu_job_scan(struct bfg_emu_job * const job, unsigned count, uint32_t * const out_nonce)
+{
+	sha256_ctx ctx;
+	uint8_t block2[SHA256_BLOCK_SIZE] = {
+		[32] = 0x80,
+		// 32 byte message length in bits
+		[62] = 0x01,
+	};
+	uint32_t nonce, be;
+	
+	while (job->active && count--)
+	{
+		nonce = job->nonce;
+		if (job->nonce == job->nonce_end)
+			job->active = false;
+		else
+			++job->nonce;
+		be = htobe32(nonce);
+		memcpy(&job->block[12], &be, sizeof(be));
+		
+		memcpy(ctx.h, job->midstate, sizeof(ctx.h));
+		sha256_transf(&ctx, job->block, 1);
+		for (int i = 0; i < 8; ++i)
+		{
+			be = htobe32(ctx.h[i]);
+			memcpy(&block2[i * 4], &be, sizeof(be));
+		}
+		memcpy(ctx.h, sha256_h0, sizeof(ctx.h));
+		sha256_transf(&ctx, block2, 1);
+		
+		// The last 32 bits of the hash must be zero for difficulty 1
+		if (ctx.h[7])
+			continue;
+		
+		*out_nonce = nonce;
+		return true;
+	}
+	return false;
+}
+
+// Returns number of bytes read, or 0 if nothing arrived within timeout_ms
+static
+ssize_t emu_read(struct bfg_emu * const emu, void * const buf, const size_t bufsz, const int timeout_ms)
+{
+	struct pollfd pfd = {
+		.fd = emu->master_fd,
+		.events = POLLIN,
+	};
+	ssize_t r;
+	
+	if (poll(&pfd, 1, timeout_ms) <= 0)
+		return 0;
+	r = read(emu->master_fd, buf, bufsz);
+	if (r < 0)
+	{
+		if (errno != EAGAIN && errno != EINTR)
+			cgsleep_ms(timeout_ms);
+		return 0;
+	}
+	return r;
+}
+
+static
+void emu_write(struct bfg_emu * const emu, const void * const buf, const size_t bufsz)
+{
+	if (unlikely(opt_dev_protocol))
+	{
+		char hex[(bufsz * 2) + 1];
+		bin2hex(hex, buf, bufsz);
+		applog(LOG_DEBUG, "%s: Emulator sending %s", emu->serial, hex);
+	}
+	if (bufsz != write(emu->master_fd, buf, bufsz))
+		applog(LOG_DEBUG, "%s: Emulator failed to write reply", emu->serial);
+}
+
+#define emu_write_str(emu, s)  emu_write(emu, s, strlen(s))
+
+static
+void emu_run_icarus(struct bfg_emu * const emu)
+{
+	struct bfg_emu_job job = { .active = false, };
+	struct timeval tv_lastrx;
+	uint8_t ob[64], midstate[32], datatail[12];
+	size_t oblen = 0;
+	uint32_t nonce;
+	ssize_t r;
+	
+	while (!emu->stopping)
+	{
+		r = emu_read(emu, &ob[oblen], sizeof(ob) - oblen, job.active ? 0 : BFG_EMU_RX_TIMEOUT_MS);
+		if (r)
+		{
+			timer_set_now(&tv_lastrx);
+			oblen += r;
+			if (oblen == sizeof(ob))
+			{
+				// New work always replaces whatever was being hashed
+				swab256(midstate, ob);
+				bswap_96p(datatail, &ob[0x34]);
+				applog(LOG_DEBUG, "%s: Emulator %s job", emu->serial, job.active ? "restarting with new" : "starting");
+				emu_job_set(&job, midstate, datatail);
+				oblen = 0;
+			}
+		}
+		else
+		if (oblen && timer_elapsed_us(&tv_lastrx, NULL) > BFG_EMU_RX_TIMEOUT_MS * 1000)
+		{
+			applog(LOG_DEBUG, "%s: Emulator discarding %u bytes of incomplete work", emu->serial, (unsigned)oblen);
+			oblen = 0;
+		}
+		
+		if (emu_job_scan(&job, BFG_EMU_SCAN_BATCH, &nonce))
+		{
+			// Icarus stops hashing once it finds a nonce
+			job.active = false;
+			nonce = htobe32(nonce);
+			emu_write(emu, &nonce, sizeof(nonce));
+		}
+	}
+}
+
+static
+void emu_run_bitforce(struct bfg_emu * const emu)
+{
+	struct bfg_emu_job job = { .active = false, };
+	struct timeval tv_lastrx, tv_jobdone;
+	char cmd[3], reply[0x80];
+	uint8_t ob[60];
+	uint32_t nonces[8];
+	int nonces_count = 0;
+	bool have_job = false;
+	size_t cmdlen = 0;
+	ssize_t r;
+	
+	while (!emu->stopping)
+	{
+		if (have_job && job.active && timer_passed(&tv_jobdone, NULL))
+			// As far as the host can tell, the whole nonce range has been hashed
+			job.active = false;
+		
+		r = emu_read(emu, &cmd[cmdlen], sizeof(cmd) - cmdlen, job.active ? 0 : BFG_EMU_RX_TIMEOUT_MS);
+		if (r)
+		{
+			timer_set_now(&tv_lastrx);
+			cmdlen += r;
+		}
+		else
+		if (cmdlen && timer_elapsed_us(&tv_lastrx, NULL) > BFG_EMU_RX_TIMEOUT_MS * 1000)
+			cmdlen = 0;
+		
+		if (cmdlen == sizeof(cmd))
+		{
+			cmdlen = 0;
+			if (cmd[0] != 'Z' || cmd[2] != 'X')
+				emu_write_str(emu, "ERR:UNKNOWN COMMAND\n");
+			else
+			switch (cmd[1])
+			{
+				case 'G':
+					emu_write_str(emu, ">>>ID: BitFORCE SHA256" BFG_EMU_PRODUCT_SUFFIX ">>>\n");
+					break;
+				case 'C':
+					emu_write_str(emu, "MANUFACTURER: BFGMiner emulator\nOK\n");
+					break;
+				case 'L':
+					emu_write_str(emu, "TEMP:45.00\n");
+					break;
+				case 'M':
+					emu_write_str(emu, "OK\n");
+					break;
+				case 'D':
+				{
+					if (job.active)
+					{
+						emu_write_str(emu, "BUSY\n");
+						break;
+					}
+					emu_write_str(emu, "OK\n");
+					
+					size_t oblen = 0;
+					while (oblen < sizeof(ob) && (r = emu_read(emu, &ob[oblen], sizeof(ob) - oblen, BFG_EMU_RX_TIMEOUT_MS)))
+						oblen += r;
+					if (oblen < sizeof(ob) || memcmp(ob, ">>>>>>>>", 8) || memcmp(&ob[52], ">>>>>>>>", 8))
+					{
+						emu_write_str(emu, "ERR:INVALID DATA\n");
+						break;
+					}
+					// ">>>>>>>>|---------- MidState ----------||-DataTail-|>>>>>>>>"
+					emu_job_set(&job, &ob[8], &ob[40]);
+					timer_set_delay_from_now(&tv_jobdone, emu->job_us);
+					have_job = true;
+					nonces_count = 0;
+					emu_write_str(emu, "OK\n");
+					break;
+				}
+				case 'F':
+				{
+					if (job.active)
+						emu_write_str(emu, "BUSY\n");
+					else
+					if (!have_job)
+						emu_write_str(emu, "IDLE\n");
+					else
+					if (!nonces_count)
+					{
+						emu_write_str(emu, "NO-NONCE\n");
+						have_job = false;
+					}
+					else
+					{
+						char *p = reply;
+						p += sprintf(p, "NONCE-FOUND:");
+						for (int i = 0; i < nonces_count; ++i)
+							p += sprintf(p, "%s%08lX", i ? "," : "", (unsigned long)nonces[i]);
+						strcpy(p, "\n");
+						emu_write_str(emu, reply);
+						have_job = false;
+					}
+					break;
+				}
+				default:
+					emu_write_str(emu, "ERR:UNKNOWN COMMAND\n");
+			}
+		}
+		
+		if (nonces_count < (int)(sizeof(nonces) / sizeof(*nonces)) && emu_job_scan(&job, BFG_EMU_SCAN_BATCH, &nonces[nonces_count]))
+			++nonces_count;
+	}
+}
+
+struct bfg_emu_klondike_work {
+	uint8_t workid;
+	uint8_t midstate[32];
+	uint8_t datatail[12];
+};
+
+// Status replies answer most commands; counts progress through the job as the K16 would have
+static
+void emu_klondike_status(struct bfg_emu * const emu, const uint8_t cmd, const bool enabled, const int queue_count, const uint8_t workid, const struct timeval * const tv_jobstart)
+{
+	uint8_t reply[BFG_EMU_KLONDIKE_REPLY_SIZE] = {
+		cmd,
+		0,  // dev
+		enabled,
+		1,  // chipcount
+		0,  // slavecount
+		queue_count,
+		workid,
+		BFG_EMU_KLONDIKE_TEMP,
+		0xff,  // fanspeed
+	};
+	long hashcount = 0;
+	
+	if (tv_jobstart)
+	{
+		hashcount = timer_elapsed_us(tv_jobstart, NULL) * 0x100 / emu->job_us;
+		if (hashcount > 0xff)
+			hashcount = 0xff;
+	}
+	reply[10] = hashcount;
+	// maxcount: hashcount units per nonce range
+	reply[13] = 0x01;
+	emu_write(emu, reply, sizeof(reply));
+}
+
+// Commands are cmd, dev and a command-specific payload, with nothing marking their end
+static
+size_t emu_klondike_cmdlen(const uint8_t cmd)
+{
+	switch (cmd)
+	{
+		case 'I': case 'S': case 'A':
+			return 2;
+		case 'E':
+			return 3;
+		case 'C':
+			// A config without settings is only 2 bytes, but the driver always sends them
+			return 8;
+		case 'W':
+			return 3 + 32 + 12;
+		default:
+			return 1;
+	}
+}
+
+static
+void emu_run_klondike(struct bfg_emu * const emu)
+{
+	struct bfg_emu_job job = { .active = false, };
+	struct bfg_emu_klondike_work queue[BFG_EMU_KLONDIKE_QUEUE];
+	struct timeval tv_lastrx, tv_jobstart, tv_jobdone;
+	uint8_t rx[0x40], reply[BFG_EMU_KLONDIKE_REPLY_SIZE], workid = 0;
+	uint8_t config[6] = { 282 & 0xff, 282 >> 8, 0, 0, 0xff, 0, };
+	int queue_count = 0;
+	bool enabled = false;
+	size_t rxlen = 0, cmdlen;
+	uint32_t nonce;
+	ssize_t r;
+	
+	while (!emu->stopping)
+	{
+		if (job.active && timer_passed(&tv_jobdone, NULL))
+			// As far as the host can tell, the whole nonce range has been hashed
+			job.active = false;
+		if (enabled && !job.active && queue_count)
+		{
+			workid = queue[0].workid;
+			emu_job_set(&job, queue[0].midstate, queue[0].datatail);
+			memmove(&queue[0], &queue[1], --queue_count * sizeof(*queue));
+			timer_set_now(&tv_jobstart);
+			timer_set_delay(&tv_jobdone, &tv_jobstart, emu->job_us);
+		}
+		
+		r = emu_read(emu, &rx[rxlen], sizeof(rx) - rxlen, job.active ? 0 : BFG_EMU_RX_TIMEOUT_MS);
+		if (r)
+		{
+			timer_set_now(&tv_lastrx);
+			rxlen += r;
+		}
+		else
+		if (rxlen && timer_elapsed_us(&tv_lastrx, NULL) > BFG_EMU_RX_TIMEOUT_MS * 1000)
+		{
+			applog(LOG_DEBUG, "%s: Emulator discarding %u bytes of incomplete command", emu->serial, (unsigned)rxlen);
+			rxlen = 0;
+		}
+		
+		while (rxlen && rxlen >= (cmdlen = emu_klondike_cmdlen(rx[0])))
+		{
+			switch (rx[0])
+			{
+				case 'I':
+					memset(reply, 0, sizeof(reply));
+					reply[0] = 'I';
+					// version
+					reply[2] = 0x10;
+					memcpy(&reply[3], "K16", 3);
+					memcpy(&reply[10], "EMU", 3);
+					emu_write(emu, reply, sizeof(reply));
+					break;
+				case 'C':
+					memcpy(config, &rx[2], sizeof(config));
+					memset(reply, 0, sizeof(reply));
+					reply[0] = 'C';
+					memcpy(&reply[2], config, sizeof(config));
+					emu_write(emu, reply, sizeof(reply));
+					break;
+				case 'W':
+					if (queue_count < BFG_EMU_KLONDIKE_QUEUE)
+					{
+						struct bfg_emu_klondike_work * const kwork = &queue[queue_count++];
+						kwork->workid = rx[2];
+						memcpy(kwork->midstate, &rx[3], sizeof(kwork->midstate));
+						memcpy(kwork->datatail, &rx[3 + 32], sizeof(kwork->datatail));
+					}
+					else
+						applog(LOG_DEBUG, "%s: Emulator queue full, dropping work", emu->serial);
+					emu_klondike_status(emu, 'W', enabled, queue_count, workid, job.active ? &tv_jobstart : NULL);
+					break;
+				case 'A':
+					job.active = false;
+					queue_count = 0;
+					emu_klondike_status(emu, 'A', enabled, queue_count, workid, NULL);
+					break;
+				case 'E':
+					enabled = (rx[2] == '1');
+					if (!enabled)
+						job.active = false;
+					// fallthru
+				case 'S':
+					emu_klondike_status(emu, rx[0], enabled, queue_count, workid, job.active ? &tv_jobstart : NULL);
+					break;
+				default:
+					// Padding after a command, or garbage
+					break;
+			}
+			rxlen -= cmdlen;
+			memmove(rx, &rx[cmdlen], rxlen);
+		}
+		
+		if (emu_job_scan(&job, BFG_EMU_SCAN_BATCH, &nonce))
+		{
+			nonce = htole32(nonce + BFG_EMU_KLONDIKE_NONCE_OFFSET);
+			memset(reply, 0, sizeof(reply));
+			reply[0] = '=';
+			reply[2] = workid;
+			memcpy(&reply[3], &nonce, sizeof(nonce));
+			emu_write(emu, reply, sizeof(reply));
+		}
+	}
+}
+
+// Plays back the device's side of a lowlevel trace, pacing replies as recorded and checking the driver's side matches
+static
+void emu_run_replay(struct bfg_emu * const emu)
+{
+	const struct lowl_trace_rec *rec, *prev = NULL;
+	uint8_t buf[0x400];
+	size_t got, want, cmplen;
+	bool match;
+	long delay_us;
+	ssize_t r;
+	int i;
+	
+	for (i = 0; i < emu->replay_count && !emu->stopping; prev = rec, ++i)
+	{
+		rec = &emu->replay[i];
+		if (rec->dir == LTD_WRITE)
+		{
+			// Only the recorded part of each write can be compared; the rest is just consumed
+			match = true;
+			for (got = 0; got < rec->len && !emu->stopping; got += r)
+			{
+				want = rec->len - got;
+				if (want > sizeof(buf))
+					want = sizeof(buf);
+				r = emu_read(emu, buf, want, BFG_EMU_RX_TIMEOUT_MS);
+				if (got < LOWL_TRACE_DATA_MAX)
+				{
+					cmplen = LOWL_TRACE_DATA_MAX - got;
+					if (cmplen > r)
+						cmplen = r;
+					if (memcmp(buf, &rec->data[got], cmplen))
+						match = false;
+				}
+			}
+			if (!match)
+				applog(LOG_WARNING, "%s: Replay diverged at record %d: driver wrote different data than recorded",
+				       emu->serial, i);
+		}
+		else
+		{
+			if (prev)
+			{
+				delay_us = timer_elapsed_us(&prev->tv, &rec->tv);
+				if (delay_us > BFG_EMU_REPLAY_MAX_DELAY_US)
+					delay_us = BFG_EMU_REPLAY_MAX_DELAY_US;
+				if (delay_us > 0)
+					cgsleep_us(delay_us);
+			}
+			if (rec->len > LOWL_TRACE_DATA_MAX)
+				applog(LOG_WARNING, "%s: Replay record %d was truncated, sending only the first %d of %lu bytes",
+				       emu->serial, i, LOWL_TRACE_DATA_MAX, (unsigned long)rec->len);
+			emu_write(emu, rec->data, (rec->len > LOWL_TRACE_DATA_MAX) ? LOWL_TRACE_DATA_MAX : rec->len);
+		}
+	}
+	
+	applog(LOG_NOTICE, "%s: Replay finished after %d records", emu->serial, emu->replay_count);
+	// Then behave like a device that stopped responding
+	while (!emu->stopping)
+		emu_read(emu, buf, sizeof(buf), BFG_EMU_RX_TIMEOUT_MS);
+}
+
+static const struct bfg_emu_type bfg_emu_types[] = {
+	[BET_ICARUS] = {
+		.name = "icarus",
+		.dname = "icarus",
+		.product = "Icarus" BFG_EMU_PRODUCT_SUFFIX,
+		.run = emu_run_icarus,
+	},
+	[BET_BITFORCE] = {
+		.name = "bitforce",
+		.dname = "bitforce",
+		.product = "BitFORCE SHA256" BFG_EMU_PRODUCT_SUFFIX,
+		.run = emu_run_bitforce,
+		.job_us = BFG_EMU_BITFORCE_JOB_US,
+	},
+	[BET_KLONDIKE] = {
+		.name = "klondike",
+		.dname = "klondike",
+		.product = "K16" BFG_EMU_PRODUCT_SUFFIX,
+		.run = emu_run_klondike,
+		.job_us = BFG_EMU_KLONDIKE_JOB_US,
+	},
+};
+
+static
+void *bfg_emu_thread(void * const userp)
+{
+	struct bfg_emu * const emu = userp;
+	char threadname[0x10];
+	
+	snprintf(threadname, sizeof(threadname), "emu_%s", emu->serial);
+	RenameThread(threadname);
+	emu->run(emu);
+	return NULL;
+}
+
+static
+struct bfg_emu *bfg_emu_create(const struct bfg_emu_type * const type, const int n, struct lowl_trace_rec * const replay, const int replay_count)
+{
+	struct bfg_emu *emu;
+	struct termios tios;
+	int master_fd, slave_fd;
+	const char *path;
+	
+	master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master_fd == -1 || grantpt(master_fd) || unlockpt(master_fd) || !(path = ptsname(master_fd)))
+		goto err;
+	slave_fd = open(path, O_RDWR | O_NOCTTY);
+	if (slave_fd == -1)
+		goto err;
+	if (!tcgetattr(slave_fd, &tios))
+	{
+		cfmakeraw(&tios);
+		tcsetattr(slave_fd, TCSANOW, &tios);
+	}
+	
+	emu = malloc(sizeof(*emu));
+	*emu = (struct bfg_emu){
+		.type = type,
+		.run = replay ? emu_run_replay : type->run,
+		.job_us = type->job_us,
+		.master_fd = master_fd,
+		.slave_fd = slave_fd,
+		.path = strdup(path),
+		.replay = replay,
+		.replay_count = replay_count,
+	};
+	emu->serial = malloc(4 + strlen(type->name) + 7 + 1 + 10 + 1);
+	sprintf(emu->serial, "EMU-%s%s-%d", type->name, replay ? "-replay" : "", n);
+	
+	if (unlikely(pthread_create(&emu->pth, NULL, bfg_emu_thread, emu)))
+		quit(1, "Failed to start device emulator thread");
+	
+	applog(LOG_NOTICE, "%s %s device %s on %s", replay ? "Replaying trace as" : "Emulating", type->name, emu->serial, emu->path);
+	return emu;
+
+err:
+	applog(LOG_ERR, "Failed to create pty for %s emulator: %s", type->name, bfg_strerror(errno, BST_ERRNO));
+	if (master_fd != -1)
+		close(master_fd);
+	return NULL;
+}
+
+// Only for emulators not added to the list scanned for devices
+static
+void bfg_emu_destroy(struct bfg_emu * const emu)
+{
+	emu->stopping = true;
+	pthread_join(emu->pth, NULL);
+	close(emu->slave_fd);
+	close(emu->master_fd);
+	free(emu->path);
+	free(emu->serial);
+	free(emu);
+}
+
+// Option handler: <type>[:<count>] or replay:<type>:<tracefile>
+char *bfg_emu_add(const char *arg)
+{
+	static int emu_count;
+	struct bfg_emu *emu;
+	const struct bfg_emu_type *type = NULL;
+	struct lowl_trace_rec *replay = NULL;
+	int count = 1, replay_count = 0;
+	const bool is_replay = !strncasecmp(arg, "replay:", 7);
+	
+	if (is_replay)
+		arg += 7;
+	
+	const char * const colon = strchr(arg, ':');
+	const size_t namelen = colon ? (size_t)(colon - arg) : strlen(arg);
+	
+	for (size_t i = 0; i < sizeof(bfg_emu_types) / sizeof(*bfg_emu_types); ++i)
+		if (strlen(bfg_emu_types[i].name) == namelen && !strncasecmp(arg, bfg_emu_types[i].name, namelen))
+			type = &bfg_emu_types[i];
+	if (!type)
+		return "Unknown device emulator type (supported: icarus, bitforce, klondike)";
+	if (is_replay)
+	{
+		if (!(colon && colon[1]))
+			return "Replay needs a trace file (replay:<type>:<file>)";
+		replay = lowl_trace_load(&colon[1], &replay_count);
+		if (!replay)
+			return "Failed to load trace for replay";
+	}
+	else
+	if (colon)
+	{
+		count = atoi(&colon[1]);
+		if (count < 1)
+			return "Invalid device emulator count";
+	}
+	
+	for (int i = 0; i < count; ++i)
+	{
+		emu = bfg_emu_create(type, emu_count++, replay, replay_count);
+		if (!emu)
+		{
+			free(replay);
+			return "Failed to create device emulator";
+		}
+		LL_APPEND(emulators, emu);
+	}
+	return NULL;
+}
+
+static
+struct lowlevel_device_info *emu_devinfo_scan()
+{
+	struct lowlevel_device_info *devinfo_list = NULL, *info;
+	struct bfg_emu *emu;
+	
+	LL_FOREACH(emulators, emu)
+	{
+		info = malloc(sizeof(*info));
+		*info = (struct lowlevel_device_info){
+			// Drivers see these as ordinary serial ports
+			.lowl = &lowl_vcom,
+			.path = strdup(emu->path),
+			.devid = devpath_to_devid(emu->path),
+			.manufacturer = strdup("BFGMiner"),
+			.product = strdup(emu->type->product),
+			.serial = strdup(emu->serial),
+			// VCOM devices otherwise never have lowl_data, so this also marks the device as emulated
+			.lowl_data = (void *)emu->type->dname,
+		};
+		if (unlikely(!info->devid))
+		{
+			lowlevel_devinfo_free(info);
+			continue;
+		}
+		LL_PREPEND(devinfo_list, info);
+	}
+	
+	return devinfo_list;
+}
+
+const char *bfg_emu_devinfo_dname(const struct lowlevel_device_info * const info)
+{
+	return (info->lowl == &lowl_vcom) ? info->lowl_data : NULL;
+}
+
+struct lowlevel_driver lowl_emu = {
+	.dname = "emu",
+	.devinfo_scan = emu_devinfo_scan,
+};
+
+// Reads exactly len bytes from the emulated device, or fails after timeout_ms
+static
+bool _test_emu_read(const int fd, void * const buf, const size_t len, const unsigned timeout_ms)
+{
+	struct timeval tv_timeout;
+	size_t got = 0;
+	ssize_t r;
+	
+	timer_set_delay_from_now(&tv_timeout, timeout_ms * 1000);
+	while (got < len && !timer_passed(&tv_timeout, NULL))
+	{
+		r = serial_read(fd, &((uint8_t *)buf)[got], len - got);
+		if (r > 0)
+			got += r;
+	}
+	return got == len;
+}
+
+#ifdef USE_ICARUS
+// Sends one job through the icarus driver's I/O functions and reads back its nonce
+static
+bool _test_emu_icarus_job(const char * const path, const void * const ob, uint8_t * const nonce)
+{
+	struct timeval tv_now, tv_timeout, tv_finish;
+	int fd, rv;
+	
+	fd = serial_open(path, 0, 1, true);
+	if (fd == -1)
+		return false;
+	timer_set_now(&tv_now);
+	timer_set_delay(&tv_timeout, &tv_now, 10000000);
+	rv = icarus_write(path, fd, ob, 64) ? ICA_GETS_ERROR : icarus_read(path, nonce, fd, &tv_finish, NULL, &tv_timeout, &tv_now, 4);
+	serial_close(fd);
+	return (rv == ICA_GETS_OK);
+}
+
+// Records the icarus driver talking to an emulated Icarus, then replays the trace and checks the driver sees the same
+static
+void _test_device_emulator_replay(const void * const ob, const uint8_t * const expect_nonce)
+{
+	const int saved_lowl_trace = opt_lowl_trace;
+	struct bfg_emu *emu;
+	struct lowl_trace *trace;
+	struct lowl_trace_rec *recs;
+	char filename[] = "/tmp/bfgminer-test-trace-XXXXXX";
+	uint8_t nonce[4];
+	int count, start, fd, i;
+	bool traced_read = false;
+	
+	fd = mkstemp(filename);
+	if (fd == -1)
+	{
+		applog(LOG_WARNING, "%s: Cannot create temporary file, skipping", __func__);
+		return;
+	}
+	close(fd);
+	
+	// Record
+	emu = bfg_emu_create(&bfg_emu_types[BET_ICARUS], 0, NULL, 0);
+	if (!emu)
+		goto out;
+	if (!opt_lowl_trace)
+		opt_lowl_trace = 0x10;
+	if (!(_test_emu_icarus_job(emu->path, ob, nonce) && !memcmp(nonce, expect_nonce, sizeof(nonce))))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Recording failed to get the expected nonce", __func__);
+	}
+	opt_lowl_trace = saved_lowl_trace;
+	trace = lowl_trace_find(emu->path);
+	if (!(trace && lowl_trace_save(trace, filename)))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: No trace recorded for %s", __func__, emu->path);
+		bfg_emu_destroy(emu);
+		goto out;
+	}
+	bfg_emu_destroy(emu);
+	
+	recs = lowl_trace_load(filename, &count);
+	if (!recs)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Failed to load saved trace", __func__);
+		goto out;
+	}
+	// The same pty may have been traced before, so only keep this exchange
+	for (start = count; start > 0; )
+		if (recs[--start].dir == LTD_WRITE)
+			break;
+	for (i = start; i < count; ++i)
+		if (recs[i].dir == LTD_READ)
+			traced_read = true;
+	if (!traced_read)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Driver reads were not traced", __func__);
+	}
+	
+	// Replay
+	emu = bfg_emu_create(&bfg_emu_types[BET_ICARUS], 0, &recs[start], count - start);
+	if (emu)
+	{
+		if (!(_test_emu_icarus_job(emu->path, ob, nonce) && !memcmp(nonce, expect_nonce, sizeof(nonce))))
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: Replay did not return the recorded nonce", __func__);
+		}
+		bfg_emu_destroy(emu);
+	}
+	free(recs);
+	
+out:
+	opt_lowl_trace = saved_lowl_trace;
+	unlink(filename);
+}
+#endif
+
+// Sends a BitForce command (or job data) and reads its one line reply
+static
+bool _test_emu_bitforce_cmd(const int fd, const void * const cmd, const size_t cmdlen, char * const reply, const size_t replysz)
+{
+	char eol = '\n';
+	ssize_t r;
+	
+	reply[0] = '\0';
+	if (cmdlen != serial_write(fd, cmd, cmdlen))
+		return false;
+	r = serial_read_line(fd, reply, replysz - 1, eol);
+	reply[(r > 0) ? r : 0] = '\0';
+	return (r > 0);
+}
+
+// Runs the golden job on an emulated BitForce, the way the bitforce driver does without queueing
+static
+void _test_device_emulator_bitforce(const uint8_t * const midstate, const uint8_t * const datatail, const uint32_t expect_nonce)
+{
+	struct bfg_emu *emu;
+	struct timeval tv_timeout;
+	char reply[0x80], expect[0x20];
+	uint8_t ob[60];
+	int fd;
+	
+	emu = bfg_emu_create(&bfg_emu_types[BET_BITFORCE], 0, NULL, 0);
+	if (!emu)
+		return;
+	// Short enough to wait for, but long enough for the CPU to reach the nonce
+	emu->job_us = 1000000;
+	fd = serial_open(emu->path, 0, 1, true);
+	if (fd == -1)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Failed to open emulated device", __func__);
+		goto out;
+	}
+	
+	if (!(_test_emu_bitforce_cmd(fd, "ZGX", 3, reply, sizeof(reply)) && strstr(reply, "BitFORCE SHA256")))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Bad identify reply \"%s\"", __func__, reply);
+		goto out_close;
+	}
+	
+	memcpy(ob, ">>>>>>>>", 8);
+	memcpy(&ob[8], midstate, 32);
+	memcpy(&ob[40], datatail, 12);
+	memcpy(&ob[52], ">>>>>>>>", 8);
+	if (!(_test_emu_bitforce_cmd(fd, "ZDX", 3, reply, sizeof(reply)) && !strcmp(reply, "OK\n")))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Bad reply \"%s\" to job command", __func__, reply);
+		goto out_close;
+	}
+	if (!(_test_emu_bitforce_cmd(fd, ob, sizeof(ob), reply, sizeof(reply)) && !strcmp(reply, "OK\n")))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Bad reply \"%s\" to job data", __func__, reply);
+		goto out_close;
+	}
+	if (!(_test_emu_bitforce_cmd(fd, "ZFX", 3, reply, sizeof(reply)) && !strcmp(reply, "BUSY\n")))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Expected BUSY while job runs, got \"%s\"", __func__, reply);
+	}
+	
+	timer_set_delay_from_now(&tv_timeout, 10000000);
+	do {
+		cgsleep_ms(100);
+		if (!_test_emu_bitforce_cmd(fd, "ZFX", 3, reply, sizeof(reply)))
+			break;
+	} while (!strcmp(reply, "BUSY\n") && !timer_passed(&tv_timeout, NULL));
+	snprintf(expect, sizeof(expect), "NONCE-FOUND:%08lX", (unsigned long)expect_nonce);
+	if (strncmp(reply, expect, strlen(expect)))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Job results \"%s\", expected \"%s\"", __func__, reply, expect);
+	}
+	
+out_close:
+	serial_close(fd);
+out:
+	bfg_emu_destroy(emu);
+}
+
+// Runs the golden job on an emulated Klondike, checking the reply framing and nonce offset the klondike driver relies on
+static
+void _test_device_emulator_klondike(const uint8_t * const midstate, const uint8_t * const datatail, const uint32_t expect_nonce)
+{
+	struct bfg_emu *emu;
+	uint8_t cmd[3 + 32 + 12], reply[BFG_EMU_KLONDIKE_REPLY_SIZE];
+	uint32_t nonce;
+	int fd;
+	
+	emu = bfg_emu_create(&bfg_emu_types[BET_KLONDIKE], 0, NULL, 0);
+	if (!emu)
+		return;
+	// The CPU must reach the nonce before the job is considered done
+	emu->job_us = 10000000;
+	fd = serial_open(emu->path, 0, 1, true);
+	if (fd == -1)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Failed to open emulated device", __func__);
+		goto out;
+	}
+	
+	if (!(2 == serial_write(fd, "I\0", 2) && _test_emu_read(fd, reply, sizeof(reply), 1000) && reply[0] == 'I' && !memcmp(&reply[3], "K16", 3)))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Bad identify reply", __func__);
+		goto out_close;
+	}
+	if (!(3 == serial_write(fd, "E\0" "1", 3) && _test_emu_read(fd, reply, sizeof(reply), 1000) && reply[0] == 'E' && reply[2]))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Bad enable reply", __func__);
+		goto out_close;
+	}
+	
+	cmd[0] = 'W';
+	cmd[1] = 0;
+	cmd[2] = 0x42;
+	memcpy(&cmd[3], midstate, 32);
+	memcpy(&cmd[3 + 32], datatail, 12);
+	if (!(sizeof(cmd) == serial_write(fd, cmd, sizeof(cmd)) && _test_emu_read(fd, reply, sizeof(reply), 1000) && reply[0] == 'W'))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Bad work reply", __func__);
+		goto out_close;
+	}
+	if (!(_test_emu_read(fd, reply, sizeof(reply), 10000) && reply[0] == '=' && reply[2] == 0x42))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: No nonce reply for work", __func__);
+		goto out_close;
+	}
+	memcpy(&nonce, &reply[3], sizeof(nonce));
+	nonce = le32toh(nonce) - BFG_EMU_KLONDIKE_NONCE_OFFSET;
+	if (nonce != expect_nonce)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Nonce %08lx reported, expected %08lx",
+		       __func__, (unsigned long)nonce, (unsigned long)expect_nonce);
+	}
+	
+out_close:
+	serial_close(fd);
+out:
+	bfg_emu_destroy(emu);
+}
+
+#define TEST_EMU_BENCH_HASHES  0x200000
+#define TEST_EMU_BENCH_RESTARTS  20
+
+// Measures how fast emulators hash, and how quickly an emulated Icarus gets through new work replacing old
+static
+void _test_device_emulator_bench(const uint8_t * const golden_ob, const uint8_t * const midstate, const uint8_t * const datatail)
+{
+	struct bfg_emu_job job;
+	struct bfg_emu *emu;
+	struct timeval tv_start;
+	uint8_t ob[64], nonce[4];
+	uint32_t found;
+	double elapsed;
+	int fd, i;
+	
+	emu_job_set(&job, midstate, datatail);
+	timer_set_now(&tv_start);
+	while (job.nonce < TEST_EMU_BENCH_HASHES)
+		emu_job_scan(&job, BFG_EMU_SCAN_BATCH, &found);
+	elapsed = timer_elapsed_us(&tv_start, NULL) / 1e6;
+	applog(LOG_NOTICE, "%s: Emulators hash at %.2f MH/s", __func__, job.nonce / elapsed / 1e6);
+	
+	emu = bfg_emu_create(&bfg_emu_types[BET_ICARUS], 0, NULL, 0);
+	if (!emu)
+		return;
+	fd = serial_open(emu->path, 0, 1, true);
+	if (fd == -1)
+		goto out;
+	memcpy(ob, golden_ob, sizeof(ob));
+	timer_set_now(&tv_start);
+	for (i = 0; i < TEST_EMU_BENCH_RESTARTS; ++i)
+	{
+		// Each golden job interrupts one that has no early nonce
+		ob[0x3f] ^= 0xff;
+		if (sizeof(ob) != write(fd, ob, sizeof(ob)))
+			break;
+		ob[0x3f] ^= 0xff;
+		if (sizeof(ob) != write(fd, ob, sizeof(ob)) || !_test_emu_read(fd, nonce, sizeof(nonce), 10000))
+			break;
+	}
+	elapsed = timer_elapsed_us(&tv_start, NULL) / 1e6;
+	if (i < TEST_EMU_BENCH_RESTARTS)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Restart %d got no nonce", __func__, i);
+	}
+	else
+		applog(LOG_NOTICE, "%s: %d Icarus restarts in %.3f s: %.1f jobs/s, %.1f ms each to the golden nonce",
+		       __func__, i, elapsed, i * 2 / elapsed, elapsed * 1e3 / i);
+	serial_close(fd);
+out:
+	bfg_emu_destroy(emu);
+}
+
+// Detects and mines on emulated devices the way their drivers do
+void test_device_emulator(void)
+{
+	// Block 171874, the icarus driver's detection job; real Icarus hardware returns nonce 0x000187a2
+	static const char * const golden_ob =
+		"4679ba4ec99876bf4bfe086082b40025"
+		"4df6c356451471139a3afa71e48f544a"
+		"00000000000000000000000000000000"
+		"0000000087320b1a1426674f2fa722ce";
+	static const uint8_t golden_nonce[4] = { 0x00, 0x01, 0x87, 0xa2 };
+	static const uint32_t golden_nonce_n = 0x000187a2;
+	struct bfg_emu *emu;
+	struct timeval tv_start;
+	uint8_t ob[64], nonce[4], midstate[32], datatail[12];
+	int fd;
+	
+	emu = bfg_emu_create(&bfg_emu_types[BET_ICARUS], 0, NULL, 0);
+	if (!emu)
+	{
+		applog(LOG_WARNING, "%s: Cannot create pty, skipping", __func__);
+		return;
+	}
+	fd = serial_open(emu->path, 0, 1, true);
+	if (fd == -1)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Failed to open emulated device", __func__);
+		goto out;
+	}
+	hex2bin(ob, golden_ob, sizeof(ob));
+	
+	// Detection: the golden nonce must come back exactly
+	timer_set_now(&tv_start);
+	if (sizeof(ob) != write(fd, ob, sizeof(ob)) || !_test_emu_read(fd, nonce, sizeof(nonce), 10000))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: No nonce returned for detection job", __func__);
+	}
+	else
+	if (memcmp(nonce, golden_nonce, sizeof(nonce)))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Detection job returned nonce %02x%02x%02x%02x, expected 000187a2",
+		       __func__, nonce[0], nonce[1], nonce[2], nonce[3]);
+	}
+	else
+		applog(LOG_DEBUG, "%s: Found golden nonce in %ld us", __func__, (long)timer_elapsed_us(&tv_start, NULL));
+	
+	// Mining: new work replaces the job in progress, so only the second job's nonce may be returned
+	// (with this data tail changed, the first job has no nonce in its first few million)
+	ob[0x3f] ^= 0xff;
+	if (sizeof(ob) != write(fd, ob, sizeof(ob)))
+		++unittest_failures;
+	cgsleep_ms(10);
+	ob[0x3f] ^= 0xff;
+	if (sizeof(ob) != write(fd, ob, sizeof(ob)) || !_test_emu_read(fd, nonce, sizeof(nonce), 10000))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: No nonce returned after replacing work", __func__);
+	}
+	else
+	if (memcmp(nonce, golden_nonce, sizeof(nonce)))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Replaced work returned nonce %02x%02x%02x%02x, expected 000187a2",
+		       __func__, nonce[0], nonce[1], nonce[2], nonce[3]);
+	}
+	// Icarus stops after a nonce, so nothing more may follow
+	else
+	if (_test_emu_read(fd, nonce, 1, 200))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Unexpected data after nonce", __func__);
+	}
+	
+	serial_close(fd);
+out:
+	bfg_emu_destroy(emu);
+	
+	hex2bin(ob, golden_ob, sizeof(ob));
+	// Drivers other than icarus get the job as work->midstate and the data tail
+	swab256(midstate, ob);
+	bswap_96p(datatail, &ob[0x34]);
+	_test_device_emulator_bitforce(midstate, datatail, golden_nonce_n);
+	_test_device_emulator_klondike(midstate, datatail, golden_nonce_n);
+	
+#ifdef USE_ICARUS
+	_test_device_emulator_replay(ob, golden_nonce);
+#endif
+	
+	if (opt_unittest_bench)
+		_test_device_emulator_bench(ob, midstate, datatail);
+}
@@ -0,0 +1,19 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef BFG_LOWL_EMU_H
+#define BFG_LOWL_EMU_H
+
+#include "lowlevel.h"
+
+extern char *bfg_emu_add(const char *arg);
+// Returns the dname of the driver an emulated device is for, or NULL if info is not emulated
+extern const char *bfg_emu_devinfo_dname(const struct lowlevel_device_info *);
+
+extern struct lowlevel_driver lowl_emu;
+
+#endif
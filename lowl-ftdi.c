@@ -105,6 +105,7 @@ struct ft232r_device_handle {
 	unsigned char *obuf;
 	uint16_t obufsz;
 	bool mpsse;
+	struct lowl_trace *trace;
 };
 
 static
@@ -148,6 +149,7 @@ struct ft232r_device_handle *ftdi_common_open(const struct lowlevel_device_info
 	ftdi->o = altcfg->endpoint[1].bEndpointAddress;
 	ftdi->osz = 0x1000;
 	ftdi->obuf = malloc(ftdi->osz);
+	ftdi->trace = lowl_trace_get(info->devid);
 	libusb_free_config_descriptor(cfg);
 
 	return ftdi;
@@ -312,6 +314,7 @@ ssize_t ft232r_flush(struct ft232r_device_handle *dev)
 	if (!dev->obufsz)
 		return 0;
 	ssize_t r = ft232r_readwrite(dev, dev->o, dev->obuf, dev->obufsz);
+	lowl_trace_record(dev->trace, LTD_WRITE, dev->obuf, r);
 	if (r == dev->obufsz) {
 		dev->obufsz = 0;
 	} else if (r > 0) {
@@ -419,6 +422,7 @@ ssize_t ft232r_read(struct ft232r_device_handle *dev, void *data, size_t count)
 	if (count > ibufsLen)
 		count = ibufsLen;
 	memcpy(data, ibufs, count);
+	lowl_trace_record(dev->trace, LTD_READ, data, count);
 	dev->ibufLen -= count;
 	ibufsLen -= count;
 	if (ibufsLen) {
@@ -222,6 +222,80 @@ struct lowlevel_device_info *hid_devinfo_scan()
 	return devinfo_list;
 }
 
+// Maps open handles to their lowlevel trace, when tracing is enabled
+struct hid_trace {
+	hid_device *dev;
+	struct lowl_trace *trace;
+	UT_hash_handle hh;
+};
+
+static struct hid_trace *hid_traces;
+static pthread_mutex_t hid_traces_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+struct lowl_trace *hid_trace_find(hid_device * const dev)
+{
+	struct hid_trace *ht;
+	
+	if (likely(!hid_traces))
+		return NULL;
+	
+	mutex_lock(&hid_traces_mutex);
+	HASH_FIND(hh, hid_traces, &dev, sizeof(dev), ht);
+	mutex_unlock(&hid_traces_mutex);
+	
+	return ht ? ht->trace : NULL;
+}
+
+hid_device *lowl_hid_open_path(const char * const path)
+{
+	hid_device * const dev = dlsym_hid_open_path(path);
+	struct hid_trace *ht;
+	
+	if (dev && opt_lowl_trace)
+	{
+		ht = malloc(sizeof(*ht));
+		ht->dev = dev;
+		ht->trace = lowl_trace_get(path);
+		mutex_lock(&hid_traces_mutex);
+		HASH_ADD(hh, hid_traces, dev, sizeof(ht->dev), ht);
+		mutex_unlock(&hid_traces_mutex);
+	}
+	return dev;
+}
+
+void lowl_hid_close(hid_device * const dev)
+{
+	struct hid_trace *ht = NULL;
+	
+	if (hid_traces)
+	{
+		mutex_lock(&hid_traces_mutex);
+		HASH_FIND(hh, hid_traces, &dev, sizeof(dev), ht);
+		if (ht)
+			HASH_DEL(hid_traces, ht);
+		mutex_unlock(&hid_traces_mutex);
+		free(ht);
+	}
+	dlsym_hid_close(dev);
+}
+
+int lowl_hid_read(hid_device * const dev, unsigned char * const data, const size_t len)
+{
+	const int r = dlsym_hid_read(dev, data, len);
+	
+	lowl_trace_record(hid_trace_find(dev), LTD_READ, data, r);
+	return r;
+}
+
+int lowl_hid_write(hid_device * const dev, const unsigned char * const data, const size_t len)
+{
+	const int r = dlsym_hid_write(dev, data, len);
+	
+	lowl_trace_record(hid_trace_find(dev), LTD_WRITE, data, r);
+	return r;
+}
+
 struct lowlevel_driver lowl_hid = {
 	.dname = "hid",
 	.devinfo_scan = hid_devinfo_scan,
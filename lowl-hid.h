@@ -17,9 +17,15 @@ extern int HID_API_EXPORT (*dlsym_hid_write)(hid_device *, const unsigned char *
 
 #define hid_enumerate dlsym_hid_enumerate
 #define hid_free_enumeration dlsym_hid_free_enumeration
-#define hid_open_path dlsym_hid_open_path
-#define hid_close dlsym_hid_close
-#define hid_read dlsym_hid_read
-#define hid_write dlsym_hid_write
+// These wrap the library calls for lowlevel tracing
+extern hid_device *lowl_hid_open_path(const char *);
+extern void lowl_hid_close(hid_device *);
+extern int lowl_hid_read(hid_device *, unsigned char *, size_t);
+extern int lowl_hid_write(hid_device *, const unsigned char *, size_t);
+
+#define hid_open_path lowl_hid_open_path
+#define hid_close lowl_hid_close
+#define hid_read lowl_hid_read
+#define hid_write lowl_hid_write
 
 #endif
@@ -0,0 +1,537 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Shared I/O reactor
+ *
+ * Instead of one mining thread per device (mostly asleep waiting on its
+ * serial port), devices whose driver has non-blocking minerloop_async hooks
+ * can be run from a single thread. It owns one epoll set with every adopted
+ * device's notifiers and data fds, and runs minerloop_async_step for a device
+ * only when one of its fds is readable or one of its timers has expired.
+ *
+ * Driver thread_init and get_work may block (the latter whenever the work
+ * queue underruns), so they are run on a separate helper thread instead; the
+ * reactor is woken through the device's notifier once they are done.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include <utlist.h>
+
+#include "deviceapi.h"
+#include "logging.h"
+#include "lowl-reactor.h"
+#include "miner.h"
+#include "util.h"
+
+bool opt_io_reactor;
+
+#ifdef HAVE_SYS_EPOLL_H
+
+enum bfg_reactor_watch_type {
+	BRW_NOTIFIER,
+	BRW_WORK_RESTART,
+	BRW_MUTEX_REQUEST,
+	BRW_DEVICE,
+	BRW_COUNT,
+};
+
+struct bfg_reactor_dev;
+
+enum bfg_reactor_job_type {
+	BRJ_INIT,
+	BRJ_FETCH,
+};
+
+// Something the helper thread has to do for a device, since it may block
+struct bfg_reactor_job {
+	struct bfg_reactor_dev *rdev;
+	enum bfg_reactor_job_type type;
+	
+	struct bfg_reactor_job *prev;
+	struct bfg_reactor_job *next;
+};
+
+struct bfg_reactor_watch {
+	struct bfg_reactor_dev *rdev;
+	enum bfg_reactor_watch_type type;
+	int fd;
+};
+
+struct bfg_reactor_dev {
+	struct thr_info *thr;
+	struct bfg_reactor_watch watches[BRW_COUNT];
+	
+	// Next time minerloop_async_step needs to run regardless of events
+	struct timeval tv_next;
+	bool need_step;
+	
+	// Protected by reactor_mutex
+	struct bfg_reactor_job job;
+	bool job_queued;
+	bool fetch_done;
+	struct work *fetched;
+	// Set if the device was released while the helper thread was using it
+	bool released;
+	
+	struct bfg_reactor_dev *prev;
+	struct bfg_reactor_dev *next;
+};
+
+static pthread_mutex_t reactor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool reactor_started, reactor_failed;
+static pthread_t reactor_pth, reactor_helper_pth;
+static pthread_cond_t reactor_helper_cond = PTHREAD_COND_INITIALIZER;
+static int reactor_epollfd = -1;
+static notifier_t reactor_notifier;
+// Protected by reactor_mutex
+static struct bfg_reactor_dev *reactor_adopting;
+static struct bfg_reactor_job *reactor_jobs;
+// Only used by the reactor thread
+static struct bfg_reactor_dev *reactor_devs;
+static unsigned reactor_dev_count;
+
+static
+bool reactor_watch(struct bfg_reactor_dev * const rdev, const enum bfg_reactor_watch_type type, const int fd, const uint32_t events)
+{
+	struct bfg_reactor_watch * const watch = &rdev->watches[type];
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = watch,
+	};
+	
+	watch->rdev = rdev;
+	watch->type = type;
+	if (-1 == epoll_ctl(reactor_epollfd, EPOLL_CTL_ADD, fd, &ev))
+	{
+		applog(LOG_WARNING, "%"PRIpreprv": Reactor failed to watch fd %d",
+		       rdev->thr->cgpu->proc_repr, fd);
+		watch->fd = -1;
+		return false;
+	}
+	watch->fd = fd;
+	return true;
+}
+
+static
+void reactor_unwatch(struct bfg_reactor_watch * const watch)
+{
+	if (watch->fd == -1)
+		return;
+	epoll_ctl(reactor_epollfd, EPOLL_CTL_DEL, watch->fd, NULL);
+	watch->fd = -1;
+}
+
+static
+void reactor_release(struct bfg_reactor_dev * const rdev)
+{
+	struct thr_info * const thr = rdev->thr;
+	
+	for (int i = 0; i < BRW_COUNT; ++i)
+		reactor_unwatch(&rdev->watches[i]);
+	DL_DELETE(reactor_devs, rdev);
+	--reactor_dev_count;
+	
+	__thr_being_msg(LOG_NOTICE, thr, "shutting down");
+	miner_thread_shutdown(thr);
+	thr->reactor = NULL;
+	
+	mutex_lock(&reactor_mutex);
+	if (rdev->job_queued)
+	{
+		// The helper thread frees it once its get_work returns
+		rdev->released = true;
+		mutex_unlock(&reactor_mutex);
+		return;
+	}
+	mutex_unlock(&reactor_mutex);
+	if (rdev->fetched)
+		free_work(rdev->fetched);
+	free(rdev);
+}
+
+// Must be called with reactor_mutex held
+static
+void __reactor_queue_job(struct bfg_reactor_dev * const rdev, const enum bfg_reactor_job_type type)
+{
+	rdev->job.rdev = rdev;
+	rdev->job.type = type;
+	rdev->job_queued = true;
+	DL_APPEND(reactor_jobs, &rdev->job);
+	pthread_cond_signal(&reactor_helper_cond);
+}
+
+static
+void reactor_helper_init(struct bfg_reactor_dev * const rdev)
+{
+	struct thr_info * const thr = rdev->thr;
+	
+	// NOTE: thread_init may call bfg_reactor_watch_fd
+	if (!miner_thread_init(thr))
+	{
+		reactor_unwatch(&rdev->watches[BRW_DEVICE]);
+		miner_thread_shutdown(thr);
+		thr->reactor = NULL;
+		free(rdev);
+		return;
+	}
+	
+	mutex_lock(&reactor_mutex);
+	rdev->job_queued = false;
+	DL_APPEND(reactor_adopting, rdev);
+	mutex_unlock(&reactor_mutex);
+	notifier_wake(reactor_notifier);
+}
+
+static
+void reactor_helper_fetch(struct bfg_reactor_dev * const rdev)
+{
+	struct thr_info * const thr = rdev->thr;
+	struct work * const work = get_and_prepare_work(thr);
+	
+	mutex_lock(&reactor_mutex);
+	rdev->job_queued = false;
+	if (unlikely(rdev->released))
+	{
+		mutex_unlock(&reactor_mutex);
+		if (work)
+			free_work(work);
+		free(rdev);
+		return;
+	}
+	rdev->fetched = work;
+	rdev->fetch_done = true;
+	mutex_unlock(&reactor_mutex);
+	notifier_wake(thr->notifier);
+}
+
+static
+void *reactor_helper_thread(__maybe_unused void * const userp)
+{
+	struct bfg_reactor_job *job;
+	
+	RenameThread("io_reactor_hlp");
+	
+	while (true)
+	{
+		mutex_lock(&reactor_mutex);
+		while (!reactor_jobs)
+			pthread_cond_wait(&reactor_helper_cond, &reactor_mutex);
+		job = reactor_jobs;
+		DL_DELETE(reactor_jobs, job);
+		mutex_unlock(&reactor_mutex);
+		
+		switch (job->type)
+		{
+			case BRJ_INIT:
+				reactor_helper_init(job->rdev);
+				break;
+			case BRJ_FETCH:
+				reactor_helper_fetch(job->rdev);
+				break;
+		}
+	}
+	
+	return NULL;
+}
+
+// Called from the reactor when a device's notifier is woken
+static
+void reactor_check_fetched(struct bfg_reactor_dev * const rdev)
+{
+	struct thr_info * const thr = rdev->thr;
+	bool done;
+	
+	mutex_lock(&reactor_mutex);
+	done = rdev->fetch_done;
+	mutex_unlock(&reactor_mutex);
+	
+	// Get do_job_prepare called again, to take the work
+	if (done)
+		timer_set_now(&thr->tv_morework);
+}
+
+static
+void reactor_take_adoptions(void)
+{
+	struct bfg_reactor_dev *list, *rdev, *tmp;
+	
+	mutex_lock(&reactor_mutex);
+	list = reactor_adopting;
+	reactor_adopting = NULL;
+	mutex_unlock(&reactor_mutex);
+	
+	DL_FOREACH_SAFE(list, rdev, tmp)
+	{
+		struct thr_info * const thr = rdev->thr;
+		struct cgpu_info * const cgpu = thr->cgpu;
+		
+		DL_DELETE(list, rdev);
+		
+		cgtime(&cgpu->cgminer_stats.start_tv);
+		minerloop_setup(thr);
+		
+		reactor_watch(rdev, BRW_NOTIFIER, thr->notifier[0], EPOLLIN);
+		reactor_watch(rdev, BRW_WORK_RESTART, thr->work_restart_notifier[0], EPOLLIN);
+		if (thr->mutex_request[1] != INVSOCK)
+			reactor_watch(rdev, BRW_MUTEX_REQUEST, thr->mutex_request[0], EPOLLIN);
+		
+		timer_unset(&rdev->tv_next);
+		rdev->need_step = true;
+		DL_APPEND(reactor_devs, rdev);
+		++reactor_dev_count;
+		
+		applog(LOG_DEBUG, "%s: Running from shared I/O reactor (%u devices)",
+		       cgpu->dev_repr, reactor_dev_count);
+	}
+}
+
+static
+void reactor_handle_event(struct bfg_reactor_watch * const watch)
+{
+	struct bfg_reactor_dev * const rdev = watch->rdev;
+	struct thr_info * const thr = rdev->thr;
+	
+	switch (watch->type)
+	{
+		case BRW_NOTIFIER:
+			notifier_read(thr->notifier);
+			reactor_check_fetched(rdev);
+			break;
+		case BRW_WORK_RESTART:
+			notifier_read(thr->work_restart_notifier);
+			break;
+		case BRW_MUTEX_REQUEST:
+			cgpu_grant_control_request(thr);
+			break;
+		case BRW_DEVICE:
+			// Edge-triggered: the driver's poll is expected to consume what it can
+			timerclear(&thr->tv_poll);
+			break;
+		case BRW_COUNT:
+			break;
+	}
+	rdev->need_step = true;
+}
+
+static
+void *reactor_thread(__maybe_unused void * const userp)
+{
+	struct epoll_event evr[0x40];
+	struct bfg_reactor_dev *rdev, *tmp;
+	struct timeval tv_now, tv_timeout;
+	long timeout_ms;
+	int n;
+	
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	RenameThread("io_reactor");
+	
+	while (true)
+	{
+		reactor_take_adoptions();
+		
+		tv_timeout.tv_sec = -1;
+		timer_set_now(&tv_now);
+		DL_FOREACH_SAFE(reactor_devs, rdev, tmp)
+		{
+			struct cgpu_info * const cgpu = rdev->thr->cgpu;
+			
+			if (unlikely(cgpu->shutdown))
+			{
+				reactor_release(rdev);
+				continue;
+			}
+			
+			if (rdev->need_step || timer_passed(&rdev->tv_next, &tv_now))
+			{
+				rdev->need_step = false;
+				timer_unset(&rdev->tv_next);
+				minerloop_async_step(cgpu, &tv_now, &rdev->tv_next);
+			}
+			reduce_timeout_to(&tv_timeout, &rdev->tv_next);
+		}
+		
+		if (timer_isset(&tv_timeout))
+		{
+			timer_set_now(&tv_now);
+			timeout_ms = (timer_remaining_us(&tv_timeout, &tv_now) + 999) / 1000;
+			if (timeout_ms < 0)
+				timeout_ms = 0;
+		}
+		else
+			timeout_ms = -1;
+		
+		n = epoll_wait(reactor_epollfd, evr, sizeof(evr) / sizeof(*evr), timeout_ms);
+		if (unlikely(n < 0))
+		{
+			if (errno != EINTR)
+				applog(LOG_ERR, "I/O reactor: epoll_wait failed: %s", bfg_strerror(errno, BST_ERRNO));
+			continue;
+		}
+		for (int i = 0; i < n; ++i)
+		{
+			if (!evr[i].data.ptr)
+			{
+				notifier_read(reactor_notifier);
+				continue;
+			}
+			reactor_handle_event(evr[i].data.ptr);
+		}
+	}
+	
+	return NULL;
+}
+
+static
+bool reactor_start(void)
+{
+	bool rv;
+	
+	mutex_lock(&reactor_mutex);
+	if (reactor_started || reactor_failed)
+		goto out;
+	
+	reactor_epollfd = epoll_create(0x40);
+	if (reactor_epollfd == -1)
+	{
+		applog(LOG_WARNING, "I/O reactor: Failed to create epoll set, using a thread per device");
+		reactor_failed = true;
+		goto out;
+	}
+	
+	notifier_init(reactor_notifier);
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	if (-1 == epoll_ctl(reactor_epollfd, EPOLL_CTL_ADD, reactor_notifier[0], &ev)
+	 || pthread_create(&reactor_helper_pth, NULL, reactor_helper_thread, NULL)
+	 || pthread_create(&reactor_pth, NULL, reactor_thread, NULL))
+	{
+		applog(LOG_WARNING, "I/O reactor: Failed to start, using a thread per device");
+		close(reactor_epollfd);
+		notifier_destroy(reactor_notifier);
+		reactor_epollfd = -1;
+		reactor_failed = true;
+		goto out;
+	}
+	pthread_detach(reactor_helper_pth);
+	pthread_detach(reactor_pth);
+	reactor_started = true;
+	
+out:
+	rv = reactor_started;
+	mutex_unlock(&reactor_mutex);
+	return rv;
+}
+
+bool bfg_reactor_adopt(struct thr_info * const thr)
+{
+	struct bfg_reactor_dev *rdev;
+	
+	if (!reactor_start())
+		return false;
+	
+	rdev = malloc(sizeof(*rdev));
+	*rdev = (struct bfg_reactor_dev){
+		.thr = thr,
+	};
+	for (int i = 0; i < BRW_COUNT; ++i)
+		rdev->watches[i].fd = -1;
+	
+	// Anything comparing against the device thread (eg, cgpu_request_control) should see the reactor
+	thr->pth = reactor_pth;
+	thr->reactor = rdev;
+	
+	mutex_lock(&reactor_mutex);
+	__reactor_queue_job(rdev, BRJ_INIT);
+	mutex_unlock(&reactor_mutex);
+	
+	return true;
+}
+
+bool bfg_reactor_get_work(struct thr_info * const thr, struct work ** const out_work)
+{
+	struct bfg_reactor_dev * const rdev = thr->reactor;
+	
+	mutex_lock(&reactor_mutex);
+	if (rdev->fetch_done)
+	{
+		*out_work = rdev->fetched;
+		rdev->fetched = NULL;
+		rdev->fetch_done = false;
+		mutex_unlock(&reactor_mutex);
+		return true;
+	}
+	if (rdev->job_queued)
+	{
+		mutex_unlock(&reactor_mutex);
+		return false;
+	}
+	mutex_unlock(&reactor_mutex);
+	
+	request_work(thr);
+	mutex_lock(&reactor_mutex);
+	__reactor_queue_job(rdev, BRJ_FETCH);
+	mutex_unlock(&reactor_mutex);
+	return false;
+}
+
+bool bfg_reactor_watch_fd(struct thr_info * const thr, const int fd)
+{
+	struct bfg_reactor_dev * const rdev = thr->reactor;
+	
+	if (!rdev)
+		return false;
+	reactor_unwatch(&rdev->watches[BRW_DEVICE]);
+	return reactor_watch(rdev, BRW_DEVICE, fd, EPOLLIN | EPOLLET);
+}
+
+void bfg_reactor_unwatch_fd(struct thr_info * const thr)
+{
+	struct bfg_reactor_dev * const rdev = thr->reactor;
+	
+	if (!rdev)
+		return;
+	reactor_unwatch(&rdev->watches[BRW_DEVICE]);
+}
+
+#else  /* !HAVE_SYS_EPOLL_H */
+
+bool bfg_reactor_adopt(__maybe_unused struct thr_info * const thr)
+{
+	return false;
+}
+
+bool bfg_reactor_watch_fd(__maybe_unused struct thr_info * const thr, __maybe_unused const int fd)
+{
+	return false;
+}
+
+void bfg_reactor_unwatch_fd(__maybe_unused struct thr_info * const thr)
+{
+}
+
+bool bfg_reactor_get_work(__maybe_unused struct thr_info * const thr, __maybe_unused struct work ** const out_work)
+{
+	return false;
+}
+
+#endif
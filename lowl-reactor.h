@@ -0,0 +1,36 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef BFG_LOWL_REACTOR_H
+#define BFG_LOWL_REACTOR_H
+
+#include <stdbool.h>
+
+#include "miner.h"
+
+extern bool opt_io_reactor;
+
+// Hands a (not yet started) device thread over to the shared I/O reactor
+// Returns false if the reactor is unavailable; the caller should then start a thread as usual
+extern bool bfg_reactor_adopt(struct thr_info *);
+
+// Watch a device fd from the reactor: when it becomes readable, the thread's poll hook is run
+// Must be removed with bfg_reactor_unwatch_fd *before* the fd is closed
+extern bool bfg_reactor_watch_fd(struct thr_info *, int fd);
+extern void bfg_reactor_unwatch_fd(struct thr_info *);
+
+// Takes work fetched for a reactor-owned device thread by the reactor's helper thread
+// Returns false (after asking for work if needed) until it has arrived; the device is stepped again then
+extern bool bfg_reactor_get_work(struct thr_info *, struct work **out_work);
+
+static inline
+bool bfg_reactor_owns(const struct thr_info * const thr)
+{
+	return thr->reactor;
+}
+
+#endif
@@ -49,6 +49,7 @@
 #endif
 
 #include "logging.h"
+#include "lowlevel.h"
 #include "lowl-spi.h"
 #include "miner.h"
 #include "util.h"
@@ -81,6 +82,7 @@ void spi_init(void)
 	sys_spi = malloc(sizeof(*sys_spi));
 	*sys_spi = (struct spi_port){
 		.txrx = sys_spi_txrx,
+		.txrx_segments = sys_spi_txrx_segments,
 	};
 #endif
 }
@@ -171,16 +173,54 @@ int spi_reset(int a)
 	return false;  \
 }while(0)
 
-bool sys_spi_txrx(struct spi_port *port)
+// spidev copies each SPI_IOC_MESSAGE through a buffer of this size (its "bufsiz" parameter)
+#define LINUX_SPI_MESSAGE_MAXSZ  4096
+#define LINUX_SPI_MESSAGE_MAXXFERS  0x40
+
+// Sends segments with as few ioctls as spidev allows
+// The delay is applied once after each message, as it was for each 4 KiB chunk of a single buffer
+static
+bool linux_spi_submit(const int fd, const struct spi_segment * const segs, const int count, const uint32_t speed, const uint16_t delay, const uint8_t bits)
 {
-	const void *wrbuf = spi_gettxbuf(port);
-	void *rdbuf = spi_getrxbuf(port);
-	size_t bufsz = spi_getbufsz(port);
-	int fd;
-	int mode, bits, speed, rv, i, j;
-	struct spi_ioc_transfer tr[16];
+	struct spi_ioc_transfer xf[LINUX_SPI_MESSAGE_MAXXFERS];
+	int n = 0, i;
+	size_t msgsz = 0, off, len;
+	
+	for (i = 0; i < count; ++i)
+		for (off = 0; off < segs[i].len; off += len)
+		{
+			len = segs[i].len - off;
+			if (len > LINUX_SPI_MESSAGE_MAXSZ)
+				len = LINUX_SPI_MESSAGE_MAXSZ;
+			if (n == LINUX_SPI_MESSAGE_MAXXFERS || msgsz + len > LINUX_SPI_MESSAGE_MAXSZ)
+			{
+				xf[n - 1].delay_usecs = delay;
+				if (ioctl(fd, SPI_IOC_MESSAGE(n), xf) < 0)
+					return false;
+				n = 0;
+				msgsz = 0;
+			}
+			xf[n++] = (struct spi_ioc_transfer){
+				.tx_buf = (uintptr_t)&((const uint8_t *)segs[i].tx)[off],
+				.rx_buf = segs[i].rx ? (uintptr_t)&((uint8_t *)segs[i].rx)[off] : 0,
+				.len = len,
+				.speed_hz = speed,
+				.bits_per_word = bits,
+			};
+			msgsz += len;
+		}
+	if (!n)
+		return true;
+	xf[n - 1].delay_usecs = delay;
+	return (ioctl(fd, SPI_IOC_MESSAGE(n), xf) >= 0);
+}
 
-	memset(&tr,0,sizeof(tr));
+static
+bool _sys_spi_txrx(struct spi_port * const port, const struct spi_segment * const segs, const int count)
+{
+	int fd;
+	int mode, bits, speed;
+	
 	mode = 0; bits = 8; speed = 4000000;
 	if (port->speed)
 		speed = port->speed;
@@ -204,33 +244,8 @@ bool sys_spi_txrx(struct spi_port *port)
 	if (ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) < 0)
 		BAILOUT("Unable to set RD_MAX_SPEED_HZ");
 
-	rv = 0;
-	while (bufsz >= 4096) {
-                tr[rv].tx_buf = (uintptr_t) wrbuf;
-                tr[rv].rx_buf = (uintptr_t) rdbuf;
-                tr[rv].len = 4096;
-                tr[rv].delay_usecs = 1;
-                tr[rv].speed_hz = speed;
-                tr[rv].bits_per_word = bits;
-                bufsz -= 4096;
-                wrbuf += 4096; rdbuf += 4096; rv ++;
-        }
-        if (bufsz > 0) {
-                tr[rv].tx_buf = (uintptr_t) wrbuf;
-                tr[rv].rx_buf = (uintptr_t) rdbuf;
-                tr[rv].len = (unsigned)bufsz;
-                tr[rv].delay_usecs = 1;
-                tr[rv].speed_hz = speed;
-                tr[rv].bits_per_word = bits;
-                rv ++;
-        }
-
-        i = rv;
-        for (j = 0; j < i; j++) {
-                rv = (int)ioctl(fd, SPI_IOC_MESSAGE(1), (intptr_t)&tr[j]);
-		if (rv < 0)
-			BAILOUT("WTF!");
-        }
+	if (!linux_spi_submit(fd, segs, count, speed, 1, bits))
+		BAILOUT("WTF!");
 
 	close(fd);
 	spi_reset(4321);
@@ -238,6 +253,21 @@ bool sys_spi_txrx(struct spi_port *port)
 	return true;
 }
 
+bool sys_spi_txrx(struct spi_port *port)
+{
+	const struct spi_segment seg = {
+		.tx = spi_gettxbuf(port),
+		.rx = spi_getrxbuf(port),
+		.len = spi_getbufsz(port),
+	};
+	return _sys_spi_txrx(port, &seg, 1);
+}
+
+bool sys_spi_txrx_segments(struct spi_port * const port)
+{
+	return _sys_spi_txrx(port, port->segments, port->segments_count);
+}
+
 bool linux_spi_txrx(struct spi_port * const spi)
 {
 	const void * const wrbuf = spi_gettxbuf(spi);
@@ -282,8 +312,125 @@ bool linux_spi_txrx2(struct spi_port * const spi)
 	return rv;
 }
 
+bool linux_spi_txrx_segments(struct spi_port * const spi)
+{
+	return linux_spi_submit(spi->fd, spi->segments, spi->segments_count, spi->speed, spi->delay, spi->bits);
+}
+
 #endif
 
+void spi_stat_count(struct spi_port * const port, const size_t bytes)
+{
+	if (unlikely(!timer_isset(&port->tv_stat_start)))
+		timer_set_now(&port->tv_stat_start);
+	++port->stat_transactions;
+	port->stat_bytes += bytes;
+}
+
+double spi_stat_transactions_per_sec(const struct spi_port * const port)
+{
+	if (!timer_isset(&port->tv_stat_start))
+		return 0;
+	const long elapsed_us = timer_elapsed_us(&port->tv_stat_start, NULL);
+	if (elapsed_us <= 0)
+		return 0;
+	return port->stat_transactions * 1e6 / elapsed_us;
+}
+
+bool spi_queue_segment(struct spi_port * const port, const void * const tx, void * const rx, const size_t len)
+{
+	// Keep within what the gathering fallback can handle
+	if (port->segments_count >= SPI_MAX_SEGMENTS || port->segments_sz + len >= SPIMAXSZ)
+		return false;
+	port->segments[port->segments_count++] = (struct spi_segment){
+		.tx = tx,
+		.rx = rx,
+		.len = len,
+	};
+	port->segments_sz += len;
+	return true;
+}
+
+bool spi_queue_break(struct spi_port * const port)
+{
+	return spi_queue_segment(port, "\x4", NULL, 1);
+}
+
+bool spi_queue_fasync(struct spi_port * const port, int n)
+{
+	static const char fasync_pad[] = "\x5\x5\x5\x5\x5\x5\x5\x5\x5\x5\x5\x5\x5\x5\x5\x5";
+	const int padsz = sizeof(fasync_pad) - 1;
+	
+	for ( ; n > 0; n -= padsz)
+		if (!spi_queue_segment(port, fasync_pad, NULL, (n > padsz) ? padsz : n))
+			return false;
+	return true;
+}
+
+// Ports are set up in too many different ways to hold a trace, so look it up by name for each frame
+static
+struct lowl_trace *spi_trace_get(const struct spi_port * const port)
+{
+	if (likely(!opt_lowl_trace) || !port->repr)
+		return NULL;
+	return lowl_trace_get(port->repr);
+}
+
+bool spi_txrx(struct spi_port * const port)
+{
+	struct lowl_trace * const trace = spi_trace_get(port);
+	bool rv;
+	
+	spi_stat_count(port, port->spibufsz);
+	lowl_trace_record(trace, LTD_WRITE, port->spibuf, port->spibufsz);
+	rv = port->txrx(port);
+	if (rv)
+		lowl_trace_record(trace, LTD_READ, port->spibuf_rx, port->spibufsz);
+	return rv;
+}
+
+bool spi_txrx_segments(struct spi_port * const port)
+{
+	struct lowl_trace * const trace = spi_trace_get(port);
+	const struct spi_segment *seg;
+	size_t off = 0;
+	int i;
+	bool rv;
+	
+	spi_stat_count(port, port->segments_sz);
+	if (port->txrx_segments)
+	{
+		for (i = 0; trace && i < port->segments_count; ++i)
+			lowl_trace_record(trace, LTD_WRITE, port->segments[i].tx, port->segments[i].len);
+		rv = port->txrx_segments(port);
+		for (i = 0; rv && trace && i < port->segments_count; ++i)
+			if (port->segments[i].rx)
+				lowl_trace_record(trace, LTD_READ, port->segments[i].rx, port->segments[i].len);
+		return rv;
+	}
+	
+	spi_clear_buf(port);
+	for (i = 0; i < port->segments_count; ++i)
+	{
+		seg = &port->segments[i];
+		spi_emit_buf(port, seg->tx, seg->len);
+	}
+	if (unlikely(spi_getbufsz(port) != port->segments_sz))
+		return false;
+	lowl_trace_record(trace, LTD_WRITE, port->spibuf, port->spibufsz);
+	if (!port->txrx(port))
+		return false;
+	lowl_trace_record(trace, LTD_READ, port->spibuf_rx, port->spibufsz);
+	for (i = 0; i < port->segments_count; ++i)
+	{
+		seg = &port->segments[i];
+		if (seg->rx)
+			memcpy(seg->rx, &port->spibuf_rx[off], seg->len);
+		off += seg->len;
+	}
+	return true;
+}
+
 static
 void *spi_emit_buf_reverse(struct spi_port *port, const void *p, size_t sz)
 {
@@ -333,6 +480,20 @@ void spi_emit_nop(struct spi_port *port, int n) {
 	}
 }
 
+size_t spi_build_data(void * const out, const uint16_t addr, const void * const buf, size_t len)
+{
+	const unsigned char * const str = buf;
+	unsigned char * const o = out;
+	if (len < 4 || len > 128)
+		return 0;
+	len -= len % 4;
+	o[0] = ((len / 4) - 1) | 0xE0;
+	o[1] = (addr >> 8)&0xFF; o[2] = addr & 0xFF;
+	for (size_t i = 0; i < len; ++i)
+		o[3 + i] = bitflip8(str[i]);
+	return 3 + len;
+}
+
 void *spi_emit_data(struct spi_port *port, uint16_t addr, const void *buf, size_t len)
 {
 	unsigned char otmp[3];
@@ -3,9 +3,11 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #define SPIMAXSZ (256*1024)
+#define SPI_MAX_SEGMENTS  0x100
 
 /* Initialize SPI using this function */
 void spi_init(void);
@@ -17,15 +19,34 @@ extern void bfg_gpio_set_low(unsigned mask);
 extern unsigned bfg_gpio_get();
 #endif
 
+/* Part of a frame, transferred directly from/to the caller's buffers
+   rx may be NULL if the data shifted back is not needed */
+struct spi_segment {
+	const void *tx;
+	void *rx;
+	size_t len;
+};
+
 /* Do not allocate spi_port on the stack! OS X, at least, has a 512 KB default stack size for secondary threads
    This includes struct assignments which get allocated on the stack before being assigned to */
 struct spi_port {
 	/* TX-RX single frame */
 	bool (*txrx)(struct spi_port *port);
+	/* TX-RX queued segments as a single frame, without copying (optional) */
+	bool (*txrx_segments)(struct spi_port *port);
 	
 	char spibuf[SPIMAXSZ], spibuf_rx[SPIMAXSZ];
 	size_t spibufsz;
 	
+	struct spi_segment segments[SPI_MAX_SEGMENTS];
+	int segments_count;
+	size_t segments_sz;
+	
+	/* Frames transferred on this bus since tv_stat_start */
+	uint64_t stat_transactions;
+	uint64_t stat_bytes;
+	struct timeval tv_stat_start;
+	
 	void *userp;
 	struct cgpu_info *cgpu;
 	const char *repr;
@@ -82,16 +103,36 @@ extern void spi_emit_nop(struct spi_port *port, int n);
    transmission quantum is 32 bits */
 extern void *spi_emit_data(struct spi_port *port, uint16_t addr, const void *buf, size_t len);
 
+/* Builds the same frame as spi_emit_data into a caller's buffer, returning its size (or 0)
+   The data shifted back will be at offset 3 */
+extern size_t spi_build_data(void *out, uint16_t addr, const void *buf, size_t len);
+
+extern void spi_stat_count(struct spi_port *, size_t bytes);
+extern double spi_stat_transactions_per_sec(const struct spi_port *);
+
+extern bool spi_txrx(struct spi_port *);
+
+/* SEGMENT OPS: build a frame from many buffers, eg one per chip */
 static inline
-bool spi_txrx(struct spi_port *port)
+void spi_clear_segments(struct spi_port *port)
 {
-	return port->txrx(port);
+	port->segments_count = 0;
+	port->segments_sz = 0;
 }
 
+extern bool spi_queue_segment(struct spi_port *, const void *tx, void *rx, size_t len);
+extern bool spi_queue_break(struct spi_port *);
+extern bool spi_queue_fasync(struct spi_port *, int n);
+
+/* Uses the port's txrx_segments if it has one, otherwise gathers into the port buffer for txrx */
+extern bool spi_txrx_segments(struct spi_port *);
+
 extern int spi_open(struct spi_port *, const char *);
 extern bool sys_spi_txrx(struct spi_port *);
+extern bool sys_spi_txrx_segments(struct spi_port *);
 extern bool linux_spi_txrx(struct spi_port *);
 extern bool linux_spi_txrx2(struct spi_port *);
+extern bool linux_spi_txrx_segments(struct spi_port *);
 
 void spi_bfsb_select_bank(int bank);
 
@@ -9,11 +9,14 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include <libusb.h>
 
@@ -164,6 +167,24 @@ void cgpu_copy_libusb_strings(struct cgpu_info *cgpu, libusb_device *usb)
 }
 #endif
 
+struct lowl_usb_async {
+	struct libusb_transfer **xfers;
+	unsigned xfer_count;
+	unsigned active;
+	// Threads waiting in usb_read_async, which usb_ep_async_read_stop must wait out
+	unsigned readers;
+	bool stopping;
+	// errno-style error which ended the async reads (0 while running)
+	int error;
+	
+	usb_async_read_cb_t cb;
+	void *userp;
+	
+	// Protects everything here, as well as the endpoint's _buf_r
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
 struct lowl_usb_endpoint {
 	struct libusb_device_handle *devh;
 	
@@ -175,8 +196,26 @@ struct lowl_usb_endpoint {
 	unsigned char endpoint_w;
 	int packetsz_w;
 	unsigned timeout_ms_w;
+	
+	struct lowl_usb_async *async;
+	struct lowl_trace *trace;
 };
 
+static
+struct lowl_trace *usb_trace_get(struct libusb_device_handle * const devh)
+{
+	libusb_device * const dev = libusb_get_device(devh);
+	struct lowl_trace *trace;
+	char *devid;
+	
+	if (!opt_lowl_trace)
+		return NULL;
+	devid = bfg_make_devid_usb(libusb_get_bus_number(dev), libusb_get_device_address(dev));
+	trace = lowl_trace_get(devid);
+	free(devid);
+	return trace;
+}
+
 struct lowl_usb_endpoint *usb_open_ep(struct libusb_device_handle * const devh, const uint8_t epid, const int pktsz)
 {
 	struct lowl_usb_endpoint * const ep = malloc(sizeof(*ep));
@@ -195,6 +234,8 @@ struct lowl_usb_endpoint *usb_open_ep(struct libusb_device_handle * const devh,
 		ep->packetsz_w = epid;
 		ep->packetsz_r = -1;
 	}
+	ep->async = NULL;
+	ep->trace = usb_trace_get(devh);
 	return ep;
 };
 
@@ -208,6 +249,7 @@ struct lowl_usb_endpoint *usb_open_ep_pair(struct libusb_device_handle * const d
 		._buf_r = BYTES_INIT,
 		.endpoint_w = epid_w,
 		.packetsz_w = pktsz_w,
+		.trace = usb_trace_get(devh),
 	};
 	return ep;
 }
@@ -218,10 +260,63 @@ void usb_ep_set_timeouts_ms(struct lowl_usb_endpoint * const ep, const unsigned
 	ep->timeout_ms_w = timeout_ms_w;
 }
 
+static
+ssize_t usb_read_async(struct lowl_usb_endpoint * const ep, void * const data, const size_t datasz)
+{
+	struct lowl_usb_async * const async = ep->async;
+	struct timeval tv_timeout;
+	struct timespec ts_timeout;
+	ssize_t rv;
+	int error = 0;
+	
+	mutex_lock(&async->mutex);
+	++async->readers;
+	// Like the synchronous read, the timeout only applies if there is no data at all yet
+	if (ep->timeout_ms_r && !bytes_len(&ep->_buf_r))
+	{
+		// The condition uses the default (realtime) clock, not timer_set_now's
+		gettimeofday(&tv_timeout, NULL);
+		timer_set_delay(&tv_timeout, &tv_timeout, ep->timeout_ms_r * 1000L);
+		timeval_to_spec(&ts_timeout, &tv_timeout);
+		while (!(bytes_len(&ep->_buf_r) || async->error))
+			if (pthread_cond_timedwait(&async->cond, &async->mutex, &ts_timeout) == ETIMEDOUT)
+				break;
+		if (!bytes_len(&ep->_buf_r))
+		{
+			error = async->error;
+			// Without an error, behaviour is like tcsetattr-style timeout
+			rv = error ? -1 : 0;
+			goto out;
+		}
+	}
+	while (bytes_len(&ep->_buf_r) < datasz && !async->error)
+		pthread_cond_wait(&async->cond, &async->mutex);
+	if (bytes_len(&ep->_buf_r) < datasz)
+	{
+		error = async->error;
+		rv = -1;
+		goto out;
+	}
+	memcpy(data, bytes_buf(&ep->_buf_r), datasz);
+	bytes_shift(&ep->_buf_r, datasz);
+	rv = datasz;
+	
+out:
+	--async->readers;
+	if (async->stopping)
+		pthread_cond_broadcast(&async->cond);
+	mutex_unlock(&async->mutex);
+	if (error)
+		errno = error;
+	return rv;
+}
+
 ssize_t usb_read(struct lowl_usb_endpoint * const ep, void * const data, size_t datasz)
 {
 	unsigned timeout;
 	size_t xfer;
+	if (ep->async && !ep->async->cb)
+		return usb_read_async(ep, data, datasz);
 	if ( (xfer = bytes_len(&ep->_buf_r)) < datasz)
 	{
 		bytes_extend_buf(&ep->_buf_r, datasz + ep->packetsz_r - 1);
@@ -241,6 +336,7 @@ ssize_t usb_read(struct lowl_usb_endpoint * const ep, void * const data, size_t
 					if (!pxfer)
 						// Behaviour is like tcsetattr-style timeout
 						return 0;
+					lowl_trace_record(ep->trace, LTD_READ, p, pxfer);
 					p += pxfer;
 					rem -= pxfer;
 					// NOTE: Need to maintain _buf_r length so data is saved in case of error
@@ -275,6 +371,7 @@ ssize_t usb_write(struct lowl_usb_endpoint * const ep, const void * const data,
 		{
 			case 0:
 			case LIBUSB_ERROR_TIMEOUT:
+				lowl_trace_record(ep->trace, LTD_WRITE, p, pxfer);
 				p += pxfer;
 				rem -= pxfer;
 				break;
@@ -292,8 +389,222 @@ ssize_t usb_write(struct lowl_usb_endpoint * const ep, const void * const data,
 	return datasz;
 }
 
+// All async transfer completions are run from this one thread
+static pthread_mutex_t usb_event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t usb_event_pth;
+static bool usb_event_thread_running, usb_event_thread_stopping;
+
+static
+void *usb_event_thread(__maybe_unused void * const userp)
+{
+	struct timeval tv_timeout = { .tv_sec = 1, };
+	int e;
+	
+	RenameThread("usb_events");
+	while (!usb_event_thread_stopping)
+	{
+		e = libusb_handle_events_timeout_completed(NULL, &tv_timeout, NULL);
+		if (unlikely(e && e != LIBUSB_ERROR_INTERRUPTED))
+		{
+			applog(LOG_ERR, "%s: Error handling events: %s", __func__, bfg_strerror(e, BST_LIBUSB));
+			cgsleep_ms(100);
+		}
+	}
+	return NULL;
+}
+
+static
+bool usb_event_thread_start(void)
+{
+	bool rv = true;
+	
+	mutex_lock(&usb_event_mutex);
+	if (!usb_event_thread_running)
+	{
+		if (unlikely(pthread_create(&usb_event_pth, NULL, usb_event_thread, NULL)))
+		{
+			applog(LOG_ERR, "%s: Failed to start USB event thread", __func__);
+			rv = false;
+		}
+		else
+			usb_event_thread_running = true;
+	}
+	mutex_unlock(&usb_event_mutex);
+	
+	return rv;
+}
+
+void usb_event_thread_stop(void)
+{
+	mutex_lock(&usb_event_mutex);
+	if (usb_event_thread_running)
+	{
+		usb_event_thread_stopping = true;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+		libusb_interrupt_event_handler(NULL);
+#endif
+		// Without libusb_interrupt_event_handler, this waits out the thread's 1 second timeout
+		pthread_join(usb_event_pth, NULL);
+		usb_event_thread_running = false;
+		usb_event_thread_stopping = false;
+	}
+	mutex_unlock(&usb_event_mutex);
+}
+
+static
+int usb_async_error_to_errno(const enum libusb_transfer_status status)
+{
+	switch (status)
+	{
+		case LIBUSB_TRANSFER_STALL:
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return EPIPE;
+		default:
+			return EIO;
+	}
+}
+
+static
+void LIBUSB_CALL usb_async_read_done(struct libusb_transfer * const xfer)
+{
+	struct lowl_usb_endpoint * const ep = xfer->user_data;
+	struct lowl_usb_async * const async = ep->async;
+	bool report_error = false;
+	int e;
+	
+	if (xfer->status == LIBUSB_TRANSFER_COMPLETED && xfer->actual_length)
+	{
+		lowl_trace_record(ep->trace, LTD_READ, xfer->buffer, xfer->actual_length);
+		if (async->cb)
+			async->cb(ep, async->userp, xfer->buffer, xfer->actual_length);
+		else
+		{
+			mutex_lock(&async->mutex);
+			bytes_append(&ep->_buf_r, xfer->buffer, xfer->actual_length);
+			pthread_cond_broadcast(&async->cond);
+			mutex_unlock(&async->mutex);
+		}
+	}
+	
+	mutex_lock(&async->mutex);
+	if (!async->stopping)
+	{
+		switch (xfer->status)
+		{
+			case LIBUSB_TRANSFER_COMPLETED:
+			case LIBUSB_TRANSFER_TIMED_OUT:
+				// Keep the transfer queued up so the device never waits on us
+				e = libusb_submit_transfer(xfer);
+				if (likely(!e))
+				{
+					mutex_unlock(&async->mutex);
+					return;
+				}
+				applog(LOG_DEBUG, "%s: Failed to resubmit transfer: %s", __func__, bfg_strerror(e, BST_LIBUSB));
+				e = (e == LIBUSB_ERROR_NO_DEVICE) ? EPIPE : EIO;
+				break;
+			default:
+				e = usb_async_error_to_errno(xfer->status);
+				break;
+		}
+		if (!async->error)
+		{
+			async->error = e;
+			report_error = (bool)async->cb;
+		}
+	}
+	mutex_unlock(&async->mutex);
+	
+	// NOTE: Must be done before decrementing active, since usb_ep_async_read_stop may free everything after that
+	if (report_error)
+		async->cb(ep, async->userp, NULL, 0);
+	
+	mutex_lock(&async->mutex);
+	--async->active;
+	pthread_cond_broadcast(&async->cond);
+	mutex_unlock(&async->mutex);
+}
+
+bool usb_ep_async_read_start(struct lowl_usb_endpoint * const ep, const unsigned outstanding, const usb_async_read_cb_t cb, void * const userp)
+{
+	struct lowl_usb_async *async;
+	int e;
+	
+	if (ep->async || ep->packetsz_r == -1 || !outstanding)
+		return false;
+	if (!usb_event_thread_start())
+		return false;
+	
+	async = malloc(sizeof(*async));
+	*async = (struct lowl_usb_async){
+		.xfers = malloc(sizeof(*async->xfers) * outstanding),
+		.cb = cb,
+		.userp = userp,
+	};
+	mutex_init(&async->mutex);
+	pthread_cond_init(&async->cond, bfg_condattr);
+	ep->async = async;
+	
+	mutex_lock(&async->mutex);
+	for (unsigned i = 0; i < outstanding; ++i)
+	{
+		struct libusb_transfer * const xfer = libusb_alloc_transfer(0);
+		if (unlikely(!xfer))
+			break;
+		libusb_fill_bulk_transfer(xfer, ep->devh, ep->endpoint_r, malloc(ep->packetsz_r), ep->packetsz_r, usb_async_read_done, ep, 0);
+		xfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
+		e = libusb_submit_transfer(xfer);
+		if (unlikely(e))
+		{
+			applog(LOG_DEBUG, "%s: Failed to submit transfer: %s", __func__, bfg_strerror(e, BST_LIBUSB));
+			libusb_free_transfer(xfer);
+			break;
+		}
+		async->xfers[async->xfer_count++] = xfer;
+		++async->active;
+	}
+	mutex_unlock(&async->mutex);
+	
+	if (!async->xfer_count)
+	{
+		usb_ep_async_read_stop(ep);
+		return false;
+	}
+	return true;
+}
+
+void usb_ep_async_read_stop(struct lowl_usb_endpoint * const ep)
+{
+	struct lowl_usb_async * const async = ep->async;
+	
+	if (!async)
+		return;
+	
+	mutex_lock(&async->mutex);
+	async->stopping = true;
+	// Wake any blocked readers, so they return before everything is freed
+	if (!async->error)
+		async->error = ECANCELED;
+	pthread_cond_broadcast(&async->cond);
+	for (unsigned i = 0; i < async->xfer_count; ++i)
+		libusb_cancel_transfer(async->xfers[i]);
+	while (async->active || async->readers)
+		pthread_cond_wait(&async->cond, &async->mutex);
+	mutex_unlock(&async->mutex);
+	
+	for (unsigned i = 0; i < async->xfer_count; ++i)
+		libusb_free_transfer(async->xfers[i]);
+	free(async->xfers);
+	pthread_cond_destroy(&async->cond);
+	mutex_destroy(&async->mutex);
+	free(async);
+	// NOTE: Anything left in _buf_r is still returned by synchronous usb_read
+	ep->async = NULL;
+}
+
 void usb_close_ep(struct lowl_usb_endpoint * const ep)
 {
+	usb_ep_async_read_stop(ep);
 	if (ep->packetsz_r != -1)
 		bytes_free(&ep->_buf_r);
 	free(ep);
@@ -19,6 +19,16 @@ extern struct lowl_usb_endpoint *usb_open_ep_pair(struct libusb_device_handle *,
 extern void usb_ep_set_timeouts_ms(struct lowl_usb_endpoint *, unsigned timeout_ms_r, unsigned timeout_ms_w);
 extern ssize_t usb_read(struct lowl_usb_endpoint *, void *, size_t);
 extern ssize_t usb_write(struct lowl_usb_endpoint *, const void *, size_t);
+
+// Called from the USB event thread with each completed read; data is NULL (and datasz 0) once reads have failed
+typedef void (*usb_async_read_cb_t)(struct lowl_usb_endpoint *, void *userp, const void *data, size_t datasz);
+// Keeps up to `outstanding` bulk reads queued at all times; without a callback, usb_read is served from what they receive
+extern bool usb_ep_async_read_start(struct lowl_usb_endpoint *, unsigned outstanding, usb_async_read_cb_t, void *userp);
+// Must not be called from the callback; reads already waiting fail with ECANCELED, but none may start during the call
+extern void usb_ep_async_read_stop(struct lowl_usb_endpoint *);
 extern void usb_close_ep(struct lowl_usb_endpoint *);
 
+// Stops the thread running async transfer completions; must be called before libusb_exit
+extern void usb_event_thread_stop(void);
+
 #endif
@@ -85,6 +85,8 @@ enum {
 #include <IOKit/usb/IOUSBLib.h>
 #endif
 
+#include <uthash.h>
+
 #include "logging.h"
 #include "lowlevel.h"
 #include "miner.h"
@@ -161,6 +163,20 @@ char *_decode_udev_enc_dup(const char *s)
 	return o;
 }
 
+static
+void _vcom_devinfo_fill_udev(struct lowlevel_device_info * const devinfo, struct udev_device * const device)
+{
+	const char *s;
+	
+	BFGINIT(devinfo->manufacturer, _decode_udev_enc_dup(udev_device_get_property_value(device, "ID_VENDOR_ENC")));
+	BFGINIT(devinfo->product, _decode_udev_enc_dup(udev_device_get_property_value(device, "ID_MODEL_ENC")));
+	BFGINIT(devinfo->serial, _decode_udev_enc_dup(udev_device_get_property_value(device, "ID_SERIAL_SHORT")));
+	if ((s = udev_device_get_property_value(device, "ID_VENDOR_ID")))
+		BFGINIT(devinfo->vid, strtol(s, NULL, 16));
+	if ((s = udev_device_get_property_value(device, "ID_MODEL_ID")))
+		BFGINIT(devinfo->pid, strtol(s, NULL, 16));
+}
+
 static
 void _vcom_devinfo_scan_udev(struct lowlevel_device_info ** const devinfo_list)
 {
@@ -183,15 +199,31 @@ void _vcom_devinfo_scan_udev(struct lowlevel_device_info ** const devinfo_list)
 		const char * const devpath = udev_device_get_devnode(device);
 		devinfo = _vcom_devinfo_findorcreate(devinfo_list, devpath);
 		
-		BFGINIT(devinfo->manufacturer, _decode_udev_enc_dup(udev_device_get_property_value(device, "ID_VENDOR_ENC")));
-		BFGINIT(devinfo->product, _decode_udev_enc_dup(udev_device_get_property_value(device, "ID_MODEL_ENC")));
-		BFGINIT(devinfo->serial, _decode_udev_enc_dup(udev_device_get_property_value(device, "ID_SERIAL_SHORT")));
+		_vcom_devinfo_fill_udev(devinfo, device);
 		
 		udev_device_unref(device);
 	}
 	udev_enumerate_unref(enumerate);
 	udev_unref(udev);
 }
+
+// Builds the info for a single tty from a hotplug event, without rescanning everything else
+struct lowlevel_device_info *vcom_devinfo_from_udev(struct udev_device * const device)
+{
+	struct lowlevel_device_info *devinfo_hash = NULL, *devinfo;
+	const char * const devpath = udev_device_get_devnode(device);
+	
+	if (!(devpath && udev_device_get_property_value(device, "ID_SERIAL")))
+		return NULL;
+	devinfo = _vcom_devinfo_findorcreate(&devinfo_hash, devpath);
+	if (!devinfo)
+		return NULL;
+	HASH_CLEAR(hh, devinfo_hash);
+	
+	_vcom_devinfo_fill_udev(devinfo, device);
+	
+	return devinfo;
+}
 #endif
 
 #ifdef __APPLE__
@@ -797,7 +829,7 @@ bool vcom_lowl_probe_wrapper(const struct lowlevel_device_info * const info, det
 		if (info->lowl == &lowl_usb)
 		{
 			if (lowl_usb_attach_kernel_driver(info))
-				bfg_need_detect_rescan = true;
+				bfg_request_detect_rescan();
 		}
 #endif
 		bfg_probe_result_flags = BPR_WRONG_DEVTYPE;
@@ -827,7 +859,7 @@ bool _serial_autodetect_found_cb(struct lowlevel_device_info * const devinfo, vo
 		if (devinfo->lowl == &lowl_usb)
 		{
 			if (lowl_usb_attach_kernel_driver(devinfo))
-				bfg_need_detect_rescan = true;
+				bfg_request_detect_rescan();
 		}
 		else
 #endif
@@ -1073,10 +1105,106 @@ bool vcom_set_timeout_ms(const int fdDev, const unsigned timeout_ms)
 #endif
 }
 
+// Line reads fill this in bulk, so they don't need a read() syscall per byte
+struct vcom_rxbuf {
+	int fd;
+	size_t pos, len;
+	char buf[0x400];
+	UT_hash_handle hh;
+};
+
+static struct vcom_rxbuf *vcom_rxbufs;
+static pthread_mutex_t vcom_rxbufs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+struct vcom_rxbuf *vcom_rxbuf_find(const int fd, const bool create)
+{
+	struct vcom_rxbuf *rxbuf;
+	
+	mutex_lock(&vcom_rxbufs_mutex);
+	HASH_FIND_INT(vcom_rxbufs, &fd, rxbuf);
+	if (create && !rxbuf)
+	{
+		rxbuf = malloc(sizeof(*rxbuf));
+		rxbuf->fd = fd;
+		rxbuf->pos = rxbuf->len = 0;
+		HASH_ADD_INT(vcom_rxbufs, fd, rxbuf);
+	}
+	mutex_unlock(&vcom_rxbufs_mutex);
+	
+	return rxbuf;
+}
+
+static
+void vcom_rxbuf_discard(const int fd)
+{
+	struct vcom_rxbuf *rxbuf;
+	
+	mutex_lock(&vcom_rxbufs_mutex);
+	HASH_FIND_INT(vcom_rxbufs, &fd, rxbuf);
+	if (rxbuf)
+		HASH_DEL(vcom_rxbufs, rxbuf);
+	mutex_unlock(&vcom_rxbufs_mutex);
+	
+	free(rxbuf);
+}
+
+// Maps open fds to their lowlevel trace, when tracing is enabled
+struct vcom_trace {
+	int fd;
+	struct lowl_trace *trace;
+	UT_hash_handle hh;
+};
+
+static struct vcom_trace *vcom_traces;
+static pthread_mutex_t vcom_traces_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+struct lowl_trace *vcom_trace_find(const int fd)
+{
+	struct vcom_trace *vt;
+	struct lowl_trace *trace;
+	
+	// vcom_trace_set may free the entry as soon as the lock is released
+	mutex_lock(&vcom_traces_mutex);
+	HASH_FIND_INT(vcom_traces, &fd, vt);
+	trace = vt ? vt->trace : NULL;
+	mutex_unlock(&vcom_traces_mutex);
+	
+	return trace;
+}
+
+static
+void vcom_trace_set(const int fd, struct lowl_trace * const trace)
+{
+	struct vcom_trace *vt;
+	
+	mutex_lock(&vcom_traces_mutex);
+	HASH_FIND_INT(vcom_traces, &fd, vt);
+	if (vt && !trace)
+	{
+		HASH_DEL(vcom_traces, vt);
+		free(vt);
+	}
+	else
+	if (trace)
+	{
+		if (!vt)
+		{
+			vt = malloc(sizeof(*vt));
+			vt->fd = fd;
+			HASH_ADD_INT(vcom_traces, fd, vt);
+		}
+		vt->trace = trace;
+	}
+	mutex_unlock(&vcom_traces_mutex);
+}
+
 /* NOTE: Linux only supports uint8_t (decisecond) timeouts; limiting it in
  *       this interface buys us warnings when bad constants are passed in.
  */
-int serial_open(const char *devpath, unsigned long baud, uint8_t timeout, bool purge)
+static
+int _serial_open(const char *devpath, unsigned long baud, uint8_t timeout, bool purge)
 {
 #ifdef WIN32
 	HANDLE hSerial = CreateFile(devpath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
@@ -1133,7 +1261,10 @@ int serial_open(const char *devpath, unsigned long baud, uint8_t timeout, bool p
 			applog(LOG_WARNING, "%s: %s failed: %s", devpath, "PURGE_TXCLEAR", bfg_strerror(GetLastError(), BST_SYSTEM));
 	}
 
-	return _open_osfhandle((intptr_t)hSerial, 0);
+	const int fd = _open_osfhandle((intptr_t)hSerial, 0);
+	// Anything still buffered belonged to a previous user of this fd number
+	vcom_rxbuf_discard(fd);
+	return fd;
 #else
 	int fdDev = open(devpath, O_RDWR | O_CLOEXEC | O_NOCTTY);
 
@@ -1147,6 +1278,9 @@ int serial_open(const char *devpath, unsigned long baud, uint8_t timeout, bool p
 		return -1;
 	}
 	
+	// Anything still buffered belonged to a previous user of this fd number
+	vcom_rxbuf_discard(fdDev);
+	
 #if defined(LOCK_EX) && defined(LOCK_NB)
 	if (likely(!flock(fdDev, LOCK_EX | LOCK_NB)))
 		applog(LOG_DEBUG, "Acquired exclusive advisory lock on %s", devpath);
@@ -1224,8 +1358,19 @@ int serial_open(const char *devpath, unsigned long baud, uint8_t timeout, bool p
 #endif
 }
 
+int serial_open(const char * const devpath, const unsigned long baud, const uint8_t timeout, const bool purge)
+{
+	const int fd = _serial_open(devpath, baud, timeout, purge);
+	
+	if (fd != -1)
+		vcom_trace_set(fd, lowl_trace_get(devpath));
+	return fd;
+}
+
 int serial_close(const int fd)
 {
+	vcom_rxbuf_discard(fd);
+	vcom_trace_set(fd, NULL);
 #if defined(LOCK_EX) && defined(LOCK_NB) && defined(LOCK_UN)
 	flock(fd, LOCK_UN);
 #endif
@@ -1234,20 +1379,79 @@ int serial_close(const int fd)
 
 ssize_t _serial_read(int fd, char *buf, size_t bufsiz, char *eol)
 {
+	struct vcom_rxbuf * const rxbuf = vcom_rxbuf_find(fd, eol);
+	struct lowl_trace * const trace = vcom_trace_find(fd);
 	ssize_t len, tlen = 0;
+	
+	if (rxbuf)
+	{
+		while (bufsiz)
+		{
+			if (rxbuf->pos == rxbuf->len)
+			{
+				if (!eol)
+					// Nothing left buffered; the rest can go directly to the caller
+					break;
+				// Like the bytewise read, this returns as soon as anything arrives, or after the termios timeout
+				len = read(fd, rxbuf->buf, sizeof(rxbuf->buf));
+				lowl_trace_record(trace, LTD_READ, rxbuf->buf, len);
+				rxbuf->pos = 0;
+				rxbuf->len = (len > 0) ? len : 0;
+				if (len < 1)
+					return tlen;
+			}
+			
+			const char *src = &rxbuf->buf[rxbuf->pos];
+			size_t avail = rxbuf->len - rxbuf->pos;
+			if (avail > bufsiz)
+				avail = bufsiz;
+			if (eol)
+			{
+				const char * const eolp = memchr(src, *eol, avail);
+				if (eolp)
+					avail = (eolp - src) + 1;
+			}
+			memcpy(buf, src, avail);
+			rxbuf->pos += avail;
+			tlen += avail;
+			if (eol && buf[avail - 1] == *eol)
+				return tlen;
+			buf += avail;
+			bufsiz -= avail;
+		}
+		if (eol)
+			return tlen;
+	}
+	
 	while (bufsiz) {
-		len = read(fd, buf, eol ? 1 : bufsiz);
+		len = read(fd, buf, bufsiz);
 		if (len < 1)
 			break;
+		lowl_trace_record(trace, LTD_READ, buf, len);
 		tlen += len;
-		if (eol && *eol == buf[0])
-			break;
 		buf += len;
 		bufsiz -= len;
 	}
 	return tlen;
 }
 
+ssize_t serial_write(const int fd, const void * const buf, const size_t bufsiz)
+{
+	const ssize_t r = write(fd, buf, bufsiz);
+	
+	lowl_trace_record(vcom_trace_find(fd), LTD_WRITE, buf, r);
+	return r;
+}
+
+// A single read(), for drivers doing their own polling and timeouts, still recorded in the trace
+ssize_t serial_read_raw(const int fd, void * const buf, const size_t bufsiz)
+{
+	const ssize_t r = read(fd, buf, bufsiz);
+	
+	lowl_trace_record(vcom_trace_find(fd), LTD_READ, buf, r);
+	return r;
+}
+
 #ifndef WIN32
 
 enum bfg_gpio_value get_serial_cts(int fd)
@@ -1346,6 +1550,87 @@ _set_serial_cmflag2(dtr, fDtrControl, DTR_CONTROL_ENABLE, DTR_CONTROL_DISABLE)
 _set_serial_cmflag2(rts, fRtsControl, RTS_CONTROL_ENABLE, RTS_CONTROL_DISABLE)
 #endif // ! WIN32
 
+#ifndef WIN32
+static
+void _test_serial_read(const int fd, const bool line, const size_t bufsiz, const char * const expect)
+{
+	char buf[0x20], eol = '\n';
+	const ssize_t expectlen = strlen(expect);
+	const ssize_t r = line ? serial_read_line(fd, buf, bufsiz, eol) : serial_read(fd, buf, bufsiz);
+	if (r != expectlen || memcmp(buf, expect, expectlen))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: serial_read%s(%u) test failed: expected \"%s\", got \"%.*s\"",
+		       __func__, line ? "_line" : "", (unsigned)bufsiz, expect, (int)(r > 0 ? r : 0), buf);
+	}
+}
+
+// Uses a pty to act as a device replying with lines
+void test_serial_read_line(void)
+{
+	const int master = posix_openpt(O_RDWR | O_NOCTTY);
+	int fd;
+	if (master == -1 || grantpt(master) || unlockpt(master))
+	{
+		applog(LOG_WARNING, "%s: Cannot create pty, skipping", __func__);
+		if (master != -1)
+			close(master);
+		return;
+	}
+	fd = serial_open(ptsname(master), 0, 1, true);
+	if (fd == -1)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Failed to open pty slave", __func__);
+		close(master);
+		return;
+	}
+	
+#define _test_device_reply(s)  do{  \
+	if (sizeof(s) - 1 != write(master, s, sizeof(s) - 1))  \
+		++unittest_failures;  \
+}while(0)
+	
+	// A queue-mode style reply with several lines in one go
+	_test_device_reply("COUNT:2\nAAAA,BBBB\nOK\npartial");
+	_test_serial_read(fd, true, 0x20, "COUNT:2\n");
+	_test_serial_read(fd, true, 0x20, "AAAA,BBBB\n");
+	_test_serial_read(fd, true, 0x20, "OK\n");
+	// No end of line arrives, so this needs to time out with what was received
+	_test_serial_read(fd, true, 0x20, "partial");
+	_test_serial_read(fd, true, 0x20, "");
+	
+	// Lines longer than the caller's buffer
+	_test_device_reply("abcdefg\n");
+	_test_serial_read(fd, true, 4, "abcd");
+	_test_serial_read(fd, true, 0x20, "efg\n");
+	
+	// Raw reads need to get buffered data first
+	_test_device_reply("line\nraw");
+	_test_serial_read(fd, true, 0x20, "line\n");
+	_test_serial_read(fd, false, 3, "raw");
+	_test_device_reply("more");
+	_test_serial_read(fd, false, 4, "more");
+	
+	// BitForce sends a binary FLB payload right after its status line, often in the same chunk
+	_test_device_reply("BIN-InP:1:FLUSHED:1\n\xaa\x55\x01\x80");
+	_test_serial_read(fd, true, 0x20, "BIN-InP:1:FLUSHED:1\n");
+	_test_serial_read(fd, false, 4, "\xaa\x55\x01\x80");
+	_test_device_reply("OK\n");
+	_test_serial_read(fd, true, 0x20, "OK\n");
+	
+	// Lines split across several device writes
+	_test_device_reply("sp");
+	_test_device_reply("lit\n");
+	_test_serial_read(fd, true, 0x20, "split\n");
+	
+#undef _test_device_reply
+	
+	serial_close(fd);
+	close(master);
+}
+#endif
+
 struct lowlevel_driver lowl_vcom = {
 	.dname = "vcom",
 	.devinfo_scan = vcom_devinfo_scan,
@@ -24,6 +24,11 @@ extern void clear_detectone_meta_info(void);
 
 extern bool vcom_lowl_probe_wrapper(const struct lowlevel_device_info *, detectone_func_t);
 
+#ifdef HAVE_LIBUDEV
+struct udev_device;
+extern struct lowlevel_device_info *vcom_devinfo_from_udev(struct udev_device *);
+#endif
+
 extern int _serial_autodetect(detectone_func_t, ...);
 #define serial_autodetect(...)  _serial_autodetect(__VA_ARGS__, NULL)
 
@@ -37,6 +42,8 @@ extern ssize_t _serial_read(int fd, char *buf, size_t buflen, char *eol);
 	_serial_read(fd, (char*)(buf), count, NULL)
 #define serial_read_line(fd, buf, bufsiz, eol)  \
 	_serial_read(fd, buf, bufsiz, &eol)
+extern ssize_t serial_write(int fd, const void *buf, size_t bufsiz);
+extern ssize_t serial_read_raw(int fd, void *buf, size_t bufsiz);
 extern int serial_close(int fd);
 
 // NOTE: timeout_ms=0 means it never times out
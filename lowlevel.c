@@ -9,7 +9,9 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -20,6 +22,10 @@
 #include "lowlevel.h"
 #include "miner.h"
 
+#if defined(NEED_BFG_LOWL_VCOM) && !defined(WIN32)
+#include "lowl-emu.h"
+#endif
+
 static struct lowlevel_device_info *devinfo_list;
 
 #if defined(HAVE_LIBUSB) || defined(NEED_BFG_LOWL_HID)
@@ -122,6 +128,10 @@ struct lowlevel_device_info *lowlevel_scan()
 #ifdef NEED_BFG_LOWL_VCOM
 	devinfo_mid_list = lowl_vcom.devinfo_scan();
 	LL_CONCAT(devinfo_list, devinfo_mid_list);
+#ifndef WIN32
+	devinfo_mid_list = lowl_emu.devinfo_scan();
+	LL_CONCAT(devinfo_list, devinfo_mid_list);
+#endif
 #endif
 	
 	struct lowlevel_device_info *devinfo_same_prev_ht = NULL, *devinfo_same_list;
@@ -267,3 +277,400 @@ struct device_drv *bfg_claim_any2(struct device_drv * const api, const char * co
 	memcpy(&devpath[llnamesz+1], path, pathsz + 1);
 	return bfg_claim_any(api, verbose, devpath);
 }
+
+// Remembers which driver claimed each device, so it can be tried first on the next probe
+struct lowl_probe_cache_entry {
+	char *key;
+	char *dname;
+	char *param;
+	double probe_secs;
+	UT_hash_handle hh;
+};
+
+char *opt_probe_cache_file;
+static struct lowl_probe_cache_entry *probe_cache;
+static pthread_mutex_t probe_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool probe_cache_loaded, probe_cache_dirty;
+
+// Serial numbers follow a device between ports; otherwise fall back to where it is attached
+static
+void probe_cache_key(char * const buf, const size_t bufsz, const struct lowlevel_device_info * const info)
+{
+	if (info->serial && info->serial[0])
+		snprintf(buf, bufsz, "%04x:%04x/%s", (unsigned)info->vid, (unsigned)info->pid, info->serial);
+	else
+		snprintf(buf, bufsz, "%04x:%04x@%s", (unsigned)info->vid, (unsigned)info->pid, info->devid);
+}
+
+// Must be called with probe_cache_mutex held
+static
+void _probe_cache_set(const char * const key, const char * const dname, const char * const param, const double probe_secs)
+{
+	struct lowl_probe_cache_entry *e;
+	
+	HASH_FIND_STR(probe_cache, key, e);
+	if (e)
+	{
+		free(e->dname);
+		free(e->param);
+	}
+	else
+	{
+		e = malloc(sizeof(*e));
+		e->key = strdup(key);
+		HASH_ADD_KEYPTR(hh, probe_cache, e->key, strlen(e->key), e);
+	}
+	e->dname = strdup(dname);
+	e->param = maybe_strdup(param);
+	e->probe_secs = probe_secs;
+}
+
+// Must be called with probe_cache_mutex held
+static
+void _probe_cache_load()
+{
+	char buf[0x400], *p, *fields[4];
+	FILE *F;
+	int n;
+	
+	probe_cache_loaded = true;
+	if (!opt_probe_cache_file)
+		return;
+	F = fopen(opt_probe_cache_file, "r");
+	if (!F)
+	{
+		applog(LOG_DEBUG, "Unable to open probe cache %s: %s", opt_probe_cache_file, bfg_strerror(errno, BST_ERRNO));
+		return;
+	}
+	while (fgets(buf, sizeof(buf), F))
+	{
+		// key <tab> driver <tab> seconds [<tab> parameters]
+		buf[strcspn(buf, "\r\n")] = '\0';
+		p = buf;
+		for (n = 0; n < 4 && p; ++n)
+		{
+			fields[n] = p;
+			p = strchr(p, '\t');
+			if (p)
+				*(p++) = '\0';
+		}
+		if (n < 3 || !(fields[0][0] && fields[1][0]))
+			continue;
+		_probe_cache_set(fields[0], fields[1], (n > 3 && fields[3][0]) ? fields[3] : NULL, atof(fields[2]));
+	}
+	fclose(F);
+	applog(LOG_DEBUG, "Loaded %u entries from probe cache %s", (unsigned)HASH_COUNT(probe_cache), opt_probe_cache_file);
+}
+
+// Finds the driver which last claimed any of the devices sharing infolist's devid
+bool lowlevel_probe_cache_get(struct lowlevel_device_info * const infolist, char * const out_dname, const size_t out_dnamesz, struct lowlevel_device_info ** const out_info)
+{
+	struct lowl_probe_cache_entry *e = NULL;
+	struct lowlevel_device_info *info;
+	char key[0x100];
+	
+	mutex_lock(&probe_cache_mutex);
+	if (!probe_cache_loaded)
+		_probe_cache_load();
+	LL_FOREACH2(infolist, info, same_devid_next)
+	{
+		probe_cache_key(key, sizeof(key), info);
+		HASH_FIND_STR(probe_cache, key, e);
+		if (e)
+			break;
+	}
+	if (e)
+	{
+		snprintf(out_dname, out_dnamesz, "%s", e->dname);
+		*out_info = info;
+	}
+	mutex_unlock(&probe_cache_mutex);
+	return e;
+}
+
+// Makes the parameters remembered for this device and driver available to the probe
+void lowlevel_probe_cache_begin(const struct lowlevel_device_info * const info, const char * const dname)
+{
+	struct lowl_probe_cache_entry *e;
+	char key[0x100];
+	
+	free(bfg_probe_cache_param);
+	bfg_probe_cache_param = NULL;
+	
+	probe_cache_key(key, sizeof(key), info);
+	mutex_lock(&probe_cache_mutex);
+	if (!probe_cache_loaded)
+		_probe_cache_load();
+	HASH_FIND_STR(probe_cache, key, e);
+	if (e && e->param && !strcasecmp(e->dname, dname))
+		bfg_probe_cache_param = strdup(e->param);
+	mutex_unlock(&probe_cache_mutex);
+}
+
+const char *lowlevel_probe_cache_param()
+{
+	return bfg_probe_cache_param;
+}
+
+// Drivers may call this during a probe to remember driver-specific parameters (eg, autodetected settings)
+void lowlevel_probe_cache_set_param(const char * const param)
+{
+	free(bfg_probe_cache_param);
+	bfg_probe_cache_param = maybe_strdup(param);
+}
+
+void lowlevel_probe_cache_found(const struct lowlevel_device_info * const info, const char * const dname, const double probe_secs)
+{
+	char key[0x100];
+	
+	probe_cache_key(key, sizeof(key), info);
+	mutex_lock(&probe_cache_mutex);
+	_probe_cache_set(key, dname, bfg_probe_cache_param, probe_secs);
+	probe_cache_dirty = true;
+	mutex_unlock(&probe_cache_mutex);
+	
+	free(bfg_probe_cache_param);
+	bfg_probe_cache_param = NULL;
+}
+
+void lowlevel_probe_cache_forget(const struct lowlevel_device_info * const info)
+{
+	struct lowl_probe_cache_entry *e;
+	char key[0x100];
+	
+	probe_cache_key(key, sizeof(key), info);
+	mutex_lock(&probe_cache_mutex);
+	HASH_FIND_STR(probe_cache, key, e);
+	if (e)
+	{
+		HASH_DEL(probe_cache, e);
+		free(e->key);
+		free(e->dname);
+		free(e->param);
+		free(e);
+		probe_cache_dirty = true;
+	}
+	mutex_unlock(&probe_cache_mutex);
+}
+
+void lowlevel_probe_cache_save()
+{
+	struct lowl_probe_cache_entry *e, *tmp;
+	FILE *F;
+	
+	mutex_lock(&probe_cache_mutex);
+	if (!(opt_probe_cache_file && probe_cache_dirty))
+		goto out;
+	F = fopen(opt_probe_cache_file, "w");
+	if (!F)
+	{
+		applog(LOG_WARNING, "Unable to write probe cache %s: %s", opt_probe_cache_file, bfg_strerror(errno, BST_ERRNO));
+		goto out;
+	}
+	HASH_ITER(hh, probe_cache, e, tmp)
+		fprintf(F, "%s\t%s\t%.3f\t%s\n", e->key, e->dname, e->probe_secs, e->param ?: "");
+	fclose(F);
+	probe_cache_dirty = false;
+out:
+	mutex_unlock(&probe_cache_mutex);
+}
+
+// Ring of the most recent transfers on each channel (device), for protocol debugging and replay
+struct lowl_trace {
+	char *name;
+	pthread_mutex_t mutex;
+	struct lowl_trace_rec *recs;
+	int recs_sz;
+	int next;
+	int count;
+	uint64_t total_recs;
+	uint64_t total_bytes;
+	UT_hash_handle hh;
+};
+
+int opt_lowl_trace;
+static struct lowl_trace *lowl_traces;
+static pthread_mutex_t lowl_traces_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns NULL if tracing is disabled; channels are never freed, so a reopened device continues its trace
+struct lowl_trace *lowl_trace_get(const char * const name)
+{
+	struct lowl_trace *trace;
+	
+	if (!opt_lowl_trace)
+		return NULL;
+	
+	mutex_lock(&lowl_traces_mutex);
+	HASH_FIND_STR(lowl_traces, name, trace);
+	if (!trace)
+	{
+		trace = malloc(sizeof(*trace));
+		*trace = (struct lowl_trace){
+			.name = strdup(name),
+			.recs = malloc(sizeof(*trace->recs) * opt_lowl_trace),
+			.recs_sz = opt_lowl_trace,
+		};
+		mutex_init(&trace->mutex);
+		HASH_ADD_KEYPTR(hh, lowl_traces, trace->name, strlen(trace->name), trace);
+	}
+	mutex_unlock(&lowl_traces_mutex);
+	
+	return trace;
+}
+
+void _lowl_trace_record(struct lowl_trace * const trace, const enum lowl_trace_dir dir, const void * const data, const size_t len)
+{
+	struct lowl_trace_rec *rec;
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	mutex_lock(&trace->mutex);
+	rec = &trace->recs[trace->next];
+	if (++trace->next == trace->recs_sz)
+		trace->next = 0;
+	if (trace->count < trace->recs_sz)
+		++trace->count;
+	++trace->total_recs;
+	trace->total_bytes += len;
+	rec->tv = tv_now;
+	rec->dir = dir;
+	rec->len = len;
+	memcpy(rec->data, data, (len < LOWL_TRACE_DATA_MAX) ? len : LOWL_TRACE_DATA_MAX);
+	mutex_unlock(&trace->mutex);
+}
+
+struct lowl_trace *lowl_trace_next(const struct lowl_trace * const prev)
+{
+	struct lowl_trace *trace;
+	
+	mutex_lock(&lowl_traces_mutex);
+	trace = prev ? prev->hh.next : lowl_traces;
+	mutex_unlock(&lowl_traces_mutex);
+	return trace;
+}
+
+struct lowl_trace *lowl_trace_find(const char * const name)
+{
+	struct lowl_trace *trace;
+	
+	mutex_lock(&lowl_traces_mutex);
+	HASH_FIND_STR(lowl_traces, name, trace);
+	mutex_unlock(&lowl_traces_mutex);
+	return trace;
+}
+
+const char *lowl_trace_name(const struct lowl_trace * const trace)
+{
+	return trace->name;
+}
+
+// Copies out the retained records (if out is not NULL), oldest first; caller must free *out
+int lowl_trace_snapshot(struct lowl_trace * const trace, struct lowl_trace_rec ** const out, uint64_t * const out_total_recs, uint64_t * const out_total_bytes)
+{
+	int count, first;
+	
+	mutex_lock(&trace->mutex);
+	count = trace->count;
+	first = (trace->next + trace->recs_sz - count) % trace->recs_sz;
+	if (out)
+	{
+		*out = malloc(sizeof(**out) * (count ?: 1));
+		if (first + count > trace->recs_sz)
+		{
+			const int n = trace->recs_sz - first;
+			memcpy(&(*out)[0], &trace->recs[first], sizeof(**out) * n);
+			memcpy(&(*out)[n], &trace->recs[0], sizeof(**out) * (count - n));
+		}
+		else
+			memcpy(*out, &trace->recs[first], sizeof(**out) * count);
+	}
+	if (out_total_recs)
+		*out_total_recs = trace->total_recs;
+	if (out_total_bytes)
+		*out_total_bytes = trace->total_bytes;
+	mutex_unlock(&trace->mutex);
+	
+	return count;
+}
+
+bool lowl_trace_save(struct lowl_trace * const trace, const char * const filename)
+{
+	struct lowl_trace_rec *recs;
+	char hex[(LOWL_TRACE_DATA_MAX * 2) + 1];
+	const int count = lowl_trace_snapshot(trace, &recs, NULL, NULL);
+	FILE *F;
+	int i;
+	
+	F = fopen(filename, "w");
+	if (!F)
+	{
+		applog(LOG_WARNING, "Unable to write lowlevel trace %s: %s", filename, bfg_strerror(errno, BST_ERRNO));
+		free(recs);
+		return false;
+	}
+	fprintf(F, "# %s\n", trace->name);
+	for (i = 0; i < count; ++i)
+	{
+		// time <tab> direction <tab> length <tab> data (hex, possibly truncated)
+		bin2hex(hex, recs[i].data, (recs[i].len < LOWL_TRACE_DATA_MAX) ? recs[i].len : LOWL_TRACE_DATA_MAX);
+		fprintf(F, "%ld.%06ld\t%c\t%lu\t%s\n", (long)recs[i].tv.tv_sec, (long)recs[i].tv.tv_usec, recs[i].dir, (unsigned long)recs[i].len, hex);
+	}
+	fclose(F);
+	free(recs);
+	applog(LOG_NOTICE, "Saved %d lowlevel trace records for %s to %s", count, trace->name, filename);
+	return true;
+}
+
+// Reads a trace written by lowl_trace_save; caller must free the result
+struct lowl_trace_rec *lowl_trace_load(const char * const filename, int * const out_count)
+{
+	struct lowl_trace_rec *recs = NULL, *rec;
+	char buf[0x40 + (LOWL_TRACE_DATA_MAX * 2)], *p, *fields[4];
+	int count = 0, recs_sz = 0, n;
+	size_t hexlen;
+	FILE *F;
+	
+	F = fopen(filename, "r");
+	if (!F)
+	{
+		applog(LOG_ERR, "Unable to open lowlevel trace %s: %s", filename, bfg_strerror(errno, BST_ERRNO));
+		return NULL;
+	}
+	while (fgets(buf, sizeof(buf), F))
+	{
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if (buf[0] == '#')
+			continue;
+		p = buf;
+		for (n = 0; n < 4 && p; ++n)
+		{
+			fields[n] = p;
+			p = strchr(p, '\t');
+			if (p)
+				*(p++) = '\0';
+		}
+		if (n < 4 || !(fields[1][0] == LTD_READ || fields[1][0] == LTD_WRITE))
+			continue;
+		hexlen = strlen(fields[3]) / 2;
+		if (hexlen > LOWL_TRACE_DATA_MAX)
+			hexlen = LOWL_TRACE_DATA_MAX;
+		if (count == recs_sz)
+		{
+			recs_sz = recs_sz ? (recs_sz * 2) : 0x100;
+			recs = realloc(recs, sizeof(*recs) * recs_sz);
+		}
+		rec = &recs[count];
+		rec->tv.tv_sec = atol(fields[0]);
+		p = strchr(fields[0], '.');
+		rec->tv.tv_usec = p ? atol(&p[1]) : 0;
+		rec->dir = fields[1][0];
+		rec->len = strtoul(fields[2], NULL, 0);
+		if (hexlen != ((rec->len < LOWL_TRACE_DATA_MAX) ? rec->len : LOWL_TRACE_DATA_MAX) || !hex2bin(rec->data, fields[3], hexlen))
+			continue;
+		++count;
+	}
+	fclose(F);
+	
+	*out_count = count;
+	return recs;
+}
@@ -55,6 +55,49 @@ extern int _lowlevel_detect(lowl_found_devinfo_func_t, const char *serial, const
 extern int lowlevel_detect_id(lowl_found_devinfo_func_t, void *, const struct lowlevel_driver *, int32_t vid, int32_t pid);
 extern void lowlevel_scan_free();
 
+extern char *opt_probe_cache_file;
+extern bool lowlevel_probe_cache_get(struct lowlevel_device_info *infolist, char *out_dname, size_t out_dnamesz, struct lowlevel_device_info **out_info);
+extern void lowlevel_probe_cache_begin(const struct lowlevel_device_info *, const char *dname);
+extern const char *lowlevel_probe_cache_param();
+extern void lowlevel_probe_cache_set_param(const char *);
+extern void lowlevel_probe_cache_found(const struct lowlevel_device_info *, const char *dname, double probe_secs);
+extern void lowlevel_probe_cache_forget(const struct lowlevel_device_info *);
+extern void lowlevel_probe_cache_save();
+
+#define LOWL_TRACE_DATA_MAX  0x80
+
+enum lowl_trace_dir {
+	LTD_READ  = 'R',
+	LTD_WRITE = 'W',
+};
+
+struct lowl_trace_rec {
+	struct timeval tv;
+	char dir;
+	// Full transfer length; only the first LOWL_TRACE_DATA_MAX bytes are kept
+	size_t len;
+	uint8_t data[LOWL_TRACE_DATA_MAX];
+};
+
+struct lowl_trace;
+
+extern int opt_lowl_trace;
+extern struct lowl_trace *lowl_trace_get(const char *name);
+extern void _lowl_trace_record(struct lowl_trace *, enum lowl_trace_dir, const void *, size_t);
+extern struct lowl_trace *lowl_trace_next(const struct lowl_trace *);
+extern struct lowl_trace *lowl_trace_find(const char *name);
+extern const char *lowl_trace_name(const struct lowl_trace *);
+extern int lowl_trace_snapshot(struct lowl_trace *, struct lowl_trace_rec **out, uint64_t *out_total_recs, uint64_t *out_total_bytes);
+extern bool lowl_trace_save(struct lowl_trace *, const char *filename);
+extern struct lowl_trace_rec *lowl_trace_load(const char *filename, int *out_count);
+
+static inline
+void lowl_trace_record(struct lowl_trace * const trace, const enum lowl_trace_dir dir, const void * const data, const ssize_t len)
+{
+	if (unlikely(trace) && len > 0)
+		_lowl_trace_record(trace, dir, data, len);
+}
+
 extern struct lowlevel_device_info *lowlevel_ref(const struct lowlevel_device_info *);
 #define lowlevel_claim(drv, verbose, info)  \
 	bfg_claim_any(drv, (verbose) ? ((info)->path ?: "") : NULL, (info)->devid)
@@ -76,6 +76,16 @@
 #include "compat.h"
 #include "deviceapi.h"
 #include "logging.h"
+#include "lowl-reactor.h"
+#ifdef NEED_BFG_LOWL_VCOM
+#include "lowl-vcom.h"
+#endif
+#if defined(NEED_BFG_LOWL_VCOM) && !defined(WIN32)
+#include "lowl-emu.h"
+#endif
+#ifdef HAVE_LIBUSB
+#include "lowl-usb.h"
+#endif
 #include "miner.h"
 #include "adl.h"
 #include "driver-cpu.h"
@@ -137,6 +147,7 @@ static uint32_t template_nonce;
 char *opt_coinbase_sig;
 #endif
 static enum bfg_quit_summary opt_quit_summary = BQS_DEFAULT;
+enum bfg_unlock_yield opt_unlock_yield = BUY_ALWAYS;
 static bool include_serial_in_statline;
 char *request_target_str;
 float request_pdiff = 1.0;
@@ -160,8 +171,13 @@ int opt_queue = 1;
 int opt_scantime = 60;
 int opt_expiry = 120;
 int opt_expiry_lp = 3600;
+static int opt_block_notify_port;
+static int opt_getwork_concurrency = 1;
+static bool opt_work_prefetch = true;
+static int opt_standby_pools;
 unsigned long long global_hashrate;
 static bool opt_unittest = false;
+bool opt_unittest_bench;
 unsigned unittest_failures;
 unsigned long global_quota_gcd = 1;
 time_t last_getwork;
@@ -195,6 +211,12 @@ int hotplug_delay_ms = 100;
 #else
 const bool opt_hotplug;
 #endif
+#ifdef HAVE_BFG_LOWLEVEL
+int opt_probe_threads = 16;
+static int probe_slots_used;
+static pthread_mutex_t probe_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_slots_cond = PTHREAD_COND_INITIALIZER;
+#endif
 struct string_elist *scan_devices;
 static struct string_elist *opt_set_device_list;
 bool opt_force_dev_init;
@@ -297,10 +319,11 @@ notifier_t submit_waiting_notifier;
 int hw_errors;
 int total_accepted, total_rejected;
 int total_getworks, total_stale, total_discarded;
+static struct bfg_tls_counters tls_counters_zeroed;
 uint64_t total_bytes_rcvd, total_bytes_sent;
 double total_diff1, total_bad_diff1;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
-static int staged_rollable, staged_spare;
+static int staged_rollable, staged_spare, staged_variants, staged_standby;
 unsigned int new_blocks;
 unsigned int found_blocks;
 
@@ -1174,7 +1197,9 @@ struct pool *add_pool2(struct mining_goal_info * const goal)
 		quit(1, "Failed to pthread_cond_init in add_pool");
 	cglock_init(&pool->data_lock);
 	pool->swork.data_lock_p = &pool->data_lock;
+	timer_unset(&pool->tv_getfail);
 	mutex_init(&pool->stratum_lock);
+	mutex_init(&pool->gbt_merkle_lock);
 	timer_unset(&pool->swork.tv_transparency);
 	pool->swork.pool = pool;
 	pool->goal = goal;
@@ -1282,6 +1307,15 @@ char *set_bool_ignore_arg(const char * const arg, bool * const b)
 	return opt_set_bool(b);
 }
 
+// Unit tests, with their timing runs at full length
+static
+char *set_unittest_bench(__maybe_unused void * const dummy)
+{
+	opt_unittest = true;
+	opt_unittest_bench = true;
+	return NULL;
+}
+
 char *set_int_range(const char *arg, int *i, int min, int max)
 {
 	char *err = opt_set_intval(arg, i);
@@ -1414,6 +1448,22 @@ char *set_quit_summary(const char * const arg)
 	return NULL;
 }
 
+static
+char *set_unlock_yield(const char * const arg)
+{
+	if (!(strcasecmp(arg, "always") && strcasecmp(arg, "yes")))
+		opt_unlock_yield = BUY_ALWAYS;
+	else
+	if (!(strcasecmp(arg, "contended") && strcasecmp(arg, "waiters")))
+		opt_unlock_yield = BUY_CONTENDED;
+	else
+	if (!(strcasecmp(arg, "never") && strcasecmp(arg, "no")))
+		opt_unlock_yield = BUY_NEVER;
+	else
+		return "Unlock yield policy must be one of always/contended/never";
+	return NULL;
+}
+
 static void pdiff_target_leadzero(void *, double);
 
 char *set_request_diff(const char *arg, float *p)
@@ -1872,6 +1922,19 @@ const char *goal_set(struct mining_goal_info * const goal, const char * const op
 		goal_set_malgo(goal, new_malgo);
 		goto success;
 	}
+	if (!strcasecmp(optname, "weight"))
+	{
+		if (!newvalue)
+			return "Goal option 'weight' requires a value";
+		char *endptr;
+		const double weight = strtod(newvalue, &endptr);
+		if (endptr == newvalue || *endptr || !(weight >= 0))
+			return "Goal weight must be a non-negative number";
+		mutex_lock(stgd_lock);
+		goal->weight = weight;
+		mutex_unlock(stgd_lock);
+		goto success;
+	}
 #if BLKMAKER_VERSION > 1
 	if (match_strtok("generate-to|generate-to-addr|generate-to-address|genaddress|genaddr|gen-address|gen-addr|generate-address|generate-addr|coinbase-addr|coinbase-address|coinbase-payout|cbaddress|cbaddr|cb-address|cb-addr|payout", "|", optname))
 	{
@@ -1892,7 +1955,6 @@ success:
 }
 
 // May leak replybuf if returning an error
-static
 const char *set_goal_params(struct mining_goal_info * const goal, char *arg)
 {
 	bytes_t replybuf = BYTES_INIT;
@@ -2359,6 +2421,9 @@ static struct opt_table opt_config_table[] = {
 			opt_set_bool, &opt_bfl_noncerange,
 			"Use nonce range on bitforce devices if supported"),
 #endif
+	OPT_WITH_ARG("--block-notify-port",
+		     set_int_1_to_65535, opt_show_intval, &opt_block_notify_port,
+		     "Listen for new block notifications on this localhost UDP port"),
 #ifdef HAVE_CHROOT
         OPT_WITH_ARG("--chroot-dir",
                      opt_set_charp, NULL, &chroot_dir,
@@ -2400,6 +2465,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--debuglog",
 		     opt_set_bool, &opt_debug,
 		     "Enable debug logging"),
+#if defined(NEED_BFG_LOWL_VCOM) && !defined(WIN32)
+	OPT_WITH_ARG("--device-emulator",
+		     bfg_emu_add, NULL, NULL,
+		     "Emulate a device on a pseudo-terminal for testing: icarus, bitforce or klondike, optionally followed by :count, or replay:<type>:<trace file>"),
+#endif
 	OPT_WITHOUT_ARG("--device-protocol-dump",
 			opt_set_bool, &opt_dev_protocol,
 			"Verbose dump of device protocol-level activities"),
@@ -2442,6 +2512,9 @@ static struct opt_table opt_config_table[] = {
 	             set_generate_addr, NULL, NULL,
 	             opt_hidden),
 #endif
+	OPT_WITH_ARG("--getwork-concurrency",
+	             set_int_1_to_65535, opt_show_intval, &opt_getwork_concurrency,
+	             "Maximum number of getwork/GBT requests in progress per pool"),
 #ifdef USE_OPENCL
 	OPT_WITH_ARG("--gpu-dyninterval",
 		     set_int_1_to_65535, opt_show_intval, &opt_dynamic_interval,
@@ -2500,6 +2573,9 @@ static struct opt_table opt_config_table[] = {
 	             set_kernel, NULL, NULL,
 	             opt_hidden),
 #endif
+	OPT_WITHOUT_ARG("--io-reactor",
+			opt_set_bool, &opt_io_reactor,
+			"Run capable devices (currently only the icarus driver) from one shared I/O thread, instead of a thread each"),
 #ifdef USE_ICARUS
 	OPT_WITH_ARG("--icarus-options",
 		     set_icarus_options, NULL, NULL,
@@ -2521,6 +2597,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--load-balance",
 		     set_loadbalance, &pool_strategy,
 		     "Change multipool strategy from failover to quota based balance"),
+#ifdef USE_LOCK_STATS
+	OPT_WITHOUT_ARG("--lock-stats",
+	                opt_set_bool, &opt_lock_stats,
+	                "Profile lock contention per call site, for the lockstats RPC command and a summary on exit"),
+#endif
 	OPT_WITH_ARG("--log|-l",
 		     set_int_0_to_9999, opt_show_intval, &opt_log_interval,
 		     "Interval in seconds between log output"),
@@ -2533,6 +2614,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--log-microseconds",
 	                opt_set_bool, &opt_log_microseconds,
 	                "Include microseconds in log output"),
+#ifdef HAVE_BFG_LOWLEVEL
+	OPT_WITH_ARG("--lowl-trace",
+		     set_int_0_to_9999, opt_show_intval, &opt_lowl_trace,
+		     "Keep a trace of the last N lowlevel reads and writes for each device, for the lowltrace RPC command"),
+#endif
 #if defined(unix) || defined(__APPLE__)
 	OPT_WITH_ARG("--monitor|-m",
 		     opt_set_charp, NULL, &opt_stderr_cmd,
@@ -2599,6 +2685,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--no-submit-stale",
 			opt_set_invbool, &opt_submit_stale,
 		        "Don't submit shares if they are detected as stale"),
+	OPT_WITHOUT_ARG("--no-work-prefetch",
+			opt_set_invbool, &opt_work_prefetch,
+			"Don't fetch the next work/template from getwork/GBT pools before it is needed"),
 #ifdef USE_OPENCL
 	OPT_WITHOUT_ARG("--no-opencl-binaries",
 	                set_no_opencl_binaries, NULL,
@@ -2637,6 +2726,14 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--force-rollntime",  // NOTE: must be after --pass for config file ordering
 			 set_pool_force_rollntime, NULL, NULL,
 			 opt_hidden),
+#ifdef HAVE_BFG_LOWLEVEL
+	OPT_WITH_ARG("--probe-cache",
+		     opt_set_charp, NULL, &opt_probe_cache_file,
+		     "File to remember which driver claimed each device, so it is probed first next time"),
+	OPT_WITH_ARG("--probe-threads",
+		     set_int_0_to_9999, opt_show_intval, &opt_probe_threads,
+		     "Maximum number of devices to probe at once (0 = unlimited)"),
+#endif
 	OPT_WITHOUT_ARG("--protocol-dump|-P",
 			opt_set_bool, &opt_protocol,
 			"Verbose dump of protocol-level activities"),
@@ -2735,6 +2832,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks proxy (host:port)"),
+	OPT_WITH_ARG("--standby-pools",
+	             set_int_0_to_9999, opt_show_intval, &opt_standby_pools,
+	             "Number of backup pools to keep connected with work ready for failover"),
 #ifdef USE_LIBEVENT
 	OPT_WITH_ARG("--stratum-port",
 	             set_long_1_to_65535_or_neg1, opt_show_longval, &stratumsrv_port,
@@ -2783,6 +2883,9 @@ static struct opt_table opt_config_table[] = {
 	                opt_set_bool, &use_unicode,
 	                "Use Unicode characters in TUI"),
 #endif
+	OPT_WITH_ARG("--unlock-yield",
+	             set_unlock_yield, NULL, NULL,
+	             "When to yield the CPU after releasing a lock: always/contended/never (default: always)"),
 	OPT_WITH_ARG("--url|-o",
 		     set_url, NULL, NULL,
 		     "URL for bitcoin JSON-RPC server"),
@@ -2810,6 +2913,8 @@ static struct opt_table opt_config_table[] = {
 #endif
 	OPT_WITHOUT_ARG("--unittest",
 			opt_set_bool, &opt_unittest, opt_hidden),
+	OPT_WITHOUT_ARG("--unittest-bench",
+			set_unittest_bench, NULL, opt_hidden),
 	OPT_WITH_ARG("--coinbase-check-addr",
 			set_cbcaddr, NULL, NULL,
 			"A list of address to check against in coinbase payout list received from the previous-defined pool, separated by ','"),
@@ -3294,12 +3399,10 @@ bool pool_may_redirect_to(struct pool * const pool, const char * const uri)
 	return match_domains(pool->rpc_url, strlen(pool->rpc_url), uri, strlen(uri));
 }
 
-void pool_check_coinbase(struct pool * const pool, const uint8_t * const cbtxn, const size_t cbtxnsz)
+static
+void pool_coinbase_checked(struct pool * const pool, const bool ok)
 {
-	if (uri_get_param_bool(pool->rpc_url, "skipcbcheck", false))
-	{}
-	else
-	if (!check_coinbase(cbtxn, cbtxnsz, &pool->cb_param))
+	if (!ok)
 	{
 		if (pool->enabled == POOL_ENABLED)
 		{
@@ -3315,6 +3418,167 @@ void pool_check_coinbase(struct pool * const pool, const uint8_t * const cbtxn,
 	}
 }
 
+/* Coinbases which passed the check are remembered per pool (most recent
+ * first), so repeated notifies only cost a hash. New ones are checked by
+ * coinbase_check_thread, to keep the parsing off the pool's thread; work
+ * generated from them meanwhile is marked, and its shares are held until
+ * the check is done (see work_coinbase_ok). Those which failed are
+ * remembered too, so such shares can be dropped. */
+struct coinbase_check_req {
+	struct pool *pool;
+	uint8_t digest[0x20];
+	bytes_t coinbase;
+	struct coinbase_check_req *next;
+};
+
+static pthread_mutex_t cbcheck_lock;
+static pthread_cond_t cbcheck_cond;
+// Broadcast whenever a queued check completes
+static pthread_cond_t cbcheck_done_cond;
+static struct coinbase_check_req *cbcheck_queue;
+
+static
+bool cbcheck_cache_find(uint8_t (* const cache)[0x20], const int cached, const uint8_t * const digest)
+{
+	for (int i = 0; i < cached; ++i)
+		if (!memcmp(cache[i], digest, 0x20))
+		{
+			memmove(cache[1], cache[0], i * 0x20);
+			memcpy(cache[0], digest, 0x20);
+			return true;
+		}
+	return false;
+}
+
+static
+void cbcheck_cache_add(uint8_t (* const cache)[0x20], int * const cachedp, const uint8_t * const digest)
+{
+	if (cbcheck_cache_find(cache, *cachedp, digest))
+		return;
+	if (*cachedp < COINBASE_CHECK_CACHE_SIZE)
+		++*cachedp;
+	memmove(cache[1], cache[0], (*cachedp - 1) * 0x20);
+	memcpy(cache[0], digest, 0x20);
+}
+
+static
+bool cbcheck_queued(struct pool * const pool, const uint8_t * const digest)
+{
+	struct coinbase_check_req *req;
+	
+	LL_FOREACH(cbcheck_queue, req)
+		if (req->pool == pool && !memcmp(req->digest, digest, 0x20))
+			return true;
+	return false;
+}
+
+static
+void *coinbase_check_thread(__maybe_unused void *userdata)
+{
+	struct coinbase_check_req *req;
+	bool ok;
+	
+	pthread_detach(pthread_self());
+	RenameThread("cbcheck");
+	
+	mutex_lock(&cbcheck_lock);
+	while (true)
+	{
+		while (!(req = cbcheck_queue))
+			pthread_cond_wait(&cbcheck_cond, &cbcheck_lock);
+		mutex_unlock(&cbcheck_lock);
+		
+		struct pool * const pool = req->pool;
+		ok = check_coinbase(bytes_buf(&req->coinbase), bytes_len(&req->coinbase), &pool->cb_param);
+		pool_coinbase_checked(pool, ok);
+		
+		mutex_lock(&cbcheck_lock);
+		if (ok)
+			cbcheck_cache_add(pool->cbcheck_cache, &pool->cbcheck_cached, req->digest);
+		else
+			cbcheck_cache_add(pool->cbcheck_failed, &pool->cbcheck_failed_count, req->digest);
+		LL_DELETE(cbcheck_queue, req);
+		pthread_cond_broadcast(&cbcheck_done_cond);
+		bytes_free(&req->coinbase);
+		free(req);
+	}
+	
+	return NULL;
+}
+
+/* The nonce2 (or GBT extranonce) space at gap_offset is excluded from the
+ * cache key, since it doesn't affect the check. Returns false if the check is
+ * still pending, in which case out_digest identifies it for work_coinbase_ok */
+bool pool_check_coinbase(struct pool * const pool, const uint8_t * const cbtxn, const size_t cbtxnsz, const size_t gap_offset, const size_t gap_len, uint8_t * const out_digest)
+{
+	struct cgminer_pool_stats * const pool_stats = &pool->cgminer_pool_stats;
+	struct coinbase_check_req *req;
+	uint8_t digest[0x20];
+	sha256_ctx ctx;
+	
+	if (uri_get_param_bool(pool->rpc_url, "skipcbcheck", false))
+		return true;
+	
+	sha256_init(&ctx);
+	if (gap_offset + gap_len <= cbtxnsz)
+	{
+		sha256_update(&ctx, cbtxn, gap_offset);
+		sha256_update(&ctx, &cbtxn[gap_offset + gap_len], cbtxnsz - gap_offset - gap_len);
+	}
+	else
+		sha256_update(&ctx, cbtxn, cbtxnsz);
+	sha256_final(&ctx, digest);
+	
+	mutex_lock(&cbcheck_lock);
+	if (cbcheck_cache_find(pool->cbcheck_cache, pool->cbcheck_cached, digest))
+	{
+		++pool_stats->cbcheck_hits;
+		mutex_unlock(&cbcheck_lock);
+		pool_coinbase_checked(pool, true);
+		return true;
+	}
+	++pool_stats->cbcheck_misses;
+	memcpy(out_digest, digest, 0x20);
+	
+	// Don't queue the same coinbase twice
+	if (!cbcheck_queued(pool, digest))
+	{
+		req = malloc(sizeof(*req));
+		*req = (struct coinbase_check_req){
+			.pool = pool,
+		};
+		memcpy(req->digest, digest, 0x20);
+		bytes_init(&req->coinbase);
+		bytes_append(&req->coinbase, cbtxn, cbtxnsz);
+		LL_APPEND(cbcheck_queue, req);
+		pthread_cond_signal(&cbcheck_cond);
+	}
+	mutex_unlock(&cbcheck_lock);
+	return false;
+}
+
+/* For work generated while its coinbase was still being checked, waits for
+ * the check to finish and returns whether the coinbase passed */
+static
+bool work_coinbase_ok(struct work * const work)
+{
+	struct pool * const pool = work->pool;
+	bool ok;
+	
+	if (likely(!work->cbcheck_pending))
+		return true;
+	
+	mutex_lock(&cbcheck_lock);
+	while (cbcheck_queued(pool, work->cbcheck_digest))
+		pthread_cond_wait(&cbcheck_done_cond, &cbcheck_lock);
+	ok = !cbcheck_cache_find(pool->cbcheck_failed, pool->cbcheck_failed_count, work->cbcheck_digest);
+	mutex_unlock(&cbcheck_lock);
+	
+	if (ok)
+		work->cbcheck_pending = false;
+	return ok;
+}
+
 void set_simple_ntime_roll_limit(struct ntime_roll_limits * const nrl, const uint32_t ntime_base, const int ntime_roll, const struct timeval * const tvp_ref)
 {
 	const int offsets = max(ntime_roll, 60);
@@ -3469,6 +3733,145 @@ void refresh_bitcoind_address(struct mining_goal_info * const goal, const bool f
 }
 #endif
 
+static
+void gbt_merkle_free(struct gbt_merkle_tree * const tree)
+{
+	for (int k = 0; k < GBT_MERKLE_MAX_LEVELS; ++k)
+		bytes_free(&tree->level[k]);
+	tree->levels = 0;
+}
+
+/* Updates the tree for a new list of transaction hashes, only rehashing the
+ * nodes which depend on transactions after the first changed one.
+ * Returns the number of node hashes computed, -1 if nothing changed, or -2 if
+ * the tree would be too deep (it is then emptied) */
+static
+int gbt_merkle_update(struct gbt_merkle_tree * const tree, const uint8_t * const txids, const size_t txcount)
+{
+	bytes_t * const leaves = &tree->level[0];
+	const size_t oldcount = bytes_len(leaves) / 0x20;
+	const size_t newcount = txcount + 1;
+	size_t dirty, cnt, nextcnt, oldnextcnt, j;
+	uint8_t buf[0x40];
+	int k, hashes = 0;
+	
+	for (dirty = 1; dirty < oldcount && dirty < newcount; ++dirty)
+		if (memcmp(&bytes_buf(leaves)[dirty * 0x20], &txids[(dirty - 1) * 0x20], 0x20))
+			break;
+	if (dirty == oldcount && dirty == newcount && oldcount)
+		return -1;
+	
+	bytes_resize(leaves, newcount * 0x20);
+	memset(bytes_buf(leaves), 0, 0x20);
+	memcpy(&bytes_buf(leaves)[dirty * 0x20], &txids[(dirty - 1) * 0x20], (newcount - dirty) * 0x20);
+	
+	cnt = newcount;
+	for (k = 0; cnt > 1; ++k)
+	{
+		if (unlikely(k + 1 >= GBT_MERKLE_MAX_LEVELS))
+		{
+			gbt_merkle_free(tree);
+			return -2;
+		}
+		bytes_t * const level = &tree->level[k];
+		bytes_t * const next = &tree->level[k + 1];
+		nextcnt = (cnt + 1) / 2;
+		oldnextcnt = (k < tree->levels) ? (bytes_len(next) / 0x20) : 0;
+		bytes_resize(next, nextcnt * 0x20);
+		memset(bytes_buf(next), 0, 0x20);
+		
+		// A change in node count can also change which node gets duplicated
+		if (dirty > cnt)
+			dirty = cnt;
+		if (dirty > oldnextcnt * 2)
+			dirty = oldnextcnt * 2;
+		
+		for (j = (dirty / 2) ?: 1; j < nextcnt; ++j)
+		{
+			const uint8_t * const left = &bytes_buf(level)[j * 0x40];
+			memcpy(&buf[0], left, 0x20);
+			memcpy(&buf[0x20], (j * 2 + 1 < cnt) ? &left[0x20] : left, 0x20);
+			gen_hash(buf, &bytes_buf(next)[j * 0x20], 0x40);
+			++hashes;
+		}
+		
+		dirty = (dirty / 2) ?: 1;
+		cnt = nextcnt;
+	}
+	tree->levels = k;
+	
+	return hashes;
+}
+
+static
+void gbt_merkle_branch(const struct gbt_merkle_tree * const tree, bytes_t * const out)
+{
+	bytes_resize(out, tree->levels * 0x20);
+	for (int k = 0; k < tree->levels; ++k)
+		memcpy(&bytes_buf(out)[k * 0x20], &bytes_buf(&tree->level[k])[0x20], 0x20);
+}
+
+#if BLKMAKER_VERSION > 6
+/* libblkmaker has no public way to take a precomputed branch. Its
+ * blkmk_get_mdata only builds _mrklbranch/_mrklbranchcount when they are
+ * unset (and frees them with the template), which is only relied on for the
+ * libblkmaker version this was checked against; others build their own. */
+#define GBT_MERKLE_SEED_BLKMAKER_VERSION  7
+
+#if BLKMAKER_VERSION == GBT_MERKLE_SEED_BLKMAKER_VERSION
+static
+void gbt_template_txids(const blktemplate_t * const tmpl, bytes_t * const out)
+{
+	bytes_resize(out, tmpl->txncount * 0x20);
+	for (unsigned long i = 0; i < tmpl->txncount; ++i)
+	{
+		const struct blktxn_t * const txn = &tmpl->txns[i];
+		const void * const txid = txn->txid ?: txn->hash_;
+		uint8_t * const dst = &bytes_buf(out)[i * 0x20];
+		if (txid)
+			memcpy(dst, txid, 0x20);
+		else
+			gen_hash(txn->data, dst, txn->datasz);
+	}
+}
+#endif
+
+// Gives libblkmaker the coinbase branch from the incremental tree, so it does not rehash every transaction itself
+// Returns the number of node hashes computed, as gbt_merkle_update
+static
+int gbt_merkle_seed(struct gbt_merkle_tree * const tree, blktemplate_t * const tmpl)
+{
+#if BLKMAKER_VERSION == GBT_MERKLE_SEED_BLKMAKER_VERSION
+	bytes_t txids = BYTES_INIT, branch = BYTES_INIT;
+	int hashes;
+	
+	if (tmpl->_mrklbranch)
+		return -1;
+	gbt_template_txids(tmpl, &txids);
+	hashes = gbt_merkle_update(tree, bytes_buf(&txids), tmpl->txncount);
+	bytes_free(&txids);
+	if (unlikely(hashes == -2))
+		// libblkmaker will just build the branch itself
+		return hashes;
+	gbt_merkle_branch(tree, &branch);
+	libblkmaker_hash_t * const mrklbranch = malloc(bytes_len(&branch) ?: 1);
+	if (unlikely(!mrklbranch))
+	{
+		bytes_free(&branch);
+		applog(LOG_WARNING, "%s: Failed to malloc merkle branch, leaving it to libblkmaker", __func__);
+		return -2;
+	}
+	memcpy(mrklbranch, bytes_buf(&branch), bytes_len(&branch));
+	tmpl->_mrklbranch = mrklbranch;
+	tmpl->_mrklbranchcount = tree->levels;
+	bytes_free(&branch);
+	return hashes;
+#else
+	return -1;
+#endif
+}
+#endif
+
 #define GBT_XNONCESZ (sizeof(uint32_t))
 
 #if BLKMAKER_VERSION > 6
@@ -3500,6 +3903,19 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 			applog(LOG_ERR, "blktmpl error: %s", err);
 			return false;
 		}
+#if BLKMAKER_VERSION > 6
+		{
+			struct timeval tv_start;
+			int hashes;
+			
+			timer_set_now(&tv_start);
+			mutex_lock(&pool->gbt_merkle_lock);
+			hashes = gbt_merkle_seed(&pool->gbt_merkle, tmpl);
+			mutex_unlock(&pool->gbt_merkle_lock);
+			applog(LOG_DEBUG, "Pool %u: Merkle tree for %lu transactions updated with %d hashes in %.6fs",
+			       pool->pool_no, (unsigned long)tmpl->txncount, hashes, timer_elapsed_us(&tv_start, NULL) / 1e6);
+		}
+#endif
 		work->rolltime = blkmk_time_left(tmpl, tv_now.tv_sec);
 #if BLKMAKER_VERSION > 1
 		struct mining_goal_info * const goal = pool->goal;
@@ -3670,8 +4086,12 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 		{
 			struct stratum_work * const swork = &pool->swork;
 			const size_t branchdatasz = branchcount * 0x20;
+			uint8_t cbcheck_digest[0x20];
 			
-			pool_check_coinbase(pool, cbtxn, cbtxnsz);
+			// The template's own work shares the coinbase, so it waits on the same check
+			work->cbcheck_pending = !pool_check_coinbase(pool, cbtxn, cbtxnsz, cbextranonceoffset, GBT_XNONCESZ, cbcheck_digest);
+			if (work->cbcheck_pending)
+				memcpy(work->cbcheck_digest, cbcheck_digest, sizeof(cbcheck_digest));
 			
 			cg_wlock(&pool->data_lock);
 			if (swork->tr)
@@ -3680,24 +4100,40 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 			tmpl_incref(swork->tr);
 			bytes_assimilate_raw(&swork->coinbase, cbtxn, cbtxnsz, cbtxnsz);
 			swork->nonce2_offset = cbextranonceoffset;
+			swork->cbcheck_pending = work->cbcheck_pending;
+			memcpy(swork->cbcheck_digest, cbcheck_digest, sizeof(swork->cbcheck_digest));
 			bytes_assimilate_raw(&swork->merkle_bin, branches, branchdatasz, branchdatasz);
 			swork->merkles = branchcount;
 			swap32yes(swork->header1, &buf[0], 36 / 4);
 			swork->ntime = le32toh(*(uint32_t *)(&buf[68]));
 			swork->tv_received = tv_now;
+			swork->ntime_roll_limits = work->ntime_roll_limits;
 			swap32yes(swork->diffbits, &buf[72], 4 / 4);
 			memcpy(swork->target, work->target, sizeof(swork->target));
 			free(swork->job_id);
 			swork->job_id = NULL;
+			++swork->job_gen;
 			swork->clean = true;
 			swork->work_restart_id = pool->work_restart_id;
 			// FIXME: Do something with expire
 			pool->nonce2sz = swork->n2size = GBT_XNONCESZ;
 			pool->nonce2 = 0;
 			cg_wunlock(&pool->data_lock);
+			applog(LOG_DEBUG, "Pool %u: Template with %lu transactions ready for work in %.6fs",
+			       pool->pool_no, (unsigned long)tmpl->txncount, timer_elapsed_us(&tv_now, NULL) / 1e6);
 		}
 		else
+		{
 			applog(LOG_DEBUG, "blkmk_get_mdata failed for pool %u", pool->pool_no);
+			// Don't keep generating jobs from an older template
+			cg_wlock(&pool->data_lock);
+			if (pool->swork.tr)
+			{
+				tmpl_decref(pool->swork.tr);
+				pool->swork.tr = NULL;
+			}
+			cg_wunlock(&pool->data_lock);
+		}
 	}
 #endif  // BLKMAKER_VERSION > 6
 	pool_set_opaque(pool, !work->tr);
@@ -3734,7 +4170,7 @@ void decay_time(double *f, double fadd, double fsecs)
 static
 int __total_staged(const bool include_spares)
 {
-	int tot = HASH_COUNT(staged_work);
+	int tot = HASH_COUNT(staged_work) + staged_variants - staged_standby;
 	if (!include_spares)
 		tot -= staged_spare;
 	return tot;
@@ -5174,7 +5610,7 @@ static
 void maybe_local_submit(const struct work *work)
 {
 #if BLKMAKER_VERSION > 3
-	if (unlikely(work->block && work->tr))
+	if (unlikely(work->block && work->tr && !work->block_broadcast))
 	{
 		// This is a block with a full template (GBT)
 		// Regardless of the result, submit to local bitcoind(s) as well
@@ -5771,6 +6207,80 @@ out:
 	return pool;
 }
 
+/* When goals have weights, work is generated for whichever weighted goal has
+ * the least staged relative to its weight, so each goal's share of the queue
+ * follows its weight (hash_pop likewise hands out work by weight). Within a
+ * goal, the highest priority usable pool is used, unless the strategy already
+ * picked one */
+static
+struct pool *select_weighted_pool(struct pool * const pool)
+{
+	struct mining_goal_info *goal, *tmpgoal, *best_goal = NULL;
+	struct pool *best_pool = NULL;
+	double best_fill = 0;
+	int i;
+	
+	mutex_lock(stgd_lock);
+	HASH_ITER(hh, mining_goals, goal, tmpgoal)
+	{
+		if (goal->weight <= 0)
+			continue;
+		const double fill = goal->staged / goal->weight;
+		if (best_goal && fill >= best_fill)
+			continue;
+		
+		struct pool *goal_pool = NULL;
+		if (pool->goal == goal && !pool_unworkable(pool))
+			goal_pool = pool;
+		else
+		for (i = 0; i < total_pools; ++i)
+		{
+			struct pool * const tp = priority_pool(i);
+			if (tp->goal == goal && !pool_unworkable(tp))
+			{
+				goal_pool = tp;
+				break;
+			}
+		}
+		if (!goal_pool)
+			continue;
+		
+		best_goal = goal;
+		best_pool = goal_pool;
+		best_fill = fill;
+	}
+	mutex_unlock(stgd_lock);
+	
+	if (!best_pool || best_pool == pool)
+		return pool;
+	applog(LOG_DEBUG, "Selecting pool %d for goal '%s' by weight", best_pool->pool_no, best_goal->name);
+	return best_pool;
+}
+
+/* Totals for __goal_work_deficit; total_weight is zero unless goals are
+ * weighted. Must be called with stgd_lock held */
+static
+void __goal_work_totals(double * const out_total_weight, uint64_t * const out_total_works)
+{
+	struct mining_goal_info *goal, *tmpgoal;
+	
+	*out_total_weight = 0;
+	*out_total_works = 0;
+	HASH_ITER(hh, mining_goals, goal, tmpgoal)
+	{
+		*out_total_weight += goal->weight;
+		*out_total_works += goal->works;
+	}
+}
+
+/* How many more works a goal should have been given by now, for its share of
+ * all works handed out to follow its weight */
+static
+double __goal_work_deficit(const struct mining_goal_info * const goal, const double total_weight, const uint64_t total_works)
+{
+	return goal->weight / total_weight * total_works - goal->works;
+}
+
 static double DIFFEXACTONE = 26959946667150639794667015087019630673637144422540572481103610249215.0;
 
 double target_diff(const unsigned char *target)
@@ -6089,47 +6599,50 @@ static enum pool_protocol pool_protocol_fallback(enum pool_protocol proto)
 	}
 }
 
-static bool get_upstream_work(struct work *work, CURL *curl)
+static char *get_upstream_work_req(struct work * const work)
 {
 	struct pool *pool = work->pool;
-	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
-	struct timeval tv_elapsed;
-	json_t *val = NULL;
-	bool rc = false;
-	char *url;
-	enum pool_protocol proto;
-
 	char *rpc_req;
 
 	if (pool->proto == PLP_NONE)
 		pool->proto = PLP_GETBLOCKTEMPLATE;
 
-tryagain:
 	rpc_req = prepare_rpc_req(work, pool->proto, NULL, pool);
 	work->pool = pool;
 	if (!rpc_req)
-		return false;
+		return NULL;
 
 	applog(LOG_DEBUG, "DBG: sending %s get RPC call: %s", pool->rpc_url, rpc_req);
 
-	url = pool->rpc_url;
-
 	cgtime(&work->tv_getwork);
+	pool->cgminer_pool_stats.getwork_attempts++;
+
+	return rpc_req;
+}
 
-	val = json_rpc_call(curl, url, pool->rpc_userpass, rpc_req, false,
-			    false, &work->rolltime, pool, false);
-	pool_stats->getwork_attempts++;
+/* Returns true if the failed request should be retried with another protocol */
+static bool get_upstream_work_fallback(struct pool * const pool)
+{
+	enum pool_protocol proto = pool_protocol_fallback(pool->proto);
 
-	free(rpc_req);
+	if (PLP_NONE == proto)
+		return false;
+	applog(LOG_WARNING, "Pool %u failed getblocktemplate request; falling back to getwork protocol", pool->pool_no);
+	pool->proto = proto;
+	return true;
+}
+
+static bool get_upstream_work_completed(struct work * const work, json_t * const val)
+{
+	struct pool *pool = work->pool;
+	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
+	struct timeval tv_elapsed;
+	bool rc = false;
 
 	if (likely(val)) {
 		rc = work_decode(pool, work, val);
 		if (unlikely(!rc))
 			applog(LOG_DEBUG, "Failed to decode work in get_upstream_work");
-	} else if (PLP_NONE != (proto = pool_protocol_fallback(pool->proto))) {
-		applog(LOG_WARNING, "Pool %u failed getblocktemplate request; falling back to getwork protocol", pool->pool_no);
-		pool->proto = proto;
-		goto tryagain;
 	} else
 		applog(LOG_DEBUG, "Failed json_rpc_call in get_upstream_work");
 
@@ -6164,6 +6677,24 @@ tryagain:
 	return rc;
 }
 
+static bool get_upstream_work(struct work *work, CURL *curl)
+{
+	struct pool *pool = work->pool;
+	json_t *val;
+	char *rpc_req;
+
+	do {
+		rpc_req = get_upstream_work_req(work);
+		if (!rpc_req)
+			return false;
+		val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, rpc_req, false,
+		                    false, &work->rolltime, pool, false);
+		free(rpc_req);
+	} while (!val && get_upstream_work_fallback(pool));
+
+	return get_upstream_work_completed(work, val);
+}
+
 #ifdef HAVE_CURSES
 static void disable_curses(void)
 {
@@ -6479,6 +7010,8 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
+	// Pending variants belong to the staged original only
+	work->variants = 0;
 	if (base_work->job_id)
 		work->job_id = strdup(base_work->job_id);
 	if (base_work->nonce1)
@@ -6536,9 +7069,43 @@ static struct work *make_clone(struct work *work)
 
 static void stage_work(struct work *work);
 
+/* Whether another variant can be promised from this work without running out
+ * of rolls before it is generated */
+static bool work_variant_available(const struct work * const work)
+{
+	if (work->tr)
+		return blkmk_work_left(work->tr->tmpl) > (unsigned long)work->variants;
+	return (work->rolls + work->variants < 7000);
+}
+
+/* Generates one rolled copy of a staged work item. The staged work's current
+ * data is never handed out, so it can be copied as-is and then rolled for the
+ * next variant. Must be called with stgd_lock held */
+static struct work *__work_variant_make(struct work * const work)
+{
+	struct work *work_clone;
+	
+	if (work->variants)
+	{
+		--work->variants;
+		--staged_variants;
+		--work->pool->goal->staged;
+		--work_mining_algorithm(work)->staged;
+	}
+	work_clone = make_clone(work);
+	roll_work(work);
+	work->pool->works++;
+	applog(LOG_DEBUG, "%s: Rolled work %d to %d", __func__, work_clone->id, work->id);
+	
+	return work_clone;
+}
+
+/* Rather than staging a rolled copy of rollable work, a variant is merely
+ * counted against it; __work_variant_make still copies the work in full, but
+ * only once a driver asks for it, and with a single roll instead of two */
 static bool clone_available(void)
 {
-	struct work *work_clone = NULL, *work, *tmp;
+	struct work *work, *tmp;
 	bool cloned = false;
 
 	mutex_lock(stgd_lock);
@@ -6546,23 +7113,22 @@ static bool clone_available(void)
 		goto out_unlock;
 
 	HASH_ITER(hh, staged_work, work, tmp) {
-		if (can_roll(work) && should_roll(work)) {
-			roll_work(work);
-			work_clone = make_clone(work);
-			applog(LOG_DEBUG, "%s: Rolling work %d to %d", __func__, work->id, work_clone->id);
-			roll_work(work);
+		if (can_roll(work) && should_roll(work) && !work->standby && work_variant_available(work)) {
+			++work->variants;
+			++staged_variants;
+			++work->pool->goal->staged;
+			++work_mining_algorithm(work)->staged;
+			applog(LOG_DEBUG, "%s: Staged variant %d of work %d", __func__, work->variants, work->id);
 			cloned = true;
 			break;
 		}
 	}
 
+	if (cloned)
+		pthread_cond_broadcast(&getq->cond);
 out_unlock:
 	mutex_unlock(stgd_lock);
 
-	if (cloned) {
-		applog(LOG_DEBUG, "Pushing cloned available work to stage thread");
-		stage_work(work_clone);
-	}
 	return cloned;
 }
 
@@ -6583,7 +7149,8 @@ static void pool_died(struct pool *pool)
 		mutex_unlock(&lp_lock);
 }
 
-bool stale_work2(struct work * const work, const bool share, const bool have_pool_data_lock)
+static
+bool _stale_work(struct work * const work, const bool share)
 {
 	unsigned work_expiry;
 	struct pool *pool;
@@ -6647,26 +7214,14 @@ bool stale_work2(struct work * const work, const bool share, const bool have_poo
 		}
 
 	if (pool->has_stratum && work->job_id) {
-		bool same_job;
-
 		if (!pool->stratum_active || !pool->stratum_notify) {
 			applog(LOG_DEBUG, "Work stale due to stratum inactive");
 			return true;
 		}
 
-		same_job = true;
-
-		if (!have_pool_data_lock) {
-			cg_rlock(&pool->data_lock);
-		}
-		if (strcmp(work->job_id, pool->swork.job_id))
-			same_job = false;
-		if (!have_pool_data_lock) {
-			cg_runlock(&pool->data_lock);
-		}
-
-		if (!same_job) {
-			applog(LOG_DEBUG, "Work stale due to stratum job_id mismatch");
+		// A single aligned word, so this is safe to read without data_lock
+		if (work->job_gen != *(volatile uint32_t *)&pool->swork.job_gen) {
+			applog(LOG_DEBUG, "Work stale due to stratum job mismatch (gen %lu != %lu)", (unsigned long)work->job_gen, (unsigned long)pool->swork.job_gen);
 			return true;
 		}
 	}
@@ -6698,6 +7253,27 @@ bool stale_work2(struct work * const work, const bool share, const bool have_poo
 	return false;
 }
 
+// have_pool_data_lock is no longer needed, but kept so callers holding it don't have to care
+bool stale_work2(struct work * const work, const bool share, __maybe_unused const bool have_pool_data_lock)
+{
+	const bool stale = _stale_work(work, share);
+	struct bfg_tls_counters * const counters = bfg_tls_counters();
+	
+	++counters->stale_checks;
+	if (stale)
+		++counters->stale_check_hits;
+	return stale;
+}
+
+void get_stale_check_counts(uint64_t * const out_checks, uint64_t * const out_hits)
+{
+	struct bfg_tls_counters counters;
+	
+	bfg_tls_counters_sum(&counters);
+	*out_checks = counters.stale_checks - tls_counters_zeroed.stale_checks;
+	*out_hits = counters.stale_check_hits - tls_counters_zeroed.stale_check_hits;
+}
+
 double share_diff(const struct work *work)
 {
 	double ret;
@@ -6800,7 +7376,8 @@ static struct submit_work_state *begin_submission(struct work *work)
 		.work = work,
 	};
 
-	work_check_for_block(work);
+	if (!work->block_broadcast)
+		work_check_for_block(work);
 
 	if (stale_work(work, true)) {
 		work->stale = true;
@@ -7238,6 +7815,8 @@ void validate_pool_priorities(void)
 }
 
 static void clear_pool_work(struct pool *pool);
+static void update_standby_pools(void);
+static void request_standby_refresh(void);
 
 /* Specifies whether we can switch to this pool or not. */
 static bool pool_unusable(struct pool *pool)
@@ -7330,11 +7909,20 @@ void switch_pools(struct pool *selected)
 	if (opt_fail_only)
 		pool_tset(pool, &pool->lagging);
 
+	if (opt_standby_pools)
+	{
+		update_standby_pools();
+		request_standby_refresh();
+	}
+
 	if (pool != last_pool)
 	{
 		pool->block_id = 0;
 		if (pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
 			applog(LOG_WARNING, "Switching to pool %d %s", pool->pool_no, pool->rpc_url);
+			mutex_lock(&pool->pool_lock);
+			timer_set_now(&pool->tv_failover);
+			mutex_unlock(&pool->pool_lock);
 			if (pool_localgen(pool) || opt_fail_only)
 				clear_pool_work(last_pool);
 		}
@@ -7370,11 +7958,22 @@ static
 void unstage_work(struct work * const work)
 {
 	HASH_DEL(staged_work, work);
-	--work_mining_algorithm(work)->staged;
 	if (work_rollable(work))
 		--staged_rollable;
+	staged_variants -= work->variants;
 	if (work->spare)
 		--staged_spare;
+	if (work->standby)
+	{
+		--staged_standby;
+		--work->pool->standby_staged;
+	}
+	else
+	{
+		work->pool->goal->staged -= 1 + work->variants;
+		work_mining_algorithm(work)->staged -= 1 + work->variants;
+	}
+	work->variants = 0;
 	staged_full = false;
 }
 
@@ -7385,6 +7984,18 @@ static void wake_gws(void)
 	mutex_unlock(stgd_lock);
 }
 
+// Set (under stgd_lock) when the scheduler should drop stale standby work and top up the rest
+static bool standby_refresh_needed = true;
+
+static
+void request_standby_refresh(void)
+{
+	mutex_lock(stgd_lock);
+	standby_refresh_needed = true;
+	pthread_cond_signal(&gws_cond);
+	mutex_unlock(stgd_lock);
+}
+
 static void discard_stale(void)
 {
 	struct work *work, *tmp;
@@ -7523,6 +8134,14 @@ void set_blockdiff(struct mining_goal_info * const goal, const struct work * con
 	goal->current_diff = diff;
 }
 
+static
+void pool_set_prevblkhash(struct pool * const pool, const uint8_t * const prevblkhash)
+{
+	mutex_lock(&pool->pool_lock);
+	memcpy(pool->prevblkhash, prevblkhash, sizeof(pool->prevblkhash));
+	mutex_unlock(&pool->pool_lock);
+}
+
 static bool test_work_current(struct work *work)
 {
 	bool ret = true;
@@ -7583,6 +8202,7 @@ static bool test_work_current(struct work *work)
 		set_blockdiff(goal, work);
 		wr_unlock(&blk_lock);
 		pool->block_id = block_id;
+		pool_set_prevblkhash(pool, prevblkhash);
 		pool_update_work_restart_time(pool);
 		
 		if (deleted_block)
@@ -7616,6 +8236,7 @@ static bool test_work_current(struct work *work)
 		{
 			bool was_active = pool->block_id != 0;
 			pool->block_id = block_id;
+			pool_set_prevblkhash(pool, prevblkhash);
 			pool_update_work_restart_time(pool);
 			if (!work->longpoll)
 				update_last_work(work);
@@ -7687,9 +8308,20 @@ static bool hash_push(struct work *work)
 	mutex_lock(stgd_lock);
 	if (work_rollable(work))
 		staged_rollable++;
-	++work_mining_algorithm(work)->staged;
+	staged_variants += work->variants;
 	if (work->spare)
 		++staged_spare;
+	// Standby work only covers a failover, so it isn't counted toward its goal and algorithm's queue
+	if (work->standby)
+	{
+		++staged_standby;
+		++work->pool->standby_staged;
+	}
+	else
+	{
+		work->pool->goal->staged += 1 + work->variants;
+		work_mining_algorithm(work)->staged += 1 + work->variants;
+	}
 	if (likely(!getq->frozen)) {
 		HASH_ADD_INT(staged_work, id, work);
 		HASH_SORT(staged_work, tv_sort);
@@ -7801,6 +8433,11 @@ void remove_pool(struct pool *pool)
 	pool->removed = true;
 	pool->has_stratum = false;
 	total_pools--;
+	
+	// The pool itself is never freed, but nothing will use its transaction tree again
+	mutex_lock(&pool->gbt_merkle_lock);
+	gbt_merkle_free(&pool->gbt_merkle);
+	mutex_unlock(&pool->gbt_merkle_lock);
 }
 
 /* add a mutex if this needs to be thread safe in the future */
@@ -8027,6 +8664,8 @@ void zero_stats(void)
 	hw_errors = 0;
 	total_stale = 0;
 	total_discarded = 0;
+	// Other threads' counters are never written here, just compared against
+	bfg_tls_counters_sum(&tls_counters_zeroed);
 	total_bytes_rcvd = total_bytes_sent = 0;
 	new_blocks = 0;
 	local_work = 0;
@@ -8047,6 +8686,8 @@ void zero_stats(void)
 	HASH_ITER(hh, mining_goals, goal, tmpgoal)
 	{
 		goal->diff_accepted = 0;
+		goal->diff1 = 0;
+		goal->works = 0;
 	}
 	
 	for (i = 0; i < total_pools; i++) {
@@ -8078,6 +8719,11 @@ void zero_stats(void)
 		pool->cgminer_pool_stats.getwork_wait_min.tv_sec = MIN_SEC_UNSET;
 		pool->cgminer_pool_stats.getwork_wait_max.tv_sec = 0;
 		pool->cgminer_pool_stats.getwork_wait_max.tv_usec = 0;
+		pool->cgminer_pool_stats.getwork_inflight_max = pool->cgminer_pool_stats.getwork_inflight;
+		pool->cgminer_pool_stats.cbcheck_hits = 0;
+		pool->cgminer_pool_stats.cbcheck_misses = 0;
+		pool->cgminer_pool_stats.prefetch_hits = 0;
+		pool->cgminer_pool_stats.prefetch_misses = 0;
 		pool->cgminer_pool_stats.min_diff = 0;
 		pool->cgminer_pool_stats.max_diff = 0;
 		pool->cgminer_pool_stats.min_diff_count = 0;
@@ -9494,6 +10140,74 @@ static void resubmit_stratum_shares(struct pool *pool)
 	}
 }
 
+/* Flags the first --standby-pools live backup pools (by priority) as standby,
+ * so cnx_needed keeps their stratum connections up */
+static
+void update_standby_pools(void)
+{
+	struct pool * const cp = current_pool();
+	int i, standbys = 0;
+	
+	for (i = 0; i < total_pools; ++i)
+	{
+		struct pool * const pool = priority_pool(i);
+		bool standby = false;
+		
+		if (pool != cp && standbys < opt_standby_pools && !pool_unusable(pool))
+		{
+			standby = true;
+			++standbys;
+		}
+		pool->standby = standby;
+	}
+}
+
+/* Drops standby work that went stale (or whose pool is neither standby nor
+ * current anymore), and tops up each standby stratum pool's buffer from its
+ * latest job so that failing over to it has work to mine immediately */
+static
+void refresh_standby_work(void)
+{
+	struct pool * const cp = current_pool();
+	struct work *work, *tmp;
+	int i;
+	
+	update_standby_pools();
+	
+	mutex_lock(stgd_lock);
+	HASH_ITER(hh, staged_work, work, tmp)
+	{
+		if (!work->standby)
+			continue;
+		if ((work->pool->standby || work->pool == cp) && !stale_work(work, false))
+			continue;
+		unstage_work(work);
+		free_work(work);
+	}
+	mutex_unlock(stgd_lock);
+	
+	for (i = 0; i < total_pools; ++i)
+	{
+		struct pool * const pool = pools[i];
+		
+		if (!(pool->standby && pool->has_stratum && pool->stratum_active && pool->stratum_notify))
+			continue;
+		// Only this thread adds standby work, so it can't overshoot
+		while (pool->standby_staged < STANDBY_WORK_QUEUE)
+		{
+			work = make_work();
+			gen_stratum_work(pool, work);
+			work->standby = true;
+			work->work_restart_id = pool->work_restart_id;
+			if (!hash_push(work))
+			{
+				free_work(work);
+				break;
+			}
+		}
+	}
+}
+
 static void clear_pool_work(struct pool *pool)
 {
 	struct work *work, *tmp;
@@ -9531,6 +10245,9 @@ static bool cnx_needed(struct pool *pool)
 	if (pool->enabled == POOL_DISABLED)
 		return false;
 
+	if (pool->standby)
+		return true;
+
 	/* Idle stratum pool needs something to kick it alive again */
 	if (pool->has_stratum && pool->idle)
 		return true;
@@ -9703,6 +10420,9 @@ static void *stratum_thread(void *userdata)
 		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
 			applog(LOG_INFO, "Unknown stratum msg: %s", s);
 		free(s);
+		if (opt_standby_pools && pool != current_pool())
+			// Let the scheduler refresh standby work (this pool may also have just become usable as a standby)
+			request_standby_refresh();
 		if (pool->swork.clean) {
 			struct work *work = make_work();
 
@@ -10041,6 +10761,7 @@ static struct work *hash_pop(struct cgpu_info * const proc)
 	struct work *work, *work_found, *tmp;
 	enum {
 		HPWS_NONE,
+		HPWS_STANDBY,
 		HPWS_LOWDIFF,
 		HPWS_SPARE,
 		HPWS_ROLLABLE,
@@ -10048,14 +10769,17 @@ static struct work *hash_pop(struct cgpu_info * const proc)
 	} work_score = HPWS_NONE;
 	bool did_cmd_idle = false;
 	pthread_t cmd_idle_thr;
+	double total_weight, deficit, found_deficit = 0;
+	uint64_t total_works;
 
-retry:
 	mutex_lock(stgd_lock);
 	while (true)
 	{
+		struct pool * const cp = current_pool();
 		work_found = NULL;
 		work_score = 0;
 		hc = HASH_COUNT(staged_work);
+		__goal_work_totals(&total_weight, &total_works);
 		HASH_ITER(hh, staged_work, work, tmp)
 		{
 			const struct mining_algorithm * const work_malgo = work_mining_algorithm(work);
@@ -10068,18 +10792,37 @@ retry:
 				}  \
 				continue;  \
 }while(0)
-			if (min_nonce_diff < work->work_difficulty)
+			// Negative means the device can't mine this algorithm at all
+			if (min_nonce_diff < 0)
+				continue;
+			if (work->standby)
 			{
-				if (min_nonce_diff < 0)
+				// Backup pools' work is only for covering a failover: either the pool was just switched to, or the current pool is failing
+				if (work->pool != cp && (opt_fail_only || !(cp->idle || cp->lagging)))
 					continue;
-				FOUND_WORK(HPWS_LOWDIFF);
+				FOUND_WORK(HPWS_STANDBY);
 			}
+			if (min_nonce_diff < work->work_difficulty)
+				FOUND_WORK(HPWS_LOWDIFF);
 			if (work->spare)
 				FOUND_WORK(HPWS_SPARE);
-			if (work->rolltime && hc > staged_rollable)
+			// Weighted goals take precedence over saving rollable work
+			if (work->rolltime && hc > staged_rollable && !total_weight)
 				FOUND_WORK(HPWS_ROLLABLE);
 #undef FOUND_WORK
 			
+			if (total_weight)
+			{
+				// Rather than the first good match, take the one whose goal is furthest behind its share of works
+				deficit = __goal_work_deficit(work->pool->goal, total_weight, total_works);
+				if (work_score == HPWS_PERFECT && deficit <= found_deficit)
+					continue;
+				work_found = work;
+				work_score = HPWS_PERFECT;
+				found_deficit = deficit;
+				continue;
+			}
+			
 			// Good match
 			work_found = work;
 			work_score = HPWS_PERFECT;
@@ -10118,15 +10861,16 @@ retry:
 	
 	no_work = false;
 
-	if (can_roll(work) && should_roll(work))
-	{
-		// Instead of consuming it, force it to be cloned and grab the clone
-		mutex_unlock(stgd_lock);
-		clone_available();
-		goto retry;
-	}
-	
-	unstage_work(work);
+	if (can_roll(work) && (work->variants || should_roll(work)))
+		// Instead of consuming it, hand out a rolled copy
+		work = __work_variant_make(work);
+	else
+		unstage_work(work);
+	if (work->standby)
+		// Top up the standby buffer this came from
+		standby_refresh_needed = true;
+
+	++work->pool->goal->works;
 
 	/* Signal the getwork scheduler to look for more work */
 	pthread_cond_signal(&gws_cond);
@@ -10140,39 +10884,103 @@ retry:
 	return work;
 }
 
+static
+float _test_goal_weights_min_nonce_diff(__maybe_unused struct cgpu_info * const proc, __maybe_unused const struct mining_algorithm * const malgo)
+{
+	return 1.;
+}
+
+// Stages all of one goal's work ahead of another's, and checks hash_pop still hands them out by weight
+void test_goal_weights()
+{
+	struct device_drv drv = {
+		.drv_min_nonce_diff = _test_goal_weights_min_nonce_diff,
+	};
+	struct cgpu_info proc = {
+		.drv = &drv,
+	};
+	static const char * const names[] = {"test-light", "test-heavy"};
+	static const double weights[] = {1, 3};
+	struct mining_goal_info goals[2];
+	struct pool pools[2];
+	struct mining_goal_info *saved_goals;
+	struct work *saved_staged, *work;
+	const int per_goal = 40;
+	int i, j, popped[2] = {0, 0};
+	
+	// Work on private goals only, with an empty queue
+	mutex_lock(stgd_lock);
+	saved_goals = mining_goals;
+	saved_staged = staged_work;
+	mining_goals = NULL;
+	staged_work = NULL;
+	for (i = 0; i < 2; ++i)
+	{
+		goals[i] = (struct mining_goal_info){
+			.name = (char *)names[i],
+			.malgo = mining_algorithms,
+			.weight = weights[i],
+		};
+		HASH_ADD_KEYPTR(hh, mining_goals, goals[i].name, strlen(goals[i].name), &goals[i]);
+		pools[i] = (struct pool){
+			.pool_no = i,
+			.goal = &goals[i],
+		};
+	}
+	mutex_unlock(stgd_lock);
+	
+	for (i = 0; i < 2; ++i)
+		for (j = 0; j < per_goal; ++j)
+		{
+			work = make_work();
+			work->pool = &pools[i];
+			work->work_difficulty = 1;
+			hash_push(work);
+		}
+	
+	for (i = 0; i < per_goal; ++i)
+	{
+		work = hash_pop(&proc);
+		++popped[work->pool - pools];
+		free_work(work);
+	}
+	if (popped[0] < per_goal / 4 - 1 || popped[0] > per_goal / 4 + 1)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Goals weighted %g:%g were given %d:%d works",
+		       __func__, weights[0], weights[1], popped[0], popped[1]);
+	}
+	
+	// Drain the rest, so neither the queue nor the algorithm counts keep any of it
+	for (i = per_goal; i < per_goal * 2; ++i)
+		free_work(hash_pop(&proc));
+	
+	mutex_lock(stgd_lock);
+	HASH_CLEAR(hh, mining_goals);
+	mining_goals = saved_goals;
+	staged_work = saved_staged;
+	mutex_unlock(stgd_lock);
+}
+
 /* Clones work by rolling it if possible, and returning a clone instead of the
- * original work item which gets staged again to possibly be rolled again in
- * the future */
+ * original work item which gets staged again (with enough variants to fill
+ * the queue) to possibly be rolled again in the future */
 static struct work *clone_work(struct work *work)
 {
 	int mrs = mining_threads + opt_queue - total_staged(false);
 	struct work *work_clone;
-	bool cloned;
 
-	if (mrs < 1)
+	if (mrs < 1 || !(can_roll(work) && should_roll(work)))
 		return work;
 
-	cloned = false;
 	work_clone = make_clone(work);
-	while (mrs-- > 0 && can_roll(work) && should_roll(work)) {
-		applog(LOG_DEBUG, "Pushing rolled converted work to stage thread");
-		stage_work(work_clone);
-		roll_work(work);
-		work_clone = make_clone(work);
-		/* Roll it again to prevent duplicates should this be used
-		 * directly later on */
-		roll_work(work);
-		cloned = true;
-	}
-
-	if (cloned) {
-		stage_work(work);
-		return work_clone;
-	}
-
-	free_work(work_clone);
+	roll_work(work);
+	while (--mrs > 0 && work_variant_available(work))
+		++work->variants;
+	applog(LOG_DEBUG, "Pushing rolled converted work to stage thread with %d variants", work->variants);
+	stage_work(work);
 
-	return work;
+	return work_clone;
 }
 
 void gen_hash(unsigned char *data, unsigned char *hash, int len)
@@ -10291,6 +11099,201 @@ void test_target()
 	TEST_TARGET(set_target_to_pdiff, true, expect, 0x100);
 }
 
+// Straightforward coinbase branch computation to check the incremental tree against
+static
+void _test_gbt_merkle_branch(const uint8_t * const txids, const size_t txcount, bytes_t * const out)
+{
+	size_t cnt = txcount + 1;
+	uint8_t *level = malloc((cnt + 1) * 0x20), buf[0x40];
+	
+	memset(level, 0, 0x20);
+	memcpy(&level[0x20], txids, txcount * 0x20);
+	bytes_reset(out);
+	while (cnt > 1)
+	{
+		bytes_append(out, &level[0x20], 0x20);
+		if (cnt % 2)
+		{
+			memcpy(&level[cnt * 0x20], &level[(cnt - 1) * 0x20], 0x20);
+			++cnt;
+		}
+		for (size_t j = 1; j < cnt / 2; ++j)
+		{
+			memcpy(buf, &level[j * 0x40], 0x40);
+			gen_hash(buf, &level[j * 0x20], 0x40);
+		}
+		cnt /= 2;
+	}
+	free(level);
+}
+
+void test_gbt_merkle()
+{
+	static const size_t txcounts[] = {0, 1, 2, 3, 4, 5, 7, 8, 9, 64, 100, 99, 98, 513, 4000, 4100, 4100, 3000, 3001, 1};
+	const size_t maxtx = 4100;
+	uint8_t *txids = malloc((maxtx + 1) * 0x20);
+	struct gbt_merkle_tree tree = {.levels = 0};
+	bytes_t branch = BYTES_INIT, expect = BYTES_INIT;
+	uint32_t x = 0x12345678;
+	struct timeval tv_start, tv_full, tv_incr;
+	int hashes;
+	
+	for (size_t i = 0; i < (maxtx + 1) * 0x20; ++i)
+	{
+		x = x * 1103515245 + 12345;
+		txids[i] = x >> 16;
+	}
+	
+	for (size_t i = 0; i < sizeof(txcounts) / sizeof(*txcounts); ++i)
+	{
+		const size_t txcount = txcounts[i];
+		if (i == 17)
+			// Replace a transaction in the middle
+			txids[1500 * 0x20] ^= 1;
+		gbt_merkle_update(&tree, txids, txcount);
+		gbt_merkle_branch(&tree, &branch);
+		_test_gbt_merkle_branch(txids, txcount, &expect);
+		if (!bytes_eq(&branch, &expect))
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: Branch mismatch for %lu transactions (step %lu)",
+			       __func__, (unsigned long)txcount, (unsigned long)i);
+		}
+	}
+	
+	// Typical template refresh: a large mempool gains a few transactions
+	gbt_merkle_free(&tree);
+	timer_set_now(&tv_start);
+	gbt_merkle_update(&tree, txids, 4000);
+	timer_set_now(&tv_full);
+	hashes = gbt_merkle_update(&tree, txids, 4050);
+	timer_set_now(&tv_incr);
+	applog(LOG_DEBUG, "%s: 4000 transactions built in %ldus, 50 added in %ldus (%d hashes)",
+	       __func__, timer_elapsed_us(&tv_start, &tv_full), timer_elapsed_us(&tv_full, &tv_incr), hashes);
+	if (gbt_merkle_update(&tree, txids, 4050) != -1)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Unchanged transaction list was rehashed", __func__);
+	}
+	
+	gbt_merkle_free(&tree);
+	bytes_free(&branch);
+	bytes_free(&expect);
+	free(txids);
+}
+
+#if BLKMAKER_VERSION > 6
+// A getblocktemplate result like a local node's, with txcount made-up transactions
+static
+json_t *_test_gbt_template_json(const size_t txcount)
+{
+	json_t * const json = json_object(), * const txns = json_array();
+	uint8_t data[0x40];
+	char hex[(sizeof(data) * 2) + 1];
+	uint32_t n;
+	
+	json_object_set_new(json, "version", json_integer(2));
+	json_object_set_new(json, "previousblockhash", json_string("00000000000000000011e6ad4bd9dc2a0f7b2a8b3f07bd4cfd7e3b44b5e8c2f1"));
+	json_object_set_new(json, "bits", json_string("18009645"));
+	json_object_set_new(json, "curtime", json_integer(time(NULL)));
+	json_object_set_new(json, "height", json_integer(500000));
+	json_object_set_new(json, "coinbasevalue", json_integer(1250000000));
+	for (size_t i = 0; i < txcount; ++i)
+	{
+		// Version 1 and one input, so nothing looks like a segwit marker; the rest just makes each unique
+		memset(data, 0, sizeof(data));
+		data[0] = 1;
+		data[4] = 1;
+		n = htole32(i);
+		memcpy(&data[5], &n, sizeof(n));
+		bin2hex(hex, data, sizeof(data));
+		json_t * const txn = json_object();
+		json_object_set_new(txn, "data", json_string(hex));
+		json_array_append_new(txns, txn);
+	}
+	json_object_set_new(json, "transactions", txns);
+	return json;
+}
+
+// Takes a template from JSON to its first work the way work_decode does, optionally seeding the branch from a tree
+static
+bool _test_gbt_first_work(const json_t * const json, struct gbt_merkle_tree * const tree, bytes_t * const out_branch, long * const out_us)
+{
+	static uint8_t script[] = { 0x51 /* OP_TRUE */ };
+	blktemplate_t * const tmpl = blktmpl_create();
+	struct timeval tv_start;
+	uint8_t buf[80];
+	int16_t expire;
+	uint8_t *cbtxn;
+	size_t cbtxnsz, cbextranonceoffset;
+	int branchcount;
+	libblkmaker_hash_t *branches;
+	const char *err;
+	bool newcb;
+	
+	timer_set_now(&tv_start);
+	err = blktmpl_add_jansson(tmpl, json, tv_start.tv_sec);
+	if (err)
+	{
+		applog(LOG_ERR, "%s: blktmpl error: %s", __func__, err);
+		blktmpl_free(tmpl);
+		return false;
+	}
+	if (tree)
+		gbt_merkle_seed(tree, tmpl);
+	blkmk_init_generation2(tmpl, script, sizeof(script), &newcb);
+	if (!blkmk_get_mdata(tmpl, buf, sizeof(buf), tv_start.tv_sec, &expire, &cbtxn, &cbtxnsz, &cbextranonceoffset, &branchcount, &branches, GBT_XNONCESZ, false))
+	{
+		applog(LOG_ERR, "%s: blkmk_get_mdata failed", __func__);
+		blktmpl_free(tmpl);
+		return false;
+	}
+	*out_us = timer_elapsed_us(&tv_start, NULL);
+	bytes_assimilate_raw(out_branch, branches, branchcount * 0x20, branchcount * 0x20);
+	free(cbtxn);
+	blktmpl_free(tmpl);
+	return true;
+}
+
+// Template-to-first-work latency for a large template refresh, with and without the incremental tree
+// Unless --unittest-bench is used, only a small template is checked
+void test_gbt_first_work()
+{
+	const size_t txcounts[] = {
+		opt_unittest_bench ? 4000 : 400,
+		opt_unittest_bench ? 4050 : 405,
+	};
+	struct gbt_merkle_tree tree = {.levels = 0};
+	bytes_t branch = BYTES_INIT, expect = BYTES_INIT;
+	long us_plain[2], us_tree[2];
+	json_t *json;
+	bool ok;
+	
+	for (int i = 0; i < 2; ++i)
+	{
+		json = _test_gbt_template_json(txcounts[i]);
+		ok = _test_gbt_first_work(json, NULL, &expect, &us_plain[i]) && _test_gbt_first_work(json, &tree, &branch, &us_tree[i]);
+		json_decref(json);
+		if (!ok)
+			++unittest_failures;
+		else
+		if (!bytes_eq(&branch, &expect))
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: Incremental branch for %lu transactions differs from libblkmaker's",
+			       __func__, (unsigned long)txcounts[i]);
+		}
+	}
+	if (ok && opt_unittest_bench)
+		applog(LOG_NOTICE, "%s: Template to first work: %lu transactions %ldus; refreshed with %lu, %ldus rebuilt by libblkmaker, %ldus with incremental tree",
+		       __func__, (unsigned long)txcounts[0], us_tree[0], (unsigned long)txcounts[1], us_plain[1], us_tree[1]);
+	
+	gbt_merkle_free(&tree);
+	bytes_free(&branch);
+	bytes_free(&expect);
+}
+#endif
+
 void stratum_work_cpy(struct stratum_work * const dst, const struct stratum_work * const src)
 {
 	*dst = *src;
@@ -10327,6 +11330,42 @@ bool pool_has_usable_swork(const struct pool * const pool)
 	return pool->stratum_notify;
 }
 
+/* GBT templates are converted into pool->swork by work_decode, so as long as
+ * the latest template is still fresh, jobs can be generated locally with
+ * gen_stratum_work instead of fetching (and parsing) a new template.
+ * out_refresh is set once most of the template's useful life has passed */
+static
+bool pool_gbt_swork_usable(struct pool * const pool, bool * const out_refresh)
+{
+	const struct stratum_work * const swork = &pool->swork;
+	struct timeval tv_now;
+	bool rv = false;
+	
+	if (pool->proto != PLP_GETBLOCKTEMPLATE || pool->has_stratum)
+		return false;
+	if (!pool_actively_in_use(pool, NULL))
+		return false;
+	
+	timer_set_now(&tv_now);
+	cg_rlock(&pool->data_lock);
+	if (swork->tr && swork->work_restart_id == pool->work_restart_id)
+	{
+		const int time_left = blkmk_time_left(swork->tr->tmpl, tv_now.tv_sec);
+		const int elapsed = timer_elapsed(&swork->tv_received, &tv_now);
+		int expiry = time_left + elapsed;
+		
+		// Same refresh policy as should_roll uses for rolled GBT work
+		if (expiry < opt_scantime)
+			expiry = opt_scantime;
+		expiry = expiry * 2 / 3;
+		rv = (time_left > 0 && elapsed <= expiry);
+		*out_refresh = (elapsed * 4 >= expiry * 3);
+	}
+	cg_runlock(&pool->data_lock);
+	
+	return rv;
+}
+
 /* Generates stratum based work based on the most recent notify information
  * from the pool. This will keep generating work while a pool is down so we use
  * other means to detect when the pool has died in stratum_thread */
@@ -10416,7 +11455,11 @@ void gen_stratum_work3(struct work * const work, struct stratum_work * const swo
 	/* Copy parameters required for share submission */
 	memcpy(work->target, swork->target, sizeof(work->target));
 	work->job_id = maybe_strdup(swork->job_id);
+	work->job_gen = swork->job_gen;
 	work->nonce1 = maybe_strdup(swork->nonce1);
+	work->cbcheck_pending = swork->cbcheck_pending;
+	if (work->cbcheck_pending)
+		memcpy(work->cbcheck_digest, swork->cbcheck_digest, sizeof(work->cbcheck_digest));
 	if (data_lock_p)
 		cg_runlock(data_lock_p);
 
@@ -10432,10 +11475,37 @@ void gen_stratum_work3(struct work * const work, struct stratum_work * const swo
 		work->getwork_mode = GETWORK_MODE_GBT;
 		work->tr = swork->tr;
 		tmpl_incref(work->tr);
+		work->rolltime = blkmk_time_left(work->tr->tmpl, time(NULL));
 	}
 	calc_diff(work, 0);
 }
 
+/* Records how long it took from switching to a pool until mining its work */
+static
+void pool_failover_done(struct pool * const pool)
+{
+	struct timeval tv_now, tv_gap;
+	bool done = false;
+	
+	cgtime(&tv_now);
+	mutex_lock(&pool->pool_lock);
+	if (timer_isset(&pool->tv_failover))
+	{
+		timersub(&tv_now, &pool->tv_failover, &tv_gap);
+		timer_unset(&pool->tv_failover);
+		pool->failover_gap_last = tv_gap;
+		if (timercmp(&tv_gap, &pool->failover_gap_max, >))
+			pool->failover_gap_max = tv_gap;
+		++pool->failovers;
+		done = true;
+	}
+	mutex_unlock(&pool->pool_lock);
+	
+	if (done)
+		applog(LOG_INFO, "Pool %d: First work mined %ldms after switching to it",
+		       pool->pool_no, (long)(tv_gap.tv_sec * 1000 + tv_gap.tv_usec / 1000));
+}
+
 void request_work(struct thr_info *thr)
 {
 	struct cgpu_info *cgpu = thr->cgpu;
@@ -10476,6 +11546,8 @@ struct work *get_work(struct thr_info *thr)
 			wake_gws();
 		}
 	}
+	if (unlikely(timer_isset(&work->pool->tv_failover)))
+		pool_failover_done(work->pool);
 	last_getwork = time(NULL);
 	applog(LOG_DEBUG, "%"PRIpreprv": Got work %d from get queue to get work for thread %d",
 	       cgpu->proc_repr, work->id, thr_id);
@@ -10531,30 +11603,409 @@ struct work *get_work(struct thr_info *thr)
 	return work;
 }
 
-struct dupe_hash_elem {
-	uint8_t hash[0x20];
-	struct timeval tv_prune;
-	UT_hash_handle hh;
+/* Blocks found on GBT work skip the submit queue: the full block is sent to
+ * the originating node and every "allblocks" pool at once, from a thread of
+ * its own */
+struct block_submission {
+	struct work *work;
+	struct curl_ent *ce;
+	char *s;
+	struct timeval tv_submit;
+	json_t *val;
 };
 
+typedef void (*block_submission_cb_t)(struct block_submission *);
+
+/* Sends every submission at once, calling done for each as soon as its reply
+ * (in val, or NULL on failure) arrives */
 static
-void _submit_work_async(struct work *work)
+void block_submit_all(struct block_submission * const subs, const int n, const block_submission_cb_t done)
 {
-	applog(LOG_DEBUG, "Pushing submit work to work thread");
+	struct block_submission *sub;
+	CURLM * const curlm = curl_multi_init();
+	CURLMsg *cm;
+	fd_set rfds, wfds, efds;
+	struct timeval tv_timeout;
+	long timeout_ms;
+	int i, maxfd, running;
 	
-	if (opt_benchmark)
+	// Serialise everything first, so the requests all go out together
+	for (i = 0; i < n; ++i)
+		subs[i].s = submit_upstream_work_request(subs[i].work);
+	for (i = 0; i < n; ++i)
 	{
-		json_t * const jn = json_null(), *result = NULL;
-		work_check_for_block(work);
+		struct pool * const pool = subs[i].work->pool;
+		subs[i].ce = pop_curl_entry3(pool, 2);
+		cgtime(&subs[i].tv_submit);
+		json_rpc_call_async(subs[i].ce->curl, pool->rpc_url, pool->rpc_userpass, subs[i].s, false, pool, true, &subs[i]);
+		curl_multi_add_handle(curlm, subs[i].ce->curl);
+	}
+	
+	do {
+		curl_multi_perform(curlm, &running);
+		while ( (cm = curl_multi_info_read(curlm, &i)) )
 		{
-			static struct dupe_hash_elem *dupe_hashes;
-			struct dupe_hash_elem *dhe, *dhetmp;
-			HASH_FIND(hh, dupe_hashes, &work->hash, sizeof(dhe->hash), dhe);
-			if (dhe)
-				result = json_string("duplicate");
-			else
-			{
-				struct timeval tv_now;
+			if (cm->msg != CURLMSG_DONE)
+				continue;
+			json_t * const val = json_rpc_call_completed(cm->easy_handle, cm->data.result, false, NULL, &sub);
+			curl_multi_remove_handle(curlm, cm->easy_handle);
+			if (unlikely(!sub))
+				continue;
+			
+			struct work * const sub_work = sub->work;
+			struct pool * const pool = sub_work->pool;
+			applog(LOG_NOTICE, "Block submission to pool %d %s after %ldms (%ldms since found)",
+			       pool->pool_no, val ? "completed" : "failed",
+			       timer_elapsed_us(&sub->tv_submit, NULL) / 1000,
+			       timer_elapsed_us(&sub_work->tv_work_found, NULL) / 1000);
+			push_curl_entry(sub->ce, pool);
+			free(sub->s);
+			sub->val = val;
+			done(sub);
+		}
+		if (!running)
+			break;
+		
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		maxfd = -1;
+		curl_multi_fdset(curlm, &rfds, &wfds, &efds, &maxfd);
+		curl_multi_timeout(curlm, &timeout_ms);
+		if (timeout_ms < 0 || timeout_ms > 100)
+			timeout_ms = 100;
+		tv_timeout = (struct timeval){
+			.tv_sec = timeout_ms / 1000,
+			.tv_usec = (timeout_ms % 1000) * 1000,
+		};
+		if (maxfd >= 0)
+			select(maxfd + 1, &rfds, &wfds, &efds, &tv_timeout);
+		else
+			cgsleep_ms(timeout_ms);
+	} while (true);
+	
+	curl_multi_cleanup(curlm);
+}
+
+static
+void block_submission_done2(struct block_submission * const sub, void (* const retry)(struct work *))
+{
+	if (submit_upstream_work_completed(sub->work, false, &sub->tv_submit, sub->val))
+		free_work(sub->work);
+	else
+		// Retry through the normal submission queue
+		retry(sub->work);
+}
+
+static
+void block_submission_done(struct block_submission * const sub)
+{
+	block_submission_done2(sub, _submit_work_async);
+}
+
+static
+void *block_submit_thread(void * const userdata)
+{
+	struct work * const work = userdata;
+	const int n_pools = total_pools;
+	struct block_submission subs[n_pools + 1];
+	int i, n = 0;
+	
+	RenameThread("block_submit");
+	
+	subs[n++] = (struct block_submission){ .work = work, };
+	for (i = 0; i < n_pools; ++i)
+	{
+		struct pool * const pool = pools[i];
+		if (pool == work->pool || !uri_get_param_bool(pool->rpc_url, "allblocks", false))
+			continue;
+		struct work * const work_cp = copy_work(work);
+		work_cp->pool = pool;
+		work_cp->do_foreign_submit = true;
+		subs[n++] = (struct block_submission){ .work = work_cp, };
+	}
+	
+	block_submit_all(subs, n, block_submission_done);
+	
+	return NULL;
+}
+
+static
+bool block_submit_fast(struct work * const work)
+{
+	struct mining_goal_info * const goal = work->pool->goal;
+	pthread_t pth;
+	
+	if (likely(target_diff(work->hash) < goal->current_diff))
+		return false;
+	work_check_for_block(work);
+	if (!work->block)
+		return false;
+	
+	// Also keeps maybe_local_submit and begin_submission from repeating this
+	work->block_broadcast = true;
+	
+	if (unlikely(pthread_create(&pth, NULL, block_submit_thread, work)))
+	{
+		applog(LOG_WARNING, "Failed to create block submission thread, submitting directly");
+		block_submit_thread(work);
+	}
+	else
+		pthread_detach(pth);
+	return true;
+}
+
+#if BLKMAKER_VERSION > 6
+// Stub node: takes one request, waits until the other stub has one too, then replies (or just hangs up)
+struct _test_block_submit_stub {
+	SOCKETTYPE sock;
+	bool reply;
+	bool got_submitblock;
+	bool saw_both;
+	pthread_t pth;
+};
+
+static pthread_mutex_t _test_block_submit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _test_block_submit_cond = PTHREAD_COND_INITIALIZER;
+static int _test_block_submit_requests;
+static struct pool *_test_block_submit_retried;
+
+static
+void *_test_block_submit_stub_thread(void * const userp)
+{
+	struct _test_block_submit_stub * const stub = userp;
+	static const char reply_body[] = "{\"result\":null,\"error\":null,\"id\":1}";
+	char buf[0x1000], *body, *clen;
+	size_t len = 0;
+	ssize_t r;
+	fd_set rfds;
+	struct timeval tv_timeout = { .tv_sec = 5, }, tv_now;
+	struct timespec ts_timeout;
+	SOCKETTYPE conn;
+	
+	FD_ZERO(&rfds);
+	FD_SET(stub->sock, &rfds);
+	if (select(stub->sock + 1, &rfds, NULL, NULL, &tv_timeout) <= 0)
+		return NULL;
+	conn = accept(stub->sock, NULL, NULL);
+	if (conn == INVSOCK)
+		return NULL;
+#ifdef WIN32
+	const DWORD timeout = 5000;
+#else
+	const struct timeval timeout = { .tv_sec = 5, };
+#endif
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, (const void *)&timeout, sizeof(timeout));
+	
+	// Read the headers, and as much body as they say there is
+	while (len < sizeof(buf) - 1)
+	{
+		r = recv(conn, &buf[len], sizeof(buf) - 1 - len, 0);
+		if (r <= 0)
+			break;
+		len += r;
+		buf[len] = '\0';
+		body = strstr(buf, "\r\n\r\n");
+		clen = strstr(buf, "Content-Length: ");
+		if (body && clen && strlen(&body[4]) >= atol(&clen[16]))
+			break;
+	}
+	buf[len] = '\0';
+	stub->got_submitblock = strstr(buf, "\"submitblock\"");
+	
+	gettimeofday(&tv_now, NULL);
+	ts_timeout = (struct timespec){
+		.tv_sec = tv_now.tv_sec + 5,
+		.tv_nsec = tv_now.tv_usec * 1000,
+	};
+	mutex_lock(&_test_block_submit_mutex);
+	++_test_block_submit_requests;
+	pthread_cond_broadcast(&_test_block_submit_cond);
+	while (_test_block_submit_requests < 2)
+		if (pthread_cond_timedwait(&_test_block_submit_cond, &_test_block_submit_mutex, &ts_timeout) == ETIMEDOUT)
+			break;
+	stub->saw_both = (_test_block_submit_requests >= 2);
+	mutex_unlock(&_test_block_submit_mutex);
+	
+	if (stub->reply)
+	{
+		snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s",
+		         (int)strlen(reply_body), reply_body);
+		send(conn, buf, strlen(buf), 0);
+	}
+	CLOSESOCKET(conn);
+	return NULL;
+}
+
+static
+void _test_block_submit_retry(struct work * const work)
+{
+	_test_block_submit_retried = work->pool;
+	free_work(work);
+}
+
+static
+void _test_block_submit_done(struct block_submission * const sub)
+{
+	if (!sub->val)
+	{
+		block_submission_done2(sub, _test_block_submit_retry);
+		return;
+	}
+	// Accepted submissions go on to share_result, which needs real devices
+	json_decref(sub->val);
+	free_work(sub->work);
+}
+
+// Submits a block to two loopback stub nodes: both should get it at once, and the one which fails should be retried
+void test_block_submit()
+{
+	static uint8_t script[] = { 0x51 /* OP_TRUE */ };
+	struct _test_block_submit_stub stubs[2];
+	struct pool test_pools[2];
+	struct block_submission subs[2];
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	struct timeval tv_now;
+	struct curl_ent *ce, *cetmp;
+	blktemplate_t *tmpl;
+	struct work *work;
+	json_t *json;
+	const char *err;
+	bool newcb;
+	int i;
+	
+	_test_block_submit_requests = 0;
+	_test_block_submit_retried = NULL;
+	for (i = 0; i < 2; ++i)
+	{
+		addr = (struct sockaddr_in){
+			.sin_family = AF_INET,
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+		addrlen = sizeof(addr);
+		stubs[i] = (struct _test_block_submit_stub){
+			.sock = bfg_socket(AF_INET, SOCK_STREAM, 0),
+			// The second stub hangs up without replying
+			.reply = !i,
+		};
+		if (stubs[i].sock == INVSOCK
+		 || SOCKETFAIL(bind(stubs[i].sock, (struct sockaddr *)&addr, sizeof(addr)))
+		 || SOCKETFAIL(listen(stubs[i].sock, 1))
+		 || SOCKETFAIL(getsockname(stubs[i].sock, (struct sockaddr *)&addr, &addrlen)))
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: Failed to open stub node %d (%s)", __func__, i, SOCKERRMSG);
+			if (stubs[i].sock != INVSOCK)
+				CLOSESOCKET(stubs[i].sock);
+			if (i)
+				CLOSESOCKET(stubs[0].sock);
+			return;
+		}
+		
+		test_pools[i] = (struct pool){
+			.pool_no = i,
+			.rpc_userpass = "user:pass",
+			.sock = INVSOCK,
+			.lp_socket = CURL_SOCKET_BAD,
+			// Already failing, so a failed submission doesn't count toward the real pools' stats
+			.submit_fail = true,
+		};
+		mutex_init(&test_pools[i].pool_lock);
+		pthread_cond_init(&test_pools[i].cr_cond, bfg_condattr);
+		test_pools[i].rpc_url = malloc(0x40);
+		snprintf(test_pools[i].rpc_url, 0x40, "http://127.0.0.1:%u/#allblocks", (unsigned)ntohs(addr.sin_port));
+	}
+	
+	tmpl = blktmpl_create();
+	json = _test_gbt_template_json(0);
+	timer_set_now(&tv_now);
+	err = blktmpl_add_jansson(tmpl, json, tv_now.tv_sec);
+	json_decref(json);
+	if (err)
+		applog(LOG_ERR, "%s: blktmpl error: %s", __func__, err);
+	blkmk_init_generation2(tmpl, script, sizeof(script), &newcb);
+	work = make_work();
+	work->tr = tmpl_makeref(tmpl);
+	if (err || blkmk_get_data(tmpl, work->data, 80, tv_now.tv_sec, NULL, &work->dataid) < 76)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Failed to get work from template", __func__);
+		free_work(work);
+		goto out;
+	}
+	swap32yes(work->data, work->data, 80 / 4);
+	work->pool = &test_pools[0];
+	subs[0] = (struct block_submission){ .work = work, };
+	work = copy_work(work);
+	work->pool = &test_pools[1];
+	work->do_foreign_submit = true;
+	subs[1] = (struct block_submission){ .work = work, };
+	
+	for (i = 0; i < 2; ++i)
+		pthread_create(&stubs[i].pth, NULL, _test_block_submit_stub_thread, &stubs[i]);
+	block_submit_all(subs, 2, _test_block_submit_done);
+	for (i = 0; i < 2; ++i)
+	{
+		pthread_join(stubs[i].pth, NULL);
+		if (!stubs[i].got_submitblock)
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: Stub node %d did not get a submitblock request", __func__, i);
+		}
+		else
+		if (!stubs[i].saw_both)
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: Stub node %d got its submission alone, not in parallel", __func__, i);
+		}
+	}
+	if (_test_block_submit_retried != &test_pools[1])
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Failed submission was not retried through the submit queue", __func__);
+	}
+	
+out:
+	for (i = 0; i < 2; ++i)
+	{
+		CLOSESOCKET(stubs[i].sock);
+		LL_FOREACH_SAFE(test_pools[i].curllist, ce, cetmp)
+		{
+			curl_easy_cleanup(ce->curl);
+			free(ce);
+		}
+		free(test_pools[i].rpc_url);
+		pthread_cond_destroy(&test_pools[i].cr_cond);
+		mutex_destroy(&test_pools[i].pool_lock);
+	}
+}
+#endif
+
+struct dupe_hash_elem {
+	uint8_t hash[0x20];
+	struct timeval tv_prune;
+	UT_hash_handle hh;
+};
+
+static
+void _submit_work_async(struct work *work)
+{
+	applog(LOG_DEBUG, "Pushing submit work to work thread");
+	
+	if (opt_benchmark)
+	{
+		json_t * const jn = json_null(), *result = NULL;
+		work_check_for_block(work);
+		{
+			static struct dupe_hash_elem *dupe_hashes;
+			struct dupe_hash_elem *dhe, *dhetmp;
+			HASH_FIND(hh, dupe_hashes, &work->hash, sizeof(dhe->hash), dhe);
+			if (dhe)
+				result = json_string("duplicate");
+			else
+			{
+				struct timeval tv_now;
 				timer_set_now(&tv_now);
 				
 				// Prune old entries
@@ -10590,6 +12041,17 @@ void _submit_work_async(struct work *work)
 		return;
 	}
 
+	if (unlikely(!work_coinbase_ok(work)))
+	{
+		applog(LOG_WARNING, "Pool %u: Discarding share from work whose coinbase failed its check",
+		       work->pool->pool_no);
+		free_work(work);
+		return;
+	}
+	
+	if (unlikely(work->tr && !(work->do_foreign_submit || work->block_broadcast)) && block_submit_fast(work))
+		return;
+	
 	mutex_lock(&submitting_lock);
 	++total_submitting;
 	DL_APPEND(submit_waiting, work);
@@ -10735,6 +12197,7 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 	total_diff1       += work->nonce_diff;
 	thr ->cgpu->diff1 += work->nonce_diff;
 	work->pool->diff1 += work->nonce_diff;
+	work->pool->goal->diff1 += work->nonce_diff;
 	thr->cgpu->last_device_valid_work = time(NULL);
 	mutex_unlock(&stats_lock);
 	
@@ -11090,25 +12553,10 @@ enum {
 	FAILURE_INTERVAL		= 30,
 };
 
-/* Stage another work item from the work returned in a longpoll */
-static void convert_to_work(json_t *val, int rolltime, struct pool *pool, struct work *work, struct timeval *tv_lp, struct timeval *tv_lp_reply)
+/* Stage work that arrived out of band (a longpoll response or a block
+ * notification), once it has been decoded */
+static void stage_longpoll_work(struct pool *pool, struct work *work)
 {
-	bool rc;
-
-	work->rolltime = rolltime;
-	rc = work_decode(pool, work, val);
-	if (unlikely(!rc)) {
-		applog(LOG_ERR, "Could not convert longpoll data to work");
-		free_work(work);
-		return;
-	}
-	total_getworks++;
-	pool->getwork_requested++;
-	work->pool = pool;
-	copy_time(&work->tv_getwork, tv_lp);
-	copy_time(&work->tv_getwork_reply, tv_lp_reply);
-	calc_diff(work, 0);
-
 	if (pool->enabled == POOL_REJECTING)
 		work->mandatory = true;
 
@@ -11137,6 +12585,28 @@ static void convert_to_work(json_t *val, int rolltime, struct pool *pool, struct
 	applog(LOG_DEBUG, "Pushing converted work to stage thread");
 
 	stage_work(work);
+}
+
+/* Stage another work item from the work returned in a longpoll */
+static void convert_to_work(json_t *val, int rolltime, struct pool *pool, struct work *work, struct timeval *tv_lp, struct timeval *tv_lp_reply)
+{
+	bool rc;
+
+	work->rolltime = rolltime;
+	rc = work_decode(pool, work, val);
+	if (unlikely(!rc)) {
+		applog(LOG_ERR, "Could not convert longpoll data to work");
+		free_work(work);
+		return;
+	}
+	total_getworks++;
+	pool->getwork_requested++;
+	work->pool = pool;
+	copy_time(&work->tv_getwork, tv_lp);
+	copy_time(&work->tv_getwork_reply, tv_lp_reply);
+	calc_diff(work, 0);
+
+	stage_longpoll_work(pool, work);
 	applog(LOG_DEBUG, "Converted longpoll data to work");
 }
 
@@ -11306,15 +12776,498 @@ lpfail:
 				goto retry_pool;
 		}
 
-		if (unlikely(pool->removed))
-			break;
+		if (unlikely(pool->removed))
+			break;
+	}
+
+out:
+	pool->lp_active = false;
+	curl_easy_cleanup(curl);
+
+	return NULL;
+}
+
+/* Block notifications: any datagram sent to the local UDP port (eg, from
+ * bitcoind -blocknotify) triggers an immediate work update from the
+ * getwork/GBT pools in use. If the payload is a block hash, pools already
+ * working on top of it are left alone. */
+static
+SOCKETTYPE block_notify_open(const int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		.sin_port = htons(port),
+	};
+	SOCKETTYPE sock = bfg_socket(AF_INET, SOCK_DGRAM, 0);
+	
+	if (sock == INVSOCK)
+		applogr(INVSOCK, LOG_ERR, "Block notify socket creation failed (%s)", SOCKERRMSG);
+	if (SOCKETFAIL(bind(sock, (struct sockaddr *)&addr, sizeof(addr))))
+	{
+		applog(LOG_ERR, "Block notify bind to port %d failed (%s)", port, SOCKERRMSG);
+		CLOSESOCKET(sock);
+		return INVSOCK;
+	}
+	return sock;
+}
+
+// Waits for a notification; out_hash is set to the block hash, or empty if none was given
+static
+bool block_notify_recv(const SOCKETTYPE sock, char * const out_hash, struct timeval * const tv_notify)
+{
+	char buf[0x100];
+	ssize_t rep, i;
+	
+	rep = recv(sock, buf, sizeof(buf) - 1, 0);
+	if (SOCKETFAIL(rep))
+		return false;
+	timer_set_now(tv_notify);
+	
+	while (rep > 0 && isspace(buf[rep - 1]))
+		--rep;
+	buf[rep] = '\0';
+	out_hash[0] = '\0';
+	if (rep == 64)
+	{
+		for (i = 0; i < rep; ++i)
+			if (!isxdigit(buf[i]))
+				break;
+		if (i == rep)
+			for (i = 0; i <= rep; ++i)
+				out_hash[i] = tolower(buf[i]);
+	}
+	return true;
+}
+
+static void getwork_fetch_start(struct pool *, struct work *, struct mining_algorithm *, bool clear_lagging);
+
+// Whether the pool's latest work already builds on the notified block
+static
+bool block_notify_pool_current(struct pool * const pool, const char * const hash)
+{
+	char curhash[65];
+	
+	mutex_lock(&pool->pool_lock);
+	blkhashstr(curhash, pool->prevblkhash);
+	mutex_unlock(&pool->pool_lock);
+	return !strcmp(hash, curhash);
+}
+
+static
+void *block_notify_thread(void * const userdata)
+{
+	SOCKETTYPE * const sockp = userdata;
+	char hash[65];
+	struct timeval tv_notify;
+	
+	RenameThread("blocknotify");
+	pthread_detach(pthread_self());
+	
+	while (true)
+	{
+		if (!block_notify_recv(*sockp, hash, &tv_notify))
+		{
+			applog(LOG_DEBUG, "Block notify recv failed (%s)", SOCKERRMSG);
+			cgsleep_ms(1000);
+			continue;
+		}
+		applog(LOG_DEBUG, "Block notification received%s%s", hash[0] ? ": " : "", hash);
+		
+		for (int i = 0; i < total_pools; ++i)
+		{
+			struct pool * const pool = pools[i];
+			
+			if (pool->has_stratum || pool->removed || !pool_actively_in_use(pool, NULL))
+				continue;
+			if (pool->proto != PLP_GETBLOCKTEMPLATE && pool->proto != PLP_GETWORK)
+				continue;
+			if (hash[0] && block_notify_pool_current(pool, hash))
+			{
+				applog(LOG_DEBUG, "Pool %u: Already working on notified block", pool->pool_no);
+				continue;
+			}
+			// All pools are fetched from at once by the getwork fetch thread, and the work is staged like any other
+			getwork_fetch_start(pool, make_work(), NULL, false);
+			applog(LOG_DEBUG, "Pool %u: Requested work %ldus after block notification",
+			       pool->pool_no, timer_elapsed_us(&tv_notify, NULL));
+		}
+	}
+	
+	return NULL;
+}
+
+static
+void block_notify_init(void)
+{
+	static SOCKETTYPE sock;
+	pthread_t pth;
+	
+	sock = block_notify_open(opt_block_notify_port);
+	if (sock == INVSOCK)
+		return;
+	if (unlikely(pthread_create(&pth, NULL, block_notify_thread, &sock)))
+		quit(1, "block notify thread create failed");
+	applog(LOG_NOTICE, "Listening for block notifications on UDP port %d", opt_block_notify_port);
+}
+
+void test_block_notify()
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	static const char * const notifications[][2] = {
+		{"000000000000000000ABCDEF0123456789abcdef0123456789abcdef01234567\n", "000000000000000000abcdef0123456789abcdef0123456789abcdef01234567"},
+		{"new block", ""},
+		{"000000000000000000abcdef0123456789abcdef0123456789abcdef012345zz", ""},
+	};
+	char hash[65];
+	struct timeval tv_sent, tv_notify;
+	SOCKETTYPE sock, pubsock;
+	
+	// Stub publisher sending to an ephemeral local port
+	sock = block_notify_open(0);
+	if (sock == INVSOCK || SOCKETFAIL(getsockname(sock, (struct sockaddr *)&addr, &addrlen)))
+	{
+		++unittest_failures;
+		applogr(, LOG_ERR, "%s: Failed to open notification socket", __func__);
+	}
+	// Don't hang the unittest if a datagram gets lost
+#ifdef WIN32
+	const DWORD timeout = 1000;
+#else
+	const struct timeval timeout = { .tv_sec = 1, };
+#endif
+	if (SOCKETFAIL(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const void *)&timeout, sizeof(timeout))))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: Failed to set receive timeout (%s)", __func__, SOCKERRMSG);
+		CLOSESOCKET(sock);
+		return;
+	}
+	pubsock = bfg_socket(AF_INET, SOCK_DGRAM, 0);
+	for (int i = 0; i < sizeof(notifications) / sizeof(*notifications); ++i)
+	{
+		const char * const msg = notifications[i][0];
+		timer_set_now(&tv_sent);
+		if (SOCKETFAIL(sendto(pubsock, msg, strlen(msg), 0, (struct sockaddr *)&addr, addrlen))
+		 || !block_notify_recv(sock, hash, &tv_notify))
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: Notification %d not delivered (%s)", __func__, i, SOCKERRMSG);
+			continue;
+		}
+		if (strcmp(hash, notifications[i][1]))
+		{
+			++unittest_failures;
+			applog(LOG_ERR, "%s: Notification %d parsed as \"%s\" (expected \"%s\")",
+			       __func__, i, hash, notifications[i][1]);
+		}
+		applog(LOG_DEBUG, "%s: Notification %d received after %ldus", __func__, i, timer_elapsed_us(&tv_sent, &tv_notify));
+	}
+	CLOSESOCKET(pubsock);
+	CLOSESOCKET(sock);
+}
+
+/* Getwork/GBT requests from the scheduler are all driven by one curl multi
+ * handle, which keeps connections alive between requests */
+struct getwork_fetch {
+	struct work *work;
+	struct curl_ent *ce;
+	char *rpc_req;
+	bool prefetch;
+	bool clear_lagging;
+	struct mining_algorithm *malgo;
+	struct getwork_fetch *next;
+};
+
+static pthread_mutex_t getwork_fetch_lock;
+static notifier_t getwork_fetch_notifier;
+static struct getwork_fetch *getwork_fetch_waiting;
+static int getwork_fetching;  // protected by stgd_lock
+// Pool that just failed to provide work the scheduler asked for, so it can fail over right away; protected by stgd_lock
+static struct pool *getwork_failed_pool;
+static struct mining_algorithm *getwork_failed_malgo;
+
+static void pool_prefetch_start(struct pool *);
+
+static
+void getwork_fetch_add(CURLM * const curlm, struct getwork_fetch * const gwf)
+{
+	struct pool * const pool = gwf->work->pool;
+	
+	json_rpc_call_async(gwf->ce->curl, pool->rpc_url, pool->rpc_userpass, gwf->rpc_req, false, pool, false, gwf);
+	curl_multi_add_handle(curlm, gwf->ce->curl);
+}
+
+static
+void getwork_fetch_done(struct getwork_fetch * const gwf, json_t * const val)
+{
+	struct work * const work = gwf->work;
+	struct pool * const pool = work->pool;
+	const bool rc = get_upstream_work_completed(work, val);
+	const bool prefetch = gwf->prefetch, clear_lagging = gwf->clear_lagging;
+	struct mining_algorithm * const malgo = gwf->malgo;
+	bool claimed = false, stage = rc, refetch = false;
+	
+	push_curl_entry(gwf->ce, pool);
+	free(gwf);
+	
+	if (prefetch)
+	{
+		mutex_lock(&pool->last_work_lock);
+		pool->prefetching = false;
+		claimed = pool->prefetch_claimed;
+		if (rc && !claimed)
+		{
+			// Held until the scheduler needs it; GBT templates are already current in swork
+			work->work_restart_id = pool->work_restart_id;
+			if (pool->prefetch_work)
+				free_work(pool->prefetch_work);
+			pool->prefetch_work = work;
+			stage = false;
+		}
+		mutex_unlock(&pool->last_work_lock);
+	}
+	
+	if (rc)
+	{
+		timer_unset(&pool->tv_getfail);
+		if (clear_lagging)
+			pool_tclear(pool, &pool->lagging);
+		if (pool_tclear(pool, &pool->idle))
+			pool_resus(pool);
+		if (stage)
+		{
+			// Plain getwork has no template to reuse, so always keep the next one coming
+			refetch = !work->tr;
+			applog(LOG_DEBUG, "Generated getwork work");
+			stage_work(work);
+		}
+	}
+	else
+	{
+		++pool->seq_getfails;
+		timer_set_now(&pool->tv_getfail);
+		free_work(work);
+		pool_died(pool);
+	}
+	
+	mutex_lock(stgd_lock);
+	--pool->cgminer_pool_stats.getwork_inflight;
+	if (claimed || !prefetch)
+		--getwork_fetching;
+	if (!(rc || prefetch))
+	{
+		getwork_failed_pool = pool;
+		getwork_failed_malgo = malgo;
+	}
+	pthread_cond_broadcast(&gws_cond);
+	mutex_unlock(stgd_lock);
+	
+	if (refetch)
+		pool_prefetch_start(pool);
+}
+
+static
+void *getwork_fetch_thread(__maybe_unused void *userdata)
+{
+	CURLM *curlm;
+	long curlm_timeout_us = -1;
+	struct timeval curlm_timer, tv_timeout, tv_now;
+	struct getwork_fetch *gwf;
+	fd_set rfds, wfds, efds;
+	int maxfd, n;
+	CURLMsg *cm;
+	
+	pthread_detach(pthread_self());
+	RenameThread("getwork_fetch");
+	
+	curlm = curl_multi_init();
+	curl_multi_setopt(curlm, CURLMOPT_TIMERDATA, &curlm_timeout_us);
+	curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, my_curl_timer_set);
+#ifdef CURLPIPE_MULTIPLEX
+	// Concurrent requests to the same pool can share one HTTP/2 connection
+	curl_multi_setopt(curlm, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
+	
+	FD_ZERO(&rfds);
+	while (true)
+	{
+		if (FD_ISSET(getwork_fetch_notifier[0], &rfds))
+			notifier_read(getwork_fetch_notifier);
+		
+		// Receive any new requests
+		mutex_lock(&getwork_fetch_lock);
+		while ( (gwf = getwork_fetch_waiting) )
+		{
+			LL_DELETE(getwork_fetch_waiting, gwf);
+			getwork_fetch_add(curlm, gwf);
+		}
+		mutex_unlock(&getwork_fetch_lock);
+		
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		tv_timeout.tv_sec = -1;
+		
+		curl_multi_perform(curlm, &n);
+		curl_multi_fdset(curlm, &rfds, &wfds, &efds, &maxfd);
+		if (curlm_timeout_us >= 0)
+		{
+			timer_set_delay_from_now(&curlm_timer, curlm_timeout_us);
+			reduce_timeout_to(&tv_timeout, &curlm_timer);
+		}
+		
+		FD_SET(getwork_fetch_notifier[0], &rfds);
+		set_maxfd(&maxfd, getwork_fetch_notifier[0]);
+		
+		cgtime(&tv_now);
+		if (select(maxfd+1, &rfds, &wfds, &efds, select_timeout(&tv_timeout, &tv_now)) < 0)
+		{
+			FD_ZERO(&rfds);
+			continue;
+		}
+		
+		curl_multi_perform(curlm, &n);
+		while ( (cm = curl_multi_info_read(curlm, &n)) )
+		{
+			if (cm->msg != CURLMSG_DONE)
+				continue;
+			
+			int rolltime = 0;
+			json_t *val = json_rpc_call_completed(cm->easy_handle, cm->data.result, false, &rolltime, &gwf);
+			curl_multi_remove_handle(curlm, cm->easy_handle);
+			if (unlikely(!gwf))
+				continue;
+			
+			struct work * const work = gwf->work;
+			free(gwf->rpc_req);
+			work->rolltime = rolltime;
+			if (!val && get_upstream_work_fallback(work->pool) && (gwf->rpc_req = get_upstream_work_req(work)))
+			{
+				getwork_fetch_add(curlm, gwf);
+				continue;
+			}
+			getwork_fetch_done(gwf, val);
+		}
+	}
+	
+	return NULL;
+}
+
+static
+void getwork_fetch_send(struct pool * const pool, struct work * const work, const bool prefetch, struct mining_algorithm * const malgo, const bool clear_lagging)
+{
+	struct getwork_fetch *gwf;
+	
+	gwf = malloc(sizeof(*gwf));
+	*gwf = (struct getwork_fetch){
+		.work = work,
+		.ce = pop_curl_entry3(pool, 2),
+		.prefetch = prefetch,
+		.clear_lagging = clear_lagging,
+		.malgo = malgo,
+	};
+	work->pool = pool;
+	gwf->rpc_req = get_upstream_work_req(work);
+	if (!gwf->rpc_req)
+	{
+		getwork_fetch_done(gwf, NULL);
+		return;
+	}
+	
+	mutex_lock(&getwork_fetch_lock);
+	LL_APPEND(getwork_fetch_waiting, gwf);
+	mutex_unlock(&getwork_fetch_lock);
+	notifier_wake(getwork_fetch_notifier);
+}
+
+/* Queues a request for new work from the pool, waiting first if it already
+ * has as many requests in progress as allowed. If the request succeeds, the
+ * pool is only considered caught up (no longer lagging) when clear_lagging */
+static
+void getwork_fetch_start(struct pool * const pool, struct work * const work, struct mining_algorithm * const malgo, const bool clear_lagging)
+{
+	struct cgminer_pool_stats * const pool_stats = &pool->cgminer_pool_stats;
+	
+	mutex_lock(stgd_lock);
+	while (pool_stats->getwork_inflight >= (uint32_t)opt_getwork_concurrency)
+		pthread_cond_wait(&gws_cond, stgd_lock);
+	if (++pool_stats->getwork_inflight > pool_stats->getwork_inflight_max)
+		pool_stats->getwork_inflight_max = pool_stats->getwork_inflight;
+	++getwork_fetching;
+	mutex_unlock(stgd_lock);
+	
+	getwork_fetch_send(pool, work, false, malgo, clear_lagging);
+}
+
+/* Starts fetching the pool's next work in the background, unless it already
+ * has some prefetched or would exceed its concurrency limit. The result is
+ * held in pool->prefetch_work instead of being staged */
+static
+void pool_prefetch_start(struct pool * const pool)
+{
+	struct cgminer_pool_stats * const pool_stats = &pool->cgminer_pool_stats;
+	
+	if (!opt_work_prefetch || opt_benchmark || pool->has_stratum)
+		return;
+	
+	mutex_lock(&pool->last_work_lock);
+	if (pool->prefetching || pool->prefetch_work)
+	{
+		mutex_unlock(&pool->last_work_lock);
+		return;
 	}
+	mutex_lock(stgd_lock);
+	if (pool_stats->getwork_inflight >= (uint32_t)opt_getwork_concurrency)
+	{
+		mutex_unlock(stgd_lock);
+		mutex_unlock(&pool->last_work_lock);
+		return;
+	}
+	if (++pool_stats->getwork_inflight > pool_stats->getwork_inflight_max)
+		pool_stats->getwork_inflight_max = pool_stats->getwork_inflight;
+	mutex_unlock(stgd_lock);
+	pool->prefetching = true;
+	pool->prefetch_claimed = false;
+	mutex_unlock(&pool->last_work_lock);
+	
+	applog(LOG_DEBUG, "Prefetching work from pool %d", pool->pool_no);
+	getwork_fetch_send(pool, make_work(), true, NULL, false);
+}
 
-out:
-	pool->lp_active = false;
-	curl_easy_cleanup(curl);
-
-	return NULL;
+/* Returns the pool's prefetched work if it is still current. If a prefetch is
+ * still in progress, it is claimed instead (counting toward getwork_fetching)
+ * so it gets staged on arrival rather than duplicated by another request */
+static
+struct work *pool_prefetch_take(struct pool * const pool, bool * const out_claimed)
+{
+	struct work *work;
+	
+	if (!(pool->prefetch_work || pool->prefetching))
+		return NULL;
+	
+	mutex_lock(&pool->last_work_lock);
+	work = pool->prefetch_work;
+	pool->prefetch_work = NULL;
+	if (pool->prefetching && !pool->prefetch_claimed)
+	{
+		pool->prefetch_claimed = *out_claimed = true;
+		mutex_lock(stgd_lock);
+		++getwork_fetching;
+		mutex_unlock(stgd_lock);
+	}
+	mutex_unlock(&pool->last_work_lock);
+	
+	if (work && stale_work(work, false))
+	{
+		applog(LOG_DEBUG, "Discarding stale prefetched work from pool %d", pool->pool_no);
+		free_work(work);
+		work = NULL;
+	}
+	if (work)
+		++pool->cgminer_pool_stats.prefetch_hits;
+	return work;
 }
 
 static void stop_longpoll(void)
@@ -11937,7 +13890,10 @@ void _bfg_clean_up(bool restarting)
 #endif
 #ifdef HAVE_LIBUSB
 	if (likely(have_libusb))
-        libusb_exit(NULL);
+	{
+		usb_event_thread_stop();
+		libusb_exit(NULL);
+	}
 #endif
 
 	cgtime(&total_tv_end);
@@ -11952,6 +13908,10 @@ void _bfg_clean_up(bool restarting)
 #endif
 		if (!opt_realquiet && successful_connect)
 			print_summary();
+#ifdef USE_LOCK_STATS
+		if (opt_lock_stats)
+			lock_stats_dump();
+#endif
 	}
 
 	if (opt_n_threads > 0)
@@ -12480,7 +14440,32 @@ extern void setup_pthread_cancel_workaround();
 extern struct sigaction pcwm_orig_term_handler;
 #endif
 
-bool bfg_need_detect_rescan;
+// Probes run in their own threads, and hotplug may scan alongside a full rescan, so this is only accessed under its mutex
+static bool bfg_need_detect_rescan;
+static pthread_mutex_t bfg_need_detect_rescan_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void bfg_request_detect_rescan(void)
+{
+	mutex_lock(&bfg_need_detect_rescan_mutex);
+	bfg_need_detect_rescan = true;
+	mutex_unlock(&bfg_need_detect_rescan_mutex);
+}
+
+/* Returns whether a rescan was requested, clearing the request. Scans don't
+ * clear it when they start, since that could drop a request from another
+ * scan's probes; at worst this costs one extra rescan. */
+static
+bool bfg_take_detect_rescan(void)
+{
+	bool rv;
+	
+	mutex_lock(&bfg_need_detect_rescan_mutex);
+	rv = bfg_need_detect_rescan;
+	bfg_need_detect_rescan = false;
+	mutex_unlock(&bfg_need_detect_rescan_mutex);
+	return rv;
+}
+
 extern void probe_device(struct lowlevel_device_info *);
 static void schedule_rescan(const struct timeval *);
 
@@ -12488,8 +14473,7 @@ static
 void drv_detect_all()
 {
 	bool rescanning = false;
-rescan:
-	bfg_need_detect_rescan = false;
+rescan: ;
 	
 #ifdef HAVE_BFG_LOWLEVEL
 	struct lowlevel_device_info * const infolist = lowlevel_scan(), *info, *infotmp;
@@ -12498,6 +14482,7 @@ rescan:
 		probe_device(info);
 	LL_FOREACH_SAFE(infolist, info, infotmp)
 		pthread_join(info->probe_pth, NULL);
+	lowlevel_probe_cache_save();
 #endif
 	
 	struct driver_registration *reg;
@@ -12514,7 +14499,7 @@ rescan:
 	lowlevel_scan_free();
 #endif
 	
-	if (bfg_need_detect_rescan)
+	if (bfg_take_detect_rescan())
 	{
 		if (rescanning)
 		{
@@ -12619,6 +14604,12 @@ void start_cgpu(struct cgpu_info *cgpu)
 
 		thread_reportout(thr);
 
+		if (opt_io_reactor && cgpu->drv->io_reactor_capable && cgpu->threads == 1 && bfg_reactor_adopt(thr))
+		{
+			notifier_wake(thr->notifier);
+			continue;
+		}
+		
 		if (unlikely(thr_info_create(thr, NULL, miner_thread, thr)))
 			quit(1, "thread %d create failed", thr->id);
 		
@@ -12679,11 +14670,18 @@ bool _probe_device_match(const struct lowlevel_device_info * const info, const c
 static
 bool _probe_device_do_probe(const struct device_drv * const drv, const struct lowlevel_device_info * const info, bool * const request_rescan_p)
 {
+	struct timeval tv_start;
+	
+	timer_set_now(&tv_start);
 	bfg_probe_result_flags = 0;
+	lowlevel_probe_cache_begin(info, drv->dname);
 	if (drv->lowl_probe(info))
 	{
 		if (!(bfg_probe_result_flags & BPR_CONTINUE_PROBES))
+		{
+			lowlevel_probe_cache_found(info, drv->dname, timer_elapsed_us(&tv_start, NULL) / 1e6);
 			return true;
+		}
 	}
 	else
 	if (request_rescan_p && opt_hotplug && !(bfg_probe_result_flags & BPR_DONT_RESCAN))
@@ -12691,24 +14689,51 @@ bool _probe_device_do_probe(const struct device_drv * const drv, const struct lo
 	return false;
 }
 
+// Check for "noauto" flag
+// NOTE: driver-specific configuration overrides general
+static
+bool _probe_device_doauto(const struct device_drv * const drv)
+{
+	struct string_elist *sd_iter, *sd_tmp;
+	bool doauto = true;
+	
+	DL_FOREACH_SAFE(scan_devices, sd_iter, sd_tmp)
+	{
+		const char * const dname = sd_iter->string;
+		// NOTE: Only checking flags here, NOT path/serial, so @ is unacceptable
+		const char *colon = strchr(dname, ':');
+		if (!colon)
+			colon = &dname[-1];
+		if (strcasecmp("noauto", &colon[1]) && strcasecmp("auto", &colon[1]))
+			continue;
+		const ssize_t dnamelen = (colon - dname);
+		if (dnamelen >= 0) {
+			char dname_nt[dnamelen + 1];
+			memcpy(dname_nt, dname, dnamelen);
+			dname_nt[dnamelen] = '\0';
+			
+			if (strcasecmp(drv->dname, dname_nt) && strcasecmp(drv->name, dname_nt))
+				continue;
+		}
+		doauto = (tolower(colon[1]) == 'a');
+		if (dnamelen != -1)
+			break;
+	}
+	return doauto;
+}
+
 bool dummy_check_never_true = false;
 
 static
-void *probe_device_thread(void *p)
+void _probe_device(void * const p)
 {
 	struct lowlevel_device_info * const infolist = p;
 	struct lowlevel_device_info *info = infolist;
 	bool request_rescan = false;
 	
-	{
-		char threadname[6 + strlen(info->devid) + 1];
-		sprintf(threadname, "probe_%s", info->devid);
-		RenameThread(threadname);
-	}
-	
 	// If already in use, ignore
 	if (bfg_claim_any(NULL, NULL, info->devid))
-		applogr(NULL, LOG_DEBUG, "%s: \"%s\" already in use",
+		applogr(, LOG_DEBUG, "%s: \"%s\" already in use",
 		        __func__, info->product);
 	
 	// if lowlevel device matches specific user assignment, probe requested driver(s)
@@ -12738,7 +14763,54 @@ void *probe_device_thread(void *p)
 				if (strcasecmp(drv->dname, dname_nt) && strcasecmp(drv->name, dname_nt))
 					continue;
 				if (_probe_device_do_probe(drv, info, &request_rescan))
-					return NULL;
+					return;
+			}
+		}
+	}
+	
+#if defined(NEED_BFG_LOWL_VCOM) && !defined(WIN32)
+	// emulated devices name the driver they emulate
+	LL_FOREACH2(infolist, info, same_devid_next)
+	{
+		const char * const emu_dname = bfg_emu_devinfo_dname(info);
+		if (!emu_dname)
+			continue;
+		BFG_FOREACH_DRIVER_BY_PRIORITY(dreg)
+		{
+			const struct device_drv * const drv = dreg->drv;
+			if (!(drv->lowl_probe && drv_algo_check(drv)))
+				continue;
+			if (strcasecmp(drv->dname, emu_dname))
+				continue;
+			if (_probe_device_do_probe(drv, info, &request_rescan))
+				return;
+		}
+	}
+#endif
+	
+	// try whichever driver claimed this device last time, before any slow probes
+	{
+		char cached_dname[0x20];
+		if (lowlevel_probe_cache_get(infolist, cached_dname, sizeof(cached_dname), &info))
+		{
+			BFG_FOREACH_DRIVER_BY_PRIORITY(dreg)
+			{
+				const struct device_drv * const drv = dreg->drv;
+				if (!(drv->lowl_probe && drv_algo_check(drv)))
+					continue;
+				if (strcasecmp(drv->dname, cached_dname))
+					continue;
+				if (!_probe_device_doauto(drv))
+					break;
+				// The cache may be stale, so the device must still look like one of the driver's
+				if (!(drv->lowl_match && drv->lowl_match(info)))
+					break;
+				applog(LOG_DEBUG, "%s: Trying cached driver %s first", info->devid, drv->dname);
+				if (_probe_device_do_probe(drv, info, NULL))
+					return;
+				applog(LOG_DEBUG, "%s: Cached driver %s failed, probing all drivers", info->devid, drv->dname);
+				lowlevel_probe_cache_forget(info);
+				break;
 			}
 		}
 	}
@@ -12751,33 +14823,7 @@ void *probe_device_thread(void *p)
 		if (!drv_algo_check(drv))
 			continue;
 		
-		// Check for "noauto" flag
-		// NOTE: driver-specific configuration overrides general
-		bool doauto = true;
-		DL_FOREACH_SAFE(scan_devices, sd_iter, sd_tmp)
-		{
-			const char * const dname = sd_iter->string;
-			// NOTE: Only checking flags here, NOT path/serial, so @ is unacceptable
-			const char *colon = strchr(dname, ':');
-			if (!colon)
-				colon = &dname[-1];
-			if (strcasecmp("noauto", &colon[1]) && strcasecmp("auto", &colon[1]))
-				continue;
-			const ssize_t dnamelen = (colon - dname);
-			if (dnamelen >= 0) {
-				char dname_nt[dnamelen + 1];
-				memcpy(dname_nt, dname, dnamelen);
-				dname_nt[dnamelen] = '\0';
-				
-				if (strcasecmp(drv->dname, dname_nt) && strcasecmp(drv->name, dname_nt))
-					continue;
-			}
-			doauto = (tolower(colon[1]) == 'a');
-			if (dnamelen != -1)
-				break;
-		}
-		
-		if (doauto && drv->lowl_match)
+		if (drv->lowl_match && _probe_device_doauto(drv))
 		{
 			LL_FOREACH2(infolist, info, same_devid_next)
 			{
@@ -12802,7 +14848,7 @@ void *probe_device_thread(void *p)
 				if (!drv->lowl_match(info))
 					continue;
 				if (_probe_device_do_probe(drv, info, &request_rescan))
-					return NULL;
+					return;
 			}
 		}
 	}
@@ -12834,7 +14880,7 @@ void *probe_device_thread(void *p)
 						if (!drv->lowl_probe)
 							continue;
 						if (_probe_device_do_probe(drv, info, NULL))
-							return NULL;
+							return;
 						if (bfg_probe_result_flags & BPR_DONT_RESCAN)
 							dont_rescan = true;
 					}
@@ -12863,14 +14909,44 @@ void *probe_device_thread(void *p)
 				if (info->lowl->exclude_from_all)
 					continue;
 				if (_probe_device_do_probe(drv, info, NULL))
-					return NULL;
+					return;
 			}
 		}
 	}
 	
 	// Only actually request a rescan if we never found any cgpu
 	if (request_rescan)
-		bfg_need_detect_rescan = true;
+		bfg_request_detect_rescan();
+}
+
+static
+void *probe_device_thread(void *p)
+{
+	struct lowlevel_device_info * const infolist = p;
+	struct timeval tv_start;
+	
+	{
+		char threadname[6 + strlen(infolist->devid) + 1];
+		sprintf(threadname, "probe_%s", infolist->devid);
+		RenameThread(threadname);
+	}
+	
+	// Slow probes (eg, golden nonces) would otherwise all run at once on big hubs
+	mutex_lock(&probe_slots_mutex);
+	while (opt_probe_threads && probe_slots_used >= opt_probe_threads)
+		pthread_cond_wait(&probe_slots_cond, &probe_slots_mutex);
+	++probe_slots_used;
+	mutex_unlock(&probe_slots_mutex);
+	
+	timer_set_now(&tv_start);
+	_probe_device(infolist);
+	applog(LOG_DEBUG, "%s: Probing took %.3f seconds",
+	       infolist->devid, timer_elapsed_us(&tv_start, NULL) / 1e6);
+	
+	mutex_lock(&probe_slots_mutex);
+	--probe_slots_used;
+	pthread_cond_signal(&probe_slots_cond);
+	mutex_unlock(&probe_slots_mutex);
 	
 	return NULL;
 }
@@ -13062,6 +15138,140 @@ void hotplug_trigger()
 
 #if defined(HAVE_LIBUDEV) && defined(HAVE_SYS_EPOLL_H)
 
+// Devices added since the last quiet period
+struct hotplug_batch {
+	struct lowlevel_device_info *infolist;
+	struct string_elist *usb_added;
+	struct string_elist *usb_covered;
+	bool need_rescan;
+};
+
+static
+const char *hotplug_usb_syspath(struct udev_device * const device)
+{
+	struct udev_device *usbdev = device;
+	const char * const devtype = udev_device_get_devtype(device);
+	
+	if (!(devtype && !strcmp(devtype, "usb_device")))
+		usbdev = udev_device_get_parent_with_subsystem_devtype(device, "usb", "usb_device");
+	return usbdev ? udev_device_get_syspath(usbdev) : NULL;
+}
+
+static
+void hotplug_add_event(struct hotplug_batch * const batch, struct udev_device * const device)
+{
+	const char * const subsystem = udev_device_get_subsystem(device);
+	const char *usbpath;
+	
+	if (subsystem && !strcmp(subsystem, "usb"))
+	{
+		// Only rescan for USB devices if no serial port turns up for them
+		usbpath = hotplug_usb_syspath(device);
+		if (usbpath)
+			string_elist_add(usbpath, &batch->usb_added);
+		else
+			batch->need_rescan = true;
+		return;
+	}
+	
+#ifdef NEED_BFG_LOWL_VCOM
+	if (subsystem && !strcmp(subsystem, "tty"))
+	{
+		struct lowlevel_device_info * const info = vcom_devinfo_from_udev(device);
+		if (info)
+		{
+			usbpath = hotplug_usb_syspath(device);
+			if (usbpath)
+				string_elist_add(usbpath, &batch->usb_covered);
+			LL_PREPEND(batch->infolist, info);
+			return;
+		}
+	}
+#endif
+	
+	batch->need_rescan = true;
+}
+
+static
+void hotplug_probe_infolist(void * const p)
+{
+	struct lowlevel_device_info * const infolist = p;
+	struct lowlevel_device_info *info;
+	
+	LL_FOREACH(infolist, info)
+		probe_device(info);
+	LL_FOREACH(infolist, info)
+		pthread_join(info->probe_pth, NULL);
+	lowlevel_probe_cache_save();
+}
+
+static
+void hotplug_flush(struct hotplug_batch * const batch)
+{
+	struct lowlevel_device_info *info, *tmp;
+	struct string_elist *iter, *iter2, *sdtmp;
+	
+	DL_FOREACH_SAFE(batch->usb_added, iter, sdtmp)
+	{
+		DL_FOREACH(batch->usb_covered, iter2)
+			if (!strcmp(iter->string, iter2->string))
+				break;
+		if (!iter2)
+		{
+			applog(LOG_DEBUG, "%s: USB device %s has no serial port, needs a full rescan", __func__, iter->string);
+			batch->need_rescan = true;
+		}
+		string_elist_del(&batch->usb_added, iter);
+	}
+	DL_FOREACH_SAFE(batch->usb_covered, iter, sdtmp)
+		string_elist_del(&batch->usb_covered, iter);
+	
+	if (!(batch->need_rescan || batch->infolist))
+		return;
+	
+	// A full rescan picks up the new serial ports too
+	if (!batch->need_rescan)
+	{
+		applog(LOG_DEBUG, "%s: Probing only newly added serial ports", __func__);
+		create_new_cgpus(hotplug_probe_infolist, batch->infolist);
+		// Probes may still be unable to tell without the rest of the device info
+		if (bfg_take_detect_rescan())
+			batch->need_rescan = true;
+	}
+	LL_FOREACH_SAFE(batch->infolist, info, tmp)
+	{
+		LL_DELETE(batch->infolist, info);
+		lowlevel_devinfo_free(info);
+	}
+	
+	if (batch->need_rescan)
+	{
+		batch->need_rescan = false;
+		hotplug_trigger();
+	}
+}
+
+// Devices are never freed, so just mark them as having failed until their driver notices the device is back
+static
+void hotplug_remove_event(struct udev_device * const device)
+{
+	const char * const devnode = udev_device_get_devnode(device);
+	struct cgpu_info *cgpu;
+	
+	if (!devnode)
+		return;
+	rd_lock(&devices_lock);
+	for (int i = 0; i < total_devices; ++i)
+	{
+		cgpu = devices[i];
+		if (!(cgpu->device_path && !strcmp(cgpu->device_path, devnode)))
+			continue;
+		applog(LOG_WARNING, "%s: Device %s removed", cgpu->proc_repr, devnode);
+		dev_error(cgpu, REASON_DEV_COMMS_ERROR);
+	}
+	rd_unlock(&devices_lock);
+}
+
 static
 void *hotplug_thread(__maybe_unused void *p)
 {
@@ -13089,6 +15299,9 @@ void *hotplug_thread(__maybe_unused void *p)
 			applogfailr(NULL, LOG_ERR, "epoll_ctl");
 	}
 	
+	struct hotplug_batch batch = {
+		.infolist = NULL,
+	};
 	struct epoll_event ev;
 	int rv;
 	bool pending = false;
@@ -13103,7 +15316,7 @@ void *hotplug_thread(__maybe_unused void *p)
 		}
 		if (!rv)
 		{
-			hotplug_trigger();
+			hotplug_flush(&batch);
 			pending = false;
 			continue;
 		}
@@ -13111,9 +15324,15 @@ void *hotplug_thread(__maybe_unused void *p)
 		if (!device)
 			continue;
 		const char * const action = udev_device_get_action(device);
-		applog(LOG_DEBUG, "%s: Received %s event", __func__, action);
+		applog(LOG_DEBUG, "%s: Received %s event for %s", __func__, action, udev_device_get_subsystem(device) ?: "unknown subsystem");
 		if (!strcmp(action, "add"))
+		{
+			hotplug_add_event(&batch, device);
 			pending = true;
+		}
+		else
+		if (!strcmp(action, "remove"))
+			hotplug_remove_event(device);
 		udev_device_unref(device);
 	}
 	
@@ -13237,6 +15456,9 @@ void bfg_atexit(void)
 extern void bfg_init_threadlocal();
 extern bool stratumsrv_change_port(unsigned);
 extern void test_aan_pll(void);
+extern void test_bitfury_nonces(void);
+extern void test_serial_read_line(void);
+extern void test_device_emulator(void);
 
 int main(int argc, char *argv[])
 {
@@ -13301,6 +15523,13 @@ int main(int argc, char *argv[])
 		quit(1, "Failed to pthread_cond_init gws_cond");
 
 	notifier_init(submit_waiting_notifier);
+	mutex_init(&getwork_fetch_lock);
+	notifier_init(getwork_fetch_notifier);
+	mutex_init(&cbcheck_lock);
+	if (unlikely(pthread_cond_init(&cbcheck_cond, bfg_condattr)))
+		quit(1, "Failed to pthread_cond_init cbcheck_cond");
+	if (unlikely(pthread_cond_init(&cbcheck_done_cond, bfg_condattr)))
+		quit(1, "Failed to pthread_cond_init cbcheck_done_cond");
 	timer_unset(&tv_rescan);
 	notifier_init(rescan_notifier);
 
@@ -13478,14 +15707,36 @@ int main(int argc, char *argv[])
 		test_intrange();
 		test_decimal_width();
 		test_domain_funcs();
+		test_cglock();
+		test_cglock_bench();
+		test_unlock_yield();
+		test_timer_wheel();
+		test_minerloop_wheel();
 #ifdef USE_SCRYPT
 		test_scrypt();
 #endif
 		test_target();
+		test_goal_weights();
+		test_gbt_merkle();
+#if BLKMAKER_VERSION > 6
+		test_gbt_first_work();
+		test_block_submit();
+#endif
+		test_block_notify();
 		test_uri_get_param();
 		utf8_test();
+#if defined(NEED_BFG_LOWL_VCOM) && !defined(WIN32)
+		test_serial_read_line();
+		test_device_emulator();
+#endif
 #ifdef USE_JINGTIAN
 		test_aan_pll();
+#endif
+#ifdef USE_BITFURY
+		test_bitfury_nonces();
+#endif
+#ifdef USE_LOCK_STATS
+		test_lock_stats();
 #endif
 		if (unittest_failures)
 			quit(1, "Unit tests failed");
@@ -13755,11 +16006,19 @@ begin_bench:
 
 	if (!opt_benchmark)
 	{
-		pthread_t submit_thread;
+		pthread_t submit_thread, getwork_thread, cbcheck_thread;
 		if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, NULL)))
 			quit(1, "submit_work thread create failed");
+		if (unlikely(pthread_create(&getwork_thread, NULL, getwork_fetch_thread, NULL)))
+			quit(1, "getwork_fetch thread create failed");
+		if (unlikely(pthread_create(&cbcheck_thread, NULL, coinbase_check_thread, NULL)))
+			quit(1, "coinbase_check thread create failed");
 	}
 
+	// Fetches go through the getwork fetch thread, which benchmarking doesn't start
+	if (opt_block_notify_port && !opt_benchmark)
+		block_notify_init();
+
 	watchpool_thr_id = 1;
 	thr = &control_thr[watchpool_thr_id];
 	/* start watchpool thread */
@@ -13826,17 +16085,46 @@ begin_bench:
 		int ts, max_staged = opt_queue;
 		struct pool *pool, *cp;
 		bool lagging = false;
-		struct curl_ent *ce;
 		struct work *work;
 		struct mining_algorithm *malgo = NULL;
+		bool prefetch_claimed = false, prefetch_due = false;
 
 		cp = current_pool();
 
+		if (opt_standby_pools)
+		{
+			mutex_lock(stgd_lock);
+			const bool refresh = standby_refresh_needed;
+			standby_refresh_needed = false;
+			mutex_unlock(stgd_lock);
+			if (refresh)
+				refresh_standby_work();
+		}
+
 		// Generally, each processor needs a new work, and all at once during work restarts
 		max_staged += base_queue;
 
 		mutex_lock(stgd_lock);
-		ts = __total_staged(false);
+		ts = __total_staged(false) + getwork_fetching;
+
+		if (getwork_failed_pool) {
+			struct pool * const failed_pool = getwork_failed_pool;
+
+			malgo = getwork_failed_malgo;
+			getwork_failed_pool = NULL;
+			mutex_unlock(stgd_lock);
+
+			/* Make sure the pool just hasn't stopped serving
+			 * requests but is up as we'll keep hammering it */
+			pool = select_pool(!opt_fail_only, malgo);
+			if (pool && pool != failed_pool) {
+				applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work, failover activated", failed_pool->pool_no);
+				work = make_work();
+				goto retry;
+			}
+			mutex_lock(stgd_lock);
+			ts = __total_staged(false) + getwork_fetching;
+		}
 
 		if (!pool_localgen(cp) && !ts && !opt_fail_only)
 			lagging = true;
@@ -13867,7 +16155,7 @@ begin_bench:
 			}
 			staged_full = true;
 			pthread_cond_wait(&gws_cond, stgd_lock);
-			ts = __total_staged(false);
+			ts = __total_staged(false) + getwork_fetching;
 		}
 		mutex_unlock(stgd_lock);
 
@@ -13880,8 +16168,16 @@ begin_bench:
 			applog(LOG_WARNING, "Pool %d not providing work fast enough", cp->pool_no);
 			cp->getfail_occasions++;
 			total_go++;
+			if (opt_standby_pools) {
+				// Standby work from backup pools can now be handed out
+				mutex_lock(stgd_lock);
+				pthread_cond_broadcast(&getq->cond);
+				mutex_unlock(stgd_lock);
+			}
 		}
 		pool = select_pool(lagging, malgo);
+		if (!malgo)
+			pool = select_weighted_pool(pool);
 
 retry:
 		if (pool->has_stratum) {
@@ -13898,6 +16194,28 @@ retry:
 			stage_work(work);
 			continue;
 		}
+		
+		{
+			struct work * const prefetched = pool_prefetch_take(pool, &prefetch_claimed);
+			if (prefetched) {
+				const bool refetch = !prefetched->tr;
+				free_work(work);
+				applog(LOG_DEBUG, "Using prefetched work from pool %d", pool->pool_no);
+				stage_work(prefetched);
+				if (refetch)
+					pool_prefetch_start(pool);
+				continue;
+			}
+		}
+		
+		if (pool_gbt_swork_usable(pool, &prefetch_due)) {
+			if (prefetch_due)
+				pool_prefetch_start(pool);
+			gen_stratum_work(pool, work);
+			applog(LOG_DEBUG, "Generated work from latest GBT job in get_work_thread");
+			stage_work(work);
+			continue;
+		}
 
 		if (pool->last_work_copy) {
 			mutex_lock(&pool->last_work_lock);
@@ -13937,35 +16255,27 @@ retry:
 			continue;
 		}
 
-		work->pool = pool;
-		ce = pop_curl_entry3(pool, 2);
-		/* obtain new work from bitcoin via JSON-RPC */
-		if (!get_upstream_work(work, ce->curl)) {
-			struct pool *next_pool;
-
-			/* Make sure the pool just hasn't stopped serving
-			 * requests but is up as we'll keep hammering it */
-			push_curl_entry(ce, pool);
-			++pool->seq_getfails;
-			pool_died(pool);
-			next_pool = select_pool(!opt_fail_only, malgo);
-			if (pool == next_pool) {
+		/* Don't keep hammering a pool which just failed to provide work */
+		if (timer_isset(&pool->tv_getfail))
+		{
+			const long failed_ms = timer_elapsed_us(&pool->tv_getfail, NULL) / 1000;
+			if (failed_ms < 5000)
+			{
 				applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work, retrying in 5s", pool->pool_no);
-				cgsleep_ms(5000);
-			} else {
-				applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work, failover activated", pool->pool_no);
-				pool = next_pool;
+				cgsleep_ms(5000 - failed_ms);
 			}
-			goto retry;
 		}
-		if (ts >= max_staged)
-			pool_tclear(pool, &pool->lagging);
-		if (pool_tclear(pool, &pool->idle))
-			pool_resus(pool);
 
-		applog(LOG_DEBUG, "Generated getwork work");
-		stage_work(work);
-		push_curl_entry(ce, pool);
+		if (opt_work_prefetch)
+			++pool->cgminer_pool_stats.prefetch_misses;
+		if (prefetch_claimed) {
+			// The prefetch in progress will be staged as soon as it completes
+			free_work(work);
+			continue;
+		}
+		
+		/* obtain new work from bitcoin via JSON-RPC */
+		getwork_fetch_start(pool, work, malgo, ts >= max_staged);
 	}
 
 	return 0;
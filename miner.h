@@ -29,6 +29,7 @@
 #include <jansson.h>
 #include <curl/curl.h>
 #include <sched.h>
+#include <errno.h>
 #ifdef HAVE_INTTYPES_H
 #include <inttypes.h>
 #endif
@@ -305,6 +306,8 @@ enum bfg_probe_result_flags_values {
 };
 extern unsigned *_bfg_probe_result_flags();
 #define bfg_probe_result_flags (*_bfg_probe_result_flags())
+extern char **_bfg_probe_cache_param();
+#define bfg_probe_cache_param (*_bfg_probe_cache_param())
 
 struct mining_algorithm;
 
@@ -361,8 +364,15 @@ struct device_drv {
 
 	// Can be used per-thread or per-processor (only with minerloop async or queue!)
 	void (*poll)(struct thr_info *);
+	// Minerloop async/queue only visit processors whose timers are due; hooks changing
+	// another processor's timers or state must call minerloop_wheel_touch on its thread
+	bool minerloop_timer_wheel;
 
 	// === Implemented by minerloop_async ===
+	// Only the device's first processor runs jobs; the driver handles the rest itself
+	bool async_jobs_per_device;
+	// Async hooks never block, so devices may be run from the shared I/O reactor
+	bool io_reactor_capable;
 	bool (*job_prepare)(struct thr_info*, struct work*, uint64_t);
 	void (*job_start)(struct thr_info*);
 	void (*job_get_results)(struct thr_info*, struct work*);
@@ -453,6 +463,12 @@ struct cgminer_pool_stats {
 	struct timeval getwork_wait_max;
 	struct timeval getwork_wait_min;
 	double getwork_wait_rolling;
+	uint32_t getwork_inflight;
+	uint32_t getwork_inflight_max;
+	uint64_t cbcheck_hits;
+	uint64_t cbcheck_misses;
+	uint64_t prefetch_hits;
+	uint64_t prefetch_misses;
 	bool hadrolltime;
 	bool canroll;
 	bool hadexpire;
@@ -657,6 +673,15 @@ struct thr_info {
 	bool starting_next_work;
 	uint32_t _max_nonce;
 	notifier_t mutex_request;
+	// Set if the thread is being run from the shared I/O reactor
+	struct bfg_reactor_dev *reactor;
+	// Used with minerloop_timer_wheel; only the device's first thread has the wheel
+	struct minerloop_wheel *minerloop_wheel;
+	struct timer_wheel_entry wheel_entry;
+	unsigned wheel_visited;
+	unsigned wheel_queued;
+	struct thr_info *wheel_pending_next;
+	struct thr_info *wheel_revisit_next;
 
 	// Used by minerloop_queue
 	struct work *work_list;
@@ -793,8 +818,41 @@ extern void bfg_watchdog(struct cgpu_info *, struct timeval *tvp_now);
 
 extern void _quit(int status);
 
+enum bfg_unlock_yield {
+	BUY_ALWAYS,
+	BUY_CONTENDED,
+	BUY_NEVER,
+};
+
+extern enum bfg_unlock_yield opt_unlock_yield;
+// Set when this thread last had to wait for a lock, so BUY_CONTENDED knows others are likely waiting too
+extern bool *_bfg_lock_waited();
+#define bfg_lock_waited (*_bfg_lock_waited())
+
+static inline void lock_yield(void)
+{
+	switch (opt_unlock_yield)
+	{
+		case BUY_NEVER:
+			return;
+		case BUY_CONTENDED:
+			if (!bfg_lock_waited)
+				return;
+			bfg_lock_waited = false;
+			// fallthru
+		case BUY_ALWAYS:
+			sched_yield();
+	}
+}
+
 static inline void mutex_lock(pthread_mutex_t *lock)
 {
+	if (opt_unlock_yield == BUY_CONTENDED)
+	{
+		if (!pthread_mutex_trylock(lock))
+			return;
+		bfg_lock_waited = true;
+	}
 	if (unlikely(pthread_mutex_lock(lock)))
 		quit(1, "WTF MUTEX ERROR ON LOCK!");
 }
@@ -808,7 +866,7 @@ static inline void mutex_unlock_noyield(pthread_mutex_t *lock)
 static inline void mutex_unlock(pthread_mutex_t *lock)
 {
 	mutex_unlock_noyield(lock);
-	sched_yield();
+	lock_yield();
 }
 
 static inline int mutex_trylock(pthread_mutex_t *lock)
@@ -818,12 +876,24 @@ static inline int mutex_trylock(pthread_mutex_t *lock)
 
 static inline void wr_lock(pthread_rwlock_t *lock)
 {
+	if (opt_unlock_yield == BUY_CONTENDED)
+	{
+		if (!pthread_rwlock_trywrlock(lock))
+			return;
+		bfg_lock_waited = true;
+	}
 	if (unlikely(pthread_rwlock_wrlock(lock)))
 		quit(1, "WTF WRLOCK ERROR ON LOCK!");
 }
 
 static inline void rd_lock(pthread_rwlock_t *lock)
 {
+	if (opt_unlock_yield == BUY_CONTENDED)
+	{
+		if (!pthread_rwlock_tryrdlock(lock))
+			return;
+		bfg_lock_waited = true;
+	}
 	if (unlikely(pthread_rwlock_rdlock(lock)))
 		quit(1, "WTF RDLOCK ERROR ON LOCK!");
 }
@@ -847,13 +917,13 @@ static inline void wr_unlock_noyield(pthread_rwlock_t *lock)
 static inline void rd_unlock(pthread_rwlock_t *lock)
 {
 	rw_unlock(lock);
-	sched_yield();
+	lock_yield();
 }
 
 static inline void wr_unlock(pthread_rwlock_t *lock)
 {
 	rw_unlock(lock);
-	sched_yield();
+	lock_yield();
 }
 
 static inline void mutex_init(pthread_mutex_t *lock)
@@ -875,14 +945,25 @@ static inline void rwlock_init(pthread_rwlock_t *lock)
 		quit(1, "Failed to pthread_rwlock_init");
 }
 
-/* cgminer locks, a write biased variant of rwlocks */
+/* cgminer locks, a write biased variant of rwlocks
+ * Readers only touch an atomic count unless a writer is pending; the mutex
+ * serialises intermediate and write lockers against each other. */
+#define CGLOCK_WRITER  0x40000000
+
 struct cglock {
 	pthread_mutex_t mutex;
-	pthread_rwlock_t rwlock;
+	// Active readers, plus CGLOCK_WRITER while a writer holds or is waiting for the lock
+	volatile int readers;
+	volatile int sleepers;
+	pthread_mutex_t wait_mutex;
+	pthread_cond_t wait_cond;
 };
 
 typedef struct cglock cglock_t;
 
+extern void _cg_wait(cglock_t *, bool writer);
+extern void _cg_wake(cglock_t *);
+
 static inline void rwlock_destroy(pthread_rwlock_t *lock)
 {
 	pthread_rwlock_destroy(lock);
@@ -891,21 +972,42 @@ static inline void rwlock_destroy(pthread_rwlock_t *lock)
 static inline void cglock_init(cglock_t *lock)
 {
 	mutex_init(&lock->mutex);
-	rwlock_init(&lock->rwlock);
+	lock->readers = lock->sleepers = 0;
+	mutex_init(&lock->wait_mutex);
+	if (unlikely(pthread_cond_init(&lock->wait_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init");
 }
 
 static inline void cglock_destroy(cglock_t *lock)
 {
-	rwlock_destroy(&lock->rwlock);
+	pthread_cond_destroy(&lock->wait_cond);
+	mutex_destroy(&lock->wait_mutex);
 	mutex_destroy(&lock->mutex);
 }
 
+// Every state change is a full barrier, so checking for sleepers afterward cannot miss one
+static inline void cg_wake(cglock_t *lock)
+{
+	if (unlikely(lock->sleepers))
+		_cg_wake(lock);
+}
+
+/* Try to take a read lock without waiting, returning 0 on success like pthread_*_trylock */
+static inline int cg_tryrlock(cglock_t *lock)
+{
+	if (likely(!(__sync_fetch_and_add(&lock->readers, 1) & CGLOCK_WRITER)))
+		return 0;
+	// Back out, waking the writer if it was only waiting on us
+	if (__sync_sub_and_fetch(&lock->readers, 1) == CGLOCK_WRITER)
+		cg_wake(lock);
+	return EBUSY;
+}
+
 /* Read lock variant of cglock. Cannot be promoted. */
 static inline void cg_rlock(cglock_t *lock)
 {
-	mutex_lock(&lock->mutex);
-	rd_lock(&lock->rwlock);
-	mutex_unlock_noyield(&lock->mutex);
+	while (unlikely(cg_tryrlock(lock)))
+		_cg_wait(lock, false);
 }
 
 /* Intermediate variant of cglock - behaves as a read lock but can be promoted
@@ -918,40 +1020,46 @@ static inline void cg_ilock(cglock_t *lock)
 /* Upgrade intermediate variant to a write lock */
 static inline void cg_ulock(cglock_t *lock)
 {
-	wr_lock(&lock->rwlock);
+	// New readers are turned away from here on, so only the current ones need to drain
+	if (__sync_or_and_fetch(&lock->readers, CGLOCK_WRITER) != CGLOCK_WRITER)
+		_cg_wait(lock, true);
 }
 
 /* Write lock variant of cglock */
 static inline void cg_wlock(cglock_t *lock)
 {
 	mutex_lock(&lock->mutex);
-	wr_lock(&lock->rwlock);
+	cg_ulock(lock);
 }
 
 /* Downgrade write variant to a read lock */
 static inline void cg_dwlock(cglock_t *lock)
 {
-	wr_unlock_noyield(&lock->rwlock);
-	rd_lock(&lock->rwlock);
+	__sync_add_and_fetch(&lock->readers, 1 - CGLOCK_WRITER);
+	cg_wake(lock);
 	mutex_unlock_noyield(&lock->mutex);
 }
 
 /* Demote a write variant to an intermediate variant */
 static inline void cg_dwilock(cglock_t *lock)
 {
-	wr_unlock(&lock->rwlock);
+	__sync_sub_and_fetch(&lock->readers, CGLOCK_WRITER);
+	cg_wake(lock);
+	lock_yield();
 }
 
 /* Downgrade intermediate variant to a read lock */
 static inline void cg_dlock(cglock_t *lock)
 {
-	rd_lock(&lock->rwlock);
+	__sync_add_and_fetch(&lock->readers, 1);
 	mutex_unlock(&lock->mutex);
 }
 
 static inline void cg_runlock(cglock_t *lock)
 {
-	rd_unlock(&lock->rwlock);
+	if (__sync_sub_and_fetch(&lock->readers, 1) == CGLOCK_WRITER)
+		cg_wake(lock);
+	lock_yield();
 }
 
 static inline void cg_iunlock(cglock_t *lock)
@@ -961,10 +1069,193 @@ static inline void cg_iunlock(cglock_t *lock)
 
 static inline void cg_wunlock(cglock_t *lock)
 {
-	wr_unlock_noyield(&lock->rwlock);
+	__sync_sub_and_fetch(&lock->readers, CGLOCK_WRITER);
+	cg_wake(lock);
 	mutex_unlock(&lock->mutex);
 }
 
+#ifdef USE_LOCK_STATS
+// Wait/hold histogram buckets: bucket i counts times under 4^i microseconds, the last is everything beyond
+#define LOCK_STATS_BUCKETS  12
+
+struct lock_site {
+	const char *lockname;
+	const char *op;
+	const char *file;
+	const char *func;
+	int line;
+	int registered;
+	
+	uint64_t acquisitions;
+	uint64_t contended;
+	uint64_t wait_us;
+	uint64_t wait_max_us;
+	uint64_t hold_us;
+	uint64_t hold_max_us;
+	uint64_t wait_hist[LOCK_STATS_BUCKETS];
+	uint64_t hold_hist[LOCK_STATS_BUCKETS];
+	
+	struct lock_site *next;
+};
+
+extern bool opt_lock_stats;
+extern struct lock_site *lock_stats_sites;
+// Per-thread list of held locks, allocated by lock-stats.c on first use
+extern void **_bfg_lock_stats_held();
+extern void lock_stats_acquired(struct lock_site *, const void *lock, const struct timeval *tv_start, bool contended, bool held);
+extern void lock_stats_released(const void *lock);
+extern struct lock_site *lock_stats_suspend(const void *lock);
+extern void lock_stats_resume(struct lock_site *, const void *lock);
+extern void lock_stats_dump(void);
+extern void test_lock_stats(void);
+
+#define LOCK_STATS_SITE(lock, opname)  ({  \
+	static struct lock_site _lock_site = {  \
+		.lockname = #lock,  \
+		.op = opname,  \
+		.file = __FILE__,  \
+		.func = __func__,  \
+		.line = __LINE__,  \
+	};  \
+	&_lock_site;  \
+})
+
+// Every instrumented acquisition first tries without blocking, so contention is counted exactly
+#define LOCK_STATS_ACQUIRE(site, lockp, trylockexpr, lockexpr, held)  do {  \
+	struct timeval _tv_start;  \
+	bool _contended = false;  \
+	if (!opt_lock_stats)  \
+	{  \
+		lockexpr;  \
+		break;  \
+	}  \
+	timer_set_now(&_tv_start);  \
+	if (trylockexpr)  \
+	{  \
+		_contended = true;  \
+		lockexpr;  \
+	}  \
+	lock_stats_acquired(site, lockp, &_tv_start, _contended, held);  \
+} while (0)
+
+static inline
+void lock_stats_mutex_lock(pthread_mutex_t * const lock, struct lock_site * const site)
+{
+	LOCK_STATS_ACQUIRE(site, lock, pthread_mutex_trylock(lock), (mutex_lock)(lock), true);
+}
+
+static inline
+int lock_stats_mutex_trylock(pthread_mutex_t * const lock, struct lock_site * const site)
+{
+	const int rv = (mutex_trylock)(lock);
+	if (opt_lock_stats && !rv)
+	{
+		struct timeval tv_now;
+		timer_set_now(&tv_now);
+		lock_stats_acquired(site, lock, &tv_now, false, true);
+	}
+	return rv;
+}
+
+static inline
+void lock_stats_wr_lock(pthread_rwlock_t * const lock, struct lock_site * const site)
+{
+	LOCK_STATS_ACQUIRE(site, lock, pthread_rwlock_trywrlock(lock), (wr_lock)(lock), true);
+}
+
+static inline
+void lock_stats_rd_lock(pthread_rwlock_t * const lock, struct lock_site * const site)
+{
+	LOCK_STATS_ACQUIRE(site, lock, pthread_rwlock_tryrdlock(lock), (rd_lock)(lock), true);
+}
+
+static inline
+void lock_stats_cg_rlock(cglock_t * const lock, struct lock_site * const site)
+{
+	LOCK_STATS_ACQUIRE(site, lock, cg_tryrlock(lock), (cg_rlock)(lock), true);
+}
+
+static inline
+void lock_stats_cg_ilock(cglock_t * const lock, struct lock_site * const site)
+{
+	LOCK_STATS_ACQUIRE(site, lock, pthread_mutex_trylock(&lock->mutex), (mutex_lock)(&lock->mutex), true);
+}
+
+// Upgrading only waits for readers to drain; the intermediate lock is already held
+static inline
+void lock_stats_cg_ulock(cglock_t * const lock, struct lock_site * const site)
+{
+	LOCK_STATS_ACQUIRE(site, lock, (lock->readers & ~CGLOCK_WRITER), (cg_ulock)(lock), false);
+}
+
+static inline
+void lock_stats_cg_wlock(cglock_t * const lock, struct lock_site * const site)
+{
+	LOCK_STATS_ACQUIRE(site, lock, pthread_mutex_trylock(&lock->mutex), (mutex_lock)(&lock->mutex), true);
+	(cg_ulock)(lock);
+}
+
+#define LOCK_STATS_RELEASE(lockp, unlockexpr)  do {  \
+	if (opt_lock_stats)  \
+		lock_stats_released(lockp);  \
+	unlockexpr;  \
+} while (0)
+
+// Time spent waiting on a condition does not count as holding its mutex
+static inline
+int lock_stats_cond_wait(pthread_cond_t * const cond, pthread_mutex_t * const lock)
+{
+	struct lock_site *site;
+	int rv;
+	
+	if (!opt_lock_stats)
+		return (pthread_cond_wait)(cond, lock);
+	site = lock_stats_suspend(lock);
+	rv = (pthread_cond_wait)(cond, lock);
+	if (site)
+		lock_stats_resume(site, lock);
+	return rv;
+}
+
+static inline
+int lock_stats_cond_timedwait(pthread_cond_t * const cond, pthread_mutex_t * const lock, const struct timespec * const abstime)
+{
+	struct lock_site *site;
+	int rv;
+	
+	if (!opt_lock_stats)
+		return (pthread_cond_timedwait)(cond, lock, abstime);
+	site = lock_stats_suspend(lock);
+	rv = (pthread_cond_timedwait)(cond, lock, abstime);
+	if (site)
+		lock_stats_resume(site, lock);
+	return rv;
+}
+
+#define mutex_lock(lock)  lock_stats_mutex_lock(lock, LOCK_STATS_SITE(lock, "mutex_lock"))
+#define mutex_trylock(lock)  lock_stats_mutex_trylock(lock, LOCK_STATS_SITE(lock, "mutex_trylock"))
+#define wr_lock(lock)  lock_stats_wr_lock(lock, LOCK_STATS_SITE(lock, "wr_lock"))
+#define rd_lock(lock)  lock_stats_rd_lock(lock, LOCK_STATS_SITE(lock, "rd_lock"))
+#define cg_rlock(lock)  lock_stats_cg_rlock(lock, LOCK_STATS_SITE(lock, "cg_rlock"))
+#define cg_ilock(lock)  lock_stats_cg_ilock(lock, LOCK_STATS_SITE(lock, "cg_ilock"))
+#define cg_ulock(lock)  lock_stats_cg_ulock(lock, LOCK_STATS_SITE(lock, "cg_ulock"))
+#define cg_wlock(lock)  lock_stats_cg_wlock(lock, LOCK_STATS_SITE(lock, "cg_wlock"))
+
+#define mutex_unlock(lock)  LOCK_STATS_RELEASE(lock, (mutex_unlock)(lock))
+#define mutex_unlock_noyield(lock)  LOCK_STATS_RELEASE(lock, (mutex_unlock_noyield)(lock))
+#define rw_unlock(lock)  LOCK_STATS_RELEASE(lock, (rw_unlock)(lock))
+#define rd_unlock(lock)  LOCK_STATS_RELEASE(lock, (rd_unlock)(lock))
+#define wr_unlock(lock)  LOCK_STATS_RELEASE(lock, (wr_unlock)(lock))
+#define rd_unlock_noyield(lock)  LOCK_STATS_RELEASE(lock, (rd_unlock_noyield)(lock))
+#define wr_unlock_noyield(lock)  LOCK_STATS_RELEASE(lock, (wr_unlock_noyield)(lock))
+#define cg_runlock(lock)  LOCK_STATS_RELEASE(lock, (cg_runlock)(lock))
+#define cg_iunlock(lock)  LOCK_STATS_RELEASE(lock, (cg_iunlock)(lock))
+#define cg_wunlock(lock)  LOCK_STATS_RELEASE(lock, (cg_wunlock)(lock))
+
+#define pthread_cond_wait(cond, lock)  lock_stats_cond_wait(cond, lock)
+#define pthread_cond_timedwait(cond, lock, abstime)  lock_stats_cond_timedwait(cond, lock, abstime)
+#endif
+
 struct pool;
 
 #define API_MCAST_CODE "FTW"
@@ -1117,6 +1408,7 @@ extern bool detect_stratum(struct pool *pool, char *url);
 extern void print_summary(void);
 extern struct mining_algorithm *mining_algorithm_by_alias(const char *alias);
 extern struct mining_goal_info *get_mining_goal(const char *name);
+extern const char *set_goal_params(struct mining_goal_info *, char *arg);
 extern void goal_set_malgo(struct mining_goal_info *, struct mining_algorithm *);
 extern void mining_goal_reset(struct mining_goal_info * const goal);
 extern void adjust_quota_gcd(void);
@@ -1195,9 +1487,15 @@ struct mining_goal_info {
 	char *current_goal_detail;
 	
 	double diff_accepted;
+	double diff1;
 	
 	bool have_longpoll;
 	
+	// Share of staged work when any goal has a weight; protected by stgd_lock
+	double weight;
+	int staged;
+	uint64_t works;
+	
 	UT_hash_handle hh;
 };
 
@@ -1232,6 +1530,15 @@ extern unsigned int new_blocks;
 extern unsigned int found_blocks;
 extern int total_accepted, total_rejected;
 extern int total_getworks, total_stale, total_discarded;
+// Counters only ever updated by their own thread, so they need no atomics or locking
+struct bfg_tls_counters {
+	uint64_t stale_checks;
+	uint64_t stale_check_hits;
+};
+extern struct bfg_tls_counters *bfg_tls_counters();
+// Totals across all threads, including those which have exited
+extern void bfg_tls_counters_sum(struct bfg_tls_counters *);
+extern void get_stale_check_counts(uint64_t *out_checks, uint64_t *out_hits);
 extern uint64_t total_bytes_rcvd, total_bytes_sent;
 #define total_bytes_xfer (total_bytes_rcvd + total_bytes_sent)
 extern double total_diff1, total_bad_diff1;
@@ -1243,6 +1550,7 @@ extern int opt_hysteresis;
 extern int opt_fail_pause;
 extern int opt_log_interval;
 extern unsigned long long global_hashrate;
+extern bool opt_unittest_bench;
 extern unsigned unittest_failures;
 extern double best_diff;
 extern struct mining_algorithm *mining_algorithms;
@@ -1289,11 +1597,16 @@ struct stratum_work {
 	
 	struct bfg_tmpl_ref *tr;
 	char *job_id;
+	// Bumped whenever job_id changes
+	uint32_t job_gen;
 	bool clean;
 	
 	bytes_t coinbase;
 	size_t nonce2_offset;
 	int n2size;
+	// Set if the coinbase was still being checked when received
+	bool cbcheck_pending;
+	uint8_t cbcheck_digest[0x20];
 	
 	int merkles;
 	bytes_t merkle_bin;
@@ -1319,6 +1632,15 @@ struct stratum_work {
 	unsigned char work_restart_id;
 };
 
+#define GBT_MERKLE_MAX_LEVELS  0x20
+
+// Merkle tree of a GBT template's transactions, kept between template updates
+// Index 0 of every level is a placeholder for the coinbase path
+struct gbt_merkle_tree {
+	bytes_t level[GBT_MERKLE_MAX_LEVELS];
+	int levels;
+};
+
 #define RBUFSIZE 8192
 #define RECVSIZE (RBUFSIZE - 4)
 
@@ -1331,6 +1653,9 @@ struct bytes_hashtbl {
 	UT_hash_handle hh;
 };
 
+#define COINBASE_CHECK_CACHE_SIZE  8
+#define STANDBY_WORK_QUEUE  2
+
 struct coinbase_param {
 	bool testnet;
 	struct bytes_hashtbl *scripts;
@@ -1344,6 +1669,7 @@ struct pool {
 	int accepted, rejected;
 	int seq_rejects;
 	int seq_getfails;
+	struct timeval tv_getfail;
 	int solved;
 	double diff1;
 	char diff[ALLOC_H2B_SHORTV];
@@ -1370,6 +1696,8 @@ struct pool {
 	time_t work_restart_time;
 	char work_restart_timestamp[11];
 	uint32_t	block_id;
+	// Previous block hash of the pool's latest work, as in work data; protected by pool_lock
+	uint8_t prevblkhash[32];
 	struct mining_goal_info *goal;
 	enum bfg_tristate pool_diff_effective_retroactively;
 
@@ -1443,6 +1771,8 @@ struct pool {
 	bool stratum_init;
 	bool stratum_notify;
 	struct stratum_work swork;
+	pthread_mutex_t gbt_merkle_lock;
+	struct gbt_merkle_tree gbt_merkle;
 	char *goalname;
 	char *next_goalname;
 	struct mining_algorithm *next_goal_malgo;
@@ -1455,9 +1785,26 @@ struct pool {
 
 	/* param for coinbase check */
 	struct coinbase_param cb_param;
+	uint8_t cbcheck_cache[COINBASE_CHECK_CACHE_SIZE][0x20];
+	int cbcheck_cached;
+	uint8_t cbcheck_failed[COINBASE_CHECK_CACHE_SIZE][0x20];
+	int cbcheck_failed_count;
 	
 	pthread_mutex_t last_work_lock;
 	struct work *last_work_copy;
+	// Next work fetched ahead of need; protected by last_work_lock
+	struct work *prefetch_work;
+	bool prefetching;
+	bool prefetch_claimed;
+	
+	// Warm standby for failover; standby_staged is protected by stgd_lock
+	bool standby;
+	int standby_staged;
+	// Time from switching to this pool until its first work is mined; protected by pool_lock
+	struct timeval tv_failover;
+	struct timeval failover_gap_last;
+	struct timeval failover_gap_max;
+	uint32_t failovers;
 };
 
 #define GETWORK_MODE_TESTPOOL 'T'
@@ -1479,6 +1826,8 @@ struct work {
 	double share_diff;
 
 	int		rolls;
+	// Rolled copies promised to the staging queue but not yet generated
+	int		variants;
 	struct ntime_roll_limits ntime_roll_limits;
 
 	struct {
@@ -1498,12 +1847,19 @@ struct work {
 	bool		stale;
 	bool		mandatory;
 	bool spare;
+	// Pre-generated for a standby pool; only used if nothing else is staged
+	bool standby;
 	bool		block;
 
 	bool		stratum;
 	char 		*job_id;
+	// swork job_gen when generated, so stale checks need neither data_lock nor strcmp
+	uint32_t	job_gen;
 	bytes_t		nonce2;
 	char		*nonce1;
+	// Generated before its coinbase was checked; shares wait for the result
+	bool		cbcheck_pending;
+	uint8_t		cbcheck_digest[0x20];
 
 	unsigned char	work_restart_id;
 	int		id;
@@ -1528,6 +1884,7 @@ struct work {
 	struct bfg_tmpl_ref *tr;
 	unsigned int	dataid;
 	bool		do_foreign_submit;
+	bool		block_broadcast;
 
 	struct timeval	tv_getwork;
 	time_t		ts_getwork;
@@ -1615,7 +1972,7 @@ extern void clear_logwin(void);
 extern void logwin_update(void);
 extern bool pool_tclear(struct pool *pool, bool *var);
 extern bool pool_may_redirect_to(struct pool *, const char *uri);
-extern void pool_check_coinbase(struct pool *, const uint8_t *cbtxn, size_t cbtxnsz);
+extern bool pool_check_coinbase(struct pool *, const uint8_t *cbtxn, size_t cbtxnsz, size_t gap_offset, size_t gap_len, uint8_t *out_digest);
 extern struct thread_q *tq_new(void);
 extern void tq_free(struct thread_q *tq);
 extern bool tq_push(struct thread_q *tq, void *data);
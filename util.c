@@ -1052,6 +1052,168 @@ out:
 	return rval;
 }
 
+// Slow paths for cglock: sleep until readers may enter, or (writer) until they have drained
+void _cg_wait(cglock_t * const lock, const bool writer)
+{
+	bfg_lock_waited = true;
+	pthread_mutex_lock(&lock->wait_mutex);
+	__sync_add_and_fetch(&lock->sleepers, 1);
+	while (writer ? (lock->readers != CGLOCK_WRITER) : (lock->readers & CGLOCK_WRITER))
+		(pthread_cond_wait)(&lock->wait_cond, &lock->wait_mutex);
+	__sync_sub_and_fetch(&lock->sleepers, 1);
+	pthread_mutex_unlock(&lock->wait_mutex);
+}
+
+void _cg_wake(cglock_t * const lock)
+{
+	pthread_mutex_lock(&lock->wait_mutex);
+	pthread_cond_broadcast(&lock->wait_cond);
+	pthread_mutex_unlock(&lock->wait_mutex);
+}
+
+static inline
+uint64_t timer_wheel_tick(const struct timeval * const tvp)
+{
+	return ((uint64_t)tvp->tv_sec * 1000) + (tvp->tv_usec / 1000);
+}
+
+void timer_wheel_init(struct timer_wheel * const wheel, const struct timeval * const tvp_now)
+{
+	*wheel = (struct timer_wheel){
+		.tick_now = timer_wheel_tick(tvp_now),
+	};
+}
+
+static
+void _timer_wheel_insert(struct timer_wheel * const wheel, struct timer_wheel_entry * const entry)
+{
+	const uint64_t max_delta = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+	uint64_t tick = entry->tick, delta;
+	int level;
+	
+	// Overdue entries go in the current slot, and far future ones are parked in the last reachable slot until cascaded
+	if (tick < wheel->tick_now)
+		tick = wheel->tick_now;
+	delta = tick - wheel->tick_now;
+	if (delta > max_delta)
+	{
+		delta = max_delta;
+		tick = wheel->tick_now + delta;
+	}
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level)
+		if (delta < ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))))
+			break;
+	entry->head = &wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+	DL_APPEND(*entry->head, entry);
+}
+
+void timer_wheel_schedule(struct timer_wheel * const wheel, struct timer_wheel_entry * const entry, const struct timeval * const tvp)
+{
+	timer_wheel_cancel(wheel, entry);
+	entry->tv = *tvp;
+	entry->tick = timer_wheel_tick(tvp);
+	_timer_wheel_insert(wheel, entry);
+	++wheel->count;
+}
+
+void timer_wheel_cancel(struct timer_wheel * const wheel, struct timer_wheel_entry * const entry)
+{
+	if (!entry->head)
+		return;
+	DL_DELETE(*entry->head, entry);
+	entry->head = NULL;
+	--wheel->count;
+}
+
+// Moves entries down from coarser levels as tick_now enters their slot
+static
+void timer_wheel_cascade(struct timer_wheel * const wheel)
+{
+	struct timer_wheel_entry *list, *entry, *tmp;
+	int level, shift;
+	
+	for (level = TIMER_WHEEL_LEVELS - 1; level > 0; --level)
+	{
+		shift = TIMER_WHEEL_BITS * level;
+		if (wheel->tick_now & (((uint64_t)1 << shift) - 1))
+			continue;
+		struct timer_wheel_entry ** const head = &wheel->slots[level][(wheel->tick_now >> shift) & (TIMER_WHEEL_SLOTS - 1)];
+		list = *head;
+		*head = NULL;
+		DL_FOREACH_SAFE(list, entry, tmp)
+		{
+			DL_DELETE(list, entry);
+			_timer_wheel_insert(wheel, entry);
+		}
+	}
+}
+
+// Returns a list (linked by next/prev) of every entry that has expired, removing them from the wheel
+struct timer_wheel_entry *timer_wheel_expire(struct timer_wheel * const wheel, const struct timeval * const tvp_now)
+{
+	const uint64_t target = timer_wheel_tick(tvp_now);
+	struct timer_wheel_entry *expired = NULL, *entry, *tmp, **head;
+	
+	if (!wheel->count)
+	{
+		if (target > wheel->tick_now)
+			wheel->tick_now = target;
+		return NULL;
+	}
+	
+	while (true)
+	{
+		head = &wheel->slots[0][wheel->tick_now & (TIMER_WHEEL_SLOTS - 1)];
+		DL_FOREACH_SAFE(*head, entry, tmp)
+		{
+			// Within the current millisecond, go by the exact time
+			if (wheel->tick_now >= target && timercmp(&entry->tv, tvp_now, >))
+				continue;
+			DL_DELETE(*head, entry);
+			entry->head = NULL;
+			--wheel->count;
+			DL_APPEND(expired, entry);
+		}
+		if (wheel->tick_now >= target)
+			break;
+		++wheel->tick_now;
+		timer_wheel_cascade(wheel);
+	}
+	
+	return expired;
+}
+
+static
+bool _timer_wheel_reduce_timeout_slot(struct timer_wheel_entry * const head, struct timeval * const tvp_timeout)
+{
+	struct timer_wheel_entry *entry;
+	
+	if (!head)
+		return false;
+	DL_FOREACH(head, entry)
+		reduce_timeout_to(tvp_timeout, &entry->tv);
+	return true;
+}
+
+// Only the first occupied slot of each level can hold the earliest entry
+void timer_wheel_reduce_timeout(struct timer_wheel * const wheel, struct timeval * const tvp_timeout)
+{
+	int level, i, shift;
+	uint64_t base;
+	
+	if (!wheel->count)
+		return;
+	for (level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+	{
+		shift = TIMER_WHEEL_BITS * level;
+		base = wheel->tick_now >> shift;
+		// Coarser levels never hold entries for their current slot, but may wrap all the way around to it
+		for (i = level ? 1 : 0; i <= (level ? TIMER_WHEEL_SLOTS : TIMER_WHEEL_SLOTS - 1); ++i)
+			if (_timer_wheel_reduce_timeout_slot(wheel->slots[level][(base + i) & (TIMER_WHEEL_SLOTS - 1)], tvp_timeout))
+				break;
+	}
+}
+
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg)
 {
 	int rv = pthread_create(&thr->pth, attr, start, arg);
@@ -2463,6 +2625,388 @@ void test_uri_get_param()
 	_test_uri_get_param("stratum+tcp://footest/#redirect=yes", "redirect", false, true);
 }
 
+/* In-tree lock benchmarks: nthreads threads run iter until stopped, and the
+ * total rate is reported. Thread counts above the CPU count are deliberate,
+ * to show behaviour under oversubscription too. */
+static volatile bool _test_lock_bench_stop;
+
+struct _test_lock_bench_thr {
+	void (*iter)(void *);
+	void *ctx;
+	uint64_t count;
+	pthread_t pth;
+};
+
+static
+void *_test_lock_bench_thread(void * const p)
+{
+	struct _test_lock_bench_thr * const thr = p;
+	
+	while (!_test_lock_bench_stop)
+	{
+		thr->iter(thr->ctx);
+		++thr->count;
+	}
+	return NULL;
+}
+
+// Returns iterations per second across all threads; extra_thread (if any) runs alongside until stopped
+static
+double _test_lock_bench(const int nthreads, void (* const iter)(void *), void * const ctx, void *(* const extra_thread)(void *), const int duration_ms)
+{
+	struct _test_lock_bench_thr thrs[nthreads];
+	struct timeval tv_start;
+	pthread_t extra_pth;
+	uint64_t total = 0;
+	long elapsed_us;
+	int i;
+	
+	_test_lock_bench_stop = false;
+	timer_set_now(&tv_start);
+	if (extra_thread && unlikely(pthread_create(&extra_pth, NULL, extra_thread, ctx)))
+		quit(1, "%s: pthread_create failed", __func__);
+	for (i = 0; i < nthreads; ++i)
+	{
+		thrs[i] = (struct _test_lock_bench_thr){
+			.iter = iter,
+			.ctx = ctx,
+		};
+		if (unlikely(pthread_create(&thrs[i].pth, NULL, _test_lock_bench_thread, &thrs[i])))
+			quit(1, "%s: pthread_create failed", __func__);
+	}
+	cgsleep_ms(duration_ms);
+	_test_lock_bench_stop = true;
+	for (i = 0; i < nthreads; ++i)
+	{
+		pthread_join(thrs[i].pth, NULL);
+		total += thrs[i].count;
+	}
+	if (extra_thread)
+		pthread_join(extra_pth, NULL);
+	elapsed_us = timer_elapsed_us(&tv_start, NULL);
+	return total * 1e6 / (elapsed_us ?: 1);
+}
+
+struct _test_unlock_yield_ctx {
+	pthread_mutex_t queue_lock, stats_lock;
+	int queued;
+	uint64_t stats;
+};
+
+// Like hash_pop taking work off the staged queue, then updating stats
+static
+void _test_unlock_yield_iter(void * const p)
+{
+	struct _test_unlock_yield_ctx * const ctx = p;
+	
+	mutex_lock(&ctx->queue_lock);
+	++ctx->queued;
+	--ctx->queued;
+	mutex_unlock(&ctx->queue_lock);
+	mutex_lock(&ctx->stats_lock);
+	++ctx->stats;
+	mutex_unlock(&ctx->stats_lock);
+}
+
+// Compares --unlock-yield policies; run with --unittest-bench on the target machine to see which suits it
+// Otherwise, each policy only gets a short run checking the lock still excludes
+void test_unlock_yield()
+{
+	static const int thread_counts[] = {1, 4, 16};
+	static const int n = sizeof(thread_counts) / sizeof(*thread_counts);
+	// The smoke run uses 4 threads, so there is contention
+	const int first = opt_unittest_bench ? 0 : 1, last = opt_unittest_bench ? (n - 1) : 1;
+	const int duration_ms = opt_unittest_bench ? 100 : 10;
+	static const char * const policy_names[] = {
+		[BUY_ALWAYS] = "always",
+		[BUY_CONTENDED] = "contended",
+		[BUY_NEVER] = "never",
+	};
+	const enum bfg_unlock_yield saved_policy = opt_unlock_yield;
+	struct _test_unlock_yield_ctx ctx = {
+		.queued = 0,
+	};
+	double rates[3][n];
+	
+	mutex_init(&ctx.queue_lock);
+	mutex_init(&ctx.stats_lock);
+	for (int policy = BUY_ALWAYS; policy <= BUY_NEVER; ++policy)
+	{
+		opt_unlock_yield = policy;
+		for (int i = first; i <= last; ++i)
+			rates[policy][i] = _test_lock_bench(thread_counts[i], _test_unlock_yield_iter, &ctx, NULL, duration_ms);
+	}
+	opt_unlock_yield = saved_policy;
+	mutex_destroy(&ctx.queue_lock);
+	mutex_destroy(&ctx.stats_lock);
+	
+	if (ctx.queued)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: queue count is %d after benchmark (expected 0)", __func__, ctx.queued);
+	}
+	if (!opt_unittest_bench)
+		return;
+	for (int policy = BUY_ALWAYS; policy <= BUY_NEVER; ++policy)
+		applog(LOG_NOTICE, "%s: %-9s %6.2f / %6.2f / %6.2f M iterations/s with %d / %d / %d threads",
+		       __func__, policy_names[policy], rates[policy][0] / 1e6, rates[policy][1] / 1e6, rates[policy][2] / 1e6,
+		       thread_counts[0], thread_counts[1], thread_counts[2]);
+}
+
+static volatile bool _test_cglock_reader_in;
+
+static
+void *_test_cglock_reader(void * const p)
+{
+	cglock_t * const lock = p;
+	cg_rlock(lock);
+	_test_cglock_reader_in = true;
+	cg_runlock(lock);
+	return lock;
+}
+
+static
+void _test_cglock_state(cglock_t * const lock, const int expect, const char * const step)
+{
+	if (lock->readers == expect)
+		return;
+	++unittest_failures;
+	applog(LOG_ERR, "%s: after %s, lock state is %x (expected %x)", "test_cglock", step, lock->readers, expect);
+}
+
+void test_cglock()
+{
+	cglock_t lock;
+	pthread_t pth;
+	void *rv = NULL;
+	int i;
+	
+	cglock_init(&lock);
+	
+	cg_rlock(&lock);
+	cg_ilock(&lock);
+	_test_cglock_state(&lock, 1, "rlock+ilock");
+	cg_runlock(&lock);
+	cg_ulock(&lock);
+	_test_cglock_state(&lock, CGLOCK_WRITER, "ulock");
+	if (!cg_tryrlock(&lock))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: read lock taken while write locked", __func__);
+	}
+	cg_dwlock(&lock);
+	_test_cglock_state(&lock, 1, "dwlock");
+	cg_runlock(&lock);
+	
+	cg_wlock(&lock);
+	cg_dwilock(&lock);
+	_test_cglock_state(&lock, 0, "dwilock");
+	cg_dlock(&lock);
+	_test_cglock_state(&lock, 1, "dlock");
+	cg_runlock(&lock);
+	
+	// A reader started during a write must wait for it, then get in
+	cg_wlock(&lock);
+	_test_cglock_reader_in = false;
+	if (unlikely(pthread_create(&pth, NULL, _test_cglock_reader, &lock)))
+		quit(1, "%s: pthread_create failed", __func__);
+	for (i = 0; !lock.sleepers && i < 5000; ++i)
+		cgsleep_ms(1);
+	// The reader counts itself as a sleeper under wait_mutex, and only releases it once waiting on wait_cond
+	pthread_mutex_lock(&lock.wait_mutex);
+	pthread_mutex_unlock(&lock.wait_mutex);
+	if (!lock.sleepers || _test_cglock_reader_in)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: reader did not block on write lock", __func__);
+	}
+	cg_wunlock(&lock);
+	pthread_join(pth, &rv);
+	if (rv != &lock || !_test_cglock_reader_in)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: reader thread failed", __func__);
+	}
+	_test_cglock_state(&lock, 0, "wunlock");
+	
+	cglock_destroy(&lock);
+}
+
+// Readers check a and b are always seen equal, while a writer updates both every millisecond
+struct _test_cglock_bench_ctx {
+	bool use_cglock;
+	cglock_t cglock;
+	pthread_rwlock_t rwlock;
+	volatile unsigned a, b;
+	volatile unsigned torn;
+	unsigned writes;
+};
+
+static
+void _test_cglock_bench_read(void * const p)
+{
+	struct _test_cglock_bench_ctx * const ctx = p;
+	
+	if (ctx->use_cglock)
+		cg_rlock(&ctx->cglock);
+	else
+		rd_lock(&ctx->rwlock);
+	if (ctx->a != ctx->b)
+		++ctx->torn;
+	if (ctx->use_cglock)
+		cg_runlock(&ctx->cglock);
+	else
+		rd_unlock(&ctx->rwlock);
+}
+
+static
+void *_test_cglock_bench_writer(void * const p)
+{
+	struct _test_cglock_bench_ctx * const ctx = p;
+	
+	while (!_test_lock_bench_stop)
+	{
+		if (ctx->use_cglock)
+			cg_wlock(&ctx->cglock);
+		else
+			wr_lock(&ctx->rwlock);
+		++ctx->a;
+		++ctx->b;
+		if (ctx->use_cglock)
+			cg_wunlock(&ctx->cglock);
+		else
+			wr_unlock(&ctx->rwlock);
+		++ctx->writes;
+		cgsleep_ms(1);
+	}
+	return NULL;
+}
+
+// Read throughput of cglock against a plain rwlock as readers are added, with a writer active
+// Only a short run checking for torn reads is done, unless --unittest-bench is used
+void test_cglock_bench()
+{
+	static const int reader_counts[] = {1, 4, 16, 64};
+	const int n = opt_unittest_bench ? (sizeof(reader_counts) / sizeof(*reader_counts)) : 1;
+	const int duration_ms = opt_unittest_bench ? 100 : 10;
+	struct _test_cglock_bench_ctx ctx = {
+		.a = 0,
+	};
+	double rates[2][n];
+	unsigned writes[2] = {0, 0};
+	
+	cglock_init(&ctx.cglock);
+	rwlock_init(&ctx.rwlock);
+	for (int kind = 0; kind < 2; ++kind)
+	{
+		ctx.use_cglock = kind;
+		for (int i = 0; i < n; ++i)
+		{
+			ctx.writes = 0;
+			rates[kind][i] = _test_lock_bench(reader_counts[i], _test_cglock_bench_read, &ctx, _test_cglock_bench_writer, duration_ms);
+			writes[kind] += ctx.writes;
+		}
+	}
+	cglock_destroy(&ctx.cglock);
+	rwlock_destroy(&ctx.rwlock);
+	
+	if (ctx.torn)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: readers saw %u partial writes", __func__, ctx.torn);
+	}
+	if (!opt_unittest_bench)
+		return;
+	for (int kind = 0; kind < 2; ++kind)
+		applog(LOG_NOTICE, "%s: %-7s %6.2f / %6.2f / %6.2f / %6.2f M reads/s with %d / %d / %d / %d readers (%u writes)",
+		       __func__, kind ? "cglock" : "rwlock",
+		       rates[kind][0] / 1e6, rates[kind][1] / 1e6, rates[kind][2] / 1e6, rates[kind][3] / 1e6,
+		       reader_counts[0], reader_counts[1], reader_counts[2], reader_counts[3], writes[kind]);
+}
+
+static
+void _test_timer_wheel_expect(struct timer_wheel * const wheel, const struct timeval * const tvp_now, const int expect_count, const int expect_mask)
+{
+	struct timer_wheel_entry *expired, *entry;
+	int count = 0, mask = 0;
+	
+	expired = timer_wheel_expire(wheel, tvp_now);
+	DL_FOREACH(expired, entry)
+	{
+		++count;
+		mask |= 1 << (int)(intptr_t)entry->userp;
+	}
+	if (count != expect_count || mask != expect_mask)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: at %ld.%06ld expired %d entries (mask %x), expected %d (mask %x)",
+		       "test_timer_wheel", (long)tvp_now->tv_sec, (long)tvp_now->tv_usec, count, mask, expect_count, expect_mask);
+	}
+}
+
+void test_timer_wheel()
+{
+	static const int64_t delays_us[] = { -5000, 0, 500, 1500, 255000, 256000, 70000000, 18000000000LL };
+	const int n = sizeof(delays_us) / sizeof(*delays_us);
+	struct timer_wheel_entry entries[n];
+	struct timer_wheel wheel;
+	struct timeval tv_start = { .tv_sec = 1000, .tv_usec = 999400, }, tv_now, tv_timeout;
+	int i;
+	
+	timer_wheel_init(&wheel, &tv_start);
+	for (i = 0; i < n; ++i)
+	{
+		entries[i] = (struct timer_wheel_entry){ .userp = (void *)(intptr_t)i, };
+		timer_set_delay(&tv_now, &tv_start, delays_us[i]);
+		timer_wheel_schedule(&wheel, &entries[i], &tv_now);
+	}
+	
+	timer_unset(&tv_timeout);
+	timer_wheel_reduce_timeout(&wheel, &tv_timeout);
+	timer_set_delay(&tv_now, &tv_start, delays_us[0]);
+	if (!timercmp(&tv_timeout, &tv_now, ==))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: wrong initial timeout", __func__);
+	}
+	
+	_test_timer_wheel_expect(&wheel, &tv_start, 2, 0x3);
+	// Same millisecond, but not yet due
+	timer_set_delay(&tv_now, &tv_start, 400);
+	_test_timer_wheel_expect(&wheel, &tv_now, 0, 0);
+	timer_set_delay(&tv_now, &tv_start, 500);
+	_test_timer_wheel_expect(&wheel, &tv_now, 1, 0x4);
+	
+	timer_wheel_cancel(&wheel, &entries[3]);
+	timer_unset(&tv_timeout);
+	timer_wheel_reduce_timeout(&wheel, &tv_timeout);
+	timer_set_delay(&tv_now, &tv_start, delays_us[4]);
+	if (!timercmp(&tv_timeout, &tv_now, ==))
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: wrong timeout after cancel", __func__);
+	}
+	
+	timer_set_delay(&tv_now, &tv_start, 255999);
+	_test_timer_wheel_expect(&wheel, &tv_now, 1, 0x10);
+	timer_set_delay(&tv_now, &tv_start, 69999999);
+	_test_timer_wheel_expect(&wheel, &tv_now, 1, 0x20);
+	timer_set_delay(&tv_now, &tv_start, 70000000);
+	_test_timer_wheel_expect(&wheel, &tv_now, 1, 0x40);
+	
+	// Beyond the wheel's range, the entry must wait to be cascaded back down
+	timer_set_delay(&tv_now, &tv_start, 17999999000LL);
+	_test_timer_wheel_expect(&wheel, &tv_now, 0, 0);
+	timer_set_delay(&tv_now, &tv_start, 18000000000LL);
+	_test_timer_wheel_expect(&wheel, &tv_now, 1, 0x80);
+	
+	if (wheel.count)
+	{
+		++unittest_failures;
+		applog(LOG_ERR, "%s: %d entries left in wheel", __func__, wheel.count);
+	}
+}
+
 void stratum_probe_transparency(struct pool *pool)
 {
 	// Request transaction data to discourage pools from doing anything shady
@@ -2645,6 +3189,9 @@ static bool parse_notify(struct pool *pool, json_t *val)
 
 	cg_wlock(&pool->data_lock);
 	cgtime(&pool->swork.tv_received);
+	// Resent jobs keep their generation, so work made from them is still current
+	if (!(pool->swork.job_id && !strcmp(pool->swork.job_id, job_id)))
+		++pool->swork.job_gen;
 	free(pool->swork.job_id);
 	pool->swork.job_id = job_id;
 	if (pool->swork.tr)
@@ -2709,7 +3256,7 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	
 	memcpy(pool->swork.target, pool->next_target, 0x20);
 	
-	pool_check_coinbase(pool, coinbase, bytes_len(&pool->swork.coinbase));
+	pool->swork.cbcheck_pending = !pool_check_coinbase(pool, coinbase, bytes_len(&pool->swork.coinbase), pool->swork.nonce2_offset, pool->swork.n2size, pool->swork.cbcheck_digest);
 	
 	cg_wunlock(&pool->data_lock);
 
@@ -3672,6 +4219,25 @@ void RenameThread(const char* name)
 }
 
 static pthread_key_t key_bfgtls;
+
+struct bfg_tls_counters_node {
+	struct bfg_tls_counters c;
+	struct bfg_tls_counters_node *prev;
+	struct bfg_tls_counters_node *next;
+};
+
+static struct bfg_tls_counters_node *bfg_tls_counters_list;
+// Counts from threads which have exited
+static struct bfg_tls_counters bfg_tls_counters_exited;
+static pthread_mutex_t bfg_tls_counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+void bfg_tls_counters_add(struct bfg_tls_counters * const dst, const struct bfg_tls_counters * const src)
+{
+	dst->stale_checks += src->stale_checks;
+	dst->stale_check_hits += src->stale_check_hits;
+}
+
 struct bfgtls_data {
 	char *bfg_strerror_result;
 	size_t bfg_strerror_resultsz;
@@ -3682,6 +4248,12 @@ struct bfgtls_data {
 	struct detectone_meta_info_t __detectone_meta_info;
 #endif
 	unsigned probe_result_flags;
+	char *probe_cache_param;
+	bool lock_waited;
+	struct bfg_tls_counters_node *counters;
+#ifdef USE_LOCK_STATS
+	void *lock_stats_held;
+#endif
 };
 
 static
@@ -3714,6 +4286,18 @@ void bfgtls_free(void * const p)
 {
 	struct bfgtls_data * const bfgtls = p;
 	free(bfgtls->bfg_strerror_result);
+	free(bfgtls->probe_cache_param);
+	if (bfgtls->counters)
+	{
+		mutex_lock(&bfg_tls_counters_mutex);
+		bfg_tls_counters_add(&bfg_tls_counters_exited, &bfgtls->counters->c);
+		DL_DELETE(bfg_tls_counters_list, bfgtls->counters);
+		mutex_unlock(&bfg_tls_counters_mutex);
+		free(bfgtls->counters);
+	}
+#ifdef USE_LOCK_STATS
+	free(bfgtls->lock_stats_held);
+#endif
 #ifdef WIN32
 	if (bfgtls->bfg_strerror_socketresult)
 		LocalFree(bfgtls->bfg_strerror_socketresult);
@@ -3733,6 +4317,51 @@ unsigned *_bfg_probe_result_flags()
 	return &get_bfgtls()->probe_result_flags;
 }
 
+char **_bfg_probe_cache_param()
+{
+	return &get_bfgtls()->probe_cache_param;
+}
+
+bool *_bfg_lock_waited()
+{
+	return &get_bfgtls()->lock_waited;
+}
+
+struct bfg_tls_counters *bfg_tls_counters()
+{
+	struct bfgtls_data * const bfgtls = get_bfgtls();
+	
+	if (unlikely(!bfgtls->counters))
+	{
+		struct bfg_tls_counters_node * const node = calloc(1, sizeof(*node));
+		if (!node)
+			quithere(1, "calloc failed");
+		mutex_lock(&bfg_tls_counters_mutex);
+		DL_APPEND(bfg_tls_counters_list, node);
+		mutex_unlock(&bfg_tls_counters_mutex);
+		bfgtls->counters = node;
+	}
+	return &bfgtls->counters->c;
+}
+
+void bfg_tls_counters_sum(struct bfg_tls_counters * const out)
+{
+	struct bfg_tls_counters_node *node;
+	
+	mutex_lock(&bfg_tls_counters_mutex);
+	*out = bfg_tls_counters_exited;
+	DL_FOREACH(bfg_tls_counters_list, node)
+		bfg_tls_counters_add(out, &node->c);
+	mutex_unlock(&bfg_tls_counters_mutex);
+}
+
+#ifdef USE_LOCK_STATS
+void **_bfg_lock_stats_held()
+{
+	return &get_bfgtls()->lock_stats_held;
+}
+#endif
+
 void bfg_init_threadlocal()
 {
 	if (pthread_key_create(&key_bfgtls, bfgtls_free))
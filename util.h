@@ -135,6 +135,9 @@ extern const char *get_registered_domain(size_t *out_len, const char *, size_t l
 extern const char *extract_domain(size_t *out_len, const char *uri, size_t urilen);
 extern bool match_domains(const char *a, size_t alen, const char *b, size_t blen);
 extern void test_domain_funcs();
+extern void test_cglock();
+extern void test_cglock_bench();
+extern void test_unlock_yield();
 
 extern bool bfg_strtobool(const char *, char **endptr, int opts);
 
@@ -777,6 +780,41 @@ struct timeval *select_timeout(struct timeval *tvp_timeout, struct timeval *tvp_
 	return tvp_timeout;
 }
 
+// Hierarchical timer wheel: millisecond slots, each level 256 times coarser than the one before
+#define TIMER_WHEEL_BITS  8
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  3
+
+struct timer_wheel_entry {
+	struct timeval tv;
+	uint64_t tick;
+	void *userp;
+	
+	// Slot list this entry is in, or NULL if not scheduled
+	struct timer_wheel_entry **head;
+	struct timer_wheel_entry *prev;
+	struct timer_wheel_entry *next;
+};
+
+struct timer_wheel {
+	uint64_t tick_now;
+	int count;
+	struct timer_wheel_entry *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+extern void timer_wheel_init(struct timer_wheel *, const struct timeval *tvp_now);
+extern void timer_wheel_schedule(struct timer_wheel *, struct timer_wheel_entry *, const struct timeval *);
+extern void timer_wheel_cancel(struct timer_wheel *, struct timer_wheel_entry *);
+extern struct timer_wheel_entry *timer_wheel_expire(struct timer_wheel *, const struct timeval *tvp_now);
+extern void timer_wheel_reduce_timeout(struct timer_wheel *, struct timeval *tvp_timeout);
+extern void test_timer_wheel();
+
+static inline
+bool timer_wheel_entry_scheduled(const struct timer_wheel_entry * const entry)
+{
+	return entry->head;
+}
+
 
 #define _SNP2(fn, ...)  do{  \
         int __n42 = fn(s, sz, __VA_ARGS__);  \